@@ -0,0 +1,495 @@
+// bench.h: Benchmark runner for commem ///////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+    inline volatile unsigned char g_sink;
+
+    // Keep the compiler from optimizing away a computed value
+    template <typename T>
+    inline void keep(T const& value) noexcept
+    {
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        g_sink = bytes[0];
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Hardware performance counters
+    //
+    // Counters are read with perf_event_open on Linux. They are unavailable
+    // on other platforms or when the kernel doesn't allow access (see
+    // /proc/sys/kernel/perf_event_paranoid).
+    //
+
+    enum Counter : size_t {
+        Cycles,
+        Instructions,
+        LLCMisses,
+        BranchMisses,
+        DTLBMisses,
+        NumCounters
+    };
+
+    inline char const* CounterName(size_t const c) noexcept
+    {
+        static char const* const names[NumCounters] = {
+            "cycles", "instructions", "llc-misses", "branch-misses", "dtlb-misses" };
+        return c < NumCounters ? names[c] : "";
+    }
+
+    struct CounterValues {
+        bool valid[NumCounters] = {};
+        double value[NumCounters] = {};
+    };
+
+    class Counters {
+#if defined(__linux__)
+        int m_fd[NumCounters] = { -1, -1, -1, -1, -1 };
+
+        static int Open(uint32_t const type, uint64_t const config) noexcept
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.inherit = 1;
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+
+        static constexpr uint64_t CacheConfig(uint64_t const cache) noexcept
+        {
+            return cache |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        }
+#endif
+
+    public:
+        Counters(Counters const&) = delete;
+        Counters& operator=(Counters const&) = delete;
+
+        Counters() noexcept
+        {
+#if defined(__linux__)
+            m_fd[Cycles] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            m_fd[Instructions] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+            m_fd[LLCMisses] = Open(PERF_TYPE_HW_CACHE, CacheConfig(PERF_COUNT_HW_CACHE_LL));
+            m_fd[BranchMisses] = Open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+            m_fd[DTLBMisses] = Open(PERF_TYPE_HW_CACHE, CacheConfig(PERF_COUNT_HW_CACHE_DTLB));
+#endif
+        }
+
+        ~Counters() noexcept
+        {
+#if defined(__linux__)
+            for (auto const fd : m_fd) if (fd >= 0) close(fd);
+#endif
+        }
+
+        bool Available() const noexcept
+        {
+#if defined(__linux__)
+            for (auto const fd : m_fd) if (fd >= 0) return true;
+#endif
+            return false;
+        }
+
+        void Start() noexcept
+        {
+#if defined(__linux__)
+            for (auto const fd : m_fd)
+            {
+                if (fd < 0) continue;
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        CounterValues Stop() noexcept
+        {
+            CounterValues v;
+#if defined(__linux__)
+            for (size_t i = 0; i < NumCounters; ++i)
+            {
+                if (m_fd[i] < 0) continue;
+                ioctl(m_fd[i], PERF_EVENT_IOC_DISABLE, 0);
+                uint64_t n = 0;
+                if (read(m_fd[i], &n, sizeof(n)) == sizeof(n))
+                {
+                    v.valid[i] = true;
+                    v.value[i] = static_cast<double>(n);
+                }
+            }
+#endif
+            return v;
+        }
+    };
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Benchmarks
+    //
+    // The body of a benchmark runs the operation the given number of times.
+    // elements, bytes, and flops describe the work done by one operation and
+    // are used to compute rates. Leave them zero if they don't apply.
+    //
+
+    struct Benchmark {
+        std::string name;
+        std::function<void(size_t)> body;
+        double elements = 0;
+        double bytes = 0;
+        double flops = 0;
+    };
+
+    struct Options {
+        double minSeconds = 0.05;       // Minimum duration of a sample
+        double warmupSeconds = 0.1;     // Time to run before sampling
+        size_t samples = 5;             // Number of timed samples
+        bool counters = false;          // Read hardware counters
+    };
+
+    struct Result {
+        std::string name;
+        size_t iterations = 0;          // Iterations per sample
+        std::vector<double> ns;         // Nanoseconds per operation, per sample
+        CounterValues counters;         // Per operation, over all samples
+        double elements = 0;
+        double bytes = 0;
+        double flops = 0;
+
+        double Median() const
+        {
+            auto v = ns;
+            std::sort(v.begin(), v.end());
+            return v.empty() ? 0 : v[v.size() / 2];
+        }
+    };
+
+    inline double Seconds(std::function<void(size_t)> const& body, size_t const n)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        body(n);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    inline Result Run(Benchmark const& b, Options const& options)
+    {
+        Result r;
+        r.name = b.name;
+        r.elements = b.elements;
+        r.bytes = b.bytes;
+        r.flops = b.flops;
+
+        // Warm up, then find an iteration count that meets the minimum time
+        auto const warmupEnd = std::chrono::steady_clock::now() +
+            std::chrono::duration<double>(options.warmupSeconds);
+        do b.body(1); while (std::chrono::steady_clock::now() < warmupEnd);
+        size_t n = 1;
+        for (;;)
+        {
+            auto const s = Seconds(b.body, n);
+            if (s >= options.minSeconds || n >= (size_t(1) << 40)) break;
+            auto const scale = s > 0 ? options.minSeconds / s * 1.2 : 10.0;
+            n = static_cast<size_t>(static_cast<double>(n) * std::min(std::max(scale, 1.5), 10.0)) + 1;
+        }
+        r.iterations = n;
+
+        std::unique_ptr<Counters> counters;
+        if (options.counters) counters = std::make_unique<Counters>();
+        if (counters) counters->Start();
+        for (size_t i = 0; i < options.samples; ++i)
+            r.ns.push_back(Seconds(b.body, n) * 1e9 / static_cast<double>(n));
+        if (counters)
+        {
+            r.counters = counters->Stop();
+            auto const ops = static_cast<double>(n * options.samples);
+            for (auto& v : r.counters.value) v /= ops;
+        }
+        return r;
+    }
+
+    // Pin the calling thread to a CPU. Return false on failure.
+    inline bool PinToCpu(unsigned const cpu) noexcept
+    {
+#if defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+        if (cpu >= sizeof(DWORD_PTR) * 8) return false;
+        return SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Baselines
+    //
+    // Results are saved as JSON:
+    // {"benchmarks":[{"name":"...","iterations":n,"ns":[...]},...]}
+    // LoadResults reads only this format.
+    //
+
+    inline void SaveResults(std::ostream& os, std::vector<Result> const& results)
+    {
+        char buf[64];
+        os << "{\"benchmarks\":[";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            auto const& r = results[i];
+            os << (i ? ",\n" : "\n") << "{\"name\":\"" << r.name << "\",\"iterations\":"
+                << r.iterations << ",\"ns\":[";
+            for (size_t j = 0; j < r.ns.size(); ++j)
+            {
+                std::snprintf(buf, sizeof(buf), "%s%.6g", j ? "," : "", r.ns[j]);
+                os << buf;
+            }
+            os << "]}";
+        }
+        os << "\n]}\n";
+    }
+
+    // Return false if the input is not in the expected format
+    inline bool LoadResults(std::istream& is, std::vector<Result>& results)
+    {
+        std::string const text{ std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>() };
+        std::vector<Result> tmp;
+
+        size_t pos = 0;
+        auto const find = [&text, &pos](char const* const key)
+            {
+                auto const i = text.find(key, pos);
+                if (i == std::string::npos) return false;
+                pos = i + std::strlen(key);
+                return true;
+            };
+
+        if (!find("\"benchmarks\":[")) return false;
+        while (find("{\"name\":\""))
+        {
+            Result r;
+            auto const end = text.find('"', pos);
+            if (end == std::string::npos) return false;
+            r.name = text.substr(pos, end - pos);
+            pos = end;
+            if (!find("\"iterations\":")) return false;
+            r.iterations = std::strtoull(text.c_str() + pos, nullptr, 10);
+            if (!find("\"ns\":[")) return false;
+            while (pos < text.size() && text[pos] != ']')
+            {
+                char* next = nullptr;
+                r.ns.push_back(std::strtod(text.c_str() + pos, &next));
+                pos = static_cast<size_t>(next - text.c_str());
+                if (pos < text.size() && text[pos] == ',') ++pos;
+                else if (pos >= text.size() || text[pos] != ']') return false;
+            }
+            tmp.push_back(std::move(r));
+        }
+        results.swap(tmp);
+        return true;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Statistics
+    //
+
+    // One-sided Mann-Whitney U test. Return the p-value for the hypothesis
+    // that values in y tend to be greater than values in x. The exact
+    // distribution of U is used for small samples without ties; otherwise
+    // the normal approximation with tie correction is used.
+    inline double MannWhitneyGreater(std::vector<double> const& x, std::vector<double> const& y)
+    {
+        auto const n1 = x.size();
+        auto const n2 = y.size();
+        if (!n1 || !n2) return 1.0;
+
+        // Rank the pooled samples, averaging the ranks of ties
+        std::vector<std::pair<double, bool>> pooled;
+        for (auto const v : x) pooled.push_back({ v, false });
+        for (auto const v : y) pooled.push_back({ v, true });
+        std::sort(pooled.begin(), pooled.end(),
+            [](auto const& a, auto const& b) { return a.first < b.first; });
+
+        double rankY = 0;
+        double tieTerm = 0;
+        for (size_t i = 0; i < pooled.size();)
+        {
+            auto j = i;
+            while (j < pooled.size() && pooled[j].first == pooled[i].first) ++j;
+            auto const rank = (static_cast<double>(i + j) + 1.0) / 2.0;
+            for (auto k = i; k < j; ++k) if (pooled[k].second) rankY += rank;
+            auto const t = static_cast<double>(j - i);
+            tieTerm += t * t * t - t;
+            i = j;
+        }
+
+        auto const u = rankY - static_cast<double>(n2 * (n2 + 1)) / 2.0;
+        auto const mn = static_cast<double>(n1 * n2);
+
+        if (tieTerm == 0 && n1 * n2 <= 2500)
+        {
+            // f[a][k] is the number of orderings of a x's and the y's placed
+            // so far for which U = k. Each y that is added either is the
+            // largest element (and exceeds all a x's) or is not.
+            std::vector<std::vector<double>> f(n1 + 1, std::vector<double>(n1 * n2 + 1));
+            std::vector<std::vector<double>> g = f;
+            for (size_t a = 0; a <= n1; ++a) f[a][0] = 1;       // Zero y's
+            for (size_t b = 1; b <= n2; ++b)
+            {
+                for (auto& row : g) std::fill(row.begin(), row.end(), 0.0);
+                for (size_t a = 0; a <= n1; ++a)
+                {
+                    for (size_t k = 0; k <= n1 * n2; ++k)
+                    {
+                        auto v = k >= a ? f[a][k - a] : 0.0;
+                        if (a > 0) v += g[a - 1][k];
+                        g[a][k] = v;
+                    }
+                }
+                std::swap(f, g);
+            }
+            double total = 0;
+            double tail = 0;
+            auto const observed = static_cast<size_t>(std::llround(u));
+            for (size_t k = 0; k <= n1 * n2; ++k)
+            {
+                total += f[n1][k];
+                if (k >= observed) tail += f[n1][k];
+            }
+            return tail / total;
+        }
+
+        auto const n = static_cast<double>(n1 + n2);
+        auto const variance = mn / 12.0 * ((n + 1) - tieTerm / (n * (n - 1)));
+        if (variance <= 0) return 1.0;
+        auto const z = (u - mn / 2.0 - 0.5) / std::sqrt(variance);
+        return 0.5 * std::erfc(z / std::sqrt(2.0));
+    }
+
+    ///////////////////////////////////////////////////////////////////////////
+    //
+    // Roofline: measured peak memory bandwidth and arithmetic throughput
+    //
+
+    struct Roofline {
+        double bytesPerSecond = 0;
+        double flopsPerSecond = 0;
+
+        // Attainable FLOP rate for a kernel with the given arithmetic intensity
+        double Attainable(double const flopsPerByte) const noexcept
+        {
+            return std::min(flopsPerSecond, flopsPerByte * bytesPerSecond);
+        }
+    };
+
+    // Bandwidth is measured with a STREAM-style triad over arrays much larger
+    // than the last-level cache. Arithmetic throughput is measured with
+    // independent multiply-add chains that the compiler can vectorize.
+    inline Roofline MeasureRoofline()
+    {
+        Roofline r;
+
+        size_t const n = size_t(1) << 23;       // 64 MB per array
+        std::vector<double> a(n), b(n, 1.0), c(n, 2.0);
+        double best = 1e300;
+        for (int rep = 0; rep < 5; ++rep)
+        {
+            auto const s = Seconds([&](size_t)
+                {
+                    for (size_t i = 0; i < n; ++i) a[i] = b[i] + 3.0 * c[i];
+                }, 1);
+            best = std::min(best, s);
+            keep(a[rep]);
+        }
+        r.bytesPerSecond = 3.0 * sizeof(double) * static_cast<double>(n) / best;
+
+        constexpr size_t lanes = 32;
+        size_t const iters = size_t(1) << 22;
+        double acc[lanes];
+        for (size_t i = 0; i < lanes; ++i) acc[i] = static_cast<double>(i);
+        best = 1e300;
+        for (int rep = 0; rep < 3; ++rep)
+        {
+            auto const s = Seconds([&](size_t)
+                {
+                    for (size_t k = 0; k < iters; ++k)
+                        for (size_t i = 0; i < lanes; ++i) acc[i] = acc[i] * 0.999999 + 1e-9;
+                }, 1);
+            best = std::min(best, s);
+            keep(acc[rep]);
+        }
+        r.flopsPerSecond = 2.0 * lanes * static_cast<double>(iters) / best;
+        return r;
+    }
+}
+
+#endif  // BENCH_H
+
+///////////////////////////////////////////////////////////////////////////////
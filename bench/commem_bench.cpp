@@ -0,0 +1,314 @@
+// commem_bench.cpp: Benchmarks for commem hot paths //////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Usage: commem_bench [--filter <text>] [--samples <n>] [--min-time <s>]
+//                     [--warmup <s>] [--pin <cpu>] [--counters] [--roofline]
+//                     [--save <file>] [--compare <file>]
+//                     [--threshold <fraction>] [--alpha <p>]
+//
+// --counters reads hardware performance counters around each benchmark
+// (Linux only) and reports them per operation, per element, and per byte.
+// --roofline measures the machine's peak memory bandwidth and arithmetic
+// throughput first and reports each benchmark's achieved bandwidth against it.
+//
+// --save writes the samples of each benchmark to a baseline file (JSON).
+// --compare runs the benchmarks and compares them with a baseline. A
+// benchmark fails if a one-sided Mann-Whitney U test finds it slower than the
+// baseline at significance level alpha (default 0.01) and its median is more
+// than threshold (default 0.05, i.e. 5%) slower. The exit code is 1 if any
+// benchmark fails. Use --pin and at least 10 samples for stable comparisons.
+//
+
+#include "commem.h"
+#include "bench.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Benchmarks
+//
+
+static std::vector<bench::Benchmark> Benchmarks()
+{
+    std::vector<bench::Benchmark> v;
+
+    for (UINT const cch : { 16u, 256u })
+    {
+        v.push_back({ "bstr_alloc_free/" + std::to_string(cch), [cch](size_t const n)
+            {
+                for (size_t i = 0; i < n; ++i) bench::keep(alloc_bstr(nullptr, cch).get());
+            }, 1 });
+    }
+
+    // Inputs are created once, outside the timed bodies
+    shared_bstr const src(alloc_bstr(nullptr, 256));
+    v.push_back({ "bstr_copy/256", [src](size_t const n)
+        {
+            for (size_t i = 0; i < n; ++i)
+                bench::keep(alloc_bstr(src.get(), SysStringLen(src.get())).get());
+        }, 256, static_cast<double>(2 * 256 * sizeof(OLECHAR)) });
+
+    for (size_t const cb : { 64u, 4096u })
+    {
+        v.push_back({ "heap_alloc_free/" + std::to_string(cb), [cb](size_t const n)
+            {
+                for (size_t i = 0; i < n; ++i) bench::keep(alloc_heap(cb).get());
+            }, 1 });
+    }
+
+    v.push_back({ "safearray_create_destroy/r8/1000", [](size_t const n)
+        {
+            for (size_t i = 0; i < n; ++i)
+                bench::keep(create_safearray_vector(VT_R8, 0, 1000).get());
+        }, 1000 });
+
+    v.push_back({ "safearray_destroy/bstr/1000", [](size_t const n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto a = create_safearray_vector(VT_BSTR, 0, 1000);
+                SafeArrayData<BSTR> data(a.get());
+                for (auto& s : data) s = SysAllocStringLen(nullptr, 16);
+            }
+        }, 1000 });
+
+    ULONG const big = 1 << 20;
+    shared_safearray const a(create_safearray_vector(VT_R8, 0, big));
+    {
+        SafeArrayData<double> data(a.get());
+        for (auto& x : data) x = 1.0;
+    }
+
+    v.push_back({ "safearray_sum/r8/1M", [a](size_t const n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                SafeArrayData<double> data(a.get());
+                double sum = 0;
+                for (auto const x : data) sum += x;
+                bench::keep(sum);
+            }
+        }, big, static_cast<double>(big * sizeof(double)), big });
+
+    v.push_back({ "safearray_copy/r8/1M", [a](size_t const n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                LPSAFEARRAY psa = nullptr;
+                if (SUCCEEDED(SafeArrayCopy(a.get(), &psa))) unique_safearray b(psa);
+            }
+        }, big, 2.0 * big * sizeof(double) });
+
+    return v;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Reporting
+//
+
+static void Report(
+    bench::Result const& r,
+    bench::Options const& options,
+    bench::Roofline const* const roofline)
+{
+    auto const ns = r.Median();
+    std::printf("%-36s %12.1f ns/op", r.name.c_str(), ns);
+    if (r.elements > 0) std::printf(" %10.3f ns/elem", ns / r.elements);
+    if (r.bytes > 0) std::printf(" %9.3f GB/s", r.bytes / ns);
+    std::printf("\n");
+
+    if (roofline && r.bytes > 0)
+    {
+        auto const bw = r.bytes / ns * 1e9;
+        std::printf("    bandwidth: %.1f%% of measured peak (%.2f GB/s)",
+            100.0 * bw / roofline->bytesPerSecond, roofline->bytesPerSecond / 1e9);
+        if (r.flops > 0)
+        {
+            auto const attainable = roofline->Attainable(r.flops / r.bytes);
+            std::printf(", %.2f GFLOP/s of %.2f attainable",
+                r.flops / ns, attainable / 1e9);
+        }
+        std::printf("\n");
+    }
+
+    if (options.counters)
+    {
+        auto const& c = r.counters;
+        for (size_t i = 0; i < bench::NumCounters; ++i)
+        {
+            if (!c.valid[i]) continue;
+            std::printf("    %-14s %14.2f /op", bench::CounterName(i), c.value[i]);
+            if (r.elements > 0) std::printf(" %12.4f /elem", c.value[i] / r.elements);
+            if (r.bytes > 0) std::printf(" %12.6f /byte", c.value[i] / r.bytes);
+            std::printf("\n");
+        }
+        if (c.valid[bench::Cycles] && c.valid[bench::Instructions] && c.value[bench::Cycles] > 0)
+            std::printf("    %-14s %14.2f\n", "ipc",
+                c.value[bench::Instructions] / c.value[bench::Cycles]);
+    }
+}
+
+// Compare results with a baseline. Return the number of regressions.
+static size_t Compare(
+    std::vector<bench::Result> const& results,
+    std::vector<bench::Result> const& baseline,
+    double const threshold,
+    double const alpha)
+{
+    size_t failures = 0;
+    std::printf("\n%-36s %12s %12s %8s %10s  %s\n",
+        "benchmark", "base ns/op", "new ns/op", "change", "p", "result");
+    for (auto const& r : results)
+    {
+        auto const b = std::find_if(baseline.begin(), baseline.end(),
+            [&r](bench::Result const& x) { return x.name == r.name; });
+        if (b == baseline.end())
+        {
+            std::printf("%-36s %12s %12.1f %8s %10s  NEW\n", r.name.c_str(), "-", r.Median(), "-", "-");
+            continue;
+        }
+
+        auto const ratio = r.Median() / b->Median();
+        auto const slower = bench::MannWhitneyGreater(b->ns, r.ns);
+        auto const faster = bench::MannWhitneyGreater(r.ns, b->ns);
+
+        char const* verdict = "PASS";
+        auto p = slower;
+        if (slower < alpha && ratio > 1.0 + threshold)
+        {
+            verdict = "FAIL";
+            ++failures;
+        }
+        else if (faster < alpha && ratio < 1.0 - threshold)
+        {
+            verdict = "IMPROVED";
+            p = faster;
+        }
+        std::printf("%-36s %12.1f %12.1f %+7.1f%% %10.4f  %s\n",
+            r.name.c_str(), b->Median(), r.Median(), 100.0 * (ratio - 1.0), p, verdict);
+    }
+    return failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// main: Application entry point
+//
+
+int main(int argc, char** argv)
+{
+    bench::Options options;
+    std::string filter;
+    std::string save;
+    std::string compare;
+    double threshold = 0.05;
+    double alpha = 0.01;
+    int pin = -1;
+    bool roofline = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        if (arg == "--counters") options.counters = true;
+        else if (arg == "--roofline") roofline = true;
+        else if (arg == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if (arg == "--samples" && i + 1 < argc) options.samples = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--min-time" && i + 1 < argc) options.minSeconds = std::atof(argv[++i]);
+        else if (arg == "--warmup" && i + 1 < argc) options.warmupSeconds = std::atof(argv[++i]);
+        else if (arg == "--pin" && i + 1 < argc) pin = std::atoi(argv[++i]);
+        else if (arg == "--save" && i + 1 < argc) save = argv[++i];
+        else if (arg == "--compare" && i + 1 < argc) compare = argv[++i];
+        else if (arg == "--threshold" && i + 1 < argc) threshold = std::atof(argv[++i]);
+        else if (arg == "--alpha" && i + 1 < argc) alpha = std::atof(argv[++i]);
+        else
+        {
+            std::cerr << "usage: commem_bench [--filter <text>] [--samples <n>] "
+                "[--min-time <s>] [--warmup <s>] [--pin <cpu>] [--counters] "
+                "[--roofline] [--save <file>] [--compare <file>] "
+                "[--threshold <fraction>] [--alpha <p>]\n";
+            return 2;
+        }
+    }
+    if (options.samples == 0) options.samples = 1;
+
+    try
+    {
+        if (pin >= 0 && !bench::PinToCpu(static_cast<unsigned>(pin)))
+            std::cerr << "cannot pin to CPU " << pin << "\n";
+
+        if (options.counters && !bench::Counters().Available())
+            std::cerr << "hardware counters are not available\n";
+
+        std::vector<bench::Result> baseline;
+        if (!compare.empty())
+        {
+            std::ifstream is(compare);
+            if (!is || !bench::LoadResults(is, baseline))
+            {
+                std::cerr << "cannot read baseline: " << compare << "\n";
+                return 2;
+            }
+        }
+
+        bench::Roofline measured;
+        if (roofline) measured = bench::MeasureRoofline();
+
+        std::vector<bench::Result> results;
+        for (auto const& b : Benchmarks())
+        {
+            if (!filter.empty() && b.name.find(filter) == std::string::npos) continue;
+            results.push_back(bench::Run(b, options));
+            Report(results.back(), options, roofline ? &measured : nullptr);
+        }
+
+        if (!save.empty())
+        {
+            std::ofstream os(save);
+            bench::SaveResults(os, results);
+            if (!os)
+            {
+                std::cerr << "cannot write baseline: " << save << "\n";
+                return 2;
+            }
+        }
+
+        if (!compare.empty() && Compare(results, baseline, threshold, alpha)) return 1;
+        return 0;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
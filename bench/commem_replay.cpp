@@ -0,0 +1,432 @@
+// commem_replay.cpp: Replay a recorded allocation trace //////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Usage: commem_replay <trace file> [system | pool [classes file]]
+//
+// Re-executes a trace written by commem::save_trace. Each thread in the trace
+// is replayed on its own thread, running its events in the recorded order
+// without waiting for the other threads, except that a free waits until the
+// object it frees has been allocated (which matters only for objects freed by
+// a different thread than the one that allocated them). Reports throughput,
+// per-operation latency, and peak resident memory.
+//
+// The system backend calls the COM allocation functions. The pool backend
+// uses pool_alloc_heap and pool_alloc_bstr (SAFEARRAYs are not pooled) with
+// the built-in size classes, or with classes written by save_pool_classes,
+// so that classes chosen by a PoolTuner can be checked against the traffic
+// they were tuned for.
+//
+
+#include "commem_pool.h"
+#include "commem_trace.h"
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#if defined(_WIN32)
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Backends: Allocators against which a trace can be replayed
+//
+
+// An object allocated by a backend, with what the backend needs to free it
+struct Allocation {
+    void* p = nullptr;
+    size_t capacity = 0;
+    void* owner = nullptr;
+};
+
+struct Backend {
+    virtual ~Backend() = default;
+    virtual char const* Name() const noexcept = 0;
+    // Called once before the replay threads start
+    virtual void Prepare(std::vector<TraceEvent> const&) { }
+    virtual bool Alloc(TraceEvent const& e, Allocation& a) noexcept = 0;
+    virtual void Free(TraceEvent const& e, Allocation& a) noexcept = 0;
+    virtual void Report(std::ostream&) const { }
+};
+
+// Number of bytes in an element of a SAFEARRAY with the given VARTYPE
+static ULONG ElementSize(VARTYPE const vt) noexcept
+{
+    unique_safearray a(SafeArrayCreateVector(vt, 0, 0));
+    return a ? SafeArrayGetElemsize(a.get()) : 0;
+}
+
+class SystemBackend : public Backend {
+    // Filled by Prepare and then only read, by all replay threads
+    std::map<VARTYPE, ULONG> m_elementSize;
+
+public:
+    char const* Name() const noexcept override { return "system"; }
+
+    void Prepare(std::vector<TraceEvent> const& events) override
+    {
+        for (auto const& e : events)
+        {
+            if (e.kind == ObjectKind::SafeArray && !m_elementSize.count(e.vt)) m_elementSize[e.vt] = ElementSize(e.vt);
+        }
+    }
+
+    bool Alloc(TraceEvent const& e, Allocation& a) noexcept override
+    {
+        a.p = AllocPointer(e);
+        return a.p != nullptr;
+    }
+
+    void Free(TraceEvent const& e, Allocation& a) noexcept override
+    {
+        switch (e.kind)
+        {
+        case ObjectKind::Heap:
+            ComHeapDeleter<void*>()(a.p);
+            break;
+        case ObjectKind::BString:
+            BStringDeleter()(static_cast<BSTR>(a.p));
+            break;
+        case ObjectKind::SafeArray:
+            SafeArrayDeleter()(static_cast<LPSAFEARRAY>(a.p));
+            break;
+        }
+        a.p = nullptr;
+    }
+
+protected:
+    void* AllocPointer(TraceEvent const& e) noexcept
+    {
+        switch (e.kind)
+        {
+        case ObjectKind::Heap:
+            return CoTaskMemAlloc(static_cast<size_t>(e.cb));
+        case ObjectKind::BString:
+            return SysAllocStringByteLen(nullptr, static_cast<UINT>(e.cb));
+        case ObjectKind::SafeArray:
+        {
+            // Multidimensional arrays are replayed as vectors of equal size
+            auto const i = m_elementSize.find(e.vt);
+            if (i == m_elementSize.end() || !i->second) return nullptr;
+            return SafeArrayCreateVector(e.vt, 0, static_cast<ULONG>(e.cb / i->second));
+        }
+        }
+        return nullptr;
+    }
+};
+
+class PoolBackend : public SystemBackend {
+public:
+    char const* Name() const noexcept override { return "pool"; }
+
+    bool Alloc(TraceEvent const& e, Allocation& a) noexcept override
+    {
+        switch (e.kind)
+        {
+        case ObjectKind::Heap:
+        {
+            auto h = pool_alloc_heap(static_cast<size_t>(e.cb));
+            a.capacity = h.get_deleter().capacity;
+            a.owner = h.get_deleter().owner;
+            a.p = h.release();
+            break;
+        }
+        case ObjectKind::BString:
+        {
+            auto b = pool_alloc_bstr(nullptr, static_cast<UINT>(e.cb / sizeof(OLECHAR)));
+            a.capacity = b.get_deleter().capacity;
+            a.owner = b.get_deleter().owner;
+            a.p = b.release();
+            break;
+        }
+        default:
+            return SystemBackend::Alloc(e, a);
+        }
+        return a.p != nullptr;
+    }
+
+    void Free(TraceEvent const& e, Allocation& a) noexcept override
+    {
+        auto const owner = static_cast<detail::ThreadCache*>(a.owner);
+        switch (e.kind)
+        {
+        case ObjectKind::Heap:
+            PooledHeapDeleter<void*>{ a.capacity, owner }(a.p);
+            break;
+        case ObjectKind::BString:
+            PooledBStringDeleter{ a.capacity, owner }(static_cast<BSTR>(a.p));
+            break;
+        default:
+            SystemBackend::Free(e, a);
+            return;
+        }
+        a.p = nullptr;
+    }
+
+    void Report(std::ostream& os) const override
+    {
+        auto const s = pool_stats();
+        os << "pool hits: " << s.hits << "\n"
+            << "pool misses: " << s.misses << "\n"
+            << "pool remote frees: " << s.remoteFrees << "\n";
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Replay
+//
+
+static size_t PeakResidentBytes() noexcept
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc = {};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    rusage ru = {};
+    if (getrusage(RUSAGE_SELF, &ru)) return 0;
+    return static_cast<size_t>(ru.ru_maxrss) * 1024;
+#endif
+}
+
+// Index of no event
+static constexpr size_t none = ~size_t{ 0 };
+
+// Latency of an event that was not replayed (a free of an object that was
+// allocated before the trace started or could not be allocated)
+static constexpr ULONGLONG skipped = ~ULONGLONG{ 0 };
+
+struct Latency {
+    std::vector<ULONGLONG> ns;
+
+    void Report(char const* const name) const
+    {
+        if (ns.empty()) return;
+        auto v = ns;
+        std::sort(v.begin(), v.end());
+        auto const at = [&v](double const q) { return v[static_cast<size_t>(q * (v.size() - 1))]; };
+        std::cout << "  " << name << ": n=" << v.size()
+            << " p50=" << at(0.50) << "ns"
+            << " p99=" << at(0.99) << "ns"
+            << " p999=" << at(0.999) << "ns"
+            << " max=" << v.back() << "ns\n";
+    }
+};
+
+// Match each free to the allocation of the object it frees. An object is
+// identified by its kind and address; an address can be reused once the
+// object is freed. Frees of objects allocated before the trace started are
+// matched to none. Return false if an allocation reuses the address of an
+// object that is still live, which means the trace is out of order.
+static bool MatchFrees(std::vector<TraceEvent> const& events, std::vector<size_t>& source)
+{
+    struct Hash {
+        size_t operator()(std::pair<ObjectKind, ULONGLONG> const& k) const noexcept
+        {
+            return std::hash<ULONGLONG>()(k.second ^ (static_cast<ULONGLONG>(k.first) << 62));
+        }
+    };
+    std::unordered_map<std::pair<ObjectKind, ULONGLONG>, size_t, Hash> live;
+    source.assign(events.size(), none);
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        auto const& e = events[i];
+        auto const key = std::make_pair(e.kind, e.id);
+        if (e.op == TraceOp::Alloc)
+        {
+            if (!live.emplace(key, i).second)
+            {
+                std::cerr << "event " << i << " allocates an address that is still live\n";
+                return false;
+            }
+            continue;
+        }
+        auto const j = live.find(key);
+        if (j == live.end()) continue;
+        source[i] = j->second;
+        live.erase(j);
+    }
+    return true;
+}
+
+static int Replay(std::vector<TraceEvent> const& events, Backend& backend)
+{
+    std::vector<size_t> source;
+    if (!MatchFrees(events, source)) return 1;
+    backend.Prepare(events);
+
+    // Assign events to replay threads, preserving each thread's sequence
+    std::map<DWORD, std::vector<size_t>> threads;
+    for (size_t i = 0; i < events.size(); ++i) threads[events[i].thread].push_back(i);
+
+    // Objects allocated by the replay, by the index of their allocation.
+    // ready is set once the allocation has been made, so that a free on
+    // another thread can wait for it.
+    struct Object {
+        Allocation a;
+        std::atomic<bool> ready{ false };
+    };
+    std::unique_ptr<Object[]> objects(new Object[events.size()]);
+    std::vector<ULONGLONG> elapsed(events.size(), skipped);
+    std::atomic<size_t> failures{ 0 };
+    std::atomic<size_t> remote{ 0 };
+
+    auto const worker = [&](std::vector<size_t> const& mine)
+        {
+            for (auto const i : mine)
+            {
+                auto const& e = events[i];
+                if (e.op == TraceOp::Alloc)
+                {
+                    auto const start = std::chrono::steady_clock::now();
+                    auto const ok = backend.Alloc(e, objects[i].a);
+                    elapsed[i] = static_cast<ULONGLONG>(std::chrono::duration_cast<
+                        std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+                    if (!ok) failures.fetch_add(1, std::memory_order_relaxed);
+                    objects[i].ready.store(true, std::memory_order_release);
+                    continue;
+                }
+
+                if (source[i] == none) continue;
+                auto& o = objects[source[i]];
+                if (events[source[i]].thread != e.thread)
+                {
+                    remote.fetch_add(1, std::memory_order_relaxed);
+                    while (!o.ready.load(std::memory_order_acquire)) std::this_thread::yield();
+                }
+                if (!o.a.p) continue;
+                auto const start = std::chrono::steady_clock::now();
+                backend.Free(e, o.a);
+                elapsed[i] = static_cast<ULONGLONG>(std::chrono::duration_cast<
+                    std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+            }
+        };
+
+    auto const start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::thread> pool;
+        for (auto const& t : threads) pool.emplace_back(worker, std::cref(t.second));
+        for (auto& t : pool) t.join();
+    }
+    auto const wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Free objects that were still live at the end of the trace
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        if (objects[i].a.p) backend.Free(events[i], objects[i].a);
+    }
+
+    Latency allocs[3], frees[3];
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        if (elapsed[i] == skipped) continue;
+        auto const k = static_cast<size_t>(events[i].kind);
+        (events[i].op == TraceOp::Alloc ? allocs[k] : frees[k]).ns.push_back(elapsed[i]);
+    }
+
+    std::cout << "backend: " << backend.Name() << "\n"
+        << "events: " << events.size() << " on " << threads.size() << " threads\n"
+        << "failed allocations: " << failures.load() << "\n"
+        << "cross-thread frees: " << remote.load() << "\n"
+        << "wall time: " << wall << " s\n"
+        << "throughput: " << (wall > 0 ? events.size() / wall : 0) << " events/s\n"
+        << "peak resident: " << PeakResidentBytes() << " bytes\n";
+    backend.Report(std::cout);
+    std::cout << "latency:\n";
+    allocs[0].Report("heap alloc");
+    frees[0].Report("heap free");
+    allocs[1].Report("bstr alloc");
+    frees[1].Report("bstr free");
+    allocs[2].Report("safearray alloc");
+    frees[2].Report("safearray free");
+
+    return failures.load() ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// main: Application entry point
+//
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 4 || (argc == 4 && std::string(argv[2]) != "pool"))
+    {
+        std::cerr << "usage: commem_replay <trace file> [system | pool [classes file]]\n";
+        return 2;
+    }
+
+    try
+    {
+        std::ifstream is(argv[1], std::ios::binary);
+        std::vector<TraceEvent> events;
+        if (FAILED(load_trace(is, events)))
+        {
+            std::cerr << "cannot read trace: " << argv[1] << "\n";
+            return 1;
+        }
+
+        std::unique_ptr<Backend> backend;
+        std::string const name = argc >= 3 ? argv[2] : "system";
+        if (name == "system") backend = std::make_unique<SystemBackend>();
+        else if (name == "pool")
+        {
+            if (argc == 4)
+            {
+                std::ifstream cs(argv[3]);
+                PoolClasses classes;
+                if (FAILED(load_pool_classes(cs, classes)) || FAILED(set_pool_classes(classes)))
+                {
+                    std::cerr << "cannot use pool classes: " << argv[3] << "\n";
+                    return 1;
+                }
+            }
+            backend = std::make_unique<PoolBackend>();
+        }
+        else
+        {
+            std::cerr << "unknown backend: " << name << "\n";
+            return 2;
+        }
+
+        return Replay(events, *backend);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,509 @@
+// commem_server.cpp: Automation server macrobenchmark ////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+// Usage: commem_server [--threads <n>] [--rate <requests/s>] [--seconds <s>]
+//                      [--queue <n>] [--size <distribution>]
+//                      [--mix <names:series:records>]
+//
+// Simulates the dispatch loop of an automation server. Worker threads decode
+// requests into VARIANT arguments, build result SAFEARRAYs (VT_BSTR, VT_R8,
+// or VT_VARIANT), and hand them to a sender thread through shared_safearray.
+// The sender marshals each result by walking its data and then drops its
+// reference, so results are destroyed on a different thread than the one that
+// created them.
+//
+// --threads   Number of worker threads (default 4)
+// --rate      Total request rate; 0 runs closed-loop at maximum throughput
+//             (default 0). Latency is measured from each request's scheduled
+//             arrival, so queueing delay is included when workers fall behind.
+// --seconds   Duration of the run (default 5)
+// --queue     Capacity of the response queue (default 256)
+// --size      Elements per result: fixed:N, uniform:A:B, or
+//             lognormal:MEDIAN:SIGMA (default lognormal:64:1.5)
+// --mix       Relative weights of the three request types (default 1:1:1)
+//
+
+#include "commem.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace commem;
+using Clock = std::chrono::steady_clock;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Configuration
+//
+
+struct SizeDistribution {
+    enum class Kind { Fixed, Uniform, LogNormal } kind = Kind::LogNormal;
+    double a = 64;
+    double b = 1.5;
+
+    // Parse fixed:N, uniform:A:B, or lognormal:MEDIAN:SIGMA
+    bool Parse(std::string const& text)
+    {
+        auto const colon = text.find(':');
+        if (colon == std::string::npos) return false;
+        auto const name = text.substr(0, colon);
+        char* end = nullptr;
+        a = std::strtod(text.c_str() + colon + 1, &end);
+        if (name == "fixed")
+        {
+            kind = Kind::Fixed;
+            return *end == '\0' && a >= 0;
+        }
+        if (*end != ':') return false;
+        b = std::strtod(end + 1, &end);
+        if (*end != '\0') return false;
+        if (name == "uniform") kind = Kind::Uniform;
+        else if (name == "lognormal") kind = Kind::LogNormal;
+        else return false;
+        return a >= 0 && b >= 0;
+    }
+
+    ULONG Sample(std::mt19937_64& rng) const
+    {
+        double n = a;
+        switch (kind)
+        {
+        case Kind::Fixed:
+            break;
+        case Kind::Uniform:
+            n = std::uniform_real_distribution<double>(a, b + 1)(rng);
+            break;
+        case Kind::LogNormal:
+            n = std::lognormal_distribution<double>(std::log(std::max(a, 1.0)), b)(rng);
+            break;
+        }
+        return static_cast<ULONG>(std::min(n, 1e7));
+    }
+};
+
+struct Config {
+    unsigned threads = 4;
+    double rate = 0;
+    double seconds = 5;
+    SizeDistribution size;
+    double mix[3] = { 1, 1, 1 };
+    size_t queue = 256;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Requests
+//
+// A request arrives as a flat buffer: a method code, a UTF-16 key, and a
+// numeric seed. Decoding it produces VARIANT arguments like those a server
+// receives through IDispatch::Invoke.
+//
+
+enum Method : LONG { Names, Series, Records };
+
+struct WireRequest {
+    LONG method;
+    ULONG count;
+    double seed;
+    OLECHAR key[24];
+    Clock::time_point arrival;
+};
+
+// Owns the decoded arguments
+struct Arguments {
+    VARIANT v[3];
+
+    Arguments() noexcept
+    {
+        for (auto& x : v) VariantInit(&x);
+    }
+
+    ~Arguments() noexcept
+    {
+        for (auto& x : v) (void)VariantClear(&x);
+    }
+
+    Arguments(Arguments const&) = delete;
+    Arguments& operator=(Arguments const&) = delete;
+};
+
+static HRESULT Decode(WireRequest const& w, Arguments& args) noexcept
+{
+    auto key = alloc_bstr(w.key);
+    if (!key) return E_OUTOFMEMORY;
+    V_VT(&args.v[0]) = VT_BSTR;
+    V_BSTR(&args.v[0]) = key.release();
+    V_VT(&args.v[1]) = VT_I4;
+    V_I4(&args.v[1]) = static_cast<LONG>(w.count);
+    V_VT(&args.v[2]) = VT_R8;
+    V_R8(&args.v[2]) = w.seed;
+    return S_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Dispatch: Build the result SAFEARRAY for a request
+//
+
+static HRESULT MakeNames(Arguments const& args, unique_safearray& out) noexcept
+{
+    auto const n = static_cast<ULONG>(V_I4(&args.v[1]));
+    auto const key = V_BSTR(&args.v[0]);
+    auto const cch = SysStringLen(key);
+
+    auto a = create_safearray_vector(VT_BSTR, 0, n);
+    if (!a) return E_OUTOFMEMORY;
+    {
+        SafeArrayData<BSTR> data(a.get());
+        if (FAILED(data.Result())) return data.Result();
+        for (ULONG i = 0; i < n; ++i)
+        {
+            // Names are the key followed by a varying-length suffix
+            auto s = alloc_bstr(nullptr, cch + 1 + (i % 17));
+            if (!s) return E_OUTOFMEMORY;
+            std::copy(key, key + cch, s.get());
+            std::fill(s.get() + cch, s.get() + SysStringLen(s.get()), static_cast<OLECHAR>('a' + i % 26));
+            data[i] = s.release();
+        }
+    }
+    out = std::move(a);
+    return S_OK;
+}
+
+static HRESULT MakeSeries(Arguments const& args, unique_safearray& out) noexcept
+{
+    auto const n = static_cast<ULONG>(V_I4(&args.v[1]));
+    auto x = V_R8(&args.v[2]);
+
+    auto a = create_safearray_vector(VT_R8, 0, n);
+    if (!a) return E_OUTOFMEMORY;
+    {
+        SafeArrayData<double> data(a.get());
+        if (FAILED(data.Result())) return data.Result();
+        for (auto& d : data)
+        {
+            x = x * 1.0000001 + 0.5;
+            d = x;
+        }
+    }
+    out = std::move(a);
+    return S_OK;
+}
+
+static HRESULT MakeRecords(Arguments const& args, unique_safearray& out) noexcept
+{
+    auto const n = static_cast<ULONG>(V_I4(&args.v[1]));
+    auto const key = V_BSTR(&args.v[0]);
+
+    auto a = create_safearray_vector(VT_VARIANT, 0, n);
+    if (!a) return E_OUTOFMEMORY;
+    {
+        SafeArrayData<VARIANT> data(a.get());
+        if (FAILED(data.Result())) return data.Result();
+        for (ULONG i = 0; i < n; ++i)
+        {
+            if (i % 2)
+            {
+                V_VT(&data[i]) = VT_R8;
+                V_R8(&data[i]) = V_R8(&args.v[2]) + i;
+            }
+            else
+            {
+                auto s = alloc_bstr(key, SysStringLen(key));
+                if (!s) return E_OUTOFMEMORY;
+                V_VT(&data[i]) = VT_BSTR;
+                V_BSTR(&data[i]) = s.release();
+            }
+        }
+    }
+    out = std::move(a);
+    return S_OK;
+}
+
+static HRESULT Dispatch(WireRequest const& w, shared_safearray& result) noexcept
+{
+    Arguments args;
+    auto hr = Decode(w, args);
+    if (FAILED(hr)) return hr;
+
+    unique_safearray a;
+    switch (w.method)
+    {
+    case Names: hr = MakeNames(args, a); break;
+    case Series: hr = MakeSeries(args, a); break;
+    case Records: hr = MakeRecords(args, a); break;
+    default: return E_INVALIDARG;
+    }
+    if (FAILED(hr)) return hr;
+
+    try
+    {
+        result = std::move(a);
+        return S_OK;
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+}
+
+// Walk a result as marshaling would, returning the number of bytes
+static size_t Marshal(LPSAFEARRAY const psa) noexcept
+{
+    VARTYPE vt = VT_EMPTY;
+    if (FAILED(SafeArrayGetVartype(psa, &vt))) return 0;
+    size_t cb = 0;
+    switch (vt)
+    {
+    case VT_BSTR:
+    {
+        SafeArrayData<BSTR> data(psa);
+        for (auto const s : data) cb += sizeof(DWORD) + SysStringByteLen(s);
+        break;
+    }
+    case VT_R8:
+    {
+        SafeArrayData<double> data(psa);
+        cb = data.Size() * sizeof(double);
+        break;
+    }
+    case VT_VARIANT:
+    {
+        SafeArrayData<VARIANT> data(psa);
+        for (auto const& v : data)
+            cb += sizeof(VARTYPE) + (V_VT(&v) == VT_BSTR ? SysStringByteLen(V_BSTR(&v)) : sizeof(double));
+        break;
+    }
+    }
+    return cb;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Outbox: Hands results from workers to the sender thread
+//
+// The outbox is bounded; workers block when the sender falls behind, as a
+// server's response queue applies backpressure.
+//
+
+struct Response {
+    shared_safearray result;
+    Clock::time_point arrival;
+};
+
+class Outbox {
+    std::mutex m_lock;
+    std::condition_variable m_ready;
+    std::condition_variable m_space;
+    std::deque<Response> m_queue;
+    size_t const m_capacity;
+    bool m_closed = false;
+
+public:
+    explicit Outbox(size_t const capacity) : m_capacity(capacity) { }
+
+    void Push(Response r)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_space.wait(lock, [this]() { return m_queue.size() < m_capacity; });
+            m_queue.push_back(std::move(r));
+        }
+        m_ready.notify_one();
+    }
+
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_closed = true;
+        }
+        m_ready.notify_all();
+    }
+
+    // Return false when the outbox is closed and empty
+    bool Pop(Response& r)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_ready.wait(lock, [this]() { return m_closed || !m_queue.empty(); });
+            if (m_queue.empty()) return false;
+            r = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+        m_space.notify_one();
+        return true;
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// Run
+//
+
+static int Run(Config const& config)
+{
+    Outbox outbox(config.queue);
+    std::vector<double> latency;        // Microseconds, written by the sender
+    size_t bytes = 0;
+    std::atomic<size_t> failures{ 0 };
+
+    std::thread sender([&]()
+        {
+            Response r;
+            while (outbox.Pop(r))
+            {
+                bytes += Marshal(r.result.get());
+                r.result.reset();       // Destroyed on the sender thread
+                latency.push_back(std::chrono::duration<double, std::micro>(
+                    Clock::now() - r.arrival).count());
+            }
+        });
+
+    auto const start = Clock::now();
+    auto const stop = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.seconds));
+
+    auto const worker = [&](unsigned const id)
+        {
+            std::mt19937_64 rng(0x9e3779b97f4a7c15ull * (id + 1));
+            std::discrete_distribution<int> method(std::begin(config.mix), std::end(config.mix));
+            auto const interval = config.rate > 0 ?
+                std::chrono::duration_cast<Clock::duration>(
+                    std::chrono::duration<double>(config.threads / config.rate)) :
+                Clock::duration::zero();
+
+            auto next = start;
+            for (size_t k = 0;; ++k)
+            {
+                auto now = Clock::now();
+                if (now >= stop) break;
+                if (interval > Clock::duration::zero())
+                {
+                    next = start + interval * static_cast<Clock::rep>(k);
+                    if (next >= stop) break;
+                    if (next > now) std::this_thread::sleep_until(next);
+                    now = next;
+                }
+
+                WireRequest w = {};
+                w.method = method(rng);
+                w.count = config.size.Sample(rng);
+                w.seed = static_cast<double>(k);
+                auto const suffix = std::to_wstring(k % 100000);
+                std::wstring const key = L"item." + suffix;
+                for (size_t i = 0; i < key.size() && i + 1 < std::size(w.key); ++i)
+                    w.key[i] = static_cast<OLECHAR>(key[i]);
+                w.arrival = now;
+
+                shared_safearray result;
+                if (FAILED(Dispatch(w, result)))
+                {
+                    failures.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                outbox.Push({ std::move(result), w.arrival });
+            }
+        };
+
+    {
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < config.threads; ++i) workers.emplace_back(worker, i);
+        for (auto& t : workers) t.join();
+    }
+    outbox.Close();
+    sender.join();
+    auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::sort(latency.begin(), latency.end());
+    auto const at = [&latency](double const q)
+        {
+            return latency.empty() ? 0.0 : latency[static_cast<size_t>(q * (latency.size() - 1))];
+        };
+
+    std::printf("threads: %u\n", config.threads);
+    std::printf("requests: %zu (%zu failed)\n", latency.size(), failures.load());
+    std::printf("throughput: %.0f requests/s, %.1f MB/s marshaled\n",
+        latency.size() / elapsed, bytes / elapsed / 1e6);
+    std::printf("latency: p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+        at(0.5), at(0.99), at(0.999), latency.empty() ? 0.0 : latency.back());
+    return failures.load() ? 1 : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// main: Application entry point
+//
+
+int main(int argc, char** argv)
+{
+    Config config;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        auto ok = i + 1 < argc;
+        if (ok && arg == "--threads") config.threads = static_cast<unsigned>(std::atoi(argv[++i]));
+        else if (ok && arg == "--rate") config.rate = std::atof(argv[++i]);
+        else if (ok && arg == "--seconds") config.seconds = std::atof(argv[++i]);
+        else if (ok && arg == "--queue") config.queue = std::strtoul(argv[++i], nullptr, 10);
+        else if (ok && arg == "--size") ok = config.size.Parse(argv[++i]);
+        else if (ok && arg == "--mix")
+        {
+            ok = std::sscanf(argv[++i], "%lf:%lf:%lf",
+                &config.mix[0], &config.mix[1], &config.mix[2]) == 3;
+        }
+        else ok = false;
+
+        if (!ok || config.threads == 0 || config.queue == 0)
+        {
+            std::cerr << "usage: commem_server [--threads <n>] [--rate <requests/s>] "
+                "[--seconds <s>] [--queue <n>] [--size <fixed:N|uniform:A:B|lognormal:M:S>] "
+                "[--mix <names:series:records>]\n";
+            return 2;
+        }
+    }
+
+    try
+    {
+        return Run(config);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -32,9 +32,282 @@
 #include <Windows.h>
 #include <memory>
 #include <exception>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+
+// USDT probes
+// Define COMMEM_USDT before including commem.h to compile SystemTap SDT probes
+// into the factories, deleters, and data-access helpers (Linux, including
+// Winelib builds; requires <sys/sdt.h>). Each probe is guarded by a semaphore
+// that is set only while a tracer such as bpftrace is attached, so the probe
+// arguments are not computed otherwise. When COMMEM_USDT is not defined, the
+// probes compile to nothing. All probes in the "commem" provider take the
+// same arguments: kind (ObjectKind), pointer, size in bytes, and VARTYPE.
+// Example:
+// bpftrace -e 'usdt:./app:commem:alloc { @bytes[arg0] = hist(arg2); }'
+
+#if defined(COMMEM_USDT)
+#if !__has_include(<sys/sdt.h>)
+#error "COMMEM_USDT requires <sys/sdt.h>"
+#endif
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define COMMEM_PROBE_SEMAPHORE(name) \
+    inline unsigned short commem_##name##_semaphore __attribute__((unused, section(".probes")))
+COMMEM_PROBE_SEMAPHORE(alloc);
+COMMEM_PROBE_SEMAPHORE(free);
+COMMEM_PROBE_SEMAPHORE(lock);
+COMMEM_PROBE_SEMAPHORE(unlock);
+COMMEM_PROBE_SEMAPHORE(cache_hit);
+COMMEM_PROBE_SEMAPHORE(cache_miss);
+#undef COMMEM_PROBE_SEMAPHORE
+#define COMMEM_PROBE(name, event) \
+    do { \
+        if (__builtin_expect(commem_##name##_semaphore, 0)) { \
+            ::commem::AllocationEvent const commem_probe_e_ = (event); \
+            DTRACE_PROBE4(commem, name, static_cast<int>(commem_probe_e_.kind), \
+                commem_probe_e_.p, commem_probe_e_.cb, commem_probe_e_.vt); \
+        } \
+    } while (0)
+#else
+#define COMMEM_PROBE(name, event) ((void)0)
+#endif
+
+// Call site of the expression that uses it, for the tagged factory functions
+// Example:
+// auto x = alloc_bstr(COMMEM_SITE, L"ABCD");
+
+#define COMMEM_SITE (::commem::CallSite(__FILE__, __LINE__, __func__))
 
 namespace commem {
 
+    // Kinds of objects managed by commem
+
+    enum class ObjectKind : unsigned char {
+        Heap,           // Memory allocated by CoTaskMemAlloc
+        BString,        // BSTR allocated by SysAllocString and friends
+        SafeArray       // SAFEARRAY allocated by SafeArrayCreate and friends
+    };
+
+    // Description of an operation reported to observers
+    // cb is the number of bytes of data (zero if it is not known)
+    // vt is the VARTYPE of a SAFEARRAY (VT_EMPTY for other kinds)
+    // time is when the operation started (steady clock, in nanoseconds)
+    // duration is how long the COM function took (zero for locks)
+
+    struct AllocationEvent {
+        ObjectKind kind;
+        VARTYPE vt;
+        void const* p;
+        size_t cb;
+        ULONGLONG time;
+        ULONGLONG duration;
+    };
+
+    // Interface for receiving events from commem factories, deleters, and
+    // data-access helpers. Callbacks may be made from any thread and must not
+    // throw. An observer must remain valid until after remove_observer
+    // returns and all threads that may be reporting events have finished.
+
+    struct AllocationObserver {
+        virtual void OnAlloc(AllocationEvent const& e) noexcept = 0;
+        virtual void OnFree(AllocationEvent const& e) noexcept = 0;
+        virtual void OnLock(AllocationEvent const&) noexcept { }
+        virtual void OnUnlock(AllocationEvent const&) noexcept { }
+    protected:
+        ~AllocationObserver() = default;
+    };
+
+    // Interface through which allocation budgets are charged and credited
+    // (see commem_budget.h). Factories call Reserve with the number of bytes
+    // of data they are about to allocate; if it returns false, the factory
+    // fails without allocating. After allocating, factories call Commit with
+    // the result (nullptr if the allocation failed). Deleters call Release
+    // before freeing an object.
+
+    struct BudgetHooks {
+        virtual bool Reserve(size_t cb) noexcept = 0;
+        virtual void Commit(void const* p, size_t cb) noexcept = 0;
+        virtual void Release(void const* p) noexcept = 0;
+    protected:
+        ~BudgetHooks() = default;
+    };
+
+    namespace detail {
+
+        // Installed budget hooks, or nullptr if budgets have never been used
+        inline std::atomic<BudgetHooks*> budget_hooks{ nullptr };
+
+        // Registered observers. The count is checked before doing any other
+        // work so that reporting costs a single branch when nobody listens.
+
+        inline constexpr size_t max_observers = 8;
+        inline std::atomic<AllocationObserver*> observers[max_observers];
+        inline std::atomic<unsigned> observer_count{ 0 };
+
+        inline bool observing() noexcept
+        {
+            return observer_count.load(std::memory_order_relaxed) != 0;
+        }
+
+        inline ULONGLONG now() noexcept
+        {
+            return static_cast<ULONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // Number of bytes of data in a SAFEARRAY
+        inline size_t safearray_bytes(LPSAFEARRAY const psa) noexcept
+        {
+            size_t n = psa->cbElements;
+            for (USHORT i = 0; i < psa->cDims; ++i) n *= psa->rgsabound[i].cElements;
+            return n;
+        }
+
+        inline AllocationEvent describe(BSTR const p) noexcept
+        {
+            return { ObjectKind::BString, VT_EMPTY, p, SysStringByteLen(p), 0, 0 };
+        }
+
+        inline AllocationEvent describe(LPSAFEARRAY const psa) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            if (FAILED(SafeArrayGetVartype(psa, &vt))) vt = VT_EMPTY;
+            return { ObjectKind::SafeArray, vt, psa, safearray_bytes(psa), 0, 0 };
+        }
+
+        inline void notify(
+            void (AllocationObserver::* const f)(AllocationEvent const&) noexcept,
+            AllocationEvent const& e) noexcept
+        {
+            for (auto& o : observers)
+            {
+                auto const p = o.load(std::memory_order_acquire);
+                if (p) (p->*f)(e);
+            }
+        }
+
+        // Call an allocation function and report the result with its timing
+        template <typename Ptr, typename Alloc, typename Describe>
+        Ptr observed_alloc(Alloc&& alloc, Describe&& describe) noexcept
+        {
+            if (!observing())
+            {
+                Ptr p(alloc());
+                if (p) COMMEM_PROBE(alloc, describe(p.get()));
+                return p;
+            }
+
+            auto const t = now();
+            Ptr p(alloc());
+            if (p)
+            {
+                auto e = describe(p.get());
+                e.time = t;
+                e.duration = now() - t;
+                COMMEM_PROBE(alloc, e);
+                notify(&AllocationObserver::OnAlloc, e);
+            }
+            return p;
+        }
+
+        // Call an allocation function for size() bytes of data after charging
+        // any budgets in effect on this thread. size is only called if
+        // budgets are in use.
+        template <typename Ptr, typename Size, typename Alloc, typename Describe>
+        Ptr budgeted_alloc(Size&& size, Alloc&& alloc, Describe&& describe) noexcept
+        {
+            auto const hooks = budget_hooks.load(std::memory_order_acquire);
+            if (!hooks) return observed_alloc<Ptr>(alloc, describe);
+            auto const cb = size();
+            if (!hooks->Reserve(cb)) return Ptr();
+            auto p = observed_alloc<Ptr>(alloc, describe);
+            hooks->Commit(p.get(), cb);
+            return p;
+        }
+
+        // Credit the budgets charged for an object that is about to be freed
+        inline void budget_release(void const* const p) noexcept
+        {
+            auto const hooks = budget_hooks.load(std::memory_order_acquire);
+            if (hooks) hooks->Release(p);
+        }
+
+        inline size_t olestr_bytes(OLECHAR const* const psz) noexcept
+        {
+            size_t n = 0;
+            if (psz) while (psz[n]) ++n;
+            return n * sizeof(OLECHAR);
+        }
+
+        // Size of an element of a SAFEARRAY of a VARTYPE (zero if not known)
+        inline size_t vartype_size(VARTYPE const vt) noexcept
+        {
+            switch (vt)
+            {
+            case VT_I1: case VT_UI1:
+                return 1;
+            case VT_I2: case VT_UI2: case VT_BOOL:
+                return 2;
+            case VT_I4: case VT_UI4: case VT_INT: case VT_UINT: case VT_R4: case VT_ERROR:
+                return 4;
+            case VT_I8: case VT_UI8: case VT_R8: case VT_CY: case VT_DATE:
+                return 8;
+            case VT_BSTR: case VT_UNKNOWN: case VT_DISPATCH:
+                return sizeof(void*);
+            case VT_VARIANT:
+                return sizeof(VARIANT);
+            case VT_DECIMAL:
+                return sizeof(DECIMAL);
+            default:
+                return 0;
+            }
+        }
+
+        // Call a free function and report it with its timing
+        template <typename Free>
+        void observed_free(AllocationEvent e, Free&& free) noexcept
+        {
+            e.time = now();
+            free();
+            e.duration = now() - e.time;
+            notify(&AllocationObserver::OnFree, e);
+        }
+    }
+
+    // Register an observer. Return false if all slots are in use.
+    inline bool add_observer(AllocationObserver* const p) noexcept
+    {
+        if (!p) return false;
+        for (auto& o : detail::observers)
+        {
+            AllocationObserver* expected = nullptr;
+            if (o.compare_exchange_strong(expected, p))
+            {
+                detail::observer_count.fetch_add(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Unregister an observer. Return false if it was not registered.
+    inline bool remove_observer(AllocationObserver* const p) noexcept
+    {
+        if (!p) return false;
+        for (auto& o : detail::observers)
+        {
+            auto expected = p;
+            if (o.compare_exchange_strong(expected, nullptr))
+            {
+                detail::observer_count.fetch_sub(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
     // Deleter that calls CoTaskMemFree
     // This deleter can be used with std::unique_ptr and std::shared_ptr
     // Examples:
@@ -47,7 +320,14 @@ namespace commem {
         typedef T pointer;
         void operator()(pointer const p) noexcept
         {
-            CoTaskMemFree(p);
+            if (p) detail::budget_release(p);
+            if (p) COMMEM_PROBE(free, (AllocationEvent{ ObjectKind::Heap, VT_EMPTY, p, 0, 0, 0 }));
+            if (p && detail::observing())
+            {
+                detail::observed_free({ ObjectKind::Heap, VT_EMPTY, p, 0, 0, 0 },
+                    [p]() { CoTaskMemFree(p); });
+            }
+            else CoTaskMemFree(p);
         }
     };
 
@@ -69,7 +349,11 @@ namespace commem {
         typedef BSTR pointer;
         void operator()(pointer const p) noexcept
         {
-            SysFreeString(p);
+            if (p) detail::budget_release(p);
+            if (p) COMMEM_PROBE(free, detail::describe(p));
+            if (p && detail::observing())
+                detail::observed_free(detail::describe(p), [p]() { SysFreeString(p); });
+            else SysFreeString(p);
         }
     };
 
@@ -90,7 +374,14 @@ namespace commem {
         typedef LPSAFEARRAY pointer;
         void operator()(pointer const p) noexcept
         {
-            if (p && FAILED(SafeArrayDestroy(p))) std::terminate();
+            if (!p) return;
+            detail::budget_release(p);
+            COMMEM_PROBE(free, detail::describe(p));
+            auto hr = S_OK;
+            if (detail::observing())
+                detail::observed_free(detail::describe(p), [p, &hr]() { hr = SafeArrayDestroy(p); });
+            else hr = SafeArrayDestroy(p);
+            if (FAILED(hr)) std::terminate();
         }
     };
 
@@ -99,6 +390,229 @@ namespace commem {
     using unique_safearray = std::unique_ptr<std::remove_pointer_t<LPSAFEARRAY>, SafeArrayDeleter>;
 
     using shared_safearray = std::shared_ptr<std::remove_pointer_t<LPSAFEARRAY>>;
+
+    // Source location of an allocation, for per-call-site accounting
+    // Use COMMEM_SITE to capture the current file, line, and function, or
+    // construct a CallSite from a tag. The strings are not copied and must
+    // outlive any observer that records them (string literals do).
+
+    struct CallSite {
+        char const* file;
+        unsigned line;
+        char const* function;
+
+        constexpr CallSite(char const* const fileName, unsigned const lineNumber, char const* const functionName) noexcept :
+            file(fileName), line(lineNumber), function(functionName) { }
+
+        constexpr explicit CallSite(char const* const tag) noexcept :
+            file(tag), line(0), function("") { }
+    };
+
+    namespace detail {
+
+        // Call site of the tagged factory call in progress on this thread
+        inline thread_local CallSite const* current_site = nullptr;
+
+        class SiteScope {
+            CallSite const* const m_previous;
+        public:
+            SiteScope(SiteScope const&) = delete;
+            SiteScope& operator=(SiteScope const&) = delete;
+
+            explicit SiteScope(CallSite const& site) noexcept : m_previous(current_site)
+            {
+                current_site = &site;
+            }
+
+            ~SiteScope() noexcept
+            {
+                current_site = m_previous;
+            }
+        };
+    }
+
+    // Return the call site passed to the tagged factory call in progress on
+    // this thread, or nullptr if the factory was not tagged. Observers may
+    // call this from OnAlloc. The call site is often a temporary of the
+    // tagged call, so the pointer is valid only during the OnAlloc callback;
+    // copy the CallSite to keep it.
+    inline CallSite const* current_call_site() noexcept
+    {
+        return detail::current_site;
+    }
+
+    // Factory functions
+    // These wrap the COM allocation functions, report the allocation to any
+    // registered observers, and return a unique pointer that owns the result.
+    // Like the functions they wrap, they return an empty pointer on failure,
+    // including when an allocation budget would be exceeded.
+    // Examples:
+    // auto x = alloc_heap<LPOLESTR>(10 * sizeof(OLECHAR));
+    // auto y = alloc_bstr(L"ABCD");
+    // auto z = create_safearray_vector(VT_I4, 0, 10);
+
+    template <typename T = void*>
+    unique_heap<T> alloc_heap(size_t const cb) noexcept
+    {
+        return detail::budgeted_alloc<unique_heap<T>>([cb]() { return cb; },
+            [cb]() { return static_cast<T>(CoTaskMemAlloc(cb)); },
+            [cb](T const p) { return AllocationEvent{ ObjectKind::Heap, VT_EMPTY, p, cb, 0, 0 }; });
+    }
+
+    inline unique_bstr alloc_bstr(OLECHAR const* const psz) noexcept
+    {
+        return detail::budgeted_alloc<unique_bstr>([psz]() { return detail::olestr_bytes(psz); },
+            [psz]() { return SysAllocString(psz); },
+            [](BSTR const p) { return detail::describe(p); });
+    }
+
+    // If pch is nullptr, the BSTR is allocated but not initialized
+    inline unique_bstr alloc_bstr(OLECHAR const* const pch, UINT const cch) noexcept
+    {
+        return detail::budgeted_alloc<unique_bstr>([cch]() { return cch * sizeof(OLECHAR); },
+            [pch, cch]() { return SysAllocStringLen(pch, cch); },
+            [](BSTR const p) { return detail::describe(p); });
+    }
+
+    inline unique_safearray create_safearray(
+        VARTYPE const vt,
+        UINT const cDims,
+        SAFEARRAYBOUND* const rgsabound) noexcept
+    {
+        auto const size = [vt, cDims, rgsabound]()
+            {
+                size_t cb = detail::vartype_size(vt);
+                for (UINT i = 0; rgsabound && i < cDims; ++i) cb *= rgsabound[i].cElements;
+                return cb;
+            };
+        return detail::budgeted_alloc<unique_safearray>(size,
+            [vt, cDims, rgsabound]() { return SafeArrayCreate(vt, cDims, rgsabound); },
+            [](LPSAFEARRAY const p) { return detail::describe(p); });
+    }
+
+    inline unique_safearray create_safearray_vector(
+        VARTYPE const vt,
+        LONG const lLbound,
+        ULONG const cElements) noexcept
+    {
+        return detail::budgeted_alloc<unique_safearray>([vt, cElements]() { return detail::vartype_size(vt) * cElements; },
+            [vt, lLbound, cElements]() { return SafeArrayCreateVector(vt, lLbound, cElements); },
+            [](LPSAFEARRAY const p) { return detail::describe(p); });
+    }
+
+    // Factory functions tagged with a call site
+    // These make the call site available to observers through
+    // current_call_site while the object is allocated.
+    // Examples:
+    // auto x = alloc_bstr(COMMEM_SITE, L"ABCD");
+    // auto y = create_safearray_vector(CallSite("load_table"), VT_R8, 0, 10);
+
+    template <typename T = void*>
+    unique_heap<T> alloc_heap(CallSite const& site, size_t const cb) noexcept
+    {
+        detail::SiteScope const scope(site);
+        return alloc_heap<T>(cb);
+    }
+
+    inline unique_bstr alloc_bstr(CallSite const& site, OLECHAR const* const psz) noexcept
+    {
+        detail::SiteScope const scope(site);
+        return alloc_bstr(psz);
+    }
+
+    inline unique_bstr alloc_bstr(CallSite const& site, OLECHAR const* const pch, UINT const cch) noexcept
+    {
+        detail::SiteScope const scope(site);
+        return alloc_bstr(pch, cch);
+    }
+
+    inline unique_safearray create_safearray(
+        CallSite const& site,
+        VARTYPE const vt,
+        UINT const cDims,
+        SAFEARRAYBOUND* const rgsabound) noexcept
+    {
+        detail::SiteScope const scope(site);
+        return create_safearray(vt, cDims, rgsabound);
+    }
+
+    inline unique_safearray create_safearray_vector(
+        CallSite const& site,
+        VARTYPE const vt,
+        LONG const lLbound,
+        ULONG const cElements) noexcept
+    {
+        detail::SiteScope const scope(site);
+        return create_safearray_vector(vt, lLbound, cElements);
+    }
+
+    // Scoped access to the data of a SAFEARRAY
+    // SafeArrayAccessData is called on construction and SafeArrayUnaccessData
+    // on destruction. Check Result() before using the data. T must have the
+    // same size as the elements of the SAFEARRAY.
+    // Example:
+    // SafeArrayData<LONG> data(psa);
+    // if (FAILED(data.Result())) return data.Result();
+    // for (auto& x : data) x = 0;
+
+    template <typename T>
+    class SafeArrayData {
+        LPSAFEARRAY m_psa = nullptr;
+        T* m_data = nullptr;
+        size_t m_size = 0;
+        HRESULT m_hr = E_INVALIDARG;
+
+    public:
+        SafeArrayData(SafeArrayData const&) = delete;
+        SafeArrayData(SafeArrayData&&) = delete;
+        SafeArrayData& operator=(SafeArrayData const&) = delete;
+        SafeArrayData& operator=(SafeArrayData&&) = delete;
+
+        explicit SafeArrayData(LPSAFEARRAY const psa) noexcept
+        {
+            if (!psa) return;
+            if (psa->cbElements != sizeof(T))
+            {
+                m_hr = DISP_E_TYPEMISMATCH;
+                return;
+            }
+
+            void* pv = nullptr;
+            m_hr = SafeArrayAccessData(psa, &pv);
+            if (FAILED(m_hr)) return;
+
+            m_psa = psa;
+            m_data = static_cast<T*>(pv);
+            m_size = detail::safearray_bytes(psa) / sizeof(T);
+            COMMEM_PROBE(lock, detail::describe(psa));
+            if (detail::observing())
+            {
+                auto e = detail::describe(psa);
+                e.time = detail::now();
+                detail::notify(&AllocationObserver::OnLock, e);
+            }
+        }
+
+        ~SafeArrayData() noexcept
+        {
+            if (!m_psa) return;
+            COMMEM_PROBE(unlock, detail::describe(m_psa));
+            if (detail::observing())
+            {
+                auto e = detail::describe(m_psa);
+                e.time = detail::now();
+                detail::notify(&AllocationObserver::OnUnlock, e);
+            }
+            (void)SafeArrayUnaccessData(m_psa);
+        }
+
+        HRESULT Result() const noexcept { return m_hr; }
+        T* Data() const noexcept { return m_data; }
+        size_t Size() const noexcept { return m_size; }
+        T* begin() const noexcept { return m_data; }
+        T* end() const noexcept { return m_data + m_size; }
+        T& operator[](size_t const i) const noexcept { return m_data[i]; }
+    };
 }
 
 #endif  // COMMEM_H
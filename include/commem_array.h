@@ -0,0 +1,326 @@
+// commem_array.h: Helpers for the SAFEARRAY kernels //////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_ARRAY_H
+#define COMMEM_ARRAY_H
+
+#include "commem_executor.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <type_traits>
+
+namespace commem {
+
+    // Conventions of the SAFEARRAY kernels
+    // Kernels take one-dimensional SAFEARRAYs (vectors) and return
+    // HRESULTs: E_INVALIDARG for a missing array, an array with more than
+    // one dimension, or vectors whose lengths don't match; DISP_E_BADVARTYPE
+    // for an element type the kernel doesn't support; and E_OUTOFMEMORY.
+    // New arrays are returned through unique_safearray references, which
+    // are changed only on success, and have the lower bound of the input.
+    // Work is split into fixed chunks of elements that run on the shared
+    // executor (see parallel_for), so results don't depend on the number of
+    // threads. A null BSTR is the same as an empty one.
+
+    namespace detail {
+
+        // Elements per chunk of a parallel kernel
+        inline constexpr size_t kernel_chunk = size_t{ 1 } << 16;
+
+        inline size_t chunk_count(size_t const n) noexcept
+        {
+            return (n + kernel_chunk - 1) / kernel_chunk;
+        }
+
+        // Call f(c, begin, end) for each chunk c of [0, n) in parallel
+        template <typename F>
+        void for_each_chunk(size_t const n, F const& f) noexcept
+        {
+            parallel_for(0, chunk_count(n), [n, &f](size_t const b, size_t const e) noexcept
+                {
+                    for (auto c = b; c < e; ++c) f(c, c * kernel_chunk, std::min(n, (c + 1) * kernel_chunk));
+                }, 1);
+        }
+
+        // Group the positions 0 to n - 1 into parts partitions by part(i),
+        // keeping them in increasing order within each partition. Partition
+        // p is positions[starts[p]] up to positions[starts[p + 1]].
+        template <typename Part>
+        HRESULT partition_positions(
+            size_t const n,
+            size_t const parts,
+            Part const& part,
+            std::unique_ptr<ULONG[]>& positions,
+            std::unique_ptr<size_t[]>& starts) noexcept
+        {
+            // Count the positions of each chunk in each partition, and turn
+            // the counts into the offsets where each chunk writes
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<size_t[]> offsets(new (std::nothrow) size_t[chunks * parts]());
+            std::unique_ptr<size_t[]> s(new (std::nothrow) size_t[parts + 1]);
+            std::unique_ptr<ULONG[]> p(new (std::nothrow) ULONG[n]);
+            if (!offsets || !s || !p) return E_OUTOFMEMORY;
+            for_each_chunk(n, [parts, &part, &offsets](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    auto const o = offsets.get() + c * parts;
+                    for (auto i = b; i < e; ++i) ++o[part(i)];
+                });
+            size_t total = 0;
+            for (size_t k = 0; k < parts; ++k)
+            {
+                s[k] = total;
+                for (size_t c = 0; c < chunks; ++c)
+                {
+                    auto const m = offsets[c * parts + k];
+                    offsets[c * parts + k] = total;
+                    total += m;
+                }
+            }
+            s[parts] = total;
+            for_each_chunk(n, [parts, &part, &offsets, &p](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    auto const o = offsets.get() + c * parts;
+                    for (auto i = b; i < e; ++i) p[o[part(i)]++] = static_cast<ULONG>(i);
+                });
+            positions = std::move(p);
+            starts = std::move(s);
+            return S_OK;
+        }
+
+        // Get the element type and length of a vector
+        inline HRESULT vector_info(LPSAFEARRAY const psa, VARTYPE& vt, size_t& n) noexcept
+        {
+            if (!psa || SafeArrayGetDim(psa) != 1) return E_INVALIDARG;
+            auto const hr = SafeArrayGetVartype(psa, &vt);
+            if (FAILED(hr)) return hr;
+            n = psa->rgsabound[0].cElements;
+            return S_OK;
+        }
+
+        // Create a vector with the lower bound of like (or zero if like is
+        // nullptr)
+        inline HRESULT create_vector_like(
+            LPSAFEARRAY const like,
+            VARTYPE const vt,
+            size_t const n,
+            unique_safearray& result) noexcept
+        {
+            if (n > (std::numeric_limits<ULONG>::max)()) return E_INVALIDARG;
+            LONG lb = 0;
+            if (like && FAILED(SafeArrayGetLBound(like, 1, &lb))) lb = 0;
+            auto a = create_safearray_vector(vt, lb, static_cast<ULONG>(n));
+            if (!a) return E_OUTOFMEMORY;
+            result = std::move(a);
+            return S_OK;
+        }
+
+        // Call f with a null pointer to the element type of a numeric
+        // VARTYPE, and return its result
+        template <typename F>
+        HRESULT visit_numeric(VARTYPE const vt, F&& f) noexcept
+        {
+            switch (vt)
+            {
+            case VT_I4: return f(static_cast<LONG*>(nullptr));
+            case VT_I8: return f(static_cast<LONGLONG*>(nullptr));
+            case VT_R4: return f(static_cast<FLOAT*>(nullptr));
+            case VT_R8: return f(static_cast<DOUBLE*>(nullptr));
+            default: return DISP_E_BADVARTYPE;
+            }
+        }
+
+        // Call f with a null pointer to the element type of a key column:
+        // VT_I4, VT_I8, or VT_BSTR
+        template <typename F>
+        HRESULT visit_key(VARTYPE const vt, F&& f) noexcept
+        {
+            switch (vt)
+            {
+            case VT_I4: return f(static_cast<LONG*>(nullptr));
+            case VT_I8: return f(static_cast<LONGLONG*>(nullptr));
+            case VT_BSTR: return f(static_cast<BSTR*>(nullptr));
+            default: return DISP_E_BADVARTYPE;
+            }
+        }
+
+        // Call f with a null pointer to the element type of a numeric or
+        // VT_BSTR VARTYPE
+        template <typename F>
+        HRESULT visit_value(VARTYPE const vt, F&& f) noexcept
+        {
+            if (vt == VT_BSTR) return f(static_cast<BSTR*>(nullptr));
+            return visit_numeric(vt, std::forward<F>(f));
+        }
+
+        // Call f with a null pointer to a type that can hold the elements of
+        // a VARTYPE: BSTR for VT_BSTR, or an unsigned integer of the same
+        // size for types whose elements own nothing (numbers, dates, and
+        // so on), which can then be copied bit for bit
+        template <typename F>
+        HRESULT visit_element(VARTYPE const vt, F&& f) noexcept
+        {
+            switch (vt)
+            {
+            case VT_BSTR: return f(static_cast<BSTR*>(nullptr));
+            case VT_I1: case VT_UI1: return f(static_cast<unsigned char*>(nullptr));
+            case VT_I2: case VT_UI2: case VT_BOOL: return f(static_cast<USHORT*>(nullptr));
+            case VT_I4: case VT_UI4: case VT_INT: case VT_UINT: case VT_R4: case VT_ERROR: return f(static_cast<ULONG*>(nullptr));
+            case VT_I8: case VT_UI8: case VT_R8: case VT_CY: case VT_DATE: return f(static_cast<ULONGLONG*>(nullptr));
+            default: return DISP_E_BADVARTYPE;
+            }
+        }
+
+        // BSTRs compare by their length prefix and bytes (an ordinal
+        // comparison), so they may contain embedded nulls
+
+        inline bool key_equal(BSTR const a, BSTR const b) noexcept
+        {
+            auto const n = SysStringByteLen(a);
+            return n == SysStringByteLen(b) && (n == 0 || std::memcmp(a, b, n) == 0);
+        }
+
+        template <typename T>
+        bool key_equal(T const a, T const b) noexcept
+        {
+            return a == b;
+        }
+
+        // Ordinal comparison of BSTRs, by code unit
+        inline bool key_less(BSTR const a, BSTR const b) noexcept
+        {
+            auto const na = SysStringLen(a);
+            auto const nb = SysStringLen(b);
+            for (UINT i = 0, n = std::min(na, nb); i < n; ++i)
+            {
+                if (a[i] != b[i]) return a[i] < b[i];
+            }
+            return na < nb;
+        }
+
+        template <typename T>
+        bool key_less(T const a, T const b) noexcept
+        {
+            return a < b;
+        }
+
+        // Finalizer of splitmix64: every bit of x affects every bit of the
+        // result
+        inline ULONGLONG mix64(ULONGLONG x) noexcept
+        {
+            x ^= x >> 30;
+            x *= 0xBF58476D1CE4E5B9ull;
+            x ^= x >> 27;
+            x *= 0x94D049BB133111EBull;
+            x ^= x >> 31;
+            return x;
+        }
+
+        // Hashes of column values. Integers hash by value; -0.0 hashes like
+        // 0.0 and all NaNs alike; BSTRs hash their length and their bytes,
+        // eight at a time.
+
+        template <typename T>
+        ULONGLONG hash_value(T const x) noexcept
+        {
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                double const d = x == 0 ? 0.0 : x != x ? std::numeric_limits<double>::quiet_NaN() : static_cast<double>(x);
+                ULONGLONG bits = 0;
+                std::memcpy(&bits, &d, sizeof(bits));
+                return mix64(bits);
+            }
+            else return mix64(static_cast<ULONGLONG>(static_cast<LONGLONG>(x)));
+        }
+
+        inline ULONGLONG hash_value(BSTR const x) noexcept
+        {
+            auto const n = SysStringByteLen(x);
+            auto const p = reinterpret_cast<unsigned char const*>(x);
+            ULONGLONG h = 0x9E3779B97F4A7C15ull ^ n;
+            UINT i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                ULONGLONG w = 0;
+                std::memcpy(&w, p + i, 8);
+                h = (h ^ mix64(w)) * 0x9E3779B97F4A7C15ull;
+            }
+            if (i < n)
+            {
+                ULONGLONG w = 0;
+                std::memcpy(&w, p + i, n - i);
+                h = (h ^ mix64(w)) * 0x9E3779B97F4A7C15ull;
+            }
+            return mix64(h);
+        }
+
+        template <typename T>
+        bool is_nan(T const x) noexcept
+        {
+            if constexpr (std::is_floating_point_v<T>) return std::isnan(x);
+            else return false;
+        }
+
+        // Order and equality of column values with NaNs equal to each other
+        // and after all numbers
+
+        template <typename T>
+        bool value_less(T const a, T const b) noexcept
+        {
+            if (is_nan(a)) return false;
+            if (is_nan(b)) return true;
+            return key_less(a, b);
+        }
+
+        template <typename T>
+        bool value_equal(T const a, T const b) noexcept
+        {
+            return key_equal(a, b) || (is_nan(a) && is_nan(b));
+        }
+
+        // Copy a BSTR into an element of a new array (a null BSTR stays
+        // null). The array owns the copy and SafeArrayDestroy frees it, so
+        // it is not charged to budgets or trackers, nor seen by observers.
+        // The byte length is kept, so an odd-length BSTR is copied intact.
+        inline HRESULT copy_bstr(BSTR const src, BSTR& dst) noexcept
+        {
+            if (!src)
+            {
+                dst = nullptr;
+                return S_OK;
+            }
+            dst = SysAllocStringByteLen(reinterpret_cast<LPCSTR>(src), SysStringByteLen(src));
+            return dst ? S_OK : E_OUTOFMEMORY;
+        }
+    }
+}
+
+#endif  // COMMEM_ARRAY_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,255 @@
+// commem_asof.h: As-of joins of time series SAFEARRAYs ///////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_ASOF_H
+#define COMMEM_ASOF_H
+
+#include "commem_gather.h"
+#include <algorithm>
+#include <type_traits>
+
+namespace commem {
+
+    // Row of a series matched to a time by asof_join
+    // Backward: the last row at or before the time (forward fill). Forward:
+    // the first row at or after the time (backward fill). Nearest: the
+    // closer of the two, or the earlier if they are equally close.
+    enum class AsOfPolicy { Backward, Forward, Nearest };
+
+    namespace detail {
+
+        inline constexpr size_t asof_none = ~size_t{ 0 };
+
+        // Check that times is a VT_DATE vector in nondecreasing order
+        inline HRESULT sorted_times(LPSAFEARRAY const times, size_t& n) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            auto const hr = vector_info(times, vt, n);
+            if (FAILED(hr)) return hr;
+            if (vt != VT_DATE) return DISP_E_BADVARTYPE;
+            SafeArrayData<DATE> t(times);
+            if (FAILED(t.Result())) return t.Result();
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (std::isnan(t[i]) || (i && t[i] < t[i - 1])) return E_INVALIDARG;
+            }
+            return S_OK;
+        }
+
+        // Call f(i, j) with the row j of t matched to each time g[i] from b
+        // to e, or asof_none. Both are sorted, so after a binary search for
+        // g[b], the rows are found by advancing two cursors through t.
+        template <typename F>
+        void asof_rows(
+            DATE const* const g,
+            size_t const b,
+            size_t const e,
+            DATE const* const t,
+            size_t const m,
+            AsOfPolicy const policy,
+            double const tolerance,
+            F const& f) noexcept
+        {
+            if (b == e) return;
+            auto after = static_cast<size_t>(std::upper_bound(t, t + m, g[b]) - t);
+            auto from = static_cast<size_t>(std::lower_bound(t, t + after, g[b]) - t);
+            for (auto i = b; i < e; ++i)
+            {
+                auto const x = g[i];
+                while (after < m && !(x < t[after])) ++after;
+                while (from < m && t[from] < x) ++from;
+
+                // Rows after - 1 (at or before) and from (at or after)
+                auto const back = after ? x - t[after - 1] : HUGE_VAL;
+                auto const ahead = from < m ? t[from] - x : HUGE_VAL;
+                auto j = asof_none;
+                auto d = HUGE_VAL;
+                if (policy != AsOfPolicy::Forward && after)
+                {
+                    j = after - 1;
+                    d = back;
+                }
+                if (policy == AsOfPolicy::Forward || (policy == AsOfPolicy::Nearest && ahead < back))
+                {
+                    j = from < m ? from : asof_none;
+                    d = ahead;
+                }
+                f(i, j != asof_none && d <= tolerance ? j : asof_none);
+            }
+        }
+
+        // Match the times of each series to the grid, in parallel over the
+        // series and chunks of the grid, and call f(k, i, j) for each match
+        template <typename F>
+        HRESULT asof_match(
+            LPSAFEARRAY const grid,
+            LPSAFEARRAY const* const times,
+            size_t const count,
+            AsOfPolicy const policy,
+            double const tolerance,
+            size_t& n,
+            F const& f) noexcept
+        {
+            if (!times && count) return E_POINTER;
+            if (!(tolerance >= 0.0)) return E_INVALIDARG;
+            auto hr = sorted_times(grid, n);
+            if (FAILED(hr)) return hr;
+            std::unique_ptr<size_t[]> sizes(new (std::nothrow) size_t[count]);
+            std::unique_ptr<LockedColumn[]> rows(new (std::nothrow) LockedColumn[count]);
+            if (!sizes || !rows) return E_OUTOFMEMORY;
+            for (size_t k = 0; k < count; ++k)
+            {
+                hr = sorted_times(times[k], sizes[k]);
+                if (FAILED(hr)) return hr;
+                hr = rows[k].Lock(times[k]);
+                if (FAILED(hr)) return hr;
+            }
+
+            SafeArrayData<DATE> g(grid);
+            if (FAILED(g.Result())) return g.Result();
+            auto const chunks = chunk_count(n);
+            auto const pg = g.Data();
+            parallel_for(0, count * chunks, [=, &sizes, &rows, &f](size_t const tb, size_t const te) noexcept
+                {
+                    for (auto task = tb; task < te; ++task)
+                    {
+                        auto const k = task / chunks;
+                        auto const b = task % chunks * kernel_chunk;
+                        auto const e = std::min(n, b + kernel_chunk);
+                        auto const t = static_cast<DATE const*>(rows[k].Data());
+                        asof_rows(pg, b, e, t, sizes[k], policy, tolerance, [k, &f](size_t const i, size_t const j) noexcept
+                            {
+                                f(k, i, j);
+                            });
+                    }
+                }, 1);
+            return S_OK;
+        }
+    }
+
+    // As-of join of time series
+    // Align count series, each a VT_DATE vector of times in nondecreasing
+    // order and a VT_R4 or VT_R8 vector of values with the same lower bound
+    // and length, onto grid, a VT_DATE vector of times in nondecreasing
+    // order. results[k] receives, for each time of the grid, the value of
+    // the row of series k chosen by policy, or NaN if there is none or it is
+    // more than tolerance (in days) away. The results have the type of the
+    // values and the lower bound of the grid.
+    // Each series is merged with the grid in one linear pass, split into
+    // chunks of the grid that start with one binary search; the series and
+    // chunks run in parallel.
+    // Example:
+    // LPSAFEARRAY times[] = { bidTimes.get(), askTimes.get() };
+    // LPSAFEARRAY values[] = { bids.get(), asks.get() };
+    // unique_safearray aligned[2];
+    // hr = asof_join(grid.get(), times, values, 2, AsOfPolicy::Backward, 1.0 / 24, aligned);
+
+    inline HRESULT asof_join(
+        LPSAFEARRAY const grid,
+        LPSAFEARRAY const* const times,
+        LPSAFEARRAY const* const values,
+        size_t const count,
+        AsOfPolicy const policy,
+        double const tolerance,
+        unique_safearray* const results) noexcept
+    {
+        if ((!times || !values || !results) && count) return E_POINTER;
+        VARTYPE gvt = VT_EMPTY;
+        size_t n = 0;
+        auto hr = detail::vector_info(grid, gvt, n);
+        if (FAILED(hr)) return hr;
+        std::unique_ptr<unique_safearray[]> out(new (std::nothrow) unique_safearray[count]);
+        std::unique_ptr<detail::LockedColumn[]> in(new (std::nothrow) detail::LockedColumn[count]);
+        std::unique_ptr<detail::LockedColumn[]> dst(new (std::nothrow) detail::LockedColumn[count]);
+        if (!out || !in || !dst) return E_OUTOFMEMORY;
+        for (size_t k = 0; k < count; ++k)
+        {
+            VARTYPE vt = VT_EMPTY;
+            VARTYPE tvt = VT_EMPTY;
+            size_t m = 0;
+            size_t tm = 0;
+            hr = detail::vector_info(values[k], vt, m);
+            if (FAILED(hr)) return hr;
+            if (vt != VT_R4 && vt != VT_R8) return DISP_E_BADVARTYPE;
+            hr = detail::vector_info(times[k], tvt, tm);
+            if (FAILED(hr)) return hr;
+            LONG lb = 0;
+            LONG tlb = 0;
+            hr = SafeArrayGetLBound(values[k], 1, &lb);
+            if (FAILED(hr)) return hr;
+            hr = SafeArrayGetLBound(times[k], 1, &tlb);
+            if (FAILED(hr)) return hr;
+            if (lb != tlb || m != tm) return E_INVALIDARG;
+            hr = detail::create_vector_like(grid, vt, n, out[k]);
+            if (FAILED(hr)) return hr;
+            hr = in[k].Lock(values[k]);
+            if (FAILED(hr)) return hr;
+            hr = dst[k].Lock(out[k].get());
+            if (FAILED(hr)) return hr;
+        }
+
+        auto const pin = in.get();
+        auto const pdst = dst.get();
+        hr = detail::asof_match(grid, times, count, policy, tolerance, n, [pin, pdst](size_t const k, size_t const i, size_t const j) noexcept
+            {
+                auto const none = j == detail::asof_none;
+                if (pin[k].ElementSize() == sizeof(FLOAT))
+                {
+                    static_cast<FLOAT*>(pdst[k].Data())[i] = none ? std::numeric_limits<FLOAT>::quiet_NaN() : static_cast<FLOAT const*>(pin[k].Data())[j];
+                }
+                else
+                {
+                    static_cast<DOUBLE*>(pdst[k].Data())[i] = none ? std::numeric_limits<DOUBLE>::quiet_NaN() : static_cast<DOUBLE const*>(pin[k].Data())[j];
+                }
+            });
+        in.reset();
+        dst.reset();
+        if (FAILED(hr)) return hr;
+        for (size_t k = 0; k < count; ++k) results[k] = std::move(out[k]);
+        return S_OK;
+    }
+
+    // As-of join of one time series
+    // Example:
+    // hr = asof_join(grid.get(), times.get(), prices.get(), AsOfPolicy::Nearest, 5.0 / (24 * 60), aligned);
+
+    inline HRESULT asof_join(
+        LPSAFEARRAY const grid,
+        LPSAFEARRAY const times,
+        LPSAFEARRAY const values,
+        AsOfPolicy const policy,
+        double const tolerance,
+        unique_safearray& result) noexcept
+    {
+        return asof_join(grid, &times, &values, 1, policy, tolerance, &result);
+    }
+}
+
+#endif  // COMMEM_ASOF_H
+
+///////////////////////////////////////////////////////////////////////////////
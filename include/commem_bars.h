@@ -0,0 +1,263 @@
+// commem_bars.h: OHLCV bars from tick SAFEARRAYs /////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_BARS_H
+#define COMMEM_BARS_H
+
+#include "commem_array.h"
+#include <algorithm>
+
+namespace commem {
+
+    // Fixed-interval OHLCV bars built from ticks
+    // Bar i covers the times from origin + i * interval up to (but not
+    // including) origin + (i + 1) * interval. The bars are written into
+    // arrays owned by the caller: open, high, low, close, and volume are
+    // VT_R8 vectors and count is a VT_I8 vector, all with the same lower
+    // bound and length, which is the number of bars that fit. Bars() is the
+    // number of bars written so far; the last of them is still open to new
+    // ticks. A bar without ticks has the previous close as its open, high,
+    // low, and close (NaN before the first tick) and no volume.
+    // Add takes batches of ticks in time order and writes each tick into
+    // the arrays as it goes: nothing is allocated, and each tick is visited
+    // once. A batch is checked first and either added whole or not at all.
+    // Attach new arrays (for example, for the next day) to continue; the
+    // last close carries over to the new arrays.
+    // Example:
+    // BarBuilder bars;
+    // hr = bars.Attach(today, 1.0 / (24 * 60), open.get(), high.get(), low.get(), close.get(), volume.get(), count.get());
+    // hr = bars.Add(times.get(), prices.get(), sizes.get());
+
+    class BarBuilder {
+        LPSAFEARRAY m_open = nullptr;
+        LPSAFEARRAY m_high = nullptr;
+        LPSAFEARRAY m_low = nullptr;
+        LPSAFEARRAY m_close = nullptr;
+        LPSAFEARRAY m_volume = nullptr;
+        LPSAFEARRAY m_count = nullptr;
+        DATE m_origin = 0.0;
+        double m_interval = 0.0;
+        size_t m_capacity = 0;
+        size_t m_bars = 0;
+        DATE m_last = -HUGE_VAL;
+        double m_price = std::numeric_limits<double>::quiet_NaN();
+
+        // Bar of a time at or after the origin, or the capacity if the time
+        // is after the last bar
+        size_t Bar(DATE const t) const noexcept
+        {
+            auto const bar = std::floor((t - m_origin) / m_interval);
+            return bar < static_cast<double>(m_capacity) ? static_cast<size_t>(bar) : m_capacity;
+        }
+
+        // The arrays, locked while a batch is written
+        class Locked {
+        public:
+            SafeArrayData<DOUBLE> open;
+            SafeArrayData<DOUBLE> high;
+            SafeArrayData<DOUBLE> low;
+            SafeArrayData<DOUBLE> close;
+            SafeArrayData<DOUBLE> volume;
+            SafeArrayData<LONGLONG> count;
+
+            explicit Locked(BarBuilder const& b) noexcept :
+                open(b.m_open), high(b.m_high), low(b.m_low), close(b.m_close), volume(b.m_volume), count(b.m_count) { }
+
+            HRESULT Result() const noexcept
+            {
+                for (auto const hr : { open.Result(), high.Result(), low.Result(), close.Result(), volume.Result(), count.Result() })
+                {
+                    if (FAILED(hr)) return hr;
+                }
+                return S_OK;
+            }
+        };
+
+        // Write bars without ticks up to (but not including) bar
+        void Fill(Locked& a, size_t const bar) noexcept
+        {
+            for (; m_bars < bar; ++m_bars)
+            {
+                a.open[m_bars] = m_price;
+                a.high[m_bars] = m_price;
+                a.low[m_bars] = m_price;
+                a.close[m_bars] = m_price;
+                a.volume[m_bars] = 0.0;
+                a.count[m_bars] = 0;
+            }
+        }
+
+    public:
+        BarBuilder() noexcept = default;
+        BarBuilder(BarBuilder const&) = delete;
+        BarBuilder& operator=(BarBuilder const&) = delete;
+
+        // Start writing bars of interval days from origin into new arrays.
+        // The arrays must outlive their use by the builder.
+        HRESULT Attach(
+            DATE const origin,
+            double const interval,
+            LPSAFEARRAY const open,
+            LPSAFEARRAY const high,
+            LPSAFEARRAY const low,
+            LPSAFEARRAY const close,
+            LPSAFEARRAY const volume,
+            LPSAFEARRAY const count) noexcept
+        {
+            if (!std::isfinite(origin) || !(interval > 0.0) || !std::isfinite(interval)) return E_INVALIDARG;
+            size_t n = 0;
+            LONG lb = 0;
+            LPSAFEARRAY const arrays[] = { open, high, low, close, volume, count };
+            for (size_t i = 0; i < 6; ++i)
+            {
+                VARTYPE vt = VT_EMPTY;
+                size_t size = 0;
+                auto hr = detail::vector_info(arrays[i], vt, size);
+                if (FAILED(hr)) return hr;
+                if (vt != (i < 5 ? VT_R8 : VT_I8)) return DISP_E_BADVARTYPE;
+                LONG bound = 0;
+                hr = SafeArrayGetLBound(arrays[i], 1, &bound);
+                if (FAILED(hr)) return hr;
+                if (i == 0)
+                {
+                    n = size;
+                    lb = bound;
+                }
+                else if (size != n || bound != lb) return E_INVALIDARG;
+            }
+
+            m_open = open;
+            m_high = high;
+            m_low = low;
+            m_close = close;
+            m_volume = volume;
+            m_count = count;
+            m_origin = origin;
+            m_interval = interval;
+            m_capacity = n;
+            m_bars = 0;
+            return S_OK;
+        }
+
+        size_t Bars() const noexcept { return m_bars; }
+        size_t Capacity() const noexcept { return m_capacity; }
+
+        // Add ticks: VT_DATE times in nondecreasing order, no earlier than
+        // the origin or the ticks added before, and VT_R8 prices and volumes
+        // (volumes may be nullptr) of the same length. Ticks with a NaN price
+        // are skipped. Returns DISP_E_BADINDEX if a tick falls after the
+        // last bar; nothing is written then.
+        HRESULT Add(LPSAFEARRAY const times, LPSAFEARRAY const prices, LPSAFEARRAY const volumes = nullptr) noexcept
+        {
+            if (!m_open) return E_UNEXPECTED;
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = detail::vector_info(times, vt, n);
+            if (FAILED(hr)) return hr;
+            if (vt != VT_DATE) return DISP_E_BADVARTYPE;
+            for (auto const column : { prices, volumes })
+            {
+                if (!column && column != prices) continue;
+                size_t m = 0;
+                hr = detail::vector_info(column, vt, m);
+                if (FAILED(hr)) return hr;
+                if (vt != VT_R8) return DISP_E_BADVARTYPE;
+                if (m != n) return E_INVALIDARG;
+            }
+
+            SafeArrayData<DATE> t(times);
+            if (FAILED(t.Result())) return t.Result();
+            SafeArrayData<DOUBLE> p(prices);
+            if (FAILED(p.Result())) return p.Result();
+            if (n)
+            {
+                if (!(t[0] >= m_last) || !(t[0] >= m_origin)) return E_INVALIDARG;
+                for (size_t i = 1; i < n; ++i)
+                {
+                    if (!(t[i] >= t[i - 1])) return E_INVALIDARG;
+                }
+                if (Bar(t[n - 1]) >= m_capacity) return DISP_E_BADINDEX;
+            }
+
+            SafeArrayData<DOUBLE> v(volumes);
+            if (volumes && FAILED(v.Result())) return v.Result();
+            Locked a(*this);
+            hr = a.Result();
+            if (FAILED(hr)) return hr;
+            for (size_t i = 0; i < n; ++i)
+            {
+                auto const price = p[i];
+                if (std::isnan(price)) continue;
+                auto const volume = volumes ? v[i] : 0.0;
+                auto const bar = Bar(t[i]);
+                if (bar >= m_bars)
+                {
+                    Fill(a, bar);
+                    a.open[bar] = price;
+                    a.high[bar] = price;
+                    a.low[bar] = price;
+                    a.volume[bar] = volume;
+                    a.count[bar] = 1;
+                    m_bars = bar + 1;
+                }
+                else
+                {
+                    a.high[bar] = std::max(a.high[bar], price);
+                    a.low[bar] = std::min(a.low[bar], price);
+                    a.volume[bar] += volume;
+                    ++a.count[bar];
+                }
+                a.close[bar] = price;
+                m_price = price;
+            }
+            if (n) m_last = t[n - 1];
+            return S_OK;
+        }
+
+        // Write the bars without ticks that end at or before time, so that
+        // quiet intervals show up before the next tick arrives. Later ticks
+        // must not be earlier than time.
+        HRESULT Advance(DATE const time) noexcept
+        {
+            if (!m_open) return E_UNEXPECTED;
+            if (!(time >= m_last)) return E_INVALIDARG;
+            if (time < m_origin) return S_OK;
+            auto const bar = Bar(time);
+            Locked a(*this);
+            auto const hr = a.Result();
+            if (FAILED(hr)) return hr;
+            Fill(a, bar);
+            m_last = time;
+            return S_OK;
+        }
+    };
+}
+
+#endif  // COMMEM_BARS_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,451 @@
+// commem_budget.h: Allocation budgets ////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_BUDGET_H
+#define COMMEM_BUDGET_H
+
+#include "commem.h"
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <new>
+
+namespace commem {
+
+    // Limits of an AllocationBudget (zero means no limit)
+    // Bytes are bytes of data: the length of a BSTR, the size of a heap
+    // block, or the element data of a SAFEARRAY.
+
+    struct BudgetLimits {
+        size_t softBytes = 0;
+        size_t hardBytes = 0;
+        size_t softObjects = 0;
+        size_t hardObjects = 0;
+    };
+
+    class BudgetScope;
+
+    namespace detail {
+        class BudgetTracker;
+    }
+
+    // Bytes and objects charged by the factory functions while a BudgetScope
+    // for the budget is in effect
+    // An allocation that would exceed a hard limit fails before anything is
+    // allocated, so the factory returns an empty pointer as if the COM
+    // allocation function had failed (E_OUTOFMEMORY). When usage first
+    // exceeds a soft limit, OnSoftLimit is called on the allocating thread;
+    // it is called again only after usage has dropped back below the soft
+    // limits. Objects are credited back to the budgets that were charged for
+    // them when a commem deleter frees them, on whichever thread frees them.
+    // An object whose ownership leaves commem (release() of its unique_ptr)
+    // stays charged until budget_release is called for it. A budget must
+    // outlive all objects that were charged to it.
+    // Example:
+    // struct RequestBudget : AllocationBudget {
+    //     using AllocationBudget::AllocationBudget;
+    //     void OnSoftLimit() noexcept override { log("request is using a lot of memory"); }
+    // } budget({ 64 << 20, 256 << 20 });
+    // BudgetScope scope(budget);
+    // auto a = create_safearray_vector(VT_R8, 0, n);
+    // if (!a) return E_OUTOFMEMORY;
+
+    class AllocationBudget {
+
+        friend class detail::BudgetTracker;
+
+        BudgetLimits const m_limits;
+        std::atomic<size_t> m_bytes{ 0 };
+        std::atomic<size_t> m_objects{ 0 };
+        std::atomic<size_t> m_peakBytes{ 0 };
+        std::atomic<size_t> m_rejected{ 0 };
+        std::atomic<bool> m_soft{ false };
+
+        static bool Over(size_t const limit, size_t const value) noexcept
+        {
+            return limit != 0 && value > limit;
+        }
+
+        // Charge one object of cb bytes. Return false, without charging
+        // anything, if a hard limit would be exceeded.
+        bool Charge(size_t const cb) noexcept
+        {
+            auto bytes = m_bytes.load(std::memory_order_relaxed);
+            do
+            {
+                if (Over(m_limits.hardBytes, bytes + cb))
+                {
+                    m_rejected.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            } while (!m_bytes.compare_exchange_weak(bytes, bytes + cb, std::memory_order_relaxed));
+
+            auto objects = m_objects.load(std::memory_order_relaxed);
+            do
+            {
+                if (Over(m_limits.hardObjects, objects + 1))
+                {
+                    m_bytes.fetch_sub(cb, std::memory_order_relaxed);
+                    m_rejected.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+            } while (!m_objects.compare_exchange_weak(objects, objects + 1, std::memory_order_relaxed));
+
+            bytes += cb;
+            auto peak = m_peakBytes.load(std::memory_order_relaxed);
+            while (peak < bytes && !m_peakBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) { }
+
+            if ((Over(m_limits.softBytes, bytes) || Over(m_limits.softObjects, objects + 1)) &&
+                !m_soft.exchange(true, std::memory_order_relaxed))
+            {
+                OnSoftLimit();
+            }
+            return true;
+        }
+
+        void Credit(size_t const cb) noexcept
+        {
+            auto const bytes = m_bytes.fetch_sub(cb, std::memory_order_relaxed) - cb;
+            auto const objects = m_objects.fetch_sub(1, std::memory_order_relaxed) - 1;
+            if (!Over(m_limits.softBytes, bytes) && !Over(m_limits.softObjects, objects))
+                m_soft.store(false, std::memory_order_relaxed);
+        }
+
+    protected:
+        // Called when usage first exceeds a soft limit. Must not throw.
+        virtual void OnSoftLimit() noexcept { }
+
+    public:
+        AllocationBudget(AllocationBudget const&) = delete;
+        AllocationBudget(AllocationBudget&&) = delete;
+        AllocationBudget& operator=(AllocationBudget const&) = delete;
+        AllocationBudget& operator=(AllocationBudget&&) = delete;
+
+        explicit AllocationBudget(BudgetLimits const& limits) noexcept : m_limits(limits) { }
+
+        virtual ~AllocationBudget() = default;
+
+        BudgetLimits const& Limits() const noexcept
+        {
+            return m_limits;
+        }
+
+        // Bytes charged and not yet credited
+        size_t Bytes() const noexcept
+        {
+            return m_bytes.load(std::memory_order_relaxed);
+        }
+
+        // Objects charged and not yet credited
+        size_t Objects() const noexcept
+        {
+            return m_objects.load(std::memory_order_relaxed);
+        }
+
+        size_t PeakBytes() const noexcept
+        {
+            return m_peakBytes.load(std::memory_order_relaxed);
+        }
+
+        // Number of allocations that failed because of a hard limit
+        size_t Rejected() const noexcept
+        {
+            return m_rejected.load(std::memory_order_relaxed);
+        }
+    };
+
+    namespace detail {
+
+        // Budget hooks installed by the first BudgetScope
+        // Each budgeted object has a record, kept in a hash table keyed by
+        // address, of the budgets that were charged for it. The table is
+        // split into stripes with their own locks. Records are allocated
+        // before the object so that a failure to allocate one fails the
+        // factory rather than losing track of the charge.
+
+        class BudgetTracker : public BudgetHooks {
+        public:
+            static constexpr size_t max_depth = 4;
+
+        private:
+            static constexpr size_t num_buckets = size_t{ 1 } << 16;
+            static constexpr size_t num_stripes = 256;
+
+            struct Record {
+                Record* next;
+                void const* p;
+                size_t cb;
+                AllocationBudget* budgets[max_depth];
+                size_t count;
+            };
+
+            struct alignas(64) Stripe {
+                std::mutex lock;
+            };
+
+            std::unique_ptr<Record*[]> m_buckets;
+            std::unique_ptr<Stripe[]> m_stripes;
+            std::atomic<size_t> m_records{ 0 };
+
+            static size_t Bucket(void const* const p) noexcept
+            {
+                auto x = static_cast<ULONGLONG>(reinterpret_cast<uintptr_t>(p));
+                x ^= x >> 33;
+                x *= 0xff51afd7ed558ccdull;
+                x ^= x >> 33;
+                return static_cast<size_t>(x) & (num_buckets - 1);
+            }
+
+            static void CreditAll(Record const& r) noexcept
+            {
+                for (size_t i = 0; i < r.count; ++i) r.budgets[i]->Credit(r.cb);
+            }
+
+            // Records freed on this thread are kept for reuse, so that a
+            // charged allocation doesn't also cost a heap allocation
+            static constexpr size_t max_spare = 64;
+            static inline thread_local Record* spare = nullptr;
+            static inline thread_local size_t spareCount = 0;
+            static inline thread_local bool spareRetired = false;
+
+            // Frees the thread's spare records when the thread exits
+            // (zero-initialized, like every thread_local)
+            struct SpareHolder {
+                bool active;
+                ~SpareHolder() noexcept
+                {
+                    spareRetired = true;
+                    while (spare)
+                    {
+                        auto const r = spare;
+                        spare = r->next;
+                        delete r;
+                    }
+                    spareCount = 0;
+                }
+            };
+
+            static inline thread_local SpareHolder spareHolder;
+
+            static Record* NewRecord() noexcept
+            {
+                auto const r = spare;
+                if (!r) return new (std::nothrow) Record();
+                spare = r->next;
+                --spareCount;
+                *r = Record();
+                return r;
+            }
+
+            static void FreeRecord(Record* const r) noexcept
+            {
+                if (spareRetired || spareCount == max_spare)
+                {
+                    delete r;
+                    return;
+                }
+                spareHolder.active = true;
+                r->next = spare;
+                spare = r;
+                ++spareCount;
+            }
+
+            // Charge a budget for a record, unless it is already charged.
+            // Return false if a hard limit would be exceeded.
+            static bool ChargeOnce(Record& r, AllocationBudget& budget) noexcept
+            {
+                auto const end = r.budgets + r.count;
+                if (std::find(r.budgets, end, &budget) != end) return true;
+                if (!budget.Charge(r.cb)) return false;
+                r.budgets[r.count++] = &budget;
+                return true;
+            }
+
+        public:
+            static inline thread_local BudgetScope* current = nullptr;
+            static inline thread_local Record* pending = nullptr;
+
+            BudgetTracker() :
+                m_buckets(new Record*[num_buckets]()),
+                m_stripes(new Stripe[num_stripes]) { }
+
+            bool Reserve(size_t cb) noexcept override;
+
+            void Commit(void const* const p, size_t) noexcept override
+            {
+                auto const r = pending;
+                if (!r) return;
+                pending = nullptr;
+                if (!p)
+                {
+                    CreditAll(*r);
+                    FreeRecord(r);
+                    return;
+                }
+
+                r->p = p;
+                auto const b = Bucket(p);
+                m_records.fetch_add(1, std::memory_order_relaxed);
+                std::lock_guard<std::mutex> lock(m_stripes[b % num_stripes].lock);
+                r->next = m_buckets[b];
+                m_buckets[b] = r;
+            }
+
+            void Release(void const* const p) noexcept override
+            {
+                if (m_records.load(std::memory_order_relaxed) == 0) return;
+
+                auto const b = Bucket(p);
+                Record* r = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(m_stripes[b % num_stripes].lock);
+                    for (auto link = &m_buckets[b]; *link; link = &(*link)->next)
+                    {
+                        if ((*link)->p != p) continue;
+                        r = *link;
+                        *link = r->next;
+                        break;
+                    }
+                }
+                if (!r) return;
+                m_records.fetch_sub(1, std::memory_order_relaxed);
+                CreditAll(*r);
+                FreeRecord(r);
+            }
+
+            // Return the tracker, installing it the first time
+            static BudgetTracker* Install() noexcept
+            {
+                static BudgetTracker* const tracker = []() noexcept -> BudgetTracker*
+                    {
+                        try
+                        {
+                            return new BudgetTracker();     // Never freed; deleters may run at exit
+                        }
+                        catch (...)
+                        {
+                            return nullptr;
+                        }
+                    }();
+                if (tracker) budget_hooks.store(tracker, std::memory_order_release);
+                return tracker;
+            }
+        };
+    }
+
+    // Makes a budget apply to the factory calls made on this thread until the
+    // scope ends
+    // Scopes nest: an allocation is charged once to the budget of the
+    // outermost scope and to the budgets of the innermost scopes, up to
+    // BudgetTracker::max_depth budgets in all, and fails if any of them would
+    // exceed a hard limit. When scopes nest deeper than that, the budgets in
+    // between are not charged, but a per-thread budget (a scope at the top of
+    // the thread's function) always is. A per-request budget is a scope
+    // around the request.
+    // Scopes must be destroyed in the reverse order of construction.
+
+    class BudgetScope {
+
+        friend class detail::BudgetTracker;
+
+        AllocationBudget& m_budget;
+        BudgetScope* const m_previous;
+        BudgetScope* const m_outermost;
+
+    public:
+        BudgetScope(BudgetScope const&) = delete;
+        BudgetScope(BudgetScope&&) = delete;
+        BudgetScope& operator=(BudgetScope const&) = delete;
+        BudgetScope& operator=(BudgetScope&&) = delete;
+
+        // If the budget tracker can't be allocated, allocations in the scope
+        // are not charged
+        explicit BudgetScope(AllocationBudget& budget) noexcept :
+            m_budget(budget),
+            m_previous(detail::BudgetTracker::current),
+            m_outermost(m_previous ? m_previous->m_outermost : this)
+        {
+            if (detail::BudgetTracker::Install()) detail::BudgetTracker::current = this;
+        }
+
+        ~BudgetScope() noexcept
+        {
+            if (detail::BudgetTracker::current == this) detail::BudgetTracker::current = m_previous;
+        }
+
+        AllocationBudget& Budget() const noexcept
+        {
+            return m_budget;
+        }
+    };
+
+    // Credit the budgets charged for an object whose ownership is leaving
+    // commem, such as a BSTR or SAFEARRAY released to a COM caller that will
+    // free it with SysFreeString or SafeArrayDestroy
+    // Only a commem deleter credits budgets, so without this call the object
+    // stays charged after it is released. Call it while the object is still
+    // live; an object that was not charged is ignored.
+    // Example:
+    // auto a = create_safearray_vector(VT_R8, 0, n);
+    // if (!a) return E_OUTOFMEMORY;
+    // budget_release(a.get());
+    // *ppsa = a.release();
+
+    inline void budget_release(void const* const p) noexcept
+    {
+        if (p) detail::budget_release(p);
+    }
+
+    inline bool detail::BudgetTracker::Reserve(size_t const cb) noexcept
+    {
+        auto scope = current;
+        if (!scope) return true;
+
+        auto const r = NewRecord();
+        if (!r) return false;
+        r->cb = cb;
+        auto& outermost = scope->m_outermost->m_budget;
+        auto ok = true;
+        for (; ok && scope && r->count + 1 < max_depth; scope = scope->m_previous)
+        {
+            ok = ChargeOnce(*r, scope->m_budget);
+        }
+        if (!ok || !ChargeOnce(*r, outermost))
+        {
+            CreditAll(*r);
+            FreeRecord(r);
+            return false;
+        }
+        pending = r;
+        return true;
+    }
+}
+
+#endif  // COMMEM_BUDGET_H
+
+///////////////////////////////////////////////////////////////////////////////
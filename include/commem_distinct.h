@@ -0,0 +1,498 @@
+// commem_distinct.h: Distinct values and value counts of SAFEARRAYs //////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_DISTINCT_H
+#define COMMEM_DISTINCT_H
+
+#include "commem_array.h"
+#include <atomic>
+#include <bitset>
+#include <type_traits>
+
+namespace commem {
+
+    // Order of the values returned by distinct and value_counts
+    // FirstSeen keeps the order in which the values first appear; Ascending
+    // sorts them, with NaN last.
+
+    enum class DistinctOrder { FirstSeen, Ascending };
+
+    namespace detail {
+
+        // Entries per partition when merging, so that a partition's table
+        // fits in the L2 cache
+        inline constexpr size_t distinct_partition_entries = 4096;
+        inline constexpr unsigned distinct_max_partition_bits = 12;
+
+        // Rows per distinct value in the first chunk above which each chunk
+        // is counted on its own before merging
+        inline constexpr size_t distinct_repeats = 4;
+
+        // The distinct values of x as the positions where they first
+        // appear, in increasing order, and the number of times each appears
+        struct DistinctPositions {
+            std::unique_ptr<ULONG[]> first;
+            std::unique_ptr<ULONGLONG[]> count;
+            size_t size = 0;
+        };
+
+        // Open-addressing table of distinct values, each held with the
+        // position where it was first added and its count. The table starts
+        // small and doubles as values are added, so its size follows the
+        // number of distinct values rather than the number of rows.
+        template <typename T>
+        class DistinctTable {
+            std::unique_ptr<ULONG[]> m_slots;       // Entry plus one, or zero if empty
+            std::unique_ptr<T[]> m_value;
+            std::unique_ptr<ULONG[]> m_first;
+            std::unique_ptr<ULONGLONG[]> m_count;
+            size_t m_mask = 0;
+            size_t m_size = 0;
+            size_t m_capacity = 0;
+
+        public:
+            // Make room for at least capacity entries. Return false if
+            // memory runs out.
+            bool Reserve(size_t const capacity) noexcept
+            {
+                if (capacity <= m_capacity) return true;
+                size_t c = 8;
+                while (c < capacity) c *= 2;
+                std::unique_ptr<ULONG[]> slots(new (std::nothrow) ULONG[2 * c]());
+                std::unique_ptr<T[]> value(new (std::nothrow) T[c]);
+                std::unique_ptr<ULONG[]> first(new (std::nothrow) ULONG[c]);
+                std::unique_ptr<ULONGLONG[]> count(new (std::nothrow) ULONGLONG[c]);
+                if (!slots || !value || !first || !count) return false;
+                std::copy(m_value.get(), m_value.get() + m_size, value.get());
+                std::copy(m_first.get(), m_first.get() + m_size, first.get());
+                std::copy(m_count.get(), m_count.get() + m_size, count.get());
+                auto const mask = 2 * c - 1;
+                for (size_t j = 0; j < m_size; ++j)
+                {
+                    auto s = static_cast<size_t>(hash_value(value[j])) & mask;
+                    while (slots[s]) s = (s + 1) & mask;
+                    slots[s] = static_cast<ULONG>(j + 1);
+                }
+                m_slots = std::move(slots);
+                m_value = std::move(value);
+                m_first = std::move(first);
+                m_count = std::move(count);
+                m_mask = mask;
+                m_capacity = c;
+                return true;
+            }
+
+            // Add count occurrences of v, whose hash is hash, first seen at
+            // position i. Return false if memory runs out.
+            bool Add(T const v, ULONGLONG const hash, ULONG const i, ULONGLONG const count) noexcept
+            {
+                if (m_size == m_capacity && !Reserve(m_size + 1)) return false;
+                auto s = static_cast<size_t>(hash) & m_mask;
+                while (m_slots[s] && !value_equal(m_value[m_slots[s] - 1], v)) s = (s + 1) & m_mask;
+                if (m_slots[s])
+                {
+                    m_count[m_slots[s] - 1] += count;
+                    return true;
+                }
+                m_slots[s] = static_cast<ULONG>(m_size + 1);
+                m_value[m_size] = v;
+                m_first[m_size] = i;
+                m_count[m_size++] = count;
+                return true;
+            }
+
+            // Free the slots and values, and the unused room for positions
+            // and counts if memory allows. Nothing can be added afterward.
+            void Trim() noexcept
+            {
+                m_slots.reset();
+                m_value.reset();
+                if (m_size == m_capacity) return;
+                std::unique_ptr<ULONG[]> first(new (std::nothrow) ULONG[m_size]);
+                std::unique_ptr<ULONGLONG[]> count(new (std::nothrow) ULONGLONG[m_size]);
+                if (!first || !count) return;
+                std::copy(m_first.get(), m_first.get() + m_size, first.get());
+                std::copy(m_count.get(), m_count.get() + m_size, count.get());
+                m_first = std::move(first);
+                m_count = std::move(count);
+                m_capacity = m_size;
+            }
+
+            size_t Size() const noexcept { return m_size; }
+            T Value(size_t const j) const noexcept { return m_value[j]; }
+            ULONG First(size_t const j) const noexcept { return m_first[j]; }
+            ULONGLONG Count(size_t const j) const noexcept { return m_count[j]; }
+        };
+
+        // Sorted input: the distinct values are the starts of runs of equal
+        // values. Return S_FALSE if x isn't sorted.
+        template <typename T>
+        HRESULT distinct_sorted(T const* const x, size_t const n, DistinctPositions& result) noexcept
+        {
+            std::atomic<bool> sorted{ true };
+            for_each_chunk(n, [x, &sorted](size_t, size_t const b, size_t const e) noexcept
+                {
+                    for (auto i = std::max<size_t>(b, 1); i < e && sorted.load(std::memory_order_relaxed); ++i)
+                    {
+                        if (value_less(x[i], x[i - 1])) sorted.store(false, std::memory_order_relaxed);
+                    }
+                });
+            if (!sorted.load()) return S_FALSE;
+
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<size_t[]> offsets(new (std::nothrow) size_t[chunks + 1]);
+            if (!offsets) return E_OUTOFMEMORY;
+            for_each_chunk(n, [x, &offsets](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    size_t m = 0;
+                    for (auto i = b; i < e; ++i) m += i == 0 || !value_equal(x[i], x[i - 1]);
+                    offsets[c] = m;
+                });
+            size_t d = 0;
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const m = offsets[c];
+                offsets[c] = d;
+                d += m;
+            }
+
+            std::unique_ptr<ULONG[]> first(new (std::nothrow) ULONG[d]);
+            std::unique_ptr<ULONGLONG[]> count(new (std::nothrow) ULONGLONG[d]);
+            if (!first || !count) return E_OUTOFMEMORY;
+            for_each_chunk(n, [x, &offsets, &first](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    auto j = offsets[c];
+                    for (auto i = b; i < e; ++i)
+                    {
+                        if (i == 0 || !value_equal(x[i], x[i - 1])) first[j++] = static_cast<ULONG>(i);
+                    }
+                });
+            for (size_t j = 0; j < d; ++j) count[j] = (j + 1 < d ? first[j + 1] : n) - first[j];
+            result.first = std::move(first);
+            result.count = std::move(count);
+            result.size = d;
+            return S_OK;
+        }
+
+        // An entry to be merged by distinct_merge: count occurrences of
+        // value, the first of which is at position first
+        template <typename T>
+        struct DistinctEntry {
+            T value;
+            ULONG first;
+            ULONGLONG count;
+        };
+
+        // Merge entries 0 to m - 1, given by entry(j) in increasing order of
+        // their first positions, of a vector of n elements. The entries are
+        // partitioned by the top bits of the hash of their values, and each
+        // partition is merged in parallel with a table that keeps only the
+        // positions and counts once it is done. A bitmap of the first
+        // positions then ranks the values in the order they first appear.
+        template <typename T, typename Entry>
+        HRESULT distinct_merge(size_t const n, size_t const m, Entry const& entry, DistinctPositions& d) noexcept
+        {
+            unsigned bits = 0;
+            while (bits < distinct_max_partition_bits && (m >> bits) > distinct_partition_entries) ++bits;
+            auto const parts = size_t{ 1 } << bits;
+            auto const partition = [bits](ULONGLONG const hash) noexcept
+                {
+                    return bits ? static_cast<size_t>(hash >> (64 - bits)) : 0;
+                };
+            std::unique_ptr<ULONG[]> entries;
+            std::unique_ptr<size_t[]> starts;
+            auto const hr = partition_positions(m, parts, [&entry, &partition](size_t const j) noexcept
+                {
+                    return partition(hash_value(entry(j).value));
+                }, entries, starts);
+            if (FAILED(hr)) return hr;
+
+            std::unique_ptr<DistinctTable<T>[]> merged(new (std::nothrow) DistinctTable<T>[parts]);
+            auto const words = (n + 63) / 64;
+            std::unique_ptr<std::atomic<ULONGLONG>[]> seen(new (std::nothrow) std::atomic<ULONGLONG>[words]());
+            std::unique_ptr<ULONG[]> ranks(new (std::nothrow) ULONG[words]);
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<size_t[]> offsets(new (std::nothrow) size_t[chunks + 1]);
+            if (!merged || !seen || !ranks || !offsets) return E_OUTOFMEMORY;
+            std::atomic<HRESULT> result{ S_OK };
+            parallel_for(0, parts, [&](size_t const pb, size_t const pe) noexcept
+                {
+                    for (auto p = pb; p < pe; ++p)
+                    {
+                        auto& t = merged[p];
+                        if (!t.Reserve(starts[p + 1] - starts[p]))
+                        {
+                            result.store(E_OUTOFMEMORY);
+                            return;
+                        }
+                        for (auto j = starts[p]; j < starts[p + 1]; ++j)
+                        {
+                            auto const e = entry(entries[j]);
+                            if (t.Add(e.value, hash_value(e.value), e.first, e.count)) continue;
+                            result.store(E_OUTOFMEMORY);
+                            return;
+                        }
+                        t.Trim();
+                        for (size_t j = 0; j < t.Size(); ++j)
+                        {
+                            auto const i = t.First(j);
+                            seen[i / 64].fetch_or(ULONGLONG{ 1 } << (i % 64), std::memory_order_relaxed);
+                        }
+                    }
+                }, 1);
+            if (FAILED(result.load())) return result.load();
+            entries.reset();
+            starts.reset();
+
+            // Rank the first marked position of each word of the bitmap,
+            // chunk by chunk (chunks are whole words)
+            auto const marks = [&seen](size_t const w) noexcept
+                {
+                    return std::bitset<64>(seen[w].load(std::memory_order_relaxed)).count();
+                };
+            for_each_chunk(n, [&marks, &offsets](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    size_t k = 0;
+                    for (auto w = b / 64; w < (e + 63) / 64; ++w) k += marks(w);
+                    offsets[c] = k;
+                });
+            size_t size = 0;
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const k = offsets[c];
+                offsets[c] = size;
+                size += k;
+            }
+            for_each_chunk(n, [&marks, &offsets, &ranks](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    auto k = offsets[c];
+                    for (auto w = b / 64; w < (e + 63) / 64; ++w)
+                    {
+                        ranks[w] = static_cast<ULONG>(k);
+                        k += marks(w);
+                    }
+                });
+
+            // Write each partition's values at their ranks
+            std::unique_ptr<ULONG[]> first(new (std::nothrow) ULONG[size]);
+            std::unique_ptr<ULONGLONG[]> count(new (std::nothrow) ULONGLONG[size]);
+            if (!first || !count) return E_OUTOFMEMORY;
+            parallel_for(0, parts, [&](size_t const pb, size_t const pe) noexcept
+                {
+                    for (auto p = pb; p < pe; ++p)
+                    {
+                        auto const& t = merged[p];
+                        for (size_t j = 0; j < t.Size(); ++j)
+                        {
+                            auto const i = t.First(j);
+                            auto const below = seen[i / 64].load(std::memory_order_relaxed) & ((ULONGLONG{ 1 } << (i % 64)) - 1);
+                            auto const r = ranks[i / 64] + std::bitset<64>(below).count();
+                            first[r] = i;
+                            count[r] = t.Count(j);
+                        }
+                    }
+                }, 1);
+            d.first = std::move(first);
+            d.count = std::move(count);
+            d.size = size;
+            return S_OK;
+        }
+
+        // Unsorted input. If the values of the first chunk repeat, count
+        // each chunk with its own table and merge the chunks' entries, so
+        // that a column with few values is counted in parallel in small
+        // tables; otherwise merge the rows directly.
+        template <typename T>
+        HRESULT distinct_hashed(T const* const x, size_t const n, DistinctPositions& d) noexcept
+        {
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<DistinctTable<T>[]> local(new (std::nothrow) DistinctTable<T>[chunks]);
+            if (!local) return E_OUTOFMEMORY;
+            std::atomic<HRESULT> result{ S_OK };
+            auto const count = [x, &local, &result](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    for (auto i = b; i < e; ++i)
+                    {
+                        if (local[c].Add(x[i], hash_value(x[i]), static_cast<ULONG>(i), 1)) continue;
+                        result.store(E_OUTOFMEMORY);
+                        return;
+                    }
+                };
+            auto const head = std::min(n, kernel_chunk);
+            count(0, 0, head);
+            if (FAILED(result.load())) return result.load();
+            if (local[0].Size() * distinct_repeats > head)
+            {
+                local.reset();
+                return distinct_merge<T>(n, n, [x](size_t const i) noexcept
+                    {
+                        return DistinctEntry<T>{ x[i], static_cast<ULONG>(i), 1 };
+                    }, d);
+            }
+
+            for_each_chunk(n, [&count](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    if (c) count(c, b, e);
+                });
+            if (FAILED(result.load())) return result.load();
+
+            // Gather the chunks' entries, in increasing order of position
+            std::unique_ptr<size_t[]> offsets(new (std::nothrow) size_t[chunks]);
+            if (!offsets) return E_OUTOFMEMORY;
+            size_t m = 0;
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                offsets[c] = m;
+                m += local[c].Size();
+            }
+            std::unique_ptr<DistinctEntry<T>[]> entries(new (std::nothrow) DistinctEntry<T>[m]);
+            if (!entries) return E_OUTOFMEMORY;
+            parallel_for(0, chunks, [&local, &offsets, &entries](size_t const cb, size_t const ce) noexcept
+                {
+                    for (auto c = cb; c < ce; ++c)
+                    {
+                        auto const& t = local[c];
+                        for (size_t j = 0; j < t.Size(); ++j) entries[offsets[c] + j] = { t.Value(j), t.First(j), t.Count(j) };
+                    }
+                }, 1);
+            local.reset();
+            return distinct_merge<T>(n, m, [&entries](size_t const j) noexcept { return entries[j]; }, d);
+        }
+
+        inline HRESULT distinct(
+            LPSAFEARRAY const src,
+            unique_safearray& values,
+            unique_safearray* const counts,
+            DistinctOrder const order) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+
+            return visit_value(vt, [=, &values](auto const tag) noexcept
+                {
+                    typedef std::remove_pointer_t<decltype(tag)> T;
+                    SafeArrayData<T> in(src);
+                    if (FAILED(in.Result())) return in.Result();
+                    auto const x = in.Data();
+
+                    DistinctPositions d;
+                    auto status = distinct_sorted(x, n, d);
+                    if (FAILED(status)) return status;
+                    auto const sorted = status == S_OK;
+                    if (!sorted)
+                    {
+                        status = distinct_hashed(x, n, d);
+                        if (FAILED(status)) return status;
+                    }
+
+                    // Sort the distinct values, and their counts with them
+                    std::unique_ptr<ULONG[]> rank(nullptr);
+                    if (order == DistinctOrder::Ascending && !sorted)
+                    {
+                        rank.reset(new (std::nothrow) ULONG[d.size]);
+                        if (!rank) return E_OUTOFMEMORY;
+                        for (size_t j = 0; j < d.size; ++j) rank[j] = static_cast<ULONG>(j);
+                        std::sort(rank.get(), rank.get() + d.size, [x, &d](ULONG const a, ULONG const b) noexcept
+                            {
+                                return value_less(x[d.first[a]], x[d.first[b]]);
+                            });
+                    }
+                    auto const entry = [&rank](size_t const j) noexcept { return rank ? rank[j] : j; };
+
+                    unique_safearray v;
+                    status = create_vector_like(src, vt, d.size, v);
+                    if (FAILED(status)) return status;
+                    unique_safearray c;
+                    if (counts)
+                    {
+                        status = create_vector_like(src, VT_I8, d.size, c);
+                        if (FAILED(status)) return status;
+                    }
+                    if (d.size)
+                    {
+                        SafeArrayData<T> out(v.get());
+                        if (FAILED(out.Result())) return out.Result();
+                        for (size_t j = 0; j < d.size; ++j)
+                        {
+                            if constexpr (std::is_same_v<T, BSTR>)
+                            {
+                                status = copy_bstr(x[d.first[entry(j)]], out[j]);
+                                if (FAILED(status)) return status;
+                            }
+                            else out[j] = x[d.first[entry(j)]];
+                        }
+                        if (counts)
+                        {
+                            SafeArrayData<LONGLONG> k(c.get());
+                            if (FAILED(k.Result())) return k.Result();
+                            for (size_t j = 0; j < d.size; ++j) k[j] = static_cast<LONGLONG>(d.count[entry(j)]);
+                        }
+                    }
+
+                    values = std::move(v);
+                    if (counts) *counts = std::move(c);
+                    return S_OK;
+                });
+        }
+    }
+
+    // Distinct values and value counts
+    // Return the distinct values of a VT_I4, VT_I8, VT_R4, VT_R8, or VT_BSTR
+    // vector as a new vector of the same type and, for value_counts, the
+    // number of times each appears as a VT_I8 vector. BSTRs are compared
+    // ordinally; -0.0 equals 0.0, and all NaNs are one value. If the input is
+    // already sorted (which is checked in parallel), the runs of equal values
+    // are counted directly; otherwise the values are hashed.
+    // Examples:
+    // unique_safearray names, counts;
+    // hr = value_counts(column.get(), names, counts, DistinctOrder::Ascending);
+    // hr = distinct(ids.get(), names);
+
+    inline HRESULT distinct(
+        LPSAFEARRAY const src,
+        unique_safearray& values,
+        DistinctOrder const order = DistinctOrder::FirstSeen) noexcept
+    {
+        return detail::distinct(src, values, nullptr, order);
+    }
+
+    inline HRESULT value_counts(
+        LPSAFEARRAY const src,
+        unique_safearray& values,
+        unique_safearray& counts,
+        DistinctOrder const order = DistinctOrder::FirstSeen) noexcept
+    {
+        return detail::distinct(src, values, &counts, order);
+    }
+}
+
+#endif  // COMMEM_DISTINCT_H
+
+///////////////////////////////////////////////////////////////////////////////
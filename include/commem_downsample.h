@@ -0,0 +1,325 @@
+// commem_downsample.h: Downsampling of VT_R8 series for charts ///////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_DOWNSAMPLE_H
+#define COMMEM_DOWNSAMPLE_H
+
+#include "commem_gather.h"
+#include <cmath>
+
+namespace commem {
+
+    // Method of downsample
+    // LTTB (largest triangle three buckets): the first and last points, and
+    // from each bucket in between, the point that makes the largest triangle
+    // with the point chosen before it and the average of the next bucket.
+    // MinMax: from each bucket, the points with the smallest and largest y,
+    // in x order.
+    enum class DownsampleMethod { LTTB, MinMax };
+
+    namespace detail {
+
+        // Row where bucket b of buckets equal buckets over rows rows from
+        // first begins
+        inline size_t bucket_start(size_t const first, size_t const rows, size_t const buckets, size_t const b) noexcept
+        {
+            return first + static_cast<size_t>(static_cast<ULONGLONG>(rows) * b / buckets);
+        }
+
+        // The rows chosen from one series, and the per-bucket values used to
+        // choose them
+        struct DownsampleSeries {
+            DOUBLE const* y = nullptr;
+            std::unique_ptr<ULONG[]> rows;
+            std::unique_ptr<DOUBLE[]> averages;
+            size_t count = 0;
+        };
+
+        inline constexpr ULONG downsample_none = ~ULONG{ 0 };
+
+        // LTTB, first pass: the average of the points of each bucket whose y
+        // is not NaN
+        inline void lttb_averages(
+            DOUBLE const* const x,
+            DownsampleSeries& s,
+            size_t const n,
+            size_t const buckets,
+            size_t const bb,
+            size_t const be) noexcept
+        {
+            for (auto b = bb; b < be; ++b)
+            {
+                auto const end = bucket_start(1, n - 2, buckets, b + 1);
+                auto sx = 0.0;
+                auto sy = 0.0;
+                size_t m = 0;
+                for (auto i = bucket_start(1, n - 2, buckets, b); i < end; ++i)
+                {
+                    auto const valid = !std::isnan(s.y[i]);
+                    sx += valid ? x[i] : 0.0;
+                    sy += valid ? s.y[i] : 0.0;
+                    m += valid;
+                }
+                auto const c = m ? static_cast<double>(m) : std::numeric_limits<double>::quiet_NaN();
+                s.averages[2 * b] = sx / c;
+                s.averages[2 * b + 1] = sy / c;
+            }
+        }
+
+        // LTTB, second pass: choose one point from each bucket in turn
+        inline void lttb_choose(DOUBLE const* const x, DownsampleSeries& s, size_t const n, size_t const buckets) noexcept
+        {
+            auto const y = s.y;
+            size_t a = 0;
+            size_t k = 0;
+            s.rows[k++] = 0;
+            for (size_t b = 0; b < buckets; ++b)
+            {
+                auto const next = b + 1 < buckets;
+                auto const cx = next ? s.averages[2 * b + 2] : x[n - 1];
+                auto const cy = next ? s.averages[2 * b + 3] : y[n - 1];
+                auto const ax = x[a];
+                auto const ay = y[a];
+                auto const begin = bucket_start(1, n - 2, buckets, b);
+                auto const end = bucket_start(1, n - 2, buckets, b + 1);
+                auto pick = begin;
+                auto best = -1.0;
+                for (auto i = begin; i < end; ++i)
+                {
+                    auto const area = std::fabs((ax - cx) * (y[i] - ay) - (ax - x[i]) * (cy - ay));
+                    if (area > best)
+                    {
+                        best = area;
+                        pick = i;
+                    }
+                }
+                s.rows[k++] = static_cast<ULONG>(pick);
+                a = pick;
+            }
+            s.rows[k++] = static_cast<ULONG>(n - 1);
+            s.count = k;
+        }
+
+        // MinMax, first pass: the rows of the smallest and largest y of each
+        // bucket, in row order. A bucket of NaNs gives its first row, so
+        // that the gap shows.
+        inline void minmax_rows(DownsampleSeries& s, size_t const n, size_t const buckets, size_t const bb, size_t const be) noexcept
+        {
+            auto const y = s.y;
+            for (auto b = bb; b < be; ++b)
+            {
+                auto const begin = bucket_start(0, n, buckets, b);
+                auto const end = bucket_start(0, n, buckets, b + 1);
+                auto lo = begin;
+                auto hi = begin;
+                for (auto i = begin; i < end; ++i)
+                {
+                    if (std::isnan(y[i])) continue;
+                    if (!(y[i] >= y[lo])) lo = i;
+                    if (!(y[i] <= y[hi])) hi = i;
+                }
+                s.rows[2 * b] = static_cast<ULONG>(std::min(lo, hi));
+                s.rows[2 * b + 1] = lo == hi ? downsample_none : static_cast<ULONG>(std::max(lo, hi));
+            }
+        }
+
+        inline void minmax_compact(DownsampleSeries& s, size_t const buckets) noexcept
+        {
+            size_t k = 0;
+            for (size_t j = 0; j < 2 * buckets; ++j)
+            {
+                if (s.rows[j] != downsample_none) s.rows[k++] = s.rows[j];
+            }
+            s.count = k;
+        }
+
+        // Check that x is a VT_R8 or VT_DATE vector and that each of ys is a
+        // VT_R8 vector with the same lower bound and length
+        inline HRESULT downsample_inputs(
+            LPSAFEARRAY const x,
+            LPSAFEARRAY const* const ys,
+            size_t const count,
+            VARTYPE& vt,
+            size_t& n) noexcept
+        {
+            auto hr = vector_info(x, vt, n);
+            if (FAILED(hr)) return hr;
+            if (vt != VT_R8 && vt != VT_DATE) return DISP_E_BADVARTYPE;
+            LONG lb = 0;
+            hr = SafeArrayGetLBound(x, 1, &lb);
+            if (FAILED(hr)) return hr;
+            for (size_t i = 0; i < count; ++i)
+            {
+                VARTYPE yvt = VT_EMPTY;
+                size_t m = 0;
+                hr = vector_info(ys[i], yvt, m);
+                if (FAILED(hr)) return hr;
+                if (yvt != VT_R8) return DISP_E_BADVARTYPE;
+                LONG bound = 0;
+                hr = SafeArrayGetLBound(ys[i], 1, &bound);
+                if (FAILED(hr)) return hr;
+                if (bound != lb || m != n) return E_INVALIDARG;
+            }
+            return S_OK;
+        }
+    }
+
+    // Downsampling of series for charts
+    // Reduce each of count VT_R8 series ys, which share the VT_R8 or VT_DATE
+    // x values x, to at most points points, returning the x and y values of
+    // the chosen points of series i in xs[i] and results[i] as vectors with
+    // a lower bound of zero. x should be in increasing order. LTTB returns
+    // exactly points points (at least 3) and keeps the shape of the series;
+    // MinMax returns up to points points (at least 2) and keeps every peak
+    // and trough. A series with no more than points points is returned
+    // whole. NaNs are chosen only from buckets with nothing else.
+    // The buckets of all series are summarized in parallel, and each series
+    // is then reduced on its own thread.
+    // Example:
+    // LPSAFEARRAY ys[] = { bid.get(), ask.get() };
+    // unique_safearray xs[2], results[2];
+    // hr = downsample(times.get(), ys, 2, 2000, DownsampleMethod::LTTB, xs, results);
+
+    inline HRESULT downsample(
+        LPSAFEARRAY const x,
+        LPSAFEARRAY const* const ys,
+        size_t const count,
+        size_t const points,
+        DownsampleMethod const method,
+        unique_safearray* const xs,
+        unique_safearray* const results) noexcept
+    {
+        if ((!ys || !xs || !results) && count) return E_POINTER;
+        auto const lttb = method == DownsampleMethod::LTTB;
+        if (points < (lttb ? 3u : 2u)) return E_INVALIDARG;
+        VARTYPE vt = VT_EMPTY;
+        size_t n = 0;
+        auto hr = detail::downsample_inputs(x, ys, count, vt, n);
+        if (FAILED(hr)) return hr;
+
+        SafeArrayData<DOUBLE> xd(x);
+        if (FAILED(xd.Result())) return xd.Result();
+        std::unique_ptr<detail::LockedColumn[]> locks(new (std::nothrow) detail::LockedColumn[count]);
+        std::unique_ptr<detail::DownsampleSeries[]> series(new (std::nothrow) detail::DownsampleSeries[count]);
+        if (!locks || !series) return E_OUTOFMEMORY;
+        auto const whole = n <= points;
+        auto const buckets = lttb ? points - 2 : points / 2;
+        for (size_t i = 0; i < count; ++i)
+        {
+            hr = locks[i].Lock(ys[i]);
+            if (FAILED(hr)) return hr;
+            auto& s = series[i];
+            s.y = static_cast<DOUBLE const*>(locks[i].Data());
+            s.rows.reset(new (std::nothrow) ULONG[whole ? n : 2 * buckets + 2]);
+            if (!s.rows) return E_OUTOFMEMORY;
+            if (!whole && lttb)
+            {
+                s.averages.reset(new (std::nothrow) DOUBLE[2 * buckets]);
+                if (!s.averages) return E_OUTOFMEMORY;
+            }
+        }
+
+        auto const px = xd.Data();
+        auto const s = series.get();
+        if (!whole)
+        {
+            // Summarize the buckets of all series in blocks of about one chunk
+            auto const step = std::max<size_t>(1, static_cast<size_t>(static_cast<ULONGLONG>(buckets) * detail::kernel_chunk / n));
+            auto const blocks = (buckets + step - 1) / step;
+            parallel_for(0, count * blocks, [=](size_t const tb, size_t const te) noexcept
+                {
+                    for (auto t = tb; t < te; ++t)
+                    {
+                        auto const bb = t % blocks * step;
+                        auto const be = std::min(buckets, bb + step);
+                        if (lttb) detail::lttb_averages(px, s[t / blocks], n, buckets, bb, be);
+                        else detail::minmax_rows(s[t / blocks], n, buckets, bb, be);
+                    }
+                }, 1);
+        }
+        parallel_for(0, count, [=](size_t const b, size_t const e) noexcept
+            {
+                for (auto i = b; i < e; ++i)
+                {
+                    if (whole)
+                    {
+                        for (size_t j = 0; j < n; ++j) s[i].rows[j] = static_cast<ULONG>(j);
+                        s[i].count = n;
+                    }
+                    else if (lttb) detail::lttb_choose(px, s[i], n, buckets);
+                    else detail::minmax_compact(s[i], buckets);
+                }
+            }, 1);
+
+        // Copy the chosen points into new vectors on the calling thread
+        std::unique_ptr<unique_safearray[]> ox(new (std::nothrow) unique_safearray[count]);
+        std::unique_ptr<unique_safearray[]> oy(new (std::nothrow) unique_safearray[count]);
+        if (!ox || !oy) return E_OUTOFMEMORY;
+        for (size_t i = 0; i < count; ++i)
+        {
+            hr = detail::create_vector_like(nullptr, vt, s[i].count, ox[i]);
+            if (FAILED(hr)) return hr;
+            hr = detail::create_vector_like(nullptr, VT_R8, s[i].count, oy[i]);
+            if (FAILED(hr)) return hr;
+            SafeArrayData<DOUBLE> a(ox[i].get());
+            if (FAILED(a.Result())) return a.Result();
+            SafeArrayData<DOUBLE> b(oy[i].get());
+            if (FAILED(b.Result())) return b.Result();
+            for (size_t j = 0; j < s[i].count; ++j)
+            {
+                a[j] = px[s[i].rows[j]];
+                b[j] = s[i].y[s[i].rows[j]];
+            }
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            xs[i] = std::move(ox[i]);
+            results[i] = std::move(oy[i]);
+        }
+        return S_OK;
+    }
+
+    // Downsampling of one series
+    // Example:
+    // hr = downsample(times.get(), prices.get(), 2000, DownsampleMethod::MinMax, xs, ys);
+
+    inline HRESULT downsample(
+        LPSAFEARRAY const x,
+        LPSAFEARRAY const y,
+        size_t const points,
+        DownsampleMethod const method,
+        unique_safearray& xs,
+        unique_safearray& result) noexcept
+    {
+        return downsample(x, &y, 1, points, method, &xs, &result);
+    }
+}
+
+#endif  // COMMEM_DOWNSAMPLE_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,667 @@
+// commem_executor.h: Work-stealing executor for parallel kernels /////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_EXECUTOR_H
+#define COMMEM_EXECUTOR_H
+
+#include "commem.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#endif
+
+namespace commem {
+
+    // Options for Executor::Start
+
+    struct ExecutorOptions {
+        size_t threads = 0;         // Worker threads (zero means one per processor)
+        size_t grain = 4096;        // Default number of elements below which a range is not split
+        bool pin = true;            // Pin each worker to one processor
+        bool numa = true;           // Group workers by NUMA node
+    };
+
+    // Interface to a scheduler owned by the host application
+    // When a host scheduler is set with set_host_scheduler, parallel_for
+    // submits its helpers to the host instead of using the shared Executor,
+    // so that the application's threads are not oversubscribed.
+
+    class HostScheduler {
+    public:
+        virtual ~HostScheduler() = default;
+
+        // Call run(context) once, on any thread, at any time. Must not throw.
+        virtual void Submit(void (*run)(void*) noexcept, void* context) noexcept = 0;
+
+        // Number of threads that can usefully run helpers at once
+        virtual size_t Concurrency() const noexcept = 0;
+    };
+
+    namespace detail {
+
+        // A logical processor: its processor group (Windows) and number
+        struct Processor {
+            WORD group;
+            DWORD number;
+        };
+
+        // A call to parallel_for. Lives on the caller's stack until every
+        // element has been processed.
+        struct ParallelJob {
+            void (*run)(void const* f, size_t begin, size_t end) noexcept;
+            void const* f;
+            size_t grain;
+            std::atomic<size_t> pending;    // Elements not yet processed
+        };
+
+        template <typename F>
+        void run_range(void const* const f, size_t const begin, size_t const end) noexcept
+        {
+            (*static_cast<F const*>(f))(begin, end);
+        }
+
+        // Logical processors available to this process, by NUMA node
+        // Throws std::bad_alloc if memory runs out.
+        inline std::vector<std::vector<Processor>> processor_topology(bool const numa)
+        {
+            std::vector<std::vector<Processor>> nodes;
+#if defined(__linux__)
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return nodes;
+
+            // Parse a sysfs list such as "0-3,8-11"
+            auto const read_list = [](std::string const& path)
+                {
+                    std::vector<DWORD> v;
+                    std::ifstream is(path);
+                    unsigned long first = 0;
+                    while (is >> first)
+                    {
+                        auto last = first;
+                        if (is.peek() == '-')
+                        {
+                            is.get();
+                            is >> last;
+                        }
+                        for (auto i = first; i <= last; ++i) v.push_back(static_cast<DWORD>(i));
+                        if (is.peek() == ',') is.get();
+                    }
+                    return v;
+                };
+
+            if (numa)
+            {
+                for (auto const n : read_list("/sys/devices/system/node/online"))
+                {
+                    std::vector<Processor> node;
+                    for (auto const cpu : read_list("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist"))
+                    {
+                        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) node.push_back({ 0, cpu });
+                    }
+                    if (!node.empty()) nodes.push_back(std::move(node));
+                }
+            }
+            if (nodes.empty())
+            {
+                std::vector<Processor> node;
+                for (DWORD cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                {
+                    if (CPU_ISSET(cpu, &allowed)) node.push_back({ 0, cpu });
+                }
+                if (!node.empty()) nodes.push_back(std::move(node));
+            }
+#else
+            ULONG highest = 0;
+            if (numa && GetNumaHighestNodeNumber(&highest))
+            {
+                for (ULONG n = 0; n <= highest; ++n)
+                {
+                    GROUP_AFFINITY ga = {};
+                    if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(n), &ga)) continue;
+                    std::vector<Processor> node;
+                    for (DWORD bit = 0; bit < sizeof(KAFFINITY) * 8; ++bit)
+                    {
+                        if (ga.Mask & (KAFFINITY{ 1 } << bit)) node.push_back({ ga.Group, bit });
+                    }
+                    if (!node.empty()) nodes.push_back(std::move(node));
+                }
+            }
+            if (nodes.empty())
+            {
+                std::vector<Processor> node;
+                auto const n = std::max(1u, std::thread::hardware_concurrency());
+                for (DWORD i = 0; i < n; ++i) node.push_back({ static_cast<WORD>(i / 64), i % 64 });
+                nodes.push_back(std::move(node));
+            }
+#endif
+            return nodes;
+        }
+
+        // Pin the calling thread to a processor
+        inline bool pin_thread(Processor const& p) noexcept
+        {
+#if defined(__linux__)
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(p.number, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+            GROUP_AFFINITY ga = {};
+            ga.Mask = KAFFINITY{ 1 } << p.number;
+            ga.Group = p.group;
+            return SetThreadGroupAffinity(GetCurrentThread(), &ga, nullptr) != FALSE;
+#endif
+        }
+    }
+
+    // Pool of worker threads for parallel kernels
+    // Each worker has a deque of ranges. A worker takes ranges from the back
+    // of its own deque, splitting each in half (pushing the upper half back)
+    // until it is no larger than the grain, and steals from the front of the
+    // deques of other workers when its own is empty, trying workers on its
+    // own NUMA node first. ParallelFor divides a range among the workers in
+    // order of node, so the same range is always processed on the same node:
+    // pages that a kernel first touches in a ParallelFor are local to the
+    // workers that later process them in another ParallelFor over the range.
+    // The calling thread helps until the range is done, so ParallelFor may
+    // be called from inside a range function. An executor that has not been
+    // started (or has no workers) runs ranges on the calling thread.
+    // Example:
+    // Executor ex;
+    // ex.Start(ExecutorOptions());
+    // ex.ParallelFor(0, n, [p](size_t b, size_t e) noexcept { std::fill(p + b, p + e, 0.0); });
+
+    class Executor {
+
+        struct Range {
+            detail::ParallelJob* job;
+            size_t begin;
+            size_t end;
+        };
+
+        struct alignas(64) Worker {
+            std::mutex lock;
+            std::deque<Range> ranges;
+            size_t node = 0;
+            detail::Processor processor = {};
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<Worker>> m_workers;
+        std::vector<size_t> m_nodeFirst;        // First worker of each node, plus the end
+        size_t m_grain = 4096;
+        bool m_pin = false;
+
+        std::mutex m_sleepLock;
+        std::condition_variable m_wake;
+        std::atomic<size_t> m_queued{ 0 };
+        std::atomic<size_t> m_sleeping{ 0 };
+        std::atomic<size_t> m_steals{ 0 };
+        bool m_stop = false;
+
+        static inline thread_local Executor* t_executor = nullptr;
+        static inline thread_local size_t t_worker = 0;
+
+        void Wake(bool const all) noexcept
+        {
+            if (m_sleeping.load() == 0) return;
+            {
+                std::lock_guard<std::mutex> lock(m_sleepLock);
+            }
+            if (all) m_wake.notify_all();
+            else m_wake.notify_one();
+        }
+
+        // Return false if memory for the deque runs out
+        bool Push(size_t const w, Range const& r) noexcept
+        {
+            try
+            {
+                std::lock_guard<std::mutex> lock(m_workers[w]->lock);
+                m_workers[w]->ranges.push_back(r);
+            }
+            catch (...)
+            {
+                return false;
+            }
+            m_queued.fetch_add(1);
+            return true;
+        }
+
+        bool PopBack(size_t const w, Range& r) noexcept
+        {
+            auto& worker = *m_workers[w];
+            std::lock_guard<std::mutex> lock(worker.lock);
+            if (worker.ranges.empty()) return false;
+            r = worker.ranges.back();
+            worker.ranges.pop_back();
+            m_queued.fetch_sub(1);
+            return true;
+        }
+
+        bool PopFront(size_t const w, Range& r) noexcept
+        {
+            auto& worker = *m_workers[w];
+            std::lock_guard<std::mutex> lock(worker.lock);
+            if (worker.ranges.empty()) return false;
+            r = worker.ranges.front();
+            worker.ranges.pop_front();
+            m_queued.fetch_sub(1);
+            return true;
+        }
+
+        // Take a range: from the back of home's deque if the caller is a
+        // worker, otherwise by stealing, nearest node first. Set home to the
+        // deque the range came from.
+        bool Take(size_t& home, bool const isWorker, Range& r) noexcept
+        {
+            if (isWorker && PopBack(home, r)) return true;
+
+            auto const n = m_workers.size();
+            auto const node = m_workers[home]->node;
+            auto const first = m_nodeFirst[node];
+            auto const count = m_nodeFirst[node + 1] - first;
+            for (size_t i = 1; i <= count; ++i)
+            {
+                auto const v = first + (home - first + i) % count;
+                if (PopFront(v, r))
+                {
+                    if (v != home) m_steals.fetch_add(1, std::memory_order_relaxed);
+                    home = isWorker ? home : v;
+                    return true;
+                }
+            }
+            for (size_t i = 1; i < n; ++i)
+            {
+                auto const v = (home + i) % n;
+                if (m_workers[v]->node == node) continue;
+                if (PopFront(v, r))
+                {
+                    m_steals.fetch_add(1, std::memory_order_relaxed);
+                    home = isWorker ? home : v;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Split a range down to the grain, pushing the upper halves onto
+        // home's deque, then run it
+        void Run(size_t const home, Range r) noexcept
+        {
+            auto const grain = r.job->grain;
+            while (r.end - r.begin > grain)
+            {
+                auto const mid = r.begin + (r.end - r.begin) / 2;
+                if (!Push(home, { r.job, mid, r.end })) break;
+                Wake(false);
+                r.end = mid;
+            }
+            r.job->run(r.job->f, r.begin, r.end);
+            r.job->pending.fetch_sub(r.end - r.begin, std::memory_order_release);
+        }
+
+        bool RunOne(size_t& home, bool const isWorker) noexcept
+        {
+            Range r = {};
+            if (!Take(home, isWorker, r)) return false;
+            Run(home, r);
+            return true;
+        }
+
+        void Work(size_t const w) noexcept
+        {
+            t_executor = this;
+            t_worker = w;
+            if (m_pin) (void)detail::pin_thread(m_workers[w]->processor);
+
+            for (;;)
+            {
+                auto home = w;
+                if (RunOne(home, true)) continue;
+
+                std::unique_lock<std::mutex> lock(m_sleepLock);
+                if (m_stop) return;
+                m_sleeping.fetch_add(1);
+                m_wake.wait(lock, [this]() { return m_stop || m_queued.load() != 0; });
+                m_sleeping.fetch_sub(1);
+                if (m_stop) return;
+            }
+        }
+
+        void RunJob(detail::ParallelJob& job, size_t const begin, size_t const end) noexcept
+        {
+            auto const n = end - begin;
+            job.pending.store(n, std::memory_order_relaxed);
+
+            // One range per worker, in order of node
+            auto const workers = m_workers.size();
+            auto const pieces = std::min(workers, (n + job.grain - 1) / job.grain);
+            size_t pushed = 0;
+            for (size_t i = 0; i < pieces; ++i)
+            {
+                auto const w = i * workers / pieces;
+                Range const r = { &job, begin + n * i / pieces, begin + n * (i + 1) / pieces };
+                if (!Push(w, r)) break;
+                ++pushed;
+            }
+            Wake(true);
+            if (pushed < pieces)
+            {
+                // Out of memory: run the rest here
+                auto const b = begin + n * pushed / pieces;
+                job.run(job.f, b, end);
+                job.pending.fetch_sub(end - b, std::memory_order_release);
+            }
+
+            // Help until every element has been processed
+            auto const isWorker = t_executor == this;
+            auto home = isWorker ? t_worker : 0;
+            while (job.pending.load(std::memory_order_acquire) != 0)
+            {
+                if (!isWorker) home = 0;
+                if (!RunOne(home, isWorker)) std::this_thread::yield();
+            }
+        }
+
+    public:
+        Executor() noexcept = default;
+        Executor(Executor const&) = delete;
+        Executor(Executor&&) = delete;
+        Executor& operator=(Executor const&) = delete;
+        Executor& operator=(Executor&&) = delete;
+
+        ~Executor() noexcept
+        {
+            Stop();
+        }
+
+        // Start the worker threads. Return E_UNEXPECTED if the executor is
+        // already running, or E_OUTOFMEMORY or E_FAIL if the workers can't
+        // be created (in which case none are left running).
+        HRESULT Start(ExecutorOptions const& options) noexcept
+        {
+            if (!m_workers.empty()) return E_UNEXPECTED;
+            m_grain = std::max<size_t>(1, options.grain);
+            m_pin = options.pin;
+            try
+            {
+                auto const nodes = detail::processor_topology(options.numa);
+                if (nodes.empty()) return E_FAIL;
+                size_t processors = 0;
+                for (auto const& node : nodes) processors += node.size();
+                auto const threads = options.threads ? options.threads : processors;
+
+                // Spread the workers across nodes, contiguous by node
+                auto const used = std::min(nodes.size(), threads);
+                for (size_t k = 0; k < used; ++k)
+                {
+                    m_nodeFirst.push_back(m_workers.size());
+                    auto const count = threads / used + (k < threads % used ? 1 : 0);
+                    for (size_t j = 0; j < count; ++j)
+                    {
+                        auto w = std::make_unique<Worker>();
+                        w->node = k;
+                        w->processor = nodes[k][j % nodes[k].size()];
+                        m_workers.push_back(std::move(w));
+                    }
+                }
+                m_nodeFirst.push_back(m_workers.size());
+
+                m_stop = false;
+                for (size_t w = 0; w < m_workers.size(); ++w)
+                    m_workers[w]->thread = std::thread([this, w]() { Work(w); });
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                Stop();
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                Stop();
+                return E_FAIL;
+            }
+        }
+
+        // Stop and join the worker threads. Must not be called while a
+        // ParallelFor is running.
+        void Stop() noexcept
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_sleepLock);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (auto& w : m_workers)
+            {
+                if (w->thread.joinable()) w->thread.join();
+            }
+            m_workers.clear();
+            m_nodeFirst.clear();
+        }
+
+        size_t Threads() const noexcept
+        {
+            return m_workers.size();
+        }
+
+        // Number of NUMA nodes with workers
+        size_t Nodes() const noexcept
+        {
+            return m_nodeFirst.empty() ? 0 : m_nodeFirst.size() - 1;
+        }
+
+        size_t Grain() const noexcept
+        {
+            return m_grain;
+        }
+
+        // Number of ranges taken from another worker's deque
+        size_t Steals() const noexcept
+        {
+            return m_steals.load(std::memory_order_relaxed);
+        }
+
+        // Node of the calling worker thread, or Nodes() if the caller is not
+        // one of this executor's workers
+        size_t CurrentNode() const noexcept
+        {
+            return t_executor == this ? m_workers[t_worker]->node : Nodes();
+        }
+
+        // Call f(b, e) on subranges [b, e) that together cover [begin, end)
+        // exactly once, and return when all calls have returned. Ranges of
+        // up to grain elements (zero means the default) are not split.
+        // f must not throw.
+        template <typename F>
+        void ParallelFor(size_t const begin, size_t const end, F const& f, size_t grain = 0) noexcept
+        {
+            if (end <= begin) return;
+            if (grain == 0) grain = m_grain;
+            if (m_workers.empty() || end - begin <= grain)
+            {
+                f(begin, end);
+                return;
+            }
+            detail::ParallelJob job = { &detail::run_range<F>, &f, grain, {} };
+            RunJob(job, begin, end);
+        }
+    };
+
+    namespace detail {
+
+        inline std::mutex executor_lock;
+        inline std::atomic<Executor*> shared_executor{ nullptr };
+        inline std::atomic<HostScheduler*> host_scheduler{ nullptr };
+
+        // State of a parallel_for run by a host scheduler. Helpers claim
+        // chunks with an atomic counter. The caller and each submitted
+        // helper hold a reference, and the last to let go frees the job, so
+        // the caller need only wait for the chunks in flight, not for helpers
+        // that the host has not started yet (a helper that starts after the
+        // range is used up just drops its reference).
+        struct HostJob {
+            void (*run)(void const* f, size_t begin, size_t end) noexcept;
+            void const* f;
+            size_t end;
+            size_t chunk;
+            std::atomic<size_t> next;
+            std::atomic<size_t> done{ 0 };
+            std::atomic<size_t> refs;
+
+            void Claim() noexcept
+            {
+                for (;;)
+                {
+                    auto const b = next.fetch_add(chunk, std::memory_order_relaxed);
+                    if (b >= end) return;
+                    auto const e = std::min(end, b + chunk);
+                    run(f, b, e);
+                    done.fetch_add(e - b, std::memory_order_release);
+                }
+            }
+
+            void Unref() noexcept
+            {
+                if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+            }
+
+            static void Help(void* const context) noexcept
+            {
+                auto const job = static_cast<HostJob*>(context);
+                job->Claim();
+                job->Unref();
+            }
+        };
+    }
+
+    // Create and start the shared executor used by parallel_for, if it does
+    // not exist yet. Return S_FALSE if it already exists (the options are
+    // ignored), or the error from Executor::Start (the shared executor then
+    // runs ranges on the calling thread).
+
+    inline HRESULT start_shared_executor(ExecutorOptions const& options) noexcept
+    {
+        std::lock_guard<std::mutex> lock(detail::executor_lock);
+        if (detail::shared_executor.load(std::memory_order_relaxed)) return S_FALSE;
+        auto const ex = new (std::nothrow) Executor();     // Never freed; kernels may run at exit
+        if (!ex) return E_OUTOFMEMORY;
+        auto const hr = ex->Start(options);
+        detail::shared_executor.store(ex, std::memory_order_release);
+        return hr;
+    }
+
+    // Return the shared executor, starting it with default options the first
+    // time, or nullptr if memory for it runs out
+
+    inline Executor* shared_executor() noexcept
+    {
+        auto ex = detail::shared_executor.load(std::memory_order_acquire);
+        if (ex) return ex;
+        (void)start_shared_executor(ExecutorOptions());
+        return detail::shared_executor.load(std::memory_order_acquire);
+    }
+
+    // Set the host scheduler used by parallel_for (nullptr to use the shared
+    // executor again). The scheduler must outlive all calls to parallel_for
+    // that use it.
+
+    inline void set_host_scheduler(HostScheduler* const scheduler) noexcept
+    {
+        detail::host_scheduler.store(scheduler, std::memory_order_release);
+    }
+
+    // Number of threads parallel_for runs ranges on: the host scheduler's
+    // concurrency, if one is set, or the shared executor's workers and the
+    // calling thread. Kernels that keep per-thread state use this to bound
+    // how many copies of it they make.
+
+    inline size_t parallel_concurrency() noexcept
+    {
+        auto const host = detail::host_scheduler.load(std::memory_order_acquire);
+        if (host) return std::max<size_t>(1, host->Concurrency());
+        auto const ex = shared_executor();
+        return ex ? ex->Threads() + 1 : 1;
+    }
+
+    // Run f over [begin, end) on the host scheduler, if one is set, or on
+    // the shared executor. This is the entry point for commem's parallel
+    // SAFEARRAY kernels. See Executor::ParallelFor.
+
+    template <typename F>
+    void parallel_for(size_t const begin, size_t const end, F const& f, size_t const grain = 0) noexcept
+    {
+        if (end <= begin) return;
+        auto const host = detail::host_scheduler.load(std::memory_order_acquire);
+        if (!host)
+        {
+            auto const ex = shared_executor();
+            if (ex) ex->ParallelFor(begin, end, f, grain);
+            else f(begin, end);
+            return;
+        }
+
+        // Use about four chunks per helper, but no fewer than grain elements
+        auto const n = end - begin;
+        auto const helpers = std::max<size_t>(1, host->Concurrency());
+        auto const chunk = std::max(grain ? grain : ExecutorOptions().grain, (n + 4 * helpers - 1) / (4 * helpers));
+        if (helpers == 1 || n <= chunk)
+        {
+            f(begin, end);
+            return;
+        }
+
+        auto const job = new (std::nothrow) detail::HostJob{ &detail::run_range<F>, &f, end, chunk, { begin }, { 0 }, { helpers } };
+        if (!job)
+        {
+            f(begin, end);
+            return;
+        }
+        for (size_t i = 1; i < helpers; ++i) host->Submit(&detail::HostJob::Help, job);
+        job->Claim();
+        while (job->done.load(std::memory_order_acquire) != n) std::this_thread::yield();
+        job->Unref();
+    }
+}
+
+#endif  // COMMEM_EXECUTOR_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,477 @@
+// commem_gather.h: Gather, scatter, and permute sibling SAFEARRAYs ///////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_GATHER_H
+#define COMMEM_GATHER_H
+
+#include "commem_array.h"
+#include <atomic>
+#include <type_traits>
+
+namespace commem {
+
+    namespace detail {
+
+        // Convert a VT_I4 or VT_I8 vector of subscripts of a vector with
+        // lower bound lb and n elements into positions. Return
+        // DISP_E_BADINDEX if a subscript is out of range.
+        inline HRESULT index_positions(
+            LPSAFEARRAY const indices,
+            LONG const lb,
+            size_t const n,
+            std::unique_ptr<ULONG[]>& positions,
+            size_t& m) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            auto hr = vector_info(indices, vt, m);
+            if (FAILED(hr)) return hr;
+            if (vt != VT_I4 && vt != VT_I8) return DISP_E_BADVARTYPE;
+
+            return visit_key(vt, [=, &positions](auto const tag) noexcept
+                {
+                    typedef std::remove_pointer_t<decltype(tag)> T;
+                    if constexpr (std::is_same_v<T, BSTR>) return DISP_E_BADVARTYPE;
+                    else
+                    {
+                        SafeArrayData<T> in(indices);
+                        if (FAILED(in.Result())) return in.Result();
+                        std::unique_ptr<ULONG[]> p(new (std::nothrow) ULONG[m]);
+                        if (!p) return E_OUTOFMEMORY;
+
+                        std::atomic<bool> bad{ false };
+                        auto const x = in.Data();
+                        auto const out = p.get();
+                        for_each_chunk(m, [x, out, lb, n, &bad](size_t, size_t const b, size_t const e) noexcept
+                            {
+                                for (auto i = b; i < e; ++i)
+                                {
+                                    auto const offset = static_cast<LONGLONG>(x[i]) - lb;
+                                    if (offset < 0 || static_cast<ULONGLONG>(offset) >= n)
+                                    {
+                                        bad.store(true, std::memory_order_relaxed);
+                                        return;
+                                    }
+                                    out[i] = static_cast<ULONG>(offset);
+                                }
+                            });
+                        if (bad.load()) return DISP_E_BADINDEX;
+                        positions = std::move(p);
+                        return S_OK;
+                    }
+                });
+        }
+
+        // Return E_INVALIDARG if any of m positions below n appears more
+        // than once
+        inline HRESULT check_unique_positions(ULONG const* const positions, size_t const m, size_t const n) noexcept
+        {
+            std::unique_ptr<unsigned char[]> seen(new (std::nothrow) unsigned char[n]());
+            if (!seen) return E_OUTOFMEMORY;
+            for (size_t i = 0; i < m; ++i)
+            {
+                if (seen[positions[i]]++) return E_INVALIDARG;
+            }
+            return S_OK;
+        }
+
+        // Check that columns are vectors with the same lower bound and
+        // length and an element type that visit_element supports
+        inline HRESULT sibling_columns(
+            LPSAFEARRAY const* const columns,
+            size_t const count,
+            LONG& lb,
+            size_t& n) noexcept
+        {
+            if (!columns && count) return E_POINTER;
+            for (size_t i = 0; i < count; ++i)
+            {
+                VARTYPE vt = VT_EMPTY;
+                size_t size = 0;
+                auto hr = vector_info(columns[i], vt, size);
+                if (FAILED(hr)) return hr;
+                hr = visit_element(vt, [](auto) noexcept { return S_OK; });
+                if (FAILED(hr)) return hr;
+                LONG bound = 0;
+                hr = SafeArrayGetLBound(columns[i], 1, &bound);
+                if (FAILED(hr)) return hr;
+                if (i == 0)
+                {
+                    lb = bound;
+                    n = size;
+                }
+                else if (bound != lb || size != n) return E_INVALIDARG;
+            }
+            return S_OK;
+        }
+
+        // The data of a column, locked with SafeArrayData of the element
+        // type chosen by visit_element
+        class LockedColumn {
+            void* m_lock = nullptr;
+            void (*m_unlock)(void*) noexcept = nullptr;
+            void* m_data = nullptr;
+            size_t m_size = 0;
+            bool m_bstr = false;
+
+        public:
+            LockedColumn() noexcept = default;
+            LockedColumn(LockedColumn const&) = delete;
+            LockedColumn(LockedColumn&&) = delete;
+            LockedColumn& operator=(LockedColumn const&) = delete;
+            LockedColumn& operator=(LockedColumn&&) = delete;
+
+            ~LockedColumn() noexcept
+            {
+                if (m_unlock) m_unlock(m_lock);
+            }
+
+            HRESULT Lock(LPSAFEARRAY const psa) noexcept
+            {
+                VARTYPE vt = VT_EMPTY;
+                auto const hr = SafeArrayGetVartype(psa, &vt);
+                if (FAILED(hr)) return hr;
+                return visit_element(vt, [this, psa](auto const tag) noexcept
+                    {
+                        typedef std::remove_pointer_t<decltype(tag)> T;
+                        auto const data = new (std::nothrow) SafeArrayData<T>(psa);
+                        if (!data) return E_OUTOFMEMORY;
+                        m_lock = data;
+                        m_unlock = [](void* const p) noexcept { delete static_cast<SafeArrayData<T>*>(p); };
+                        if (FAILED(data->Result())) return data->Result();
+                        m_data = data->Data();
+                        m_size = sizeof(T);
+                        m_bstr = std::is_same_v<T, BSTR>;
+                        return S_OK;
+                    });
+            }
+
+            void* Data() const noexcept { return m_data; }
+            size_t ElementSize() const noexcept { return m_size; }
+            bool IsBString() const noexcept { return m_bstr; }
+        };
+
+        // Copy elements: out[i] = in[positions[i]] to gather, or
+        // out[positions[i]] = in[i] to scatter
+        template <bool Scatter, typename T>
+        void move_span(
+            void const* const src,
+            void* const dst,
+            ULONG const* const positions,
+            size_t const b,
+            size_t const e) noexcept
+        {
+            auto const in = static_cast<T const*>(src);
+            auto const out = static_cast<T*>(dst);
+            for (auto i = b; i < e; ++i)
+            {
+                if constexpr (Scatter) out[positions[i]] = in[i];
+                else out[i] = in[positions[i]];
+            }
+        }
+
+        template <bool Scatter>
+        void move_span(
+            LockedColumn const& src,
+            LockedColumn const& dst,
+            ULONG const* const positions,
+            size_t const b,
+            size_t const e) noexcept
+        {
+            switch (src.ElementSize())
+            {
+            case 1: return move_span<Scatter, unsigned char>(src.Data(), dst.Data(), positions, b, e);
+            case 2: return move_span<Scatter, USHORT>(src.Data(), dst.Data(), positions, b, e);
+            case 4: return move_span<Scatter, ULONG>(src.Data(), dst.Data(), positions, b, e);
+            default: return move_span<Scatter, ULONGLONG>(src.Data(), dst.Data(), positions, b, e);
+            }
+        }
+
+        // Lock pairs of columns, and then, for each chunk of positions, copy
+        // the elements of every column that holds no BSTRs (so that the chunk
+        // of positions is read from cache for all but the first column)
+        template <bool Scatter>
+        HRESULT move_columns(
+            LPSAFEARRAY const* const src,
+            LPSAFEARRAY const* const dst,
+            size_t const count,
+            ULONG const* const positions,
+            size_t const m) noexcept
+        {
+            std::unique_ptr<LockedColumn[]> in(new (std::nothrow) LockedColumn[count]);
+            std::unique_ptr<LockedColumn[]> out(new (std::nothrow) LockedColumn[count]);
+            if (!in || !out) return E_OUTOFMEMORY;
+            for (size_t i = 0; i < count; ++i)
+            {
+                auto hr = in[i].Lock(src[i]);
+                if (FAILED(hr)) return hr;
+                hr = out[i].Lock(dst[i]);
+                if (FAILED(hr)) return hr;
+            }
+            for_each_chunk(m, [count, positions, &in, &out](size_t, size_t const b, size_t const e) noexcept
+                {
+                    for (size_t i = 0; i < count; ++i)
+                    {
+                        if (!in[i].IsBString()) move_span<Scatter>(in[i], out[i], positions, b, e);
+                    }
+                });
+            return S_OK;
+        }
+
+        // Copy the BSTRs of src at positions into dst
+        inline HRESULT gather_bstrs(
+            LPSAFEARRAY const src,
+            LPSAFEARRAY const dst,
+            ULONG const* const positions,
+            size_t const m) noexcept
+        {
+            SafeArrayData<BSTR> in(src);
+            if (FAILED(in.Result())) return in.Result();
+            SafeArrayData<BSTR> out(dst);
+            if (FAILED(out.Result())) return out.Result();
+            for (size_t i = 0; i < m; ++i)
+            {
+                auto const hr = copy_bstr(in[positions[i]], out[i]);
+                if (FAILED(hr)) return hr;
+            }
+            return S_OK;
+        }
+
+        inline bool is_bstr(LPSAFEARRAY const psa) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            return SUCCEEDED(SafeArrayGetVartype(psa, &vt)) && vt == VT_BSTR;
+        }
+
+        // Create a vector for each column, of the same type and lower bound
+        inline HRESULT create_columns_like(
+            LPSAFEARRAY const* const columns,
+            size_t const count,
+            size_t const m,
+            std::unique_ptr<unique_safearray[]>& result) noexcept
+        {
+            std::unique_ptr<unique_safearray[]> a(new (std::nothrow) unique_safearray[count]);
+            if (!a) return E_OUTOFMEMORY;
+            for (size_t i = 0; i < count; ++i)
+            {
+                VARTYPE vt = VT_EMPTY;
+                auto hr = SafeArrayGetVartype(columns[i], &vt);
+                if (FAILED(hr)) return hr;
+                hr = create_vector_like(columns[i], vt, m, a[i]);
+                if (FAILED(hr)) return hr;
+            }
+            result = std::move(a);
+            return S_OK;
+        }
+    }
+
+    // Gather
+    // Set element j of results[i] to the element of columns[i] whose
+    // subscript is element j of indices, a VT_I4 or VT_I8 vector. The
+    // columns must be vectors with the same lower bound and length; results
+    // have their lower bound and the length of indices. Columns may hold
+    // BSTRs (which are copied) or any type whose elements own nothing, such
+    // as numbers, dates, and VT_BOOL. For each chunk of indices, every
+    // column is gathered in turn, in parallel across chunks. Return
+    // DISP_E_BADINDEX if an index is out of range.
+    // Example (reorder the columns of a table by the result of top_k):
+    // LPSAFEARRAY columns[] = { names.get(), prices.get(), dates.get() };
+    // unique_safearray sorted[3];
+    // hr = gather(where.get(), columns, 3, sorted);
+
+    inline HRESULT gather(
+        LPSAFEARRAY const indices,
+        LPSAFEARRAY const* const columns,
+        size_t const count,
+        unique_safearray* const results) noexcept
+    {
+        if (count && !results) return E_POINTER;
+        LONG lb = 0;
+        size_t n = 0;
+        auto hr = detail::sibling_columns(columns, count, lb, n);
+        if (FAILED(hr)) return hr;
+        std::unique_ptr<ULONG[]> positions;
+        size_t m = 0;
+        hr = detail::index_positions(indices, lb, n, positions, m);
+        if (FAILED(hr)) return hr;
+
+        std::unique_ptr<unique_safearray[]> out;
+        hr = detail::create_columns_like(columns, count, m, out);
+        if (FAILED(hr)) return hr;
+        std::unique_ptr<LPSAFEARRAY[]> dst(new (std::nothrow) LPSAFEARRAY[count]);
+        if (!dst) return E_OUTOFMEMORY;
+        for (size_t i = 0; i < count; ++i) dst[i] = out[i].get();
+
+        hr = detail::move_columns<false>(columns, dst.get(), count, positions.get(), m);
+        if (FAILED(hr)) return hr;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!detail::is_bstr(columns[i])) continue;
+            hr = detail::gather_bstrs(columns[i], dst[i], positions.get(), m);
+            if (FAILED(hr)) return hr;
+        }
+
+        for (size_t i = 0; i < count; ++i) results[i] = std::move(out[i]);
+        return S_OK;
+    }
+
+    inline HRESULT gather(
+        LPSAFEARRAY const indices,
+        LPSAFEARRAY const column,
+        unique_safearray& result) noexcept
+    {
+        return gather(indices, &column, 1, &result);
+    }
+
+    // Scatter
+    // Set the element of targets[i] whose subscript is element j of indices
+    // to element j of columns[i]: the inverse of gather. The columns must be
+    // vectors with the length of indices, and the targets vectors of the
+    // same types with a common lower bound and length. No index may appear
+    // twice (E_INVALIDARG). BSTRs are copied, and the strings they replace
+    // are freed. The targets are not changed unless the function succeeds.
+
+    inline HRESULT scatter(
+        LPSAFEARRAY const indices,
+        LPSAFEARRAY const* const columns,
+        size_t const count,
+        LPSAFEARRAY const* const targets) noexcept
+    {
+        if (count && !targets) return E_POINTER;
+        LONG lb = 0;
+        size_t n = 0;
+        auto hr = detail::sibling_columns(targets, count, lb, n);
+        if (FAILED(hr)) return hr;
+        LONG clb = 0;
+        size_t cn = 0;
+        hr = detail::sibling_columns(columns, count, clb, cn);
+        if (FAILED(hr)) return hr;
+        for (size_t i = 0; i < count; ++i)
+        {
+            VARTYPE a = VT_EMPTY;
+            VARTYPE b = VT_EMPTY;
+            if (FAILED(SafeArrayGetVartype(columns[i], &a)) || FAILED(SafeArrayGetVartype(targets[i], &b)) || a != b) return E_INVALIDARG;
+        }
+        std::unique_ptr<ULONG[]> positions;
+        size_t m = 0;
+        hr = detail::index_positions(indices, lb, n, positions, m);
+        if (FAILED(hr)) return hr;
+        if (count && m != cn) return E_INVALIDARG;
+        hr = detail::check_unique_positions(positions.get(), m, n);
+        if (FAILED(hr)) return hr;
+
+        // Copy the BSTR columns first, so that nothing can fail once the
+        // targets are being changed
+        std::unique_ptr<unique_safearray[]> copies(new (std::nothrow) unique_safearray[count]);
+        std::unique_ptr<ULONG[]> identity(new (std::nothrow) ULONG[m]);
+        if (!copies || !identity) return E_OUTOFMEMORY;
+        for (size_t j = 0; j < m; ++j) identity[j] = static_cast<ULONG>(j);
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!detail::is_bstr(columns[i])) continue;
+            hr = detail::create_vector_like(columns[i], VT_BSTR, m, copies[i]);
+            if (FAILED(hr)) return hr;
+            hr = detail::gather_bstrs(columns[i], copies[i].get(), identity.get(), m);
+            if (FAILED(hr)) return hr;
+        }
+
+        hr = detail::move_columns<true>(columns, targets, count, positions.get(), m);
+        if (FAILED(hr)) return hr;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!copies[i]) continue;
+            SafeArrayData<BSTR> in(copies[i].get());
+            if (FAILED(in.Result())) return in.Result();
+            SafeArrayData<BSTR> out(targets[i]);
+            if (FAILED(out.Result())) return out.Result();
+            // The replaced strings are freed with the copies
+            for (size_t j = 0; j < m; ++j) std::swap(in[j], out[positions[j]]);
+        }
+        return S_OK;
+    }
+
+    // Permute
+    // Reorder columns in place so that element j of each is the element
+    // whose subscript was element j of indices, which must hold every
+    // subscript of the columns exactly once (E_INVALIDARG otherwise). Because
+    // the caller owns the columns, BSTRs are moved rather than copied.
+    // Example:
+    // unique_safearray table[] = { std::move(names), std::move(prices) };
+    // hr = permute(order.get(), table, 2);
+
+    inline HRESULT permute(
+        LPSAFEARRAY const indices,
+        unique_safearray* const columns,
+        size_t const count) noexcept
+    {
+        if (count && !columns) return E_POINTER;
+        std::unique_ptr<LPSAFEARRAY[]> src(new (std::nothrow) LPSAFEARRAY[count]);
+        if (!src) return E_OUTOFMEMORY;
+        for (size_t i = 0; i < count; ++i) src[i] = columns[i].get();
+        LONG lb = 0;
+        size_t n = 0;
+        auto hr = detail::sibling_columns(src.get(), count, lb, n);
+        if (FAILED(hr)) return hr;
+        std::unique_ptr<ULONG[]> positions;
+        size_t m = 0;
+        hr = detail::index_positions(indices, lb, n, positions, m);
+        if (FAILED(hr)) return hr;
+        if (count && m != n) return E_INVALIDARG;
+        hr = detail::check_unique_positions(positions.get(), m, n);
+        if (FAILED(hr)) return hr;
+
+        std::unique_ptr<unique_safearray[]> out;
+        hr = detail::create_columns_like(src.get(), count, m, out);
+        if (FAILED(hr)) return hr;
+        std::unique_ptr<LPSAFEARRAY[]> dst(new (std::nothrow) LPSAFEARRAY[count]);
+        if (!dst) return E_OUTOFMEMORY;
+        for (size_t i = 0; i < count; ++i) dst[i] = out[i].get();
+
+        hr = detail::move_columns<false>(src.get(), dst.get(), count, positions.get(), m);
+        if (FAILED(hr)) return hr;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!detail::is_bstr(src[i])) continue;
+            SafeArrayData<BSTR> in(src[i]);
+            if (FAILED(in.Result())) return in.Result();
+            SafeArrayData<BSTR> to(dst[i]);
+            if (FAILED(to.Result())) return to.Result();
+            auto const p = positions.get();
+            detail::for_each_chunk(m, [&in, &to, p](size_t, size_t const b, size_t const e) noexcept
+                {
+                    for (auto j = b; j < e; ++j) std::swap(to[j], in[p[j]]);
+                });
+        }
+
+        for (size_t i = 0; i < count; ++i) columns[i] = std::move(out[i]);
+        return S_OK;
+    }
+}
+
+#endif  // COMMEM_GATHER_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,241 @@
+// commem_histogram.h: Histograms of numeric SAFEARRAYs ///////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_HISTOGRAM_H
+#define COMMEM_HISTOGRAM_H
+
+#include "commem_array.h"
+#include <limits>
+#include <type_traits>
+
+namespace commem {
+
+    // Spacing of the bins of histogram: equal widths from lo to hi, or equal
+    // ratios (equal widths of log(x))
+    enum class BinScale { Uniform, Log };
+
+    // Values that fall in no bin: below the first edge, above the last edge,
+    // or NaN
+    struct HistogramOutliers {
+        ULONGLONG below = 0;
+        ULONGLONG above = 0;
+        ULONGLONG nan = 0;
+    };
+
+    namespace detail {
+
+        // Most counters held by the private histograms of one call
+        inline constexpr size_t histogram_counters = size_t{ 1 } << 22;
+
+        // Counters after the bins of each private histogram
+        enum HistogramExtra : size_t { HistogramBelow, HistogramAbove, HistogramNaN, HistogramExtras };
+
+        // Count the values of x in bins chosen by bin(v), which returns the
+        // bin of v, or bins + HistogramBelow and so on. The input is split into
+        // a few large ranges, each counted into a private histogram, and the
+        // private histograms are added up bin by bin.
+        template <typename T, typename Bin>
+        HRESULT histogram_counts(
+            T const* const x,
+            size_t const n,
+            size_t const bins,
+            Bin const& bin,
+            ULONGLONG* const counts,
+            HistogramOutliers* const outliers) noexcept
+        {
+            auto const width = bins + HistogramExtras;
+            auto groups = std::max<size_t>(1, std::min(chunk_count(n), histogram_counters / width));
+            groups = std::min<size_t>(groups, 64);
+            std::unique_ptr<ULONGLONG[]> local(new (std::nothrow) ULONGLONG[groups * width]());
+            if (!local) return E_OUTOFMEMORY;
+
+            parallel_for(0, groups, [x, n, groups, width, &bin, &local](size_t const gb, size_t const ge) noexcept
+                {
+                    for (auto g = gb; g < ge; ++g)
+                    {
+                        auto const h = local.get() + g * width;
+                        auto const end = n * (g + 1) / groups;
+                        for (auto i = n * g / groups; i < end; ++i) ++h[bin(static_cast<double>(x[i]))];
+                    }
+                }, 1);
+
+            auto const l = local.get();
+            parallel_for(0, width, [groups, width, l, counts](size_t const b, size_t const e) noexcept
+                {
+                    for (auto j = b; j < e; ++j)
+                    {
+                        ULONGLONG sum = 0;
+                        for (size_t g = 0; g < groups; ++g) sum += l[g * width + j];
+                        counts[j] = sum;
+                    }
+                });
+            if (outliers)
+            {
+                outliers->below = counts[bins + HistogramBelow];
+                outliers->above = counts[bins + HistogramAbove];
+                outliers->nan = counts[bins + HistogramNaN];
+            }
+            return S_OK;
+        }
+
+        template <typename Bin>
+        HRESULT histogram(
+            LPSAFEARRAY const src,
+            size_t const bins,
+            Bin const& bin,
+            unique_safearray& counts,
+            HistogramOutliers* const outliers) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+            hr = visit_numeric(vt, [](auto) noexcept { return S_OK; });
+            if (FAILED(hr)) return hr;
+
+            std::unique_ptr<ULONGLONG[]> totals(new (std::nothrow) ULONGLONG[bins + HistogramExtras]);
+            if (!totals) return E_OUTOFMEMORY;
+            HistogramOutliers o;
+            hr = visit_numeric(vt, [=, &bin, &totals, &o](auto const tag) noexcept
+                {
+                    typedef std::remove_pointer_t<decltype(tag)> T;
+                    SafeArrayData<T> in(src);
+                    if (FAILED(in.Result())) return in.Result();
+                    return histogram_counts(in.Data(), n, bins, bin, totals.get(), &o);
+                });
+            if (FAILED(hr)) return hr;
+
+            unique_safearray a;
+            hr = create_vector_like(nullptr, VT_I8, bins, a);
+            if (FAILED(hr)) return hr;
+            {
+                SafeArrayData<LONGLONG> out(a.get());
+                if (FAILED(out.Result())) return out.Result();
+                for (size_t j = 0; j < bins; ++j) out[j] = static_cast<LONGLONG>(totals[j]);
+            }
+            counts = std::move(a);
+            if (outliers) *outliers = o;
+            return S_OK;
+        }
+    }
+
+    // Histograms of VT_I4, VT_I8, VT_R4, and VT_R8 vectors
+    // Count the elements in each of bins bins from lo to hi, returning the
+    // counts as a VT_I8 vector with a lower bound of zero. Each bin includes
+    // its lower edge; the last bin also includes hi. With BinScale::Log, lo
+    // must be positive and the bins have equal ratios, for example decades
+    // from 1 to 1e6 with 6 bins. Elements outside the range, and NaNs, are
+    // counted in outliers if it is given. The bin of each element is found
+    // by one multiplication (uniform bins) or one logarithm (log bins).
+    // Example:
+    // unique_safearray counts;
+    // HistogramOutliers outliers;
+    // hr = histogram(latency.get(), 0.0, 500.0, 50, counts, BinScale::Uniform, &outliers);
+
+    inline HRESULT histogram(
+        LPSAFEARRAY const src,
+        double const lo,
+        double const hi,
+        size_t const bins,
+        unique_safearray& counts,
+        BinScale const scale = BinScale::Uniform,
+        HistogramOutliers* const outliers = nullptr) noexcept
+    {
+        if (!bins || !(lo < hi) || !std::isfinite(lo) || !std::isfinite(hi)) return E_INVALIDARG;
+        if (bins > (std::numeric_limits<ULONG>::max)()) return E_INVALIDARG;     // Must fit the result
+        if (scale == BinScale::Log && !(lo > 0.0)) return E_INVALIDARG;
+
+        auto const nb = static_cast<double>(bins);
+        auto const last = bins - 1;
+        if (scale == BinScale::Uniform)
+        {
+            auto const k = nb / (hi - lo);
+            return detail::histogram(src, bins, [lo, hi, k, bins, last](double const v) noexcept
+                {
+                    if (v >= lo && v <= hi) return std::min(static_cast<size_t>((v - lo) * k), last);
+                    if (v < lo) return bins + detail::HistogramBelow;
+                    if (v > hi) return bins + detail::HistogramAbove;
+                    return bins + detail::HistogramNaN;
+                }, counts, outliers);
+        }
+
+        auto const base = std::log(lo);
+        auto const k = nb / (std::log(hi) - base);
+        return detail::histogram(src, bins, [lo, hi, base, k, bins, last](double const v) noexcept
+            {
+                if (v >= lo && v <= hi) return std::min(static_cast<size_t>((std::log(v) - base) * k), last);
+                if (v < lo) return bins + detail::HistogramBelow;
+                if (v > hi) return bins + detail::HistogramAbove;
+                return bins + detail::HistogramNaN;
+            }, counts, outliers);
+    }
+
+    // Histogram with explicit bin edges
+    // edges is a VT_R8 vector of at least two increasing values; bin i runs
+    // from edges[i] up to edges[i + 1] (and includes the last edge). The bin
+    // of each element is found by binary search.
+    // Example:
+    // hr = histogram(sizes.get(), edges.get(), counts);
+
+    inline HRESULT histogram(
+        LPSAFEARRAY const src,
+        LPSAFEARRAY const edges,
+        unique_safearray& counts,
+        HistogramOutliers* const outliers = nullptr) noexcept
+    {
+        VARTYPE vt = VT_EMPTY;
+        size_t m = 0;
+        auto const hr = detail::vector_info(edges, vt, m);
+        if (FAILED(hr)) return hr;
+        if (vt != VT_R8) return DISP_E_BADVARTYPE;
+        if (m < 2) return E_INVALIDARG;
+
+        SafeArrayData<DOUBLE> e(edges);
+        if (FAILED(e.Result())) return e.Result();
+        for (size_t i = 1; i < m; ++i)
+        {
+            if (!(e[i - 1] < e[i])) return E_INVALIDARG;
+        }
+        auto const first = e.begin();
+        auto const end = e.end();
+        auto const lo = e[0];
+        auto const hi = e[m - 1];
+        auto const bins = m - 1;
+        return detail::histogram(src, bins, [first, end, lo, hi, bins](double const v) noexcept
+            {
+                if (v >= lo && v <= hi) return std::min(static_cast<size_t>(std::upper_bound(first, end, v) - first) - 1, bins - 1);
+                if (v < lo) return bins + detail::HistogramBelow;
+                if (v > hi) return bins + detail::HistogramAbove;
+                return bins + detail::HistogramNaN;
+            }, counts, outliers);
+    }
+}
+
+#endif  // COMMEM_HISTOGRAM_H
+
+///////////////////////////////////////////////////////////////////////////////
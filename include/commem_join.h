@@ -0,0 +1,304 @@
+// commem_join.h: Hash joins of SAFEARRAY key columns /////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_JOIN_H
+#define COMMEM_JOIN_H
+
+#include "commem_array.h"
+#include <atomic>
+#include <type_traits>
+
+namespace commem {
+
+    // Kind of hash_join
+    // Inner: a pair for each match. Left: also a pair, with a right index of
+    // -1, for each left row without a match. Semi: each left row with at
+    // least one match, once. Anti: each left row without a match.
+
+    enum class JoinType { Inner, Left, Semi, Anti };
+
+    namespace detail {
+
+        // Build-side rows per partition, so that a partition's table fits in
+        // the L2 cache
+        inline constexpr size_t join_partition_rows = 4096;
+        inline constexpr unsigned join_max_partition_bits = 12;
+
+        // Chained hash table over the build rows of one partition. heads
+        // and next hold an index into the partition's rows plus one, or
+        // zero at the end of a chain; each chain is in row order.
+        struct JoinTable {
+            std::unique_ptr<ULONG[]> heads;
+            std::unique_ptr<ULONG[]> next;
+            size_t mask = 0;
+        };
+
+        template <typename K>
+        class JoinBuild {
+            K const* m_keys;
+            unsigned m_bits = 0;
+            std::unique_ptr<ULONG[]> m_rows;
+            std::unique_ptr<size_t[]> m_starts;
+            std::unique_ptr<JoinTable[]> m_tables;
+
+            size_t Partition(ULONGLONG const hash) const noexcept
+            {
+                return m_bits ? static_cast<size_t>(hash >> (64 - m_bits)) : 0;
+            }
+
+        public:
+            explicit JoinBuild(K const* const keys) noexcept : m_keys(keys) { }
+
+            // Partition the rows by hash, and then build the table of each
+            // partition in parallel
+            HRESULT Build(size_t const n) noexcept
+            {
+                while (m_bits < join_max_partition_bits && (n >> m_bits) > join_partition_rows) ++m_bits;
+                auto const parts = size_t{ 1 } << m_bits;
+                auto hr = partition_positions(n, parts, [this](size_t const i) noexcept
+                    {
+                        return Partition(hash_value(m_keys[i]));
+                    }, m_rows, m_starts);
+                if (FAILED(hr)) return hr;
+                m_tables.reset(new (std::nothrow) JoinTable[parts]);
+                if (!m_tables) return E_OUTOFMEMORY;
+
+                std::atomic<HRESULT> result{ S_OK };
+                parallel_for(0, parts, [this, &result](size_t const pb, size_t const pe) noexcept
+                    {
+                        for (auto p = pb; p < pe; ++p)
+                        {
+                            auto const rows = m_rows.get() + m_starts[p];
+                            auto const size = m_starts[p + 1] - m_starts[p];
+                            size_t slots = 16;
+                            while (slots < 2 * size) slots *= 2;
+                            auto& t = m_tables[p];
+                            t.heads.reset(new (std::nothrow) ULONG[slots]());
+                            t.next.reset(new (std::nothrow) ULONG[size + 1]);
+                            if (!t.heads || !t.next)
+                            {
+                                result.store(E_OUTOFMEMORY);
+                                return;
+                            }
+                            t.mask = slots - 1;
+                            // Push in reverse, so that each chain is in row order
+                            for (auto j = size; j-- > 0;)
+                            {
+                                auto const s = static_cast<size_t>(hash_value(m_keys[rows[j]])) & t.mask;
+                                t.next[j] = t.heads[s];
+                                t.heads[s] = static_cast<ULONG>(j + 1);
+                            }
+                        }
+                    }, 1);
+                return result.load();
+            }
+
+            // Call f(row) for each build row whose key equals key, in row
+            // order, until f returns false
+            template <typename F>
+            void Probe(K const key, F&& f) const noexcept
+            {
+                auto const hash = hash_value(key);
+                auto const p = Partition(hash);
+                auto const& t = m_tables[p];
+                auto const rows = m_rows.get() + m_starts[p];
+                for (auto j = t.heads[static_cast<size_t>(hash) & t.mask]; j; j = t.next[j - 1])
+                {
+                    auto const row = rows[j - 1];
+                    if (key_equal(m_keys[row], key) && !f(row)) return;
+                }
+            }
+        };
+
+        // Probe each left row, first to count its output rows and then to
+        // write them, so that the output is in left row order
+        template <typename K, typename I>
+        HRESULT join_probe(
+            K const* const left,
+            size_t const n,
+            JoinBuild<K> const& build,
+            JoinType const type,
+            LONG const leftLb,
+            LONG const rightLb,
+            VARTYPE const vtIndex,
+            unique_safearray& leftIndices,
+            unique_safearray* const rightIndices) noexcept
+        {
+            auto const rows = [&build, type](K const key) noexcept
+                {
+                    size_t m = 0;
+                    auto const all = type == JoinType::Inner || type == JoinType::Left;
+                    build.Probe(key, [&m, all](ULONG) noexcept { ++m; return all; });
+                    switch (type)
+                    {
+                    case JoinType::Left: return std::max<size_t>(m, 1);
+                    case JoinType::Anti: return size_t{ m == 0 };
+                    default: return m;
+                    }
+                };
+
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<size_t[]> offsets(new (std::nothrow) size_t[chunks + 1]);
+            if (!offsets) return E_OUTOFMEMORY;
+            for_each_chunk(n, [left, &rows, &offsets](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    size_t m = 0;
+                    for (auto i = b; i < e; ++i) m += rows(left[i]);
+                    offsets[c] = m;
+                });
+            size_t total = 0;
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const m = offsets[c];
+                offsets[c] = total;
+                total += m;
+            }
+
+            unique_safearray l;
+            auto hr = create_vector_like(nullptr, vtIndex, total, l);
+            if (FAILED(hr)) return hr;
+            unique_safearray r;
+            if (rightIndices)
+            {
+                hr = create_vector_like(nullptr, vtIndex, total, r);
+                if (FAILED(hr)) return hr;
+            }
+            {
+                SafeArrayData<I> lo(l.get());
+                if (FAILED(lo.Result())) return lo.Result();
+                SafeArrayData<I> ro(r ? r.get() : l.get());
+                if (FAILED(ro.Result())) return ro.Result();
+                auto const lp = lo.Data();
+                auto const rp = r ? ro.Data() : nullptr;
+                for_each_chunk(n, [=, &build, &offsets](size_t const c, size_t const b, size_t const e) noexcept
+                    {
+                        auto o = offsets[c];
+                        for (auto i = b; i < e; ++i)
+                        {
+                            auto const subscript = static_cast<I>(leftLb + static_cast<LONGLONG>(i));
+                            if (type == JoinType::Semi || type == JoinType::Anti)
+                            {
+                                auto found = false;
+                                build.Probe(left[i], [&found](ULONG) noexcept { found = true; return false; });
+                                if (found == (type == JoinType::Semi)) lp[o++] = subscript;
+                                continue;
+                            }
+                            auto const start = o;
+                            build.Probe(left[i], [=, &o](ULONG const row) noexcept
+                                {
+                                    lp[o] = subscript;
+                                    rp[o++] = static_cast<I>(rightLb + static_cast<LONGLONG>(row));
+                                    return true;
+                                });
+                            if (o == start && type == JoinType::Left)
+                            {
+                                lp[o] = subscript;
+                                rp[o++] = static_cast<I>(-1);
+                            }
+                        }
+                    });
+            }
+
+            leftIndices = std::move(l);
+            if (rightIndices) *rightIndices = std::move(r);
+            return S_OK;
+        }
+    }
+
+    // Hash join
+    // Match the rows of two VT_I4, VT_I8, or VT_BSTR key columns of the same
+    // type, returning the subscripts of the matching rows as index vectors
+    // of type vtIndex (VT_I4 or VT_I8) with a lower bound of zero, ready for
+    // gather. The output is in left row order, and the matches of each left
+    // row are in right row order. BSTRs match if they have the same length
+    // and bytes. For Semi and Anti joins, rightIndices is released. For
+    // Left joins, the right column must have a lower bound of zero or more,
+    // so that -1 marks a missing match.
+    // The right column is the build side: its rows are partitioned by hash
+    // into partitions of a few thousand rows, whose tables are built in
+    // parallel and stay in cache while they are probed. The left rows are
+    // then probed in parallel.
+    // Example:
+    // unique_safearray orders, customers;
+    // hr = hash_join(orderCustomer.get(), customerId.get(), JoinType::Left, orders, customers);
+
+    inline HRESULT hash_join(
+        LPSAFEARRAY const left,
+        LPSAFEARRAY const right,
+        JoinType const type,
+        unique_safearray& leftIndices,
+        unique_safearray& rightIndices,
+        VARTYPE const vtIndex = VT_I4) noexcept
+    {
+        if (vtIndex != VT_I4 && vtIndex != VT_I8) return DISP_E_BADVARTYPE;
+        VARTYPE vt = VT_EMPTY;
+        VARTYPE rvt = VT_EMPTY;
+        size_t n = 0;
+        size_t m = 0;
+        auto hr = detail::vector_info(left, vt, n);
+        if (FAILED(hr)) return hr;
+        hr = detail::vector_info(right, rvt, m);
+        if (FAILED(hr)) return hr;
+        if (vt != rvt) return DISP_E_TYPEMISMATCH;
+        LONG leftLb = 0;
+        LONG rightLb = 0;
+        hr = SafeArrayGetLBound(left, 1, &leftLb);
+        if (FAILED(hr)) return hr;
+        hr = SafeArrayGetLBound(right, 1, &rightLb);
+        if (FAILED(hr)) return hr;
+        if (type == JoinType::Left && rightLb < 0) return E_INVALIDARG;
+        auto const pairs = type == JoinType::Inner || type == JoinType::Left;
+
+        hr = detail::visit_key(vt, [&](auto const tag) noexcept
+            {
+                typedef std::remove_pointer_t<decltype(tag)> K;
+                SafeArrayData<K> l(left);
+                if (FAILED(l.Result())) return l.Result();
+                SafeArrayData<K> r(right);
+                if (FAILED(r.Result())) return r.Result();
+
+                detail::JoinBuild<K> build(r.Data());
+                auto const built = build.Build(m);
+                if (FAILED(built)) return built;
+                if (vtIndex == VT_I4)
+                {
+                    return detail::join_probe<K, LONG>(l.Data(), n, build, type, leftLb, rightLb,
+                        vtIndex, leftIndices, pairs ? &rightIndices : nullptr);
+                }
+                return detail::join_probe<K, LONGLONG>(l.Data(), n, build, type, leftLb, rightLb,
+                    vtIndex, leftIndices, pairs ? &rightIndices : nullptr);
+            });
+        if (FAILED(hr)) return hr;
+        if (!pairs) rightIndices.reset();
+        return S_OK;
+    }
+}
+
+#endif  // COMMEM_JOIN_H
+
+///////////////////////////////////////////////////////////////////////////////
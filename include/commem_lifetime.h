@@ -0,0 +1,336 @@
+// commem_lifetime.h: Object lifetime histograms //////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_LIFETIME_H
+#define COMMEM_LIFETIME_H
+
+#include "commem_stats.h"
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+
+namespace commem {
+
+    // Snapshot of one lifetime histogram
+    // Lifetimes are in nanoseconds and are kept in log-linear buckets: each
+    // power of two is split into eight buckets of equal width, so a bucket's
+    // width is at most 12.5% of its lower bound.
+
+    struct LifetimeHistogram {
+
+        static constexpr size_t sub_buckets = 8;
+        static constexpr size_t num_buckets = 46 * sub_buckets;     // Up to 2^48 ns
+
+        std::vector<ULONGLONG> counts;  // Samples in each bucket
+        ULONGLONG count = 0;            // Total samples
+        ULONGLONG sum = 0;              // Sum of sampled lifetimes
+
+        // Index of the bucket that holds a lifetime
+        static size_t Bucket(ULONGLONG const ns) noexcept
+        {
+            if (ns < sub_buckets) return static_cast<size_t>(ns);
+            size_t e = 0;
+            while ((ns >> e) > 1) ++e;
+            auto const b = (e - 2) * sub_buckets + ((ns >> (e - 3)) & (sub_buckets - 1));
+            return b < num_buckets ? b : num_buckets - 1;
+        }
+
+        // Smallest lifetime that falls into a bucket
+        static ULONGLONG LowerBound(size_t const b) noexcept
+        {
+            if (b < sub_buckets) return b;
+            auto const e = b / sub_buckets + 2;
+            return (sub_buckets + b % sub_buckets) << (e - 3);
+        }
+
+        // Approximate lifetime at quantile q (0 to 1), taken as the midpoint
+        // of the bucket that contains it. Return 0 if there are no samples.
+        ULONGLONG Quantile(double const q) const noexcept
+        {
+            if (count == 0) return 0;
+            auto const rank = static_cast<ULONGLONG>(q * static_cast<double>(count - 1));
+            ULONGLONG seen = 0;
+            for (size_t b = 0; b < counts.size(); ++b)
+            {
+                seen += counts[b];
+                if (seen > rank)
+                {
+                    auto const lo = LowerBound(b);
+                    return b + 1 < num_buckets ? lo + (LowerBound(b + 1) - lo) / 2 : lo;
+                }
+            }
+            return LowerBound(num_buckets - 1);
+        }
+    };
+
+    // Observer that records how long objects live, by kind and size class
+    // Each creation is sampled with probability 1 / SampleRate from a
+    // per-thread generator, so an address that is reused many times is not
+    // always (or never) sampled. The creation time and size class of each
+    // sampled object are kept in a lock-free side table until the object is
+    // freed, when its lifetime is added to the histogram for its kind and
+    // size class; a free that is not in the table costs one probe. Counts are
+    // numbers of samples; multiply by SampleRate to estimate totals. Samples
+    // are dropped if the side table is full, and objects created before the
+    // observer was started are not recorded.
+    // Example:
+    // LifetimeHistograms lifetimes(64);
+    // lifetimes.Start();
+    // ... run the workload ...
+    // auto const h = lifetimes.Snapshot(ObjectKind::BString, LifetimeHistograms::SizeClass(256));
+    // auto const p99 = h.Quantile(0.99);
+
+    class LifetimeHistograms : public AllocationObserver, public MetricSource {
+
+    public:
+        static constexpr size_t num_size_classes = 12;      // 16 bytes to 16 KB, then larger
+
+    private:
+        static constexpr size_t ways = 8;       // Entries searched for each object
+        static constexpr uintptr_t busy = 1;    // Key of an entry being written
+
+        struct Entry {
+            std::atomic<uintptr_t> key;
+            std::atomic<ULONGLONG> time;
+            std::atomic<unsigned> sizeClass;
+        };
+
+        struct Histogram {
+            std::atomic<ULONGLONG> counts[LifetimeHistogram::num_buckets];
+            std::atomic<ULONGLONG> sum;
+        };
+
+        std::unique_ptr<Entry[]> m_table;
+        std::unique_ptr<Histogram[]> m_histograms;
+        size_t const m_tableMask;
+        ULONGLONG const m_sampleMask;
+        std::atomic<size_t> m_dropped{ 0 };
+        bool m_started = false;
+
+        static ULONGLONG Hash(void const* const p) noexcept
+        {
+            auto x = static_cast<ULONGLONG>(reinterpret_cast<uintptr_t>(p));
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        }
+
+        // True for about one call in mask + 1 on each thread
+        static bool Sample(ULONGLONG const mask) noexcept
+        {
+            thread_local ULONGLONG state = Hash(&state) | 1;
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return (state & mask) == 0;
+        }
+
+        // Claim the entry that still holds an address (its free was not
+        // recorded, or is about to be recorded after the address was reused),
+        // or else an empty entry, by setting its key to busy
+        Entry* Claim(size_t const first, uintptr_t const key) const noexcept
+        {
+            for (auto const from : { key, uintptr_t{ 0 } })
+            {
+                for (size_t i = 0; i < ways; ++i)
+                {
+                    auto& entry = m_table[(first + i) & m_tableMask];
+                    auto expected = from;
+                    if (entry.key.load(std::memory_order_relaxed) == from &&
+                        entry.key.compare_exchange_strong(expected, busy, std::memory_order_acquire)) return &entry;
+                }
+            }
+            return nullptr;
+        }
+
+        static size_t RoundUp(size_t const n) noexcept
+        {
+            size_t r = 1;
+            while (r < n) r <<= 1;
+            return r;
+        }
+
+        Histogram& At(ObjectKind const kind, size_t const sizeClass) const noexcept
+        {
+            return m_histograms[static_cast<size_t>(kind) * num_size_classes + sizeClass];
+        }
+
+    public:
+        LifetimeHistograms(LifetimeHistograms const&) = delete;
+        LifetimeHistograms(LifetimeHistograms&&) = delete;
+        LifetimeHistograms& operator=(LifetimeHistograms const&) = delete;
+        LifetimeHistograms& operator=(LifetimeHistograms&&) = delete;
+
+        // Sample about one creation in sampleRate (rounded up to a power of two)
+        // and track up to tableCapacity sampled objects at a time
+        // Throws std::bad_alloc if the tables can't be allocated
+        explicit LifetimeHistograms(size_t const sampleRate = 64, size_t const tableCapacity = 1 << 16) :
+            m_table(new Entry[RoundUp(std::max(tableCapacity, ways))]()),
+            m_histograms(new Histogram[detail::num_kinds * num_size_classes]()),
+            m_tableMask(RoundUp(std::max(tableCapacity, ways)) - 1),
+            m_sampleMask(RoundUp(std::max<size_t>(sampleRate, 1)) - 1) { }
+
+        ~LifetimeHistograms() noexcept
+        {
+            Stop();
+        }
+
+        bool Start() noexcept
+        {
+            if (!m_started) m_started = add_observer(this);
+            return m_started;
+        }
+
+        void Stop() noexcept
+        {
+            if (m_started) remove_observer(this);
+            m_started = false;
+        }
+
+        size_t SampleRate() const noexcept
+        {
+            return static_cast<size_t>(m_sampleMask + 1);
+        }
+
+        // Number of samples lost because the side table was full
+        size_t Dropped() const noexcept
+        {
+            return m_dropped.load(std::memory_order_relaxed);
+        }
+
+        // Size class of an object with cb bytes of data: 0 for up to 16 bytes,
+        // 1 for up to 32 bytes, and so on; the last class holds larger objects
+        static size_t SizeClass(size_t const cb) noexcept
+        {
+            size_t c = 0;
+            while (c + 1 < num_size_classes && (size_t{ 16 } << c) < cb) ++c;
+            return c;
+        }
+
+        LifetimeHistogram Snapshot(ObjectKind const kind, size_t const sizeClass) const
+        {
+            LifetimeHistogram h;
+            if (sizeClass >= num_size_classes) return h;
+            auto const& src = At(kind, sizeClass);
+            h.counts.resize(LifetimeHistogram::num_buckets);
+            for (size_t b = 0; b < h.counts.size(); ++b)
+            {
+                h.counts[b] = src.counts[b].load(std::memory_order_relaxed);
+                h.count += h.counts[b];
+            }
+            h.sum = src.sum.load(std::memory_order_relaxed);
+            return h;
+        }
+
+        // Write the histograms that have samples as commem_lifetime_seconds,
+        // with one bucket boundary per power of two
+        void WriteMetrics(std::ostream& os) const override
+        {
+            detail::write_family(os, "commem_lifetime_seconds", "histogram",
+                "Sampled lifetimes of objects by kind and size class.");
+            char buf[64];
+            for (size_t k = 0; k < detail::num_kinds; ++k)
+            {
+                auto const kind = static_cast<ObjectKind>(k);
+                for (size_t c = 0; c < num_size_classes; ++c)
+                {
+                    auto const h = Snapshot(kind, c);
+                    if (h.count == 0) continue;
+
+                    char labels[64];
+                    if (c + 1 < num_size_classes)
+                        std::snprintf(labels, sizeof(labels), "kind=\"%s\",size=\"%zu\"", detail::kind_name(kind), size_t{ 16 } << c);
+                    else
+                        std::snprintf(labels, sizeof(labels), "kind=\"%s\",size=\"+Inf\"", detail::kind_name(kind));
+
+                    ULONGLONG cumulative = 0;
+                    for (size_t b = 0; b < LifetimeHistogram::num_buckets; ++b)
+                    {
+                        if (b > 0 && b % LifetimeHistogram::sub_buckets == 0)
+                        {
+                            std::snprintf(buf, sizeof(buf), "%.9g", LifetimeHistogram::LowerBound(b) / 1e9);
+                            os << "commem_lifetime_seconds_bucket{" << labels << ",le=\"" << buf << "\"} " << cumulative << '\n';
+                        }
+                        cumulative += h.counts[b];
+                    }
+                    os << "commem_lifetime_seconds_bucket{" << labels << ",le=\"+Inf\"} " << h.count << '\n';
+                    std::snprintf(buf, sizeof(buf), "%.9g", h.sum / 1e9);
+                    os << "commem_lifetime_seconds_sum{" << labels << "} " << buf << '\n';
+                    os << "commem_lifetime_seconds_count{" << labels << "} " << h.count << '\n';
+                }
+            }
+        }
+
+        void OnAlloc(AllocationEvent const& e) noexcept override
+        {
+            if (!Sample(m_sampleMask)) return;
+
+            // Fill in the entry before publishing its key, so that a free
+            // that finds the key also finds the time and size class
+            auto const key = reinterpret_cast<uintptr_t>(e.p);
+            auto const entry = Claim(static_cast<size_t>(Hash(e.p)) & m_tableMask, key);
+            if (!entry)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            entry->time.store(e.time, std::memory_order_relaxed);
+            entry->sizeClass.store(static_cast<unsigned>(SizeClass(e.cb)), std::memory_order_relaxed);
+            entry->key.store(key, std::memory_order_release);
+        }
+
+        void OnFree(AllocationEvent const& e) noexcept override
+        {
+            auto const key = reinterpret_cast<uintptr_t>(e.p);
+            auto const first = static_cast<size_t>(Hash(e.p)) & m_tableMask;
+            for (size_t i = 0; i < ways; ++i)
+            {
+                auto& entry = m_table[(first + i) & m_tableMask];
+                if (entry.key.load(std::memory_order_acquire) != key) continue;
+
+                auto const sizeClass = entry.sizeClass.load(std::memory_order_relaxed);
+                auto const time = entry.time.load(std::memory_order_relaxed);
+                auto expected = key;
+                if (!entry.key.compare_exchange_strong(expected, 0, std::memory_order_relaxed)) return;
+
+                auto const lifetime = e.time > time ? e.time - time : 0;
+                auto& hist = At(e.kind, sizeClass);
+                hist.counts[LifetimeHistogram::Bucket(lifetime)].fetch_add(1, std::memory_order_relaxed);
+                hist.sum.fetch_add(lifetime, std::memory_order_relaxed);
+                return;
+            }
+        }
+    };
+}
+
+#endif  // COMMEM_LIFETIME_H
+
+///////////////////////////////////////////////////////////////////////////////
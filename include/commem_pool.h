@@ -0,0 +1,1173 @@
+// commem_pool.h: Pooled heap blocks and BSTRs ////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_POOL_H
+#define COMMEM_POOL_H
+
+#include "commem_stats.h"
+#include "commem_trace.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace commem {
+
+    // Pooled memory
+    // Heap blocks and BSTRs are cached in per-thread free lists by size
+    // class. Every cached block is a real CoTaskMemAlloc block or BSTR whose
+    // capacity is the size of its class, so pooled objects can be passed to
+    // any code that expects COM memory. A pooled BSTR's length prefix is set
+    // to the requested length. Pooled objects are owned by pooled_heap and
+    // pooled_bstr, whose deleters return them to the cache of the thread
+    // that allocated them, without a lock, even when another thread frees
+    // them. A thread's cache is freed when the thread exits; call pool_trim
+    // to free it sooner. Requests larger than the largest class go directly
+    // to the COM allocation functions. The size classes can be changed at
+    // run time (see PoolTuner).
+
+    namespace detail {
+
+        inline constexpr size_t num_pool_kinds = 2;         // Heap and BString
+        inline constexpr size_t max_pool_classes = 32;
+        inline constexpr size_t min_pool_capacity = 16;     // Room for the links of a free block
+        inline constexpr size_t max_pool_capacity = 4096;
+        inline constexpr size_t pool_granule = 8;           // Sizes are tracked in steps of 8 bytes
+        inline constexpr size_t num_pool_sizes = max_pool_capacity / pool_granule;
+
+        inline size_t pool_kind(ObjectKind const kind) noexcept
+        {
+            return kind == ObjectKind::BString ? 1 : 0;
+        }
+
+        // Index of the step that holds a request of cb bytes (at most
+        // max_pool_capacity bytes)
+        inline size_t pool_size_index(size_t const cb) noexcept
+        {
+            return (std::max(cb, min_pool_capacity) + pool_granule - 1) / pool_granule - 1;
+        }
+
+        // Size classes of each kind: capacities in increasing order and the
+        // most blocks of each class that a thread caches
+        // Tables are immutable once published. A table that is replaced is
+        // never freed, because other threads may still be reading it.
+        struct PoolClassTable {
+            size_t count[num_pool_kinds];
+            size_t capacity[num_pool_kinds][max_pool_classes];
+            size_t depth[num_pool_kinds][max_pool_classes];
+            PoolClassTable* next;       // In the list of all published tables
+
+            // Index of the smallest class of kind k that holds cb bytes, or
+            // count[k] if cb is too large to pool
+            size_t Class(size_t const k, size_t const cb) const noexcept
+            {
+                return static_cast<size_t>(std::lower_bound(capacity[k], capacity[k] + count[k], cb) - capacity[k]);
+            }
+
+            // Index of the class of kind k with exactly this capacity, or
+            // count[k] if there is none
+            size_t Find(size_t const k, size_t const cb) const noexcept
+            {
+                auto const cls = Class(k, cb);
+                return (cls < count[k] && capacity[k][cls] == cb) ? cls : count[k];
+            }
+        };
+
+        // Most blocks cached for a class by default: up to 64 KB, between 8
+        // and 256
+        inline size_t default_pool_depth(size_t const capacity) noexcept
+        {
+            return std::min<size_t>(256, std::max<size_t>(8, 65536 / capacity));
+        }
+
+        inline PoolClassTable const default_pool_table = []() noexcept
+            {
+                constexpr size_t capacities[] = {
+                    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+                PoolClassTable t = {};
+                for (size_t k = 0; k < num_pool_kinds; ++k)
+                {
+                    for (auto const c : capacities)
+                    {
+                        t.capacity[k][t.count[k]] = c;
+                        t.depth[k][t.count[k]++] = default_pool_depth(c);
+                    }
+                }
+                return t;
+            }();
+
+        inline std::atomic<PoolClassTable const*> pool_table{ &default_pool_table };
+        inline std::atomic<PoolClassTable*> pool_tables{ nullptr };
+
+        inline void* system_alloc(ObjectKind const kind, size_t const capacity) noexcept
+        {
+            if (kind == ObjectKind::BString)
+                return SysAllocStringByteLen(nullptr, static_cast<UINT>(capacity));
+            return CoTaskMemAlloc(capacity);
+        }
+
+        inline void system_free(ObjectKind const kind, void* const p) noexcept
+        {
+            if (kind == ObjectKind::BString) SysFreeString(static_cast<BSTR>(p));
+            else CoTaskMemFree(p);
+        }
+
+        // Free blocks are linked through their first bytes. BSTR data need
+        // not be pointer-aligned, so the links are copied. Blocks on remote
+        // lists also hold their capacity after the link.
+        inline void* next_block(void* const p) noexcept
+        {
+            void* next = nullptr;
+            std::memcpy(&next, p, sizeof(next));
+            return next;
+        }
+
+        inline void set_next_block(void* const p, void* const next) noexcept
+        {
+            std::memcpy(p, &next, sizeof(next));
+        }
+
+        inline size_t block_capacity(void* const p) noexcept
+        {
+            UINT cb = 0;
+            std::memcpy(&cb, static_cast<char*>(p) + sizeof(void*), sizeof(cb));
+            return cb;
+        }
+
+        inline void set_block_capacity(void* const p, size_t const capacity) noexcept
+        {
+            auto const cb = static_cast<UINT>(capacity);
+            std::memcpy(static_cast<char*>(p) + sizeof(void*), &cb, sizeof(cb));
+        }
+
+        // Per-thread cache of free blocks
+        // Only the owning thread changes the lists. The counters have a
+        // single writer and are atomic so that statistics can be read from
+        // other threads. Blocks freed by other threads are pushed onto a
+        // lock-free remote list for their kind, which the owner takes over
+        // in one exchange when a local list runs out. When the class table
+        // changes, the owner frees its lists and switches to the new table.
+
+        struct ThreadCache {
+            struct List {
+                void* head = nullptr;
+                size_t count = 0;
+            };
+
+            typedef std::atomic<ULONGLONG> Counter;
+
+            PoolClassTable const* table = &default_pool_table;
+            List lists[num_pool_kinds][max_pool_classes];
+            std::atomic<void*> remote[num_pool_kinds] = {};
+            Counter hits{ 0 };
+            Counter misses{ 0 };
+            std::atomic<size_t> cachedBlocks{ 0 };
+            std::atomic<size_t> cachedBytes{ 0 };
+            Counter remoteFrees{ 0 };
+            Counter requests[num_pool_kinds][num_pool_sizes] = {};     // By size, for PoolTuner
+            Counter sizeMisses[num_pool_kinds][num_pool_sizes] = {};
+            std::atomic<bool> inUse{ true };
+            ThreadCache* next = nullptr;
+
+            static size_t KindIndex(ObjectKind const kind) noexcept
+            {
+                return pool_kind(kind);
+            }
+
+            template <typename T>
+            static void Add(std::atomic<T>& counter, size_t const n) noexcept
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            template <typename T>
+            static void Subtract(std::atomic<T>& counter, size_t const n) noexcept
+            {
+                counter.store(counter.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+            }
+
+            // Switch to the current class table, freeing the lists kept for
+            // the old one. Return the current table.
+            PoolClassTable const* Sync() noexcept
+            {
+                auto const t = pool_table.load(std::memory_order_acquire);
+                if (t != table)
+                {
+                    Trim();
+                    table = t;
+                }
+                return t;
+            }
+
+            // Move the blocks freed by other threads to the local lists,
+            // freeing those that don't fit or match no current class
+            void Reclaim(ObjectKind const kind) noexcept
+            {
+                auto& head = remote[KindIndex(kind)];
+                if (!head.load(std::memory_order_relaxed)) return;
+                auto const k = KindIndex(kind);
+                for (auto p = head.exchange(nullptr, std::memory_order_acquire); p;)
+                {
+                    auto const link = next_block(p);
+                    auto const cls = table->Find(k, block_capacity(p));
+                    if (cls == table->count[k] || !Push(kind, cls, p)) system_free(kind, p);
+                    p = link;
+                }
+            }
+
+            // Free the blocks on a remote list. Safe to call from any thread.
+            void DrainRemote(ObjectKind const kind) noexcept
+            {
+                for (auto p = remote[KindIndex(kind)].exchange(nullptr); p;)
+                {
+                    auto const link = next_block(p);
+                    system_free(kind, p);
+                    p = link;
+                }
+            }
+
+            // Called by a thread other than the owner
+            void PushRemote(ObjectKind const kind, void* const p, size_t const capacity) noexcept
+            {
+                auto& head = remote[KindIndex(kind)];
+                set_block_capacity(p, capacity);
+                auto link = head.load(std::memory_order_relaxed);
+                do
+                {
+                    set_next_block(p, link);
+                } while (!head.compare_exchange_weak(link, p));
+                remoteFrees.fetch_add(1, std::memory_order_relaxed);
+
+                // If the owner exited, it may have drained the list before
+                // the push. Nobody else will take these blocks until the
+                // cache is reused, so free them.
+                if (!inUse.load()) DrainRemote(kind);
+            }
+
+            void* Pop(ObjectKind const kind, size_t const cls) noexcept
+            {
+                auto const k = KindIndex(kind);
+                auto& list = lists[k][cls];
+                if (!list.head) Reclaim(kind);
+                auto const p = list.head;
+                if (!p) return nullptr;
+                list.head = next_block(p);
+                --list.count;
+                Subtract(cachedBlocks, 1);
+                Subtract(cachedBytes, table->capacity[k][cls]);
+                return p;
+            }
+
+            // Return false if the list is full
+            bool Push(ObjectKind const kind, size_t const cls, void* const p) noexcept
+            {
+                auto const k = KindIndex(kind);
+                auto& list = lists[k][cls];
+                if (list.count >= table->depth[k][cls]) return false;
+                set_next_block(p, list.head);
+                list.head = p;
+                ++list.count;
+                Add(cachedBlocks, 1);
+                Add(cachedBytes, table->capacity[k][cls]);
+                return true;
+            }
+
+            size_t Count(ObjectKind const kind, size_t const cls) const noexcept
+            {
+                return lists[KindIndex(kind)][cls].count;
+            }
+
+            // Free all cached blocks, including those freed by other threads
+            // The local lists are emptied directly rather than through Pop,
+            // which would file blocks freed meanwhile by other threads under
+            // the classes of a table that Sync is about to replace. Blocks
+            // pushed after the remote lists are drained keep their capacity
+            // and are matched against the new table when reclaimed.
+            void Trim() noexcept
+            {
+                for (auto const kind : { ObjectKind::Heap, ObjectKind::BString })
+                {
+                    auto const k = KindIndex(kind);
+                    for (size_t cls = 0; cls < table->count[k]; ++cls)
+                    {
+                        auto& list = lists[k][cls];
+                        for (auto p = list.head; p;)
+                        {
+                            auto const link = next_block(p);
+                            system_free(kind, p);
+                            p = link;
+                        }
+                        Subtract(cachedBlocks, list.count);
+                        Subtract(cachedBytes, list.count * table->capacity[k][cls]);
+                        list = List();
+                    }
+                    DrainRemote(kind);
+                }
+            }
+        };
+
+        // All thread caches ever created. Caches are never freed; when a
+        // thread exits, its cache is trimmed and reused by a later thread.
+        inline std::atomic<ThreadCache*> thread_caches{ nullptr };
+
+        inline thread_local ThreadCache* current_cache = nullptr;
+        inline thread_local bool cache_retired = false;
+
+        // Releases the thread's cache when the thread exits
+        struct ThreadCacheHolder {
+            bool active = false;
+            ~ThreadCacheHolder() noexcept
+            {
+                cache_retired = true;
+                if (!current_cache) return;
+                current_cache->Trim();
+                current_cache->inUse.store(false);
+                current_cache->DrainRemote(ObjectKind::Heap);
+                current_cache->DrainRemote(ObjectKind::BString);
+                current_cache = nullptr;
+            }
+        };
+
+        inline thread_local ThreadCacheHolder thread_cache_holder;
+
+        // Return the calling thread's cache, or nullptr if one can't be
+        // allocated or the thread is exiting
+        inline ThreadCache* thread_cache() noexcept
+        {
+            if (current_cache) return current_cache;
+            if (cache_retired) return nullptr;
+
+            ThreadCache* cache = nullptr;
+            for (auto c = thread_caches.load(std::memory_order_acquire); c; c = c->next)
+            {
+                auto expected = false;
+                if (c->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                {
+                    cache = c;
+                    break;
+                }
+            }
+            if (!cache)
+            {
+                cache = new (std::nothrow) ThreadCache();
+                if (!cache) return nullptr;
+                cache->next = thread_caches.load(std::memory_order_relaxed);
+                while (!thread_caches.compare_exchange_weak(cache->next, cache, std::memory_order_release)) { }
+            }
+
+            thread_cache_holder.active = true;
+            current_cache = cache;
+            return cache;
+        }
+
+        // Set the length of a pooled BSTR and terminate it
+        inline void set_bstr_length(BSTR const p, UINT const cb) noexcept
+        {
+            std::memcpy(reinterpret_cast<char*>(p) - sizeof(UINT), &cb, sizeof(UINT));
+            OLECHAR const zero = 0;
+            std::memcpy(reinterpret_cast<char*>(p) + cb, &zero, sizeof(zero));
+        }
+
+        // Allocate a block of at least cb bytes. Set capacity to the size of
+        // its class, or zero if it is too large to pool, and owner to the
+        // cache that it is returned to when freed.
+        inline void* pool_alloc(ObjectKind const kind, size_t const cb, size_t& capacity, ThreadCache*& owner) noexcept
+        {
+            auto const k = pool_kind(kind);
+            auto const cache = cb <= max_pool_capacity ? thread_cache() : nullptr;
+            auto const table = cache ? cache->Sync() : pool_table.load(std::memory_order_acquire);
+            auto const cls = table->Class(k, cb);
+            owner = nullptr;
+            if (cls == table->count[k])
+            {
+                capacity = 0;
+                if (cache) ThreadCache::Add(cache->requests[k][pool_size_index(cb)], 1);
+                return system_alloc(kind, cb);
+            }
+
+            capacity = table->capacity[k][cls];
+            owner = cache;
+            if (cache)
+            {
+                auto const size = pool_size_index(cb);
+                ThreadCache::Add(cache->requests[k][size], 1);
+                if (auto const p = cache->Pop(kind, cls))
+                {
+                    ThreadCache::Add(cache->hits, 1);
+                    COMMEM_PROBE(cache_hit, (AllocationEvent{ kind, VT_EMPTY, p, capacity, 0, 0 }));
+                    return p;
+                }
+                ThreadCache::Add(cache->misses, 1);
+                ThreadCache::Add(cache->sizeMisses[k][size], 1);
+            }
+            auto const p = system_alloc(kind, capacity);
+            if (p) COMMEM_PROBE(cache_miss, (AllocationEvent{ kind, VT_EMPTY, p, capacity, 0, 0 }));
+            return p;
+        }
+
+        // Return a block to its owner's cache: directly if the calling
+        // thread is the owner (or the block has none), or through the
+        // owner's remote list. Free it if the cache is full or no current
+        // class has its capacity.
+        inline void pool_free(ObjectKind const kind, void* const p, size_t const capacity, ThreadCache* const owner) noexcept
+        {
+            if (capacity != 0)
+            {
+                // Cached and freed BSTRs have the length they were allocated with
+                if (kind == ObjectKind::BString) set_bstr_length(static_cast<BSTR>(p), static_cast<UINT>(capacity));
+                if (owner && owner != current_cache)
+                {
+                    owner->PushRemote(kind, p, capacity);
+                    return;
+                }
+                auto const cache = thread_cache();
+                if (cache)
+                {
+                    auto const k = pool_kind(kind);
+                    auto const table = cache->Sync();
+                    auto const cls = table->Find(k, capacity);
+                    if (cls < table->count[k] && cache->Push(kind, cls, p)) return;
+                }
+            }
+            system_free(kind, p);
+        }
+    }
+
+    // Deleter for pooled heap blocks
+    // capacity is the size of the block's class (zero if it is not pooled).
+    // owner is the cache of the allocating thread; a block freed on another
+    // thread goes back to that cache.
+
+    template<typename T>
+    struct PooledHeapDeleter {
+        static_assert(std::is_pointer_v<T>);
+        typedef T pointer;
+        size_t capacity = 0;
+        detail::ThreadCache* owner = nullptr;
+        void operator()(pointer const p) noexcept
+        {
+            if (!p) return;
+            detail::budget_release(p);
+            COMMEM_PROBE(free, (AllocationEvent{ ObjectKind::Heap, VT_EMPTY, p, 0, 0, 0 }));
+            auto const release = [p, c = capacity, o = owner]() { detail::pool_free(ObjectKind::Heap, p, c, o); };
+            if (detail::observing()) detail::observed_free({ ObjectKind::Heap, VT_EMPTY, p, 0, 0, 0 }, release);
+            else release();
+        }
+    };
+
+    // Deleter for pooled BSTRs
+
+    struct PooledBStringDeleter {
+        typedef BSTR pointer;
+        size_t capacity = 0;
+        detail::ThreadCache* owner = nullptr;
+        void operator()(pointer const p) noexcept
+        {
+            if (!p) return;
+            detail::budget_release(p);
+            COMMEM_PROBE(free, detail::describe(p));
+            auto const release = [p, c = capacity, o = owner]() { detail::pool_free(ObjectKind::BString, p, c, o); };
+            if (detail::observing()) detail::observed_free(detail::describe(p), release);
+            else release();
+        }
+    };
+
+    // Pointer types for pooled memory
+    // Convert to shared_heap or shared_bstr by move; the deleter is kept.
+
+    template <typename T>
+    using pooled_heap = std::unique_ptr<std::remove_pointer_t<T>, PooledHeapDeleter<T>>;
+
+    using pooled_bstr = std::unique_ptr<std::remove_pointer_t<BSTR>, PooledBStringDeleter>;
+
+    // Pooled factory functions
+    // These behave like alloc_heap and alloc_bstr, including observers and
+    // budgets, but take memory from the calling thread's cache.
+    // Examples:
+    // auto x = pool_alloc_heap<LPOLESTR>(10 * sizeof(OLECHAR));
+    // auto y = pool_alloc_bstr(L"ABCD");
+
+    template <typename T = void*>
+    pooled_heap<T> pool_alloc_heap(size_t const cb) noexcept
+    {
+        return detail::budgeted_alloc<pooled_heap<T>>([cb]() { return cb; },
+            [cb]()
+            {
+                size_t capacity = 0;
+                detail::ThreadCache* owner = nullptr;
+                auto const p = static_cast<T>(detail::pool_alloc(ObjectKind::Heap, cb, capacity, owner));
+                return pooled_heap<T>(p, PooledHeapDeleter<T>{ capacity, owner });
+            },
+            [cb](T const p) { return AllocationEvent{ ObjectKind::Heap, VT_EMPTY, p, cb, 0, 0 }; });
+    }
+
+    // If pch is nullptr, the BSTR is allocated but not initialized
+    inline pooled_bstr pool_alloc_bstr(OLECHAR const* const pch, UINT const cch) noexcept
+    {
+        auto const cb = static_cast<UINT>(cch * sizeof(OLECHAR));
+        return detail::budgeted_alloc<pooled_bstr>([cb]() { return size_t{ cb }; },
+            [pch, cb]()
+            {
+                size_t capacity = 0;
+                detail::ThreadCache* owner = nullptr;
+                auto const p = static_cast<BSTR>(detail::pool_alloc(ObjectKind::BString, cb, capacity, owner));
+                if (p)
+                {
+                    if (capacity) detail::set_bstr_length(p, cb);
+                    if (pch) std::memcpy(p, pch, cb);
+                }
+                return pooled_bstr(p, PooledBStringDeleter{ capacity, owner });
+            },
+            [](BSTR const p) { return detail::describe(p); });
+    }
+
+    // Like SysAllocString, return an empty pointer if psz is nullptr
+    inline pooled_bstr pool_alloc_bstr(OLECHAR const* const psz) noexcept
+    {
+        if (!psz) return pooled_bstr();
+        return pool_alloc_bstr(psz, static_cast<UINT>(detail::olestr_bytes(psz) / sizeof(OLECHAR)));
+    }
+
+    // Free the blocks cached by the calling thread
+    inline void pool_trim() noexcept
+    {
+        if (detail::current_cache) detail::current_cache->Trim();
+    }
+
+    // Totals over the caches of all threads
+
+    struct PoolStats {
+        ULONGLONG hits;             // Allocations served from a cache
+        ULONGLONG misses;           // Allocations of pooled sizes that were not
+        ULONGLONG remoteFrees;      // Frees by threads other than the allocating thread
+        size_t cachedBlocks;
+        size_t cachedBytes;
+    };
+
+    inline PoolStats pool_stats() noexcept
+    {
+        PoolStats s = {};
+        for (auto c = detail::thread_caches.load(std::memory_order_acquire); c; c = c->next)
+        {
+            s.hits += c->hits.load(std::memory_order_relaxed);
+            s.misses += c->misses.load(std::memory_order_relaxed);
+            s.cachedBlocks += c->cachedBlocks.load(std::memory_order_relaxed);
+            s.remoteFrees += c->remoteFrees.load(std::memory_order_relaxed);
+            s.cachedBytes += c->cachedBytes.load(std::memory_order_relaxed);
+        }
+        return s;
+    }
+
+    // Metric source for StatsServer that reports pool_stats
+
+    struct PoolMetrics : MetricSource {
+        void WriteMetrics(std::ostream& os) const override
+        {
+            auto const s = pool_stats();
+            detail::write_family(os, "commem_pool_hits", "counter",
+                "Pooled allocations served from a thread cache.");
+            os << "commem_pool_hits_total " << s.hits << '\n';
+            detail::write_family(os, "commem_pool_misses", "counter",
+                "Pooled allocations that were not served from a thread cache.");
+            os << "commem_pool_misses_total " << s.misses << '\n';
+            detail::write_family(os, "commem_pool_remote_frees", "counter",
+                "Pooled objects freed by a thread other than the one that allocated them.");
+            os << "commem_pool_remote_frees_total " << s.remoteFrees << '\n';
+            detail::write_family(os, "commem_pool_cached_blocks", "gauge",
+                "Free blocks held in thread caches.");
+            os << "commem_pool_cached_blocks " << s.cachedBlocks << '\n';
+            detail::write_family(os, "commem_pool_cached_bytes", "gauge",
+                "Bytes of free blocks held in thread caches.");
+            os << "commem_pool_cached_bytes " << s.cachedBytes << '\n';
+        }
+    };
+
+    // Size classes of pooled memory
+    // Each pair is the capacity of a class in bytes and the most blocks of
+    // the class that a thread caches.
+
+    struct PoolClasses {
+        std::vector<std::pair<size_t, size_t>> heap;
+        std::vector<std::pair<size_t, size_t>> bstr;
+    };
+
+    namespace detail {
+
+        // Check a list of classes and copy it into a table
+        inline HRESULT fill_pool_table(
+            std::vector<std::pair<size_t, size_t>> const& classes,
+            PoolClassTable& table,
+            size_t const k) noexcept
+        {
+            if (classes.empty() || classes.size() > max_pool_classes) return E_INVALIDARG;
+            size_t last = 0;
+            for (auto const& c : classes)
+            {
+                if (c.first <= last || c.first < min_pool_capacity || c.first > max_pool_capacity ||
+                    c.first % pool_granule != 0 || c.second == 0 || c.second > 4096)
+                {
+                    return E_INVALIDARG;
+                }
+                last = c.first;
+                table.capacity[k][table.count[k]] = c.first;
+                table.depth[k][table.count[k]++] = c.second;
+            }
+            return S_OK;
+        }
+
+        inline bool same_pool_table(PoolClassTable const& a, PoolClassTable const& b) noexcept
+        {
+            for (size_t k = 0; k < num_pool_kinds; ++k)
+            {
+                if (a.count[k] != b.count[k]) return false;
+                for (size_t i = 0; i < a.count[k]; ++i)
+                {
+                    if (a.capacity[k][i] != b.capacity[k][i] || a.depth[k][i] != b.depth[k][i]) return false;
+                }
+            }
+            return true;
+        }
+    }
+
+    // Return the current size classes. Throws std::bad_alloc if memory runs out.
+
+    inline PoolClasses pool_classes()
+    {
+        auto const table = detail::pool_table.load(std::memory_order_acquire);
+        PoolClasses classes;
+        for (size_t i = 0; i < table->count[0]; ++i) classes.heap.push_back({ table->capacity[0][i], table->depth[0][i] });
+        for (size_t i = 0; i < table->count[1]; ++i) classes.bstr.push_back({ table->capacity[1][i], table->depth[1][i] });
+        return classes;
+    }
+
+    // Replace the size classes
+    // Each kind needs 1 to 32 classes in increasing order of capacity. A
+    // capacity must be a multiple of 8 from 16 to 4096, and a depth must be
+    // from 1 to 4096. Each thread switches to the new classes at its next
+    // pooled allocation or free, freeing the blocks it has cached. Objects
+    // allocated before the change are freed to the system if no class has
+    // their capacity. The old classes are never freed (they take about
+    // 1 KB), so change the classes rarely. Return S_FALSE if the classes
+    // are already in use, E_INVALIDARG if they are not valid, or
+    // E_OUTOFMEMORY.
+
+    inline HRESULT set_pool_classes(PoolClasses const& classes) noexcept
+    {
+        detail::PoolClassTable table = {};
+        auto hr = detail::fill_pool_table(classes.heap, table, 0);
+        if (SUCCEEDED(hr)) hr = detail::fill_pool_table(classes.bstr, table, 1);
+        if (FAILED(hr)) return hr;
+        if (detail::same_pool_table(table, *detail::pool_table.load(std::memory_order_acquire))) return S_FALSE;
+
+        auto const p = new (std::nothrow) detail::PoolClassTable(table);
+        if (!p) return E_OUTOFMEMORY;
+        p->next = detail::pool_tables.load(std::memory_order_relaxed);
+        while (!detail::pool_tables.compare_exchange_weak(p->next, p, std::memory_order_relaxed)) { }
+        detail::pool_table.store(p, std::memory_order_release);
+        return S_OK;
+    }
+
+    // Go back to the built-in size classes
+    inline void reset_pool_classes() noexcept
+    {
+        detail::pool_table.store(&detail::default_pool_table, std::memory_order_release);
+    }
+
+    // Write size classes as text, one class per line, so that the classes
+    // chosen by a PoolTuner can be loaded at the next startup
+    inline HRESULT save_pool_classes(std::ostream& os, PoolClasses const& classes) noexcept
+    {
+        try
+        {
+            os << "commem-pool-classes 1\n";
+            for (auto const& c : classes.heap) os << "heap " << c.first << ' ' << c.second << '\n';
+            for (auto const& c : classes.bstr) os << "bstr " << c.first << ' ' << c.second << '\n';
+            return os ? S_OK : E_FAIL;
+        }
+        catch (std::bad_alloc const&)
+        {
+            return E_OUTOFMEMORY;
+        }
+        catch (...)
+        {
+            return E_FAIL;
+        }
+    }
+
+    // Read size classes written by save_pool_classes. Return E_INVALIDARG if
+    // the text is not in that format. The classes are checked when they are
+    // passed to set_pool_classes.
+    inline HRESULT load_pool_classes(std::istream& is, PoolClasses& classes) noexcept
+    {
+        try
+        {
+            std::string word;
+            int version = 0;
+            if (!(is >> word >> version) || word != "commem-pool-classes" || version != 1) return E_INVALIDARG;
+
+            PoolClasses result;
+            size_t capacity = 0;
+            size_t depth = 0;
+            while (is >> word >> capacity >> depth)
+            {
+                if (word == "heap") result.heap.push_back({ capacity, depth });
+                else if (word == "bstr") result.bstr.push_back({ capacity, depth });
+                else return E_INVALIDARG;
+            }
+            if (!is.eof()) return E_INVALIDARG;
+            classes = std::move(result);
+            return S_OK;
+        }
+        catch (std::bad_alloc const&)
+        {
+            return E_OUTOFMEMORY;
+        }
+        catch (...)
+        {
+            return E_FAIL;
+        }
+    }
+
+    // Chooses size classes from the sizes that are requested
+    // Every thread cache counts pooled requests, and cache misses, by size in
+    // steps of 8 bytes. Rebalance looks at the requests since the last
+    // rebalance (or since the tuner was created) and, for each kind with at
+    // least minRequests of them, picks the classes that minimize the bytes
+    // wasted by rounding requests up to a class, with the largest class kept
+    // at 4096 bytes. A class whose capacity is unchanged has its depth
+    // doubled if more than 10% of its requests missed the cache, or halved
+    // if fewer than 1% did; a new class starts at the default depth.
+    // Example:
+    // PoolTuner tuner;
+    // tuner.Start(std::chrono::minutes(5));
+    // ... on shutdown ...
+    // tuner.Stop();
+    // save_pool_classes(file, pool_classes());
+
+    class PoolTuner {
+
+        typedef std::vector<std::pair<size_t, size_t>> ClassList;
+
+        size_t const m_classes;
+        ULONGLONG const m_minRequests;
+        ULONGLONG m_requests[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+        ULONGLONG m_misses[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        std::thread m_thread;
+        bool m_stop = false;
+
+        // Totals over all thread caches
+        static void Totals(
+            ULONGLONG (&requests)[detail::num_pool_kinds][detail::num_pool_sizes],
+            ULONGLONG (&misses)[detail::num_pool_kinds][detail::num_pool_sizes]) noexcept
+        {
+            for (auto c = detail::thread_caches.load(std::memory_order_acquire); c; c = c->next)
+            {
+                for (size_t k = 0; k < detail::num_pool_kinds; ++k)
+                {
+                    for (size_t s = 0; s < detail::num_pool_sizes; ++s)
+                    {
+                        requests[k][s] += c->requests[k][s].load(std::memory_order_relaxed);
+                        misses[k][s] += c->sizeMisses[k][s].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        // Choose the classes of one kind. Throws std::bad_alloc.
+        ClassList Choose(
+            size_t const k,
+            ULONGLONG const (&requests)[detail::num_pool_sizes],
+            ULONGLONG const (&misses)[detail::num_pool_sizes],
+            detail::PoolClassTable const& current) const
+        {
+            // Candidate capacities: every size requested, and the largest
+            std::vector<size_t> sizes;
+            for (size_t s = 0; s < detail::num_pool_sizes; ++s)
+            {
+                if (requests[s] != 0 || s + 1 == detail::num_pool_sizes) sizes.push_back(s);
+            }
+            auto const n = sizes.size();
+            auto const classes = std::min(m_classes, n);
+            auto const capacity = [&sizes](size_t const i) { return (sizes[i] + 1) * detail::pool_granule; };
+
+            // Prefix sums of requests and requested bytes
+            std::vector<double> count(n + 1);
+            std::vector<double> bytes(n + 1);
+            for (size_t i = 0; i < n; ++i)
+            {
+                count[i + 1] = count[i] + static_cast<double>(requests[sizes[i]]);
+                bytes[i + 1] = bytes[i] + static_cast<double>(requests[sizes[i]]) * static_cast<double>(capacity(i));
+            }
+
+            // waste[c][j]: least bytes wasted by c classes covering sizes
+            // 0 to j, the largest at sizes[j]
+            auto const wasted = [&](size_t const from, size_t const to)
+                {
+                    return static_cast<double>(capacity(to)) * (count[to + 1] - count[from]) - (bytes[to + 1] - bytes[from]);
+                };
+            double const infinity = std::numeric_limits<double>::infinity();
+            std::vector<std::vector<double>> waste(classes + 1, std::vector<double>(n, infinity));
+            std::vector<std::vector<size_t>> previous(classes + 1, std::vector<size_t>(n, 0));
+            for (size_t j = 0; j < n; ++j) waste[1][j] = wasted(0, j);
+            for (size_t c = 2; c <= classes; ++c)
+            {
+                for (size_t j = c - 1; j < n; ++j)
+                {
+                    for (size_t i = c - 2; i < j; ++i)
+                    {
+                        auto const w = waste[c - 1][i] + wasted(i + 1, j);
+                        if (w < waste[c][j])
+                        {
+                            waste[c][j] = w;
+                            previous[c][j] = i;
+                        }
+                    }
+                }
+            }
+
+            std::vector<size_t> chosen;
+            for (size_t c = classes, j = n - 1; c >= 1; --c)
+            {
+                chosen.push_back(j);
+                if (c > 1) j = previous[c][j];
+            }
+            std::reverse(chosen.begin(), chosen.end());
+
+            ClassList result;
+            size_t first = 0;
+            for (auto const j : chosen)
+            {
+                auto const cap = capacity(j);
+                auto const existing = current.Find(k, cap);
+                auto depth = detail::default_pool_depth(cap);
+                if (existing < current.count[k])
+                {
+                    depth = current.depth[k][existing];
+                    ULONGLONG r = 0;
+                    ULONGLONG m = 0;
+                    for (auto s = sizes[first]; s <= sizes[j]; ++s)
+                    {
+                        r += requests[s];
+                        m += misses[s];
+                    }
+                    if (r >= 100 && m * 10 > r) depth *= 2;
+                    else if (r >= 100 && m * 100 < r) depth /= 2;
+                    depth = std::clamp<size_t>(depth, 8, std::min<size_t>(1024, std::max<size_t>(8, (1 << 20) / cap)));
+                }
+                result.push_back({ cap, depth });
+                first = j + 1;
+            }
+            return result;
+        }
+
+        // Set tuned[k] if kind k had enough requests to choose its classes
+        HRESULT Recommend(PoolClasses& classes, bool (&tuned)[detail::num_pool_kinds]) const noexcept
+        {
+            ULONGLONG requests[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+            ULONGLONG misses[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+            Totals(requests, misses);
+            auto const current = detail::pool_table.load(std::memory_order_acquire);
+            try
+            {
+                PoolClasses result;
+                for (size_t k = 0; k < detail::num_pool_kinds; ++k)
+                {
+                    ULONGLONG total = 0;
+                    for (size_t s = 0; s < detail::num_pool_sizes; ++s)
+                    {
+                        requests[k][s] -= m_requests[k][s];
+                        misses[k][s] -= m_misses[k][s];
+                        total += requests[k][s];
+                    }
+
+                    auto& list = k == 0 ? result.heap : result.bstr;
+                    tuned[k] = total >= m_minRequests && total != 0;
+                    if (tuned[k])
+                    {
+                        list = Choose(k, requests[k], misses[k], *current);
+                    }
+                    else
+                    {
+                        for (size_t i = 0; i < current->count[k]; ++i)
+                            list.push_back({ current->capacity[k][i], current->depth[k][i] });
+                    }
+                }
+                classes = std::move(result);
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+    public:
+        PoolTuner(PoolTuner const&) = delete;
+        PoolTuner(PoolTuner&&) = delete;
+        PoolTuner& operator=(PoolTuner const&) = delete;
+        PoolTuner& operator=(PoolTuner&&) = delete;
+
+        // Choose up to classes classes for each kind (at most 32), once at
+        // least minRequests requests of the kind have been counted
+        explicit PoolTuner(size_t const classes = 16, ULONGLONG const minRequests = 10000) noexcept :
+            m_classes(std::clamp<size_t>(classes, 1, detail::max_pool_classes)),
+            m_minRequests(minRequests)
+        {
+            Totals(m_requests, m_misses);
+        }
+
+        ~PoolTuner() noexcept
+        {
+            Stop();
+        }
+
+        // Return the classes that Rebalance would set
+        HRESULT Recommend(PoolClasses& classes) const noexcept
+        {
+            bool tuned[detail::num_pool_kinds] = {};
+            return Recommend(classes, tuned);
+        }
+
+        // Set the recommended classes and start counting again for each kind
+        // that had enough requests. Return S_FALSE if the classes did not
+        // change.
+        HRESULT Rebalance() noexcept
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            PoolClasses classes;
+            bool tuned[detail::num_pool_kinds] = {};
+            auto hr = Recommend(classes, tuned);
+            if (FAILED(hr)) return hr;
+            hr = set_pool_classes(classes);
+            if (FAILED(hr)) return hr;
+
+            ULONGLONG requests[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+            ULONGLONG misses[detail::num_pool_kinds][detail::num_pool_sizes] = {};
+            Totals(requests, misses);
+            for (size_t k = 0; k < detail::num_pool_kinds; ++k)
+            {
+                if (!tuned[k]) continue;
+                std::copy(requests[k], requests[k] + detail::num_pool_sizes, m_requests[k]);
+                std::copy(misses[k], misses[k] + detail::num_pool_sizes, m_misses[k]);
+            }
+            return hr;
+        }
+
+        // Rebalance every interval on a background thread
+        HRESULT Start(std::chrono::milliseconds const interval) noexcept
+        {
+            if (m_thread.joinable()) return E_UNEXPECTED;
+            if (interval.count() <= 0) return E_INVALIDARG;
+            try
+            {
+                m_stop = false;
+                m_thread = std::thread([this, interval]()
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        while (!m_wake.wait_for(lock, interval, [this]() { return m_stop; }))
+                        {
+                            lock.unlock();
+                            (void)Rebalance();
+                            lock.lock();
+                        }
+                    });
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+        void Stop() noexcept
+        {
+            if (!m_thread.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            m_thread.join();
+        }
+    };
+
+    // What warm_up prepares
+    // heap and bstr give the number of blocks to cache for each size in
+    // bytes (rounded up to its class, and limited to the depth of the class).
+
+    struct WarmUpProfile {
+        std::vector<std::pair<size_t, size_t>> heap;
+        std::vector<std::pair<size_t, size_t>> bstr;
+        std::vector<VARTYPE> safearrays;    // Types whose SAFEARRAY paths to initialize
+        bool prefault = true;               // Touch every page of the cached blocks
+    };
+
+    // Prepare the calling thread for steady-state allocation
+    // Initializes the COM allocators (the first BSTR allocation sets up
+    // internal data in oleaut32), creates and destroys one SAFEARRAY of each
+    // type in the profile, and fills the thread's cache to the levels in
+    // the profile. Call it on each thread that will allocate, before its
+    // first request. Return E_OUTOFMEMORY if memory runs out.
+    // Example:
+    // std::vector<TraceEvent> events;
+    // load_trace(file, events);
+    // warm_up(profile_from_trace(events));
+
+    inline HRESULT warm_up(WarmUpProfile const& profile) noexcept
+    {
+        auto const p = CoTaskMemAlloc(1);
+        if (!p) return E_OUTOFMEMORY;
+        CoTaskMemFree(p);
+        auto const s = SysAllocString(L"1234");
+        if (!s) return E_OUTOFMEMORY;
+        SysFreeString(s);
+
+        for (auto const vt : profile.safearrays)
+        {
+            auto const psa = SafeArrayCreateVector(vt, 0, 1);
+            if (!psa) return E_OUTOFMEMORY;
+            if (FAILED(SafeArrayDestroy(psa))) return E_FAIL;
+        }
+
+        auto const cache = detail::thread_cache();
+        if (!cache) return (profile.heap.empty() && profile.bstr.empty()) ? S_OK : E_OUTOFMEMORY;
+
+        auto const table = cache->Sync();
+        auto const fill = [cache, table, &profile](ObjectKind const kind, std::pair<size_t, size_t> const& level) noexcept
+            {
+                auto const k = detail::pool_kind(kind);
+                auto const cls = table->Class(k, level.first);
+                if (cls == table->count[k]) return S_OK;
+                auto const capacity = table->capacity[k][cls];
+                auto const target = std::min(level.second, table->depth[k][cls]);
+                while (cache->Count(kind, cls) < target)
+                {
+                    auto const block = detail::system_alloc(kind, capacity);
+                    if (!block) return E_OUTOFMEMORY;
+                    if (profile.prefault) std::memset(block, 0, capacity);
+                    cache->Push(kind, cls, block);
+                }
+                return S_OK;
+            };
+
+        for (auto const& level : profile.heap)
+        {
+            auto const hr = fill(ObjectKind::Heap, level);
+            if (FAILED(hr)) return hr;
+        }
+        for (auto const& level : profile.bstr)
+        {
+            auto const hr = fill(ObjectKind::BString, level);
+            if (FAILED(hr)) return hr;
+        }
+        return S_OK;
+    }
+
+    // Derive a warm-up profile from a recorded trace
+    // For each pooled size class of heap blocks and BSTRs, the profile asks
+    // for the largest number of objects of that class that were alive at
+    // once on any one thread, and for the SAFEARRAY types that were used.
+    // Throws std::bad_alloc if memory runs out.
+
+    inline WarmUpProfile profile_from_trace(std::vector<TraceEvent> const& events)
+    {
+        struct Live {
+            ObjectKind kind;
+            size_t cls;
+            DWORD thread;
+        };
+
+        std::map<ULONGLONG, Live> live;                             // By object
+        std::map<std::pair<DWORD, size_t>, size_t> count;           // By thread, kind and class
+        size_t peak[detail::num_pool_kinds][detail::max_pool_classes] = {};
+        auto const table = detail::pool_table.load(std::memory_order_acquire);
+        WarmUpProfile profile;
+
+        for (auto const& e : events)
+        {
+            if (e.kind == ObjectKind::SafeArray)
+            {
+                if (e.op == TraceOp::Alloc &&
+                    std::find(profile.safearrays.begin(), profile.safearrays.end(), e.vt) == profile.safearrays.end())
+                {
+                    profile.safearrays.push_back(e.vt);
+                }
+                continue;
+            }
+
+            auto const k = detail::pool_kind(e.kind);
+            if (e.op == TraceOp::Alloc)
+            {
+                auto const cls = table->Class(k, static_cast<size_t>(e.cb));
+                if (cls == table->count[k]) continue;
+                live[e.id] = { e.kind, cls, e.thread };
+                auto& n = count[{ e.thread, k * detail::max_pool_classes + cls }];
+                peak[k][cls] = std::max(peak[k][cls], ++n);
+            }
+            else
+            {
+                auto const i = live.find(e.id);
+                if (i == live.end()) continue;
+                --count[{ i->second.thread, k * detail::max_pool_classes + i->second.cls }];
+                live.erase(i);
+            }
+        }
+
+        for (size_t cls = 0; cls < table->count[0]; ++cls)
+        {
+            if (peak[0][cls]) profile.heap.push_back({ table->capacity[0][cls], peak[0][cls] });
+        }
+        for (size_t cls = 0; cls < table->count[1]; ++cls)
+        {
+            if (peak[1][cls]) profile.bstr.push_back({ table->capacity[1][cls], peak[1][cls] });
+        }
+        return profile;
+    }
+}
+
+#endif  // COMMEM_POOL_H
+
+///////////////////////////////////////////////////////////////////////////////
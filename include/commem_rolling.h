@@ -0,0 +1,359 @@
+// commem_rolling.h: Rolling-window aggregations of VT_R8 SAFEARRAYs //////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_ROLLING_H
+#define COMMEM_ROLLING_H
+
+#include "commem_array.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace commem {
+
+    // Statistic computed by rolling over each window. Variance and StdDev
+    // are sample statistics (divided by the count less one).
+    enum class RollingStat { Sum, Mean, Min, Max, Variance, StdDev };
+
+    namespace detail {
+
+        // Running sum with Neumaier compensation, so that adding and later
+        // removing the same values leaves little error behind
+        class CompensatedSum {
+            double m_sum = 0.0;
+            double m_c = 0.0;
+
+        public:
+            void Add(double const v) noexcept
+            {
+                auto const t = m_sum + v;
+                if (std::fabs(m_sum) >= std::fabs(v)) m_c += (m_sum - t) + v;
+                else m_c += (v - t) + m_sum;
+                m_sum = t;
+            }
+
+            double Value() const noexcept { return m_sum + m_c; }
+        };
+
+        // The window of row i holds the rows from First(i) to i; Contains(j, i)
+        // tells whether row j is still in the window of row i
+        class CountWindow {
+            size_t m_size;
+
+        public:
+            explicit CountWindow(size_t const size) noexcept : m_size(size) { }
+            size_t First(size_t const i) const noexcept { return i + 1 > m_size ? i + 1 - m_size : 0; }
+            bool Contains(size_t const j, size_t const i) const noexcept { return j + m_size > i; }
+        };
+
+        class TimeWindow {
+            DATE const* m_t;
+            double m_span;
+
+        public:
+            TimeWindow(DATE const* const t, double const span) noexcept : m_t(t), m_span(span) { }
+
+            size_t First(size_t const i) const noexcept
+            {
+                return static_cast<size_t>(std::upper_bound(m_t, m_t + i, m_t[i] - m_span) - m_t);
+            }
+
+            bool Contains(size_t const j, size_t const i) const noexcept { return m_t[j] > m_t[i] - m_span; }
+        };
+
+        // Split the rows into segments that are computed in parallel. Each
+        // segment first replays the rows of the window of its first row, so
+        // segments are made at least four times as long as that overlap.
+        template <typename Window>
+        HRESULT rolling_segments(size_t const n, Window const& w, std::vector<size_t>& bounds) noexcept
+        {
+            try
+            {
+                bounds.assign(1, 0);
+                for (size_t b = 0; b < n;)
+                {
+                    auto const length = std::max(kernel_chunk, 4 * (b - w.First(b)));
+                    b = n - b > length ? b + length : n;
+                    bounds.push_back(b);
+                }
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            return S_OK;
+        }
+
+        // Sum, mean, and variance of rows b to e with running sums of x and
+        // of x squared, both shifted by a value from the segment to avoid
+        // cancellation. Infinities are counted by sign rather than summed,
+        // so that one leaving the window does not leave NaN in the sums.
+        template <typename Window>
+        void rolling_moments(
+            double const* const x,
+            size_t const b,
+            size_t const e,
+            Window const& w,
+            RollingStat const stat,
+            size_t const minPeriods,
+            double* const out) noexcept
+        {
+            auto const nan = std::numeric_limits<double>::quiet_NaN();
+            auto const inf = std::numeric_limits<double>::infinity();
+            auto const first = w.First(b);
+            auto shift = 0.0;
+            for (auto i = first; i < e; ++i)
+            {
+                if (std::isfinite(x[i]))
+                {
+                    shift = x[i];
+                    break;
+                }
+            }
+
+            CompensatedSum s1;
+            CompensatedSum s2;
+            size_t count = 0;
+            size_t positive = 0;    // Infinities in the window, by sign
+            size_t negative = 0;
+            auto const update = [&](double const v, bool const add) noexcept
+                {
+                    if (std::isnan(v)) return;
+                    auto const step = [add](size_t& n) noexcept { add ? ++n : --n; };
+                    step(count);
+                    if (std::isinf(v))
+                    {
+                        step(v > 0 ? positive : negative);
+                        return;
+                    }
+                    auto const d = add ? v - shift : shift - v;
+                    s1.Add(d);
+                    s2.Add(add ? d * d : -d * d);
+                };
+
+            auto lo = first;
+            for (auto i = first; i < e; ++i)
+            {
+                update(x[i], true);
+                for (; !w.Contains(lo, i); ++lo) update(x[lo], false);
+                if (i < b) continue;
+
+                auto& y = out[i];
+                if (count < minPeriods)
+                {
+                    y = nan;
+                    continue;
+                }
+                auto const c = static_cast<double>(count);
+                auto const sum = s1.Value();
+                switch (stat)
+                {
+                case RollingStat::Sum:
+                case RollingStat::Mean:
+                    if (positive || negative) y = positive && negative ? nan : positive ? inf : -inf;
+                    else if (stat == RollingStat::Sum) y = sum + c * shift;
+                    else y = count ? shift + sum / c : nan;
+                    break;
+                default:
+                    if (count < 2 || positive || negative)
+                    {
+                        y = nan;
+                        break;
+                    }
+                    y = std::max(0.0, (s2.Value() - sum * sum / c) / (c - 1.0));
+                    if (stat == RollingStat::StdDev) y = std::sqrt(y);
+                    break;
+                }
+            }
+        }
+
+        // Minimum or maximum of rows b to e with a monotonic deque of rows:
+        // each row enters and leaves the deque once, and the front of the
+        // deque is the extreme of the window
+        template <typename Window>
+        HRESULT rolling_extremes(
+            double const* const x,
+            size_t const b,
+            size_t const e,
+            Window const& w,
+            bool const max,
+            size_t const minPeriods,
+            double* const out) noexcept
+        {
+            auto const nan = std::numeric_limits<double>::quiet_NaN();
+            auto const first = w.First(b);
+            std::unique_ptr<size_t[]> rows(new (std::nothrow) size_t[e - first]);
+            if (!rows) return E_OUTOFMEMORY;
+            auto const q = rows.get();
+            size_t head = 0;
+            size_t tail = 0;
+            size_t count = 0;
+            auto lo = first;
+            for (auto i = first; i < e; ++i)
+            {
+                auto const v = x[i];
+                if (!std::isnan(v))
+                {
+                    while (tail > head && (max ? !(x[q[tail - 1]] > v) : !(x[q[tail - 1]] < v))) --tail;
+                    q[tail++] = i;
+                    ++count;
+                }
+                for (; !w.Contains(lo, i); ++lo)
+                {
+                    if (!std::isnan(x[lo])) --count;
+                }
+                while (head < tail && q[head] < lo) ++head;
+                if (i < b) continue;
+                out[i] = count && count >= minPeriods ? x[q[head]] : nan;
+            }
+            return S_OK;
+        }
+
+        template <typename Window>
+        HRESULT rolling(
+            LPSAFEARRAY const src,
+            size_t const n,
+            Window const& w,
+            RollingStat const stat,
+            size_t const minPeriods,
+            unique_safearray& result) noexcept
+        {
+            std::vector<size_t> bounds;
+            auto hr = rolling_segments(n, w, bounds);
+            if (FAILED(hr)) return hr;
+            unique_safearray a;
+            hr = create_vector_like(src, VT_R8, n, a);
+            if (FAILED(hr)) return hr;
+            {
+                SafeArrayData<DOUBLE> in(src);
+                if (FAILED(in.Result())) return in.Result();
+                SafeArrayData<DOUBLE> out(a.get());
+                if (FAILED(out.Result())) return out.Result();
+                auto const x = in.Data();
+                auto const y = out.Data();
+                std::atomic<HRESULT> status{ S_OK };
+                parallel_for(0, bounds.size() - 1, [=, &w, &bounds, &status](size_t const sb, size_t const se) noexcept
+                    {
+                        for (auto s = sb; s < se; ++s)
+                        {
+                            auto const b = bounds[s];
+                            auto const e = bounds[s + 1];
+                            if (stat == RollingStat::Min || stat == RollingStat::Max)
+                            {
+                                auto const extremes = rolling_extremes(x, b, e, w, stat == RollingStat::Max, minPeriods, y);
+                                if (FAILED(extremes)) status.store(extremes);
+                            }
+                            else rolling_moments(x, b, e, w, stat, minPeriods, y);
+                        }
+                    }, 1);
+                hr = status.load();
+                if (FAILED(hr)) return hr;
+            }
+            result = std::move(a);
+            return S_OK;
+        }
+
+        inline HRESULT rolling_source(LPSAFEARRAY const src, size_t& n) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            auto const hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+            return vt == VT_R8 ? S_OK : DISP_E_BADVARTYPE;
+        }
+    }
+
+    // Rolling-window statistics of a VT_R8 vector
+    // Compute stat over the window of each element, which holds the element
+    // and up to window - 1 elements before it, returning a VT_R8 vector with
+    // the lower bound of src. NaNs are skipped; a window with fewer than
+    // minPeriods values (or fewer than two, for Variance and StdDev)
+    // gives NaN. An infinity makes the Sum and Mean of its windows infinite
+    // (NaN if both signs are present) and their Variance and StdDev NaN,
+    // without affecting later windows. Each element enters and leaves the
+    // running sums or the min/max deque once, so the cost does not depend
+    // on the window size.
+    // The input is split into segments computed in parallel, each of which
+    // first replays the window before it.
+    // Example:
+    // unique_safearray ma;
+    // hr = rolling(prices.get(), 20, RollingStat::Mean, ma);
+
+    inline HRESULT rolling(
+        LPSAFEARRAY const src,
+        size_t const window,
+        RollingStat const stat,
+        unique_safearray& result,
+        size_t const minPeriods = 1) noexcept
+    {
+        if (!window) return E_INVALIDARG;
+        size_t n = 0;
+        auto const hr = detail::rolling_source(src, n);
+        if (FAILED(hr)) return hr;
+        return detail::rolling(src, n, detail::CountWindow(window), stat, minPeriods, result);
+    }
+
+    // Rolling-window statistics over time
+    // As above, but the window of each element holds the elements whose time
+    // is greater than its own time less span (in days), and not after it.
+    // times is a VT_DATE vector of nondecreasing times, one for each element
+    // of src.
+    // Example:
+    // hr = rolling(prices.get(), times.get(), 5.0 / (24 * 60), RollingStat::Max, high);
+
+    inline HRESULT rolling(
+        LPSAFEARRAY const src,
+        LPSAFEARRAY const times,
+        double const span,
+        RollingStat const stat,
+        unique_safearray& result,
+        size_t const minPeriods = 1) noexcept
+    {
+        if (!(span > 0.0) || !std::isfinite(span)) return E_INVALIDARG;
+        size_t n = 0;
+        auto hr = detail::rolling_source(src, n);
+        if (FAILED(hr)) return hr;
+        VARTYPE vt = VT_EMPTY;
+        size_t m = 0;
+        hr = detail::vector_info(times, vt, m);
+        if (FAILED(hr)) return hr;
+        if (vt != VT_DATE) return DISP_E_BADVARTYPE;
+        if (m != n) return E_INVALIDARG;
+
+        SafeArrayData<DATE> t(times);
+        if (FAILED(t.Result())) return t.Result();
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (std::isnan(t[i]) || (i && t[i] < t[i - 1])) return E_INVALIDARG;
+        }
+        return detail::rolling(src, n, detail::TimeWindow(t.Data(), span), stat, minPeriods, result);
+    }
+}
+
+#endif  // COMMEM_ROLLING_H
+
+///////////////////////////////////////////////////////////////////////////////
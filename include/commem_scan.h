@@ -0,0 +1,367 @@
+// commem_scan.h: Parallel scans over numeric SAFEARRAYs //////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_SCAN_H
+#define COMMEM_SCAN_H
+
+#include "commem_array.h"
+#include <type_traits>
+
+namespace commem {
+
+    // Operation and mode of a scan
+    // An inclusive scan sets element i to the sum (or product) of elements 0
+    // through i; an exclusive scan sets it to that of elements 0 through
+    // i - 1 (zero, or one for a product, at element 0).
+
+    enum class ScanOp { Sum, Product };
+
+    enum class ScanMode { Inclusive, Exclusive };
+
+    namespace detail {
+
+        // Integers wrap around on overflow instead of being undefined
+        template <ScanOp Op, typename T>
+        T scan_combine(T const a, T const b) noexcept
+        {
+            if constexpr (std::is_integral_v<T>)
+            {
+                typedef std::make_unsigned_t<T> U;
+                return static_cast<T>(Op == ScanOp::Sum ?
+                    static_cast<U>(static_cast<U>(a) + static_cast<U>(b)) :
+                    static_cast<U>(static_cast<U>(a) * static_cast<U>(b)));
+            }
+            else return Op == ScanOp::Sum ? a + b : a * b;
+        }
+
+        template <ScanOp Op, typename T>
+        constexpr T scan_identity() noexcept
+        {
+            return Op == ScanOp::Sum ? T(0) : T(1);
+        }
+
+        // Total of a span, in four independent lanes so that the compiler
+        // can vectorize the loop
+        template <ScanOp Op, typename T>
+        T scan_reduce(T const* const x, size_t const n) noexcept
+        {
+            T lane[4] = { scan_identity<Op, T>(), scan_identity<Op, T>(), scan_identity<Op, T>(), scan_identity<Op, T>() };
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+            {
+                for (size_t j = 0; j < 4; ++j) lane[j] = scan_combine<Op>(lane[j], x[i + j]);
+            }
+            for (; i < n; ++i) lane[0] = scan_combine<Op>(lane[0], x[i]);
+            return scan_combine<Op>(scan_combine<Op>(lane[0], lane[1]), scan_combine<Op>(lane[2], lane[3]));
+        }
+
+        // Scan a span starting from acc. src and dst may be the same.
+        template <ScanOp Op, typename T>
+        void scan_span(T const* const src, T* const dst, size_t const n, T acc, ScanMode const mode) noexcept
+        {
+            if (mode == ScanMode::Inclusive)
+            {
+                for (size_t i = 0; i < n; ++i) dst[i] = acc = scan_combine<Op>(acc, src[i]);
+            }
+            else
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    auto const x = src[i];
+                    dst[i] = acc;
+                    acc = scan_combine<Op>(acc, x);
+                }
+            }
+        }
+
+        // Scan in two parallel passes: total each chunk, then scan each
+        // chunk starting from the total of the chunks before it
+        template <ScanOp Op, typename T>
+        HRESULT scan_values(T const* const src, T* const dst, size_t const n, ScanMode const mode) noexcept
+        {
+            auto const chunks = chunk_count(n);
+            if (chunks <= 1)
+            {
+                scan_span<Op>(src, dst, n, scan_identity<Op, T>(), mode);
+                return S_OK;
+            }
+
+            std::unique_ptr<T[]> carry(new (std::nothrow) T[chunks]);
+            if (!carry) return E_OUTOFMEMORY;
+            for_each_chunk(n, [src, &carry](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    carry[c] = scan_reduce<Op>(src + b, e - b);
+                });
+            auto acc = scan_identity<Op, T>();
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const total = carry[c];
+                carry[c] = acc;
+                acc = scan_combine<Op>(acc, total);
+            }
+            for_each_chunk(n, [src, dst, mode, &carry](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    scan_span<Op>(src + b, dst + b, e - b, carry[c], mode);
+                });
+            return S_OK;
+        }
+
+        // Segmented scan: the scan restarts wherever the key differs from
+        // the key of the element before. Each chunk reports the total of its
+        // last segment and whether a segment starts in it; a sequential pass
+        // over the chunks turns those into the starting value of each chunk.
+        template <ScanOp Op, typename T, typename K>
+        HRESULT segmented_scan_values(
+            T const* const src,
+            K const* const keys,
+            T* const dst,
+            size_t const n,
+            ScanMode const mode) noexcept
+        {
+            struct Chunk {
+                T tail;
+                bool head;
+            };
+
+            auto const head = [keys](size_t const i) noexcept { return i == 0 || !key_equal(keys[i], keys[i - 1]); };
+            auto const chunks = chunk_count(n);
+            std::unique_ptr<Chunk[]> carry(new (std::nothrow) Chunk[std::max<size_t>(1, chunks)]());
+            if (!carry) return E_OUTOFMEMORY;
+
+            if (chunks > 1)
+            {
+                for_each_chunk(n, [src, &head, &carry](size_t const c, size_t const b, size_t const e) noexcept
+                    {
+                        auto acc = scan_identity<Op, T>();
+                        auto starts = false;
+                        for (auto i = b; i < e; ++i)
+                        {
+                            if (head(i))
+                            {
+                                acc = scan_identity<Op, T>();
+                                starts = true;
+                            }
+                            acc = scan_combine<Op>(acc, src[i]);
+                        }
+                        carry[c] = { acc, starts };
+                    });
+            }
+
+            auto acc = scan_identity<Op, T>();
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const chunk = carry[c];
+                carry[c].tail = acc;
+                acc = chunk.head ? chunk.tail : scan_combine<Op>(acc, chunk.tail);
+            }
+
+            for_each_chunk(n, [src, dst, mode, &head, &carry](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    auto running = carry[c].tail;
+                    for (auto i = b; i < e; ++i)
+                    {
+                        if (head(i)) running = scan_identity<Op, T>();
+                        auto const x = src[i];
+                        if (mode == ScanMode::Inclusive) dst[i] = running = scan_combine<Op>(running, x);
+                        else
+                        {
+                            dst[i] = running;
+                            running = scan_combine<Op>(running, x);
+                        }
+                    }
+                });
+            return S_OK;
+        }
+
+        // Scan src into dst, which must be a vector of the same type and
+        // length (it may be src). keys is nullptr for an unsegmented scan.
+        inline HRESULT scan_array(
+            LPSAFEARRAY const src,
+            LPSAFEARRAY const keys,
+            LPSAFEARRAY const dst,
+            ScanMode const mode,
+            ScanOp const op) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+
+            return visit_numeric(vt, [=](auto const tag) noexcept
+                {
+                    typedef std::remove_pointer_t<decltype(tag)> T;
+                    SafeArrayData<T> in(src);
+                    if (FAILED(in.Result())) return in.Result();
+                    SafeArrayData<T> out(dst);
+                    if (FAILED(out.Result())) return out.Result();
+
+                    if (!keys)
+                    {
+                        return op == ScanOp::Sum ?
+                            scan_values<ScanOp::Sum>(in.Data(), out.Data(), n, mode) :
+                            scan_values<ScanOp::Product>(in.Data(), out.Data(), n, mode);
+                    }
+
+                    VARTYPE kvt = VT_EMPTY;
+                    size_t kn = 0;
+                    auto const status = vector_info(keys, kvt, kn);
+                    if (FAILED(status)) return status;
+                    if (kn != n) return E_INVALIDARG;
+                    return visit_key(kvt, [=, &in, &out](auto const ktag) noexcept
+                        {
+                            typedef std::remove_pointer_t<decltype(ktag)> K;
+                            SafeArrayData<K> k(keys);
+                            if (FAILED(k.Result())) return k.Result();
+                            return op == ScanOp::Sum ?
+                                segmented_scan_values<ScanOp::Sum>(in.Data(), k.Data(), out.Data(), n, mode) :
+                                segmented_scan_values<ScanOp::Product>(in.Data(), k.Data(), out.Data(), n, mode);
+                        });
+                });
+        }
+
+        inline HRESULT scan_new(
+            LPSAFEARRAY const src,
+            LPSAFEARRAY const keys,
+            unique_safearray& result,
+            ScanMode const mode,
+            ScanOp const op) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+            hr = visit_numeric(vt, [](auto) noexcept { return S_OK; });
+            if (FAILED(hr)) return hr;
+
+            unique_safearray a;
+            hr = create_vector_like(src, vt, n, a);
+            if (FAILED(hr)) return hr;
+            hr = scan_array(src, keys, a.get(), mode, op);
+            if (FAILED(hr)) return hr;
+            result = std::move(a);
+            return S_OK;
+        }
+    }
+
+    // Scans of VT_I4, VT_I8, VT_R4, and VT_R8 vectors
+    // Chunks of the input are totaled in parallel, and then scanned in
+    // parallel from the totals of the chunks before them. Floating-point
+    // results may therefore differ in the last bits from a sequential loop,
+    // but don't depend on the number of threads. Integers wrap around on
+    // overflow. The in-place forms take a unique_safearray to make it clear
+    // that nobody else is reading the array.
+    // Examples:
+    // unique_safearray totals;
+    // hr = scan(prices.get(), totals, ScanMode::Inclusive);
+    // hr = scan(factors, ScanMode::Exclusive, ScanOp::Product);
+
+    inline HRESULT scan(
+        LPSAFEARRAY const src,
+        unique_safearray& result,
+        ScanMode const mode,
+        ScanOp const op = ScanOp::Sum) noexcept
+    {
+        return detail::scan_new(src, nullptr, result, mode, op);
+    }
+
+    inline HRESULT scan(
+        unique_safearray& a,
+        ScanMode const mode,
+        ScanOp const op = ScanOp::Sum) noexcept
+    {
+        return detail::scan_array(a.get(), nullptr, a.get(), mode, op);
+    }
+
+    // Segmented scans
+    // keys is a VT_I4, VT_I8, or VT_BSTR vector with the length of src. The
+    // scan restarts at each element whose key differs from the key of the
+    // element before it, so rows sorted (or clustered) by a group column
+    // get a running total per group.
+    // Example:
+    // hr = segmented_scan(amounts.get(), accounts.get(), balances, ScanMode::Inclusive);
+
+    inline HRESULT segmented_scan(
+        LPSAFEARRAY const src,
+        LPSAFEARRAY const keys,
+        unique_safearray& result,
+        ScanMode const mode,
+        ScanOp const op = ScanOp::Sum) noexcept
+    {
+        if (!keys) return E_INVALIDARG;
+        return detail::scan_new(src, keys, result, mode, op);
+    }
+
+    inline HRESULT segmented_scan(
+        unique_safearray& a,
+        LPSAFEARRAY const keys,
+        ScanMode const mode,
+        ScanOp const op = ScanOp::Sum) noexcept
+    {
+        if (!keys) return E_INVALIDARG;
+        return detail::scan_array(a.get(), keys, a.get(), mode, op);
+    }
+
+    // Byte offsets for packing a VT_BSTR vector into one buffer
+    // Returns a VT_I8 vector with one more element than bstrs: element i is
+    // the offset of string i (the total length of the strings before it), and
+    // the last element is the total length of all strings, in bytes.
+
+    inline HRESULT bstr_offsets(LPSAFEARRAY const bstrs, unique_safearray& offsets) noexcept
+    {
+        VARTYPE vt = VT_EMPTY;
+        size_t n = 0;
+        auto hr = detail::vector_info(bstrs, vt, n);
+        if (FAILED(hr)) return hr;
+        if (vt != VT_BSTR) return DISP_E_BADVARTYPE;
+
+        unique_safearray a;
+        hr = detail::create_vector_like(bstrs, VT_I8, n + 1, a);
+        if (FAILED(hr)) return hr;
+        {
+            SafeArrayData<BSTR> in(bstrs);
+            if (FAILED(in.Result())) return in.Result();
+            SafeArrayData<LONGLONG> out(a.get());
+            if (FAILED(out.Result())) return out.Result();
+
+            auto const lengths = out.Data();
+            detail::for_each_chunk(n, [&in, lengths](size_t, size_t const b, size_t const e) noexcept
+                {
+                    for (auto i = b; i < e; ++i) lengths[i] = SysStringByteLen(in[i]);
+                });
+            lengths[n] = 0;
+            hr = detail::scan_values<ScanOp::Sum>(lengths, lengths, n + 1, ScanMode::Exclusive);
+            if (FAILED(hr)) return hr;
+        }
+        offsets = std::move(a);
+        return S_OK;
+    }
+}
+
+#endif  // COMMEM_SCAN_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,360 @@
+// commem_sites.h: Per-call-site allocation accounting ////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_SITES_H
+#define COMMEM_SITES_H
+
+#include "commem_stats.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace commem {
+
+    // Totals for one call site, as reported by CallSiteStats
+
+    struct CallSiteReport {
+        CallSite site;
+        ULONGLONG allocs;           // Objects created
+        ULONGLONG bytes;            // Bytes of data in objects created
+        LONGLONG outstanding;       // Objects created and not yet freed
+        LONGLONG outstandingBytes;  // Bytes of data in objects not yet freed
+        double rate;                // Objects created per second
+    };
+
+    // Orders for CallSiteStats reports (largest first)
+
+    enum class CallSiteOrder { Bytes, Rate, Outstanding };
+
+    // Observer that accumulates allocations by call site
+    // Allocations made through the tagged factory functions are counted
+    // against their CallSite; other allocations are counted against a single
+    // "(untagged)" site. Sites are kept in a fixed-size open-addressed table
+    // that is searched without locks. Each object's site is kept in a side
+    // table until the object is freed so that frees (on any thread) can be
+    // credited to the site that created it. Sites that don't fit in the site
+    // table are counted as untagged, and objects that don't fit in the side
+    // table are counted as Untracked and are never seen as freed.
+    // Example:
+    // CallSiteStats sites;
+    // sites.Start();
+    // ... run the workload ...
+    // sites.WriteReport(std::cout, CallSiteOrder::Bytes, 20);
+
+    class CallSiteStats : public AllocationObserver, public MetricSource {
+
+        static constexpr size_t ways = 8;       // Entries searched for each object
+        static constexpr uintptr_t busy = 1;    // Key of an object being written
+
+        enum : int { Empty, Claimed, Ready };
+
+        struct Site {
+            std::atomic<int> state;
+            char const* file;
+            unsigned line;
+            char const* function;
+            std::atomic<ULONGLONG> allocs;
+            std::atomic<ULONGLONG> bytes;
+            std::atomic<ULONGLONG> frees;
+            std::atomic<ULONGLONG> freedBytes;
+        };
+
+        struct Object {
+            std::atomic<uintptr_t> key;
+            std::atomic<size_t> site;
+            std::atomic<size_t> cb;
+        };
+
+        std::unique_ptr<Site[]> m_sites;
+        std::unique_ptr<Object[]> m_objects;
+        size_t const m_siteMask;
+        size_t const m_objectMask;
+        std::atomic<size_t> m_untracked{ 0 };
+        std::chrono::steady_clock::time_point m_start;
+        bool m_started = false;
+
+        static ULONGLONG Hash(ULONGLONG x) noexcept
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ull;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebull;
+            return x ^ (x >> 31);
+        }
+
+        static size_t RoundUp(size_t const n) noexcept
+        {
+            size_t r = 2;
+            while (r < n) r <<= 1;
+            return r;
+        }
+
+        // Return the index of a site, adding it if it is new. Index 0 is the
+        // untagged site.
+        size_t FindSite(CallSite const* const site) noexcept
+        {
+            if (!site) return 0;
+            auto const h = Hash(reinterpret_cast<uintptr_t>(site->file) ^ (ULONGLONG{ site->line } << 48));
+            for (size_t n = 0; n < m_siteMask; ++n)
+            {
+                auto const i = 1 + (static_cast<size_t>(h) + n) % m_siteMask;
+                auto& s = m_sites[i];
+                auto state = s.state.load(std::memory_order_acquire);
+                if (state == Empty)
+                {
+                    if (s.state.compare_exchange_strong(state, Claimed, std::memory_order_acquire))
+                    {
+                        s.file = site->file;
+                        s.line = site->line;
+                        s.function = site->function;
+                        s.state.store(Ready, std::memory_order_release);
+                        return i;
+                    }
+                }
+                while (state == Claimed)
+                {
+                    std::this_thread::yield();
+                    state = s.state.load(std::memory_order_acquire);
+                }
+                if (s.file == site->file && s.line == site->line) return i;
+            }
+            return 0;
+        }
+
+        static void WriteLabel(std::ostream& os, char const* p)
+        {
+            for (; *p; ++p)
+            {
+                if (*p == '\\' || *p == '"') os << '\\';
+                if (*p == '\n') os << "\\n";
+                else os << *p;
+            }
+        }
+
+    public:
+        CallSiteStats(CallSiteStats const&) = delete;
+        CallSiteStats(CallSiteStats&&) = delete;
+        CallSiteStats& operator=(CallSiteStats const&) = delete;
+        CallSiteStats& operator=(CallSiteStats&&) = delete;
+
+        // Track up to siteCapacity - 1 tagged sites and objectCapacity live
+        // objects (both rounded up to a power of two)
+        // Throws std::bad_alloc if the tables can't be allocated
+        explicit CallSiteStats(size_t const siteCapacity = 4096, size_t const objectCapacity = 1 << 18) :
+            m_sites(new Site[RoundUp(siteCapacity)]()),
+            m_objects(new Object[RoundUp(std::max(objectCapacity, ways))]()),
+            m_siteMask(RoundUp(siteCapacity) - 1),
+            m_objectMask(RoundUp(std::max(objectCapacity, ways)) - 1)
+        {
+            m_sites[0].file = "(untagged)";
+            m_sites[0].function = "";
+            m_sites[0].state.store(Ready, std::memory_order_relaxed);
+        }
+
+        ~CallSiteStats() noexcept
+        {
+            Stop();
+        }
+
+        bool Start() noexcept
+        {
+            if (m_started) return true;
+            m_start = std::chrono::steady_clock::now();
+            m_started = add_observer(this);
+            return m_started;
+        }
+
+        void Stop() noexcept
+        {
+            if (m_started) remove_observer(this);
+            m_started = false;
+        }
+
+        // Number of objects whose frees can't be credited to their sites
+        // because the side table was full
+        size_t Untracked() const noexcept
+        {
+            return m_untracked.load(std::memory_order_relaxed);
+        }
+
+        // Return the totals of every site that has allocated, in order.
+        // Sites with the same file and line (for example, in a header
+        // included by several translation units) are combined.
+        std::vector<CallSiteReport> Report(CallSiteOrder const order) const
+        {
+            auto const seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - m_start).count();
+
+            std::vector<CallSiteReport> v;
+            for (size_t i = 0; i <= m_siteMask; ++i)
+            {
+                auto const& s = m_sites[i];
+                if (s.state.load(std::memory_order_acquire) != Ready) continue;
+                auto const allocs = s.allocs.load(std::memory_order_relaxed);
+                if (allocs == 0) continue;
+                auto const bytes = s.bytes.load(std::memory_order_relaxed);
+                v.push_back({ CallSite(s.file, s.line, s.function), allocs, bytes,
+                    static_cast<LONGLONG>(allocs - s.frees.load(std::memory_order_relaxed)),
+                    static_cast<LONGLONG>(bytes - s.freedBytes.load(std::memory_order_relaxed)),
+                    0 });
+            }
+
+            auto const less = [](CallSiteReport const& a, CallSiteReport const& b)
+                {
+                    auto const c = std::strcmp(a.site.file, b.site.file);
+                    return c < 0 || (c == 0 && a.site.line < b.site.line);
+                };
+            std::sort(v.begin(), v.end(), less);
+            size_t n = 0;
+            for (size_t i = 0; i < v.size(); ++i)
+            {
+                if (n > 0 && !less(v[n - 1], v[i]))
+                {
+                    v[n - 1].allocs += v[i].allocs;
+                    v[n - 1].bytes += v[i].bytes;
+                    v[n - 1].outstanding += v[i].outstanding;
+                    v[n - 1].outstandingBytes += v[i].outstandingBytes;
+                }
+                else v[n++] = v[i];
+            }
+            v.erase(v.begin() + static_cast<std::ptrdiff_t>(n), v.end());
+
+            for (auto& r : v) r.rate = seconds > 0 ? r.allocs / seconds : 0;
+            std::stable_sort(v.begin(), v.end(), [order](CallSiteReport const& a, CallSiteReport const& b)
+                {
+                    switch (order)
+                    {
+                    case CallSiteOrder::Bytes: return a.bytes > b.bytes;
+                    case CallSiteOrder::Rate: return a.rate > b.rate;
+                    case CallSiteOrder::Outstanding: return a.outstandingBytes > b.outstandingBytes;
+                    }
+                    return false;
+                });
+            return v;
+        }
+
+        // Write the first limit sites of a report as a table
+        void WriteReport(std::ostream& os, CallSiteOrder const order, size_t const limit = 20) const
+        {
+            auto const v = Report(order);
+            char buf[128];
+            std::snprintf(buf, sizeof(buf), "%14s %12s %12s %14s %12s  %s\n",
+                "bytes", "allocs", "outstanding", "outst. bytes", "allocs/s", "site");
+            os << buf;
+            for (size_t i = 0; i < v.size() && i < limit; ++i)
+            {
+                auto const& r = v[i];
+                std::snprintf(buf, sizeof(buf), "%14llu %12llu %12lld %14lld %12.0f  ",
+                    static_cast<unsigned long long>(r.bytes), static_cast<unsigned long long>(r.allocs),
+                    static_cast<long long>(r.outstanding), static_cast<long long>(r.outstandingBytes), r.rate);
+                os << buf << r.site.file;
+                if (r.site.line) os << ':' << r.site.line;
+                if (*r.site.function) os << " (" << r.site.function << ')';
+                os << '\n';
+            }
+        }
+
+        void WriteMetrics(std::ostream& os) const override
+        {
+            auto const v = Report(CallSiteOrder::Bytes);
+            auto const each = [&os, &v](char const* const name, auto const& value)
+                {
+                    for (auto const& r : v)
+                    {
+                        os << name << "{site=\"";
+                        WriteLabel(os, r.site.file);
+                        if (r.site.line) os << ':' << r.site.line;
+                        os << "\"} " << value(r) << '\n';
+                    }
+                };
+
+            detail::write_family(os, "commem_site_allocations", "counter",
+                "Objects created by commem factories, by call site.");
+            each("commem_site_allocations_total", [](CallSiteReport const& r) { return r.allocs; });
+            detail::write_family(os, "commem_site_allocated_bytes", "counter",
+                "Bytes of data in objects created by commem factories, by call site.");
+            each("commem_site_allocated_bytes_total", [](CallSiteReport const& r) { return r.bytes; });
+            detail::write_family(os, "commem_site_outstanding_objects", "gauge",
+                "Objects created and not yet freed, by call site.");
+            each("commem_site_outstanding_objects", [](CallSiteReport const& r) { return r.outstanding; });
+        }
+
+        void OnAlloc(AllocationEvent const& e) noexcept override
+        {
+            auto const i = FindSite(current_call_site());
+            auto& s = m_sites[i];
+            s.allocs.fetch_add(1, std::memory_order_relaxed);
+            s.bytes.fetch_add(e.cb, std::memory_order_relaxed);
+
+            auto const key = reinterpret_cast<uintptr_t>(e.p);
+            auto const first = static_cast<size_t>(Hash(key)) & m_objectMask;
+            for (size_t w = 0; w < ways; ++w)
+            {
+                auto& o = m_objects[(first + w) & m_objectMask];
+                // Fill in the object before publishing its key, so that a
+                // free that finds the key also finds its site and size
+                uintptr_t expected = 0;
+                if (o.key.compare_exchange_strong(expected, busy, std::memory_order_acquire))
+                {
+                    o.cb.store(e.cb, std::memory_order_relaxed);
+                    o.site.store(i, std::memory_order_relaxed);
+                    o.key.store(key, std::memory_order_release);
+                    return;
+                }
+            }
+            m_untracked.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void OnFree(AllocationEvent const& e) noexcept override
+        {
+            auto const key = reinterpret_cast<uintptr_t>(e.p);
+            auto const first = static_cast<size_t>(Hash(key)) & m_objectMask;
+            for (size_t w = 0; w < ways; ++w)
+            {
+                auto& o = m_objects[(first + w) & m_objectMask];
+                if (o.key.load(std::memory_order_acquire) != key) continue;
+
+                auto& s = m_sites[o.site.load(std::memory_order_relaxed)];
+                auto const cb = o.cb.load(std::memory_order_relaxed);
+                auto expected = key;
+                if (!o.key.compare_exchange_strong(expected, 0, std::memory_order_relaxed)) return;
+                s.frees.fetch_add(1, std::memory_order_relaxed);
+                s.freedBytes.fetch_add(cb, std::memory_order_relaxed);
+                return;
+            }
+        }
+    };
+}
+
+#endif  // COMMEM_SITES_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,608 @@
+// commem_sketch.h: Quantile and distinct-count sketches //////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_SKETCH_H
+#define COMMEM_SKETCH_H
+
+#include "commem_array.h"
+#include <cmath>
+#include <istream>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace commem {
+
+    namespace detail {
+
+        inline unsigned leading_zeros(ULONGLONG const x) noexcept
+        {
+            if (!x) return 64;
+#ifdef _MSC_VER
+            unsigned long i = 0;
+            _BitScanReverse64(&i, x);
+            return 63 - static_cast<unsigned>(i);
+#else
+            return static_cast<unsigned>(__builtin_clzll(x));
+#endif
+        }
+
+        // Header of a serialized sketch
+        struct SketchHeader {
+            char magic[4];
+            DWORD version;
+        };
+
+        inline constexpr char quantile_magic[4] = { 'C', 'M', 'Q', 'S' };
+        inline constexpr char hll_magic[4] = { 'C', 'M', 'H', 'L' };
+        inline constexpr DWORD sketch_version = 1;
+
+        template <typename T>
+        bool write_raw(std::ostream& os, T const* const p, size_t const n)
+        {
+            return static_cast<bool>(os.write(reinterpret_cast<char const*>(p), static_cast<std::streamsize>(n * sizeof(T))));
+        }
+
+        template <typename T>
+        bool read_raw(std::istream& is, T* const p, size_t const n)
+        {
+            return static_cast<bool>(is.read(reinterpret_cast<char*>(p), static_cast<std::streamsize>(n * sizeof(T))));
+        }
+    }
+
+    // Approximate quantiles of a stream of numbers (a KLL sketch)
+    // The sketch keeps levels of sampled values; a value at level h stands
+    // for 2^h values of the stream. When the sketch is full, the lowest full
+    // level is sorted and every other value (starting from a random one of
+    // the first two) moves up a level. With the default k of 200, the rank of
+    // a returned quantile is within about 1.5% of the requested rank, using a
+    // few kilobytes whatever the length of the stream. Sketches with the same
+    // k can be merged, so each thread or batch can have its own. NaNs are
+    // ignored. Results are deterministic: the random choices come from a
+    // generator seeded by the constructor.
+    // Example:
+    // QuantileSketch latency;
+    // hr = latency.Add(column.get());
+    // double p99 = 0;
+    // hr = latency.Quantile(0.99, p99);
+
+    class QuantileSketch {
+
+        unsigned m_k;
+        ULONGLONG m_count = 0;
+        double m_min = 0;
+        double m_max = 0;
+        ULONGLONG m_random;
+        std::vector<std::vector<double>> m_levels;
+        size_t m_retained = 0;  // Values in all levels
+        size_t m_capacity = 0;  // Sum of the capacities of the levels
+
+        // Capacity of level h: k at the top, shrinking by 2/3 per level below
+        size_t Capacity(size_t const h) const noexcept
+        {
+            auto const depth = m_levels.size() - 1 - h;
+            return std::max<size_t>(2, static_cast<size_t>(m_k * std::pow(2.0 / 3.0, static_cast<double>(depth))));
+        }
+
+        void Recount() noexcept
+        {
+            m_retained = 0;
+            m_capacity = 0;
+            for (size_t h = 0; h < m_levels.size(); ++h)
+            {
+                m_retained += m_levels[h].size();
+                m_capacity += Capacity(h);
+            }
+        }
+
+        ULONGLONG Next() noexcept
+        {
+            m_random = m_random * 6364136223846793005ull + 1442695040888963407ull;
+            return m_random;
+        }
+
+        bool Coin() noexcept
+        {
+            return (Next() >> 63) != 0;
+        }
+
+        // Throws std::bad_alloc
+        void Compress()
+        {
+            while (m_retained > m_capacity)
+            {
+                size_t h = 0;
+                while (m_levels[h].size() < Capacity(h)) ++h;
+                if (h + 1 == m_levels.size())
+                {
+                    m_levels.emplace_back();
+                    Recount();
+                }
+
+                auto& level = m_levels[h];
+                auto& above = m_levels[h + 1];
+                std::sort(level.begin(), level.end());
+                // An odd value out stays at this level
+                auto const begin = level.size() % 2;
+                auto const moved = above.size();
+                for (auto i = begin + Coin(); i < level.size(); i += 2) above.push_back(level[i]);
+                m_retained -= level.size() - begin - (above.size() - moved);
+                level.resize(begin);
+            }
+        }
+
+    public:
+        explicit QuantileSketch(unsigned const k = 200, ULONGLONG const seed = 0) noexcept :
+            m_k(std::max(8u, k)),
+            m_random(detail::mix64(seed + 1)) { }
+
+        unsigned K() const noexcept { return m_k; }
+        ULONGLONG Count() const noexcept { return m_count; }
+        bool Empty() const noexcept { return m_count == 0; }
+        double Min() const noexcept { return m_count ? m_min : std::nan(""); }
+        double Max() const noexcept { return m_count ? m_max : std::nan(""); }
+
+        void Clear() noexcept
+        {
+            m_count = 0;
+            m_levels.clear();
+            Recount();
+        }
+
+        HRESULT Add(double const x) noexcept
+        {
+            if (std::isnan(x)) return S_FALSE;
+            try
+            {
+                if (m_levels.empty())
+                {
+                    m_levels.emplace_back();
+                    Recount();
+                }
+                m_levels[0].push_back(x);
+                ++m_retained;
+                Compress();
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            m_min = m_count ? std::min(m_min, x) : x;
+            m_max = m_count ? std::max(m_max, x) : x;
+            ++m_count;
+            return S_OK;
+        }
+
+        // Add the elements of a VT_I4, VT_I8, VT_R4, or VT_R8 vector. Each
+        // chunk of the vector is sketched in parallel, and the chunk
+        // sketches are merged in order.
+        HRESULT Add(LPSAFEARRAY const column) noexcept;
+
+        // Merge a sketch with the same k into this one
+        HRESULT Merge(QuantileSketch const& other) noexcept
+        {
+            if (other.m_k != m_k) return E_INVALIDARG;
+            if (other.Empty()) return S_OK;
+            try
+            {
+                auto levels = m_levels;
+                if (levels.size() < other.m_levels.size()) levels.resize(other.m_levels.size());
+                for (size_t h = 0; h < other.m_levels.size(); ++h)
+                {
+                    levels[h].insert(levels[h].end(), other.m_levels[h].begin(), other.m_levels[h].end());
+                }
+                std::swap(levels, m_levels);
+                Recount();
+                try
+                {
+                    Compress();
+                }
+                catch (...)
+                {
+                    std::swap(levels, m_levels);
+                    Recount();
+                    throw;
+                }
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            m_min = m_count ? std::min(m_min, other.m_min) : other.m_min;
+            m_max = m_count ? std::max(m_max, other.m_max) : other.m_max;
+            m_count += other.m_count;
+            return S_OK;
+        }
+
+        // Get the value at rank q (0 to 1) of the values added. Quantile 0
+        // is the minimum and quantile 1 the maximum. Return S_FALSE, and NaN,
+        // if the sketch is empty.
+        HRESULT Quantile(double const q, double& value) const noexcept
+        {
+            return Quantiles(&q, 1, &value);
+        }
+
+        HRESULT Quantiles(double const* const q, size_t const n, double* const values) const noexcept
+        {
+            if ((n && (!q || !values))) return E_POINTER;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (!(q[i] >= 0.0 && q[i] <= 1.0)) return E_INVALIDARG;
+            }
+            if (Empty())
+            {
+                std::fill(values, values + n, std::nan(""));
+                return S_FALSE;
+            }
+            try
+            {
+                // Sort the retained values with their weights
+                std::vector<std::pair<double, ULONGLONG>> items;
+                items.reserve(m_retained);
+                for (size_t h = 0; h < m_levels.size(); ++h)
+                {
+                    for (auto const x : m_levels[h]) items.emplace_back(x, ULONGLONG{ 1 } << h);
+                }
+                std::sort(items.begin(), items.end());
+                ULONGLONG total = 0;
+                for (auto& item : items) item.second = total += item.second;
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    if (q[i] == 0.0) values[i] = m_min;
+                    else if (q[i] == 1.0) values[i] = m_max;
+                    else
+                    {
+                        auto const rank = static_cast<ULONGLONG>(std::ceil(q[i] * static_cast<double>(total)));
+                        auto const it = std::lower_bound(items.begin(), items.end(), rank,
+                            [](std::pair<double, ULONGLONG> const& item, ULONGLONG const r) { return item.second < r; });
+                        values[i] = it == items.end() ? m_max : it->first;
+                    }
+                }
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+        }
+
+        // Write the sketch in binary format
+        HRESULT Save(std::ostream& os) const noexcept
+        {
+            detail::SketchHeader header = {};
+            std::copy(detail::quantile_magic, detail::quantile_magic + 4, header.magic);
+            header.version = detail::sketch_version;
+            try
+            {
+                DWORD const k = m_k;
+                DWORD const levels = static_cast<DWORD>(m_levels.size());
+                auto ok = detail::write_raw(os, &header, 1) &&
+                    detail::write_raw(os, &k, 1) &&
+                    detail::write_raw(os, &levels, 1) &&
+                    detail::write_raw(os, &m_count, 1) &&
+                    detail::write_raw(os, &m_min, 1) &&
+                    detail::write_raw(os, &m_max, 1) &&
+                    detail::write_raw(os, &m_random, 1);
+                for (size_t h = 0; ok && h < m_levels.size(); ++h)
+                {
+                    DWORD const size = static_cast<DWORD>(m_levels[h].size());
+                    ok = detail::write_raw(os, &size, 1) && detail::write_raw(os, m_levels[h].data(), size);
+                }
+                return ok ? S_OK : E_FAIL;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+        // Read a sketch written by Save
+        HRESULT Load(std::istream& is) noexcept
+        {
+            detail::SketchHeader header = {};
+            try
+            {
+                if (!detail::read_raw(is, &header, 1)) return E_FAIL;
+                if (!std::equal(header.magic, header.magic + 4, detail::quantile_magic) ||
+                    header.version != detail::sketch_version) return E_INVALIDARG;
+
+                QuantileSketch tmp;
+                DWORD k = 0;
+                DWORD levels = 0;
+                if (!detail::read_raw(is, &k, 1) ||
+                    !detail::read_raw(is, &levels, 1) ||
+                    !detail::read_raw(is, &tmp.m_count, 1) ||
+                    !detail::read_raw(is, &tmp.m_min, 1) ||
+                    !detail::read_raw(is, &tmp.m_max, 1) ||
+                    !detail::read_raw(is, &tmp.m_random, 1)) return E_FAIL;
+                if (k < 8 || levels > 64) return E_INVALIDARG;
+                tmp.m_k = k;
+                tmp.m_levels.resize(levels);
+                for (auto& level : tmp.m_levels)
+                {
+                    DWORD size = 0;
+                    if (!detail::read_raw(is, &size, 1)) return E_FAIL;
+                    if (size > 3 * k + 2 * levels) return E_INVALIDARG;
+                    level.resize(size);
+                    if (!detail::read_raw(is, level.data(), size)) return E_FAIL;
+                }
+                tmp.Recount();
+                if (tmp.m_retained > tmp.m_capacity) return E_INVALIDARG;
+                *this = std::move(tmp);
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+    };
+
+    // Approximate number of distinct values (HyperLogLog)
+    // Each value is hashed to 64 bits; the first p bits choose one of 2^p
+    // registers, which keeps the largest number of leading zeros (plus one)
+    // seen in the remaining bits. The relative error is about 1.04 / 2^(p/2):
+    // 1.6% for the default precision of 12, which uses 4 KB. Sketches with
+    // the same precision merge by taking the larger of each register.
+    // Example:
+    // HyperLogLog users;
+    // hr = users.Add(names.get());
+    // auto distinct = users.Estimate();
+
+    class HyperLogLog {
+
+        unsigned m_precision;
+        std::vector<unsigned char> m_registers;
+
+    public:
+        static constexpr unsigned MinPrecision = 4;
+        static constexpr unsigned MaxPrecision = 16;
+
+        // Throws std::bad_alloc if the registers can't be allocated
+        explicit HyperLogLog(unsigned const precision = 12) :
+            m_precision(std::min(MaxPrecision, std::max(MinPrecision, precision))),
+            m_registers(size_t{ 1 } << m_precision) { }
+
+        unsigned Precision() const noexcept { return m_precision; }
+
+        void Clear() noexcept
+        {
+            std::fill(m_registers.begin(), m_registers.end(), static_cast<unsigned char>(0));
+        }
+
+        // Add a value hashed to 64 bits
+        void AddHash(ULONGLONG const hash) noexcept
+        {
+            auto const i = static_cast<size_t>(hash >> (64 - m_precision));
+            auto const rho = static_cast<unsigned char>(
+                std::min(detail::leading_zeros(hash << m_precision), 64 - m_precision) + 1);
+            if (m_registers[i] < rho) m_registers[i] = rho;
+        }
+
+        // Add the elements of a VT_I4, VT_I8, VT_R4, VT_R8, or VT_BSTR vector.
+        // NaNs are ignored. Blocks of the vector are hashed in parallel into
+        // registers of their own (one set per thread), which are then merged.
+        HRESULT Add(LPSAFEARRAY const column) noexcept;
+
+        HRESULT Merge(HyperLogLog const& other) noexcept
+        {
+            if (other.m_precision != m_precision) return E_INVALIDARG;
+            for (size_t i = 0; i < m_registers.size(); ++i)
+            {
+                m_registers[i] = std::max(m_registers[i], other.m_registers[i]);
+            }
+            return S_OK;
+        }
+
+        double Estimate() const noexcept
+        {
+            auto const m = static_cast<double>(m_registers.size());
+            double sum = 0;
+            size_t zeros = 0;
+            for (auto const r : m_registers)
+            {
+                sum += std::ldexp(1.0, -static_cast<int>(r));
+                zeros += r == 0;
+            }
+            double alpha = 0.7213 / (1.0 + 1.079 / m);
+            if (m_registers.size() == 16) alpha = 0.673;
+            else if (m_registers.size() == 32) alpha = 0.697;
+            else if (m_registers.size() == 64) alpha = 0.709;
+            auto const estimate = alpha * m * m / sum;
+
+            // Linear counting is more accurate while many registers are empty
+            if (estimate <= 2.5 * m && zeros) return m * std::log(m / static_cast<double>(zeros));
+            return estimate;
+        }
+
+        // Write the sketch in binary format
+        HRESULT Save(std::ostream& os) const noexcept
+        {
+            detail::SketchHeader header = {};
+            std::copy(detail::hll_magic, detail::hll_magic + 4, header.magic);
+            header.version = detail::sketch_version;
+            try
+            {
+                DWORD const precision = m_precision;
+                auto const ok = detail::write_raw(os, &header, 1) &&
+                    detail::write_raw(os, &precision, 1) &&
+                    detail::write_raw(os, m_registers.data(), m_registers.size());
+                return ok ? S_OK : E_FAIL;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+        // Read a sketch written by Save
+        HRESULT Load(std::istream& is) noexcept
+        {
+            detail::SketchHeader header = {};
+            try
+            {
+                if (!detail::read_raw(is, &header, 1)) return E_FAIL;
+                if (!std::equal(header.magic, header.magic + 4, detail::hll_magic) ||
+                    header.version != detail::sketch_version) return E_INVALIDARG;
+                DWORD precision = 0;
+                if (!detail::read_raw(is, &precision, 1)) return E_FAIL;
+                if (precision < MinPrecision || precision > MaxPrecision) return E_INVALIDARG;
+
+                HyperLogLog tmp(precision);
+                if (!detail::read_raw(is, tmp.m_registers.data(), tmp.m_registers.size())) return E_FAIL;
+                for (auto const r : tmp.m_registers)
+                {
+                    if (r > 65 - precision) return E_INVALIDARG;
+                }
+                *this = std::move(tmp);
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+    };
+
+    inline HRESULT QuantileSketch::Add(LPSAFEARRAY const column) noexcept
+    {
+        VARTYPE vt = VT_EMPTY;
+        size_t n = 0;
+        auto const hr = detail::vector_info(column, vt, n);
+        if (FAILED(hr)) return hr;
+
+        return detail::visit_numeric(vt, [this, column, n](auto const tag) noexcept
+            {
+                typedef std::remove_pointer_t<decltype(tag)> T;
+                SafeArrayData<T> data(column);
+                if (FAILED(data.Result())) return data.Result();
+
+                // Each chunk gets a sketch with a seed of its own, so that the
+                // result doesn't depend on the order the chunks run in. The
+                // seeds are drawn from this sketch's generator, so the next
+                // batch gets different ones.
+                QuantileSketch merged(*this);
+                std::vector<QuantileSketch> chunks;
+                try
+                {
+                    chunks.reserve(detail::chunk_count(n));
+                    for (size_t c = 0; c < detail::chunk_count(n); ++c) chunks.emplace_back(m_k, merged.Next());
+                }
+                catch (std::bad_alloc const&)
+                {
+                    return E_OUTOFMEMORY;
+                }
+                std::atomic<HRESULT> result{ S_OK };
+                auto const x = data.Data();
+                detail::for_each_chunk(n, [x, &chunks, &result](size_t const c, size_t const b, size_t const e) noexcept
+                    {
+                        for (auto i = b; i < e; ++i)
+                        {
+                            if (detail::is_nan(x[i])) continue;
+                            if (FAILED(chunks[c].Add(static_cast<double>(x[i]))))
+                            {
+                                result.store(E_OUTOFMEMORY);
+                                return;
+                            }
+                        }
+                    });
+                if (FAILED(result.load())) return result.load();
+
+                for (auto const& chunk : chunks)
+                {
+                    auto const status = merged.Merge(chunk);
+                    if (FAILED(status)) return status;
+                }
+                *this = std::move(merged);
+                return S_OK;
+            });
+    }
+
+    inline HRESULT HyperLogLog::Add(LPSAFEARRAY const column) noexcept
+    {
+        VARTYPE vt = VT_EMPTY;
+        size_t n = 0;
+        auto const hr = detail::vector_info(column, vt, n);
+        if (FAILED(hr)) return hr;
+
+        return detail::visit_value(vt, [this, column, n](auto const tag) noexcept
+            {
+                typedef std::remove_pointer_t<decltype(tag)> T;
+                SafeArrayData<T> data(column);
+                if (FAILED(data.Result())) return data.Result();
+
+                // Hash contiguous blocks of the vector in parallel, one set
+                // of registers per block and no more blocks than threads
+                auto const m = m_registers.size();
+                auto const blocks = std::min(detail::chunk_count(n), parallel_concurrency());
+                std::unique_ptr<unsigned char[]> registers(new (std::nothrow) unsigned char[blocks * m]());
+                if (!registers) return E_OUTOFMEMORY;
+                auto const x = data.Data();
+                auto const p = m_precision;
+                parallel_for(0, blocks, [x, n, m, p, blocks, &registers](size_t const kb, size_t const ke) noexcept
+                    {
+                        for (auto k = kb; k < ke; ++k)
+                        {
+                            auto const r = registers.get() + k * m;
+                            for (auto i = k * n / blocks; i < (k + 1) * n / blocks; ++i)
+                            {
+                                if (detail::is_nan(x[i])) continue;
+                                auto const hash = detail::hash_value(x[i]);
+                                auto const j = static_cast<size_t>(hash >> (64 - p));
+                                auto const rho = static_cast<unsigned char>(std::min(detail::leading_zeros(hash << p), 64 - p) + 1);
+                                if (r[j] < rho) r[j] = rho;
+                            }
+                        }
+                    }, 1);
+                for (size_t k = 0; k < blocks; ++k)
+                {
+                    auto const r = registers.get() + k * m;
+                    for (size_t j = 0; j < m; ++j) m_registers[j] = std::max(m_registers[j], r[j]);
+                }
+                return S_OK;
+            });
+    }
+}
+
+#endif  // COMMEM_SKETCH_H
+
+///////////////////////////////////////////////////////////////////////////////
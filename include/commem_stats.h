@@ -0,0 +1,458 @@
+// commem_stats.h: Live statistics for commem /////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_STATS_H
+#define COMMEM_STATS_H
+
+#include "commem.h"
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace commem {
+
+    // Source of metrics served by StatsServer
+    // WriteMetrics is called on the server thread while the process runs, so
+    // it must only read state that can be read concurrently (atomics).
+
+    struct MetricSource {
+        virtual void WriteMetrics(std::ostream& os) const = 0;
+    protected:
+        ~MetricSource() = default;
+    };
+
+    namespace detail {
+
+        constexpr size_t num_kinds = 3;
+
+        inline char const* kind_name(ObjectKind const kind) noexcept
+        {
+            switch (kind)
+            {
+            case ObjectKind::Heap: return "heap";
+            case ObjectKind::BString: return "bstr";
+            case ObjectKind::SafeArray: return "safearray";
+            }
+            return "unknown";
+        }
+
+        // Write the metadata lines of an OpenMetrics metric family
+        inline void write_family(
+            std::ostream& os,
+            char const* const name,
+            char const* const type,
+            char const* const help)
+        {
+            os << "# TYPE " << name << ' ' << type << '\n';
+            os << "# HELP " << name << ' ' << help << '\n';
+        }
+    }
+
+    // Totals reported by AllocationStats, indexed by ObjectKind
+
+    struct AllocationSnapshot {
+        ULONGLONG allocs[detail::num_kinds];    // Objects created by factories
+        ULONGLONG frees[detail::num_kinds];     // Objects freed by deleters
+        ULONGLONG allocBytes[detail::num_kinds];
+        ULONGLONG freeBytes[detail::num_kinds]; // Zero for heap blocks
+
+        LONGLONG Outstanding(ObjectKind const kind) const noexcept
+        {
+            auto const i = static_cast<size_t>(kind);
+            return static_cast<LONGLONG>(allocs[i] - frees[i]);
+        }
+
+        LONGLONG OutstandingBytes(ObjectKind const kind) const noexcept
+        {
+            auto const i = static_cast<size_t>(kind);
+            return static_cast<LONGLONG>(allocBytes[i] - freeBytes[i]);
+        }
+    };
+
+    // Observer that counts allocations and frees by kind
+    // Counters are relaxed atomics spread over cache-line-sized shards so that
+    // threads seldom write the same line; a snapshot sums the shards without
+    // taking a lock. Objects that were not created by a factory are counted
+    // when they are freed, so outstanding counts can be negative if such
+    // objects are freed while the observer is running. The size of a heap
+    // block is not known when it is freed, so outstanding bytes are not
+    // reported for heap blocks.
+
+    class AllocationStats : public AllocationObserver, public MetricSource {
+
+        static constexpr size_t num_shards = 16;
+
+        struct alignas(64) Shard {
+            std::atomic<ULONGLONG> allocs[detail::num_kinds];
+            std::atomic<ULONGLONG> frees[detail::num_kinds];
+            std::atomic<ULONGLONG> allocBytes[detail::num_kinds];
+            std::atomic<ULONGLONG> freeBytes[detail::num_kinds];
+        };
+
+        Shard m_shards[num_shards] = {};
+        bool m_started = false;
+
+        // Write one sample per kind, starting with the kind at index first
+        template<typename T>
+        static void WriteByKind(
+            std::ostream& os,
+            char const* const name,
+            T const (&values)[detail::num_kinds],
+            size_t const first = 0)
+        {
+            for (size_t i = first; i < detail::num_kinds; ++i)
+            {
+                os << name << "{kind=\"" << detail::kind_name(static_cast<ObjectKind>(i))
+                    << "\"} " << values[i] << '\n';
+            }
+        }
+
+        Shard& ThreadShard() noexcept
+        {
+            thread_local size_t const shard = GetCurrentThreadId() % num_shards;
+            return m_shards[shard];
+        }
+
+    public:
+        AllocationStats() noexcept = default;
+        AllocationStats(AllocationStats const&) = delete;
+        AllocationStats(AllocationStats&&) = delete;
+        AllocationStats& operator=(AllocationStats const&) = delete;
+        AllocationStats& operator=(AllocationStats&&) = delete;
+
+        ~AllocationStats() noexcept
+        {
+            Stop();
+        }
+
+        bool Start() noexcept
+        {
+            if (!m_started) m_started = add_observer(this);
+            return m_started;
+        }
+
+        void Stop() noexcept
+        {
+            if (m_started) remove_observer(this);
+            m_started = false;
+        }
+
+        AllocationSnapshot Snapshot() const noexcept
+        {
+            AllocationSnapshot s = {};
+            for (auto const& shard : m_shards)
+            {
+                for (size_t i = 0; i < detail::num_kinds; ++i)
+                {
+                    s.allocs[i] += shard.allocs[i].load(std::memory_order_relaxed);
+                    s.frees[i] += shard.frees[i].load(std::memory_order_relaxed);
+                    s.allocBytes[i] += shard.allocBytes[i].load(std::memory_order_relaxed);
+                    s.freeBytes[i] += shard.freeBytes[i].load(std::memory_order_relaxed);
+                }
+            }
+            return s;
+        }
+
+        void WriteMetrics(std::ostream& os) const override
+        {
+            auto const s = Snapshot();
+            LONGLONG outstanding[detail::num_kinds];
+            LONGLONG outstandingBytes[detail::num_kinds];
+            for (size_t i = 0; i < detail::num_kinds; ++i)
+            {
+                outstanding[i] = s.Outstanding(static_cast<ObjectKind>(i));
+                outstandingBytes[i] = s.OutstandingBytes(static_cast<ObjectKind>(i));
+            }
+
+            detail::write_family(os, "commem_allocations", "counter",
+                "Objects created by commem factories.");
+            WriteByKind(os, "commem_allocations_total", s.allocs);
+            detail::write_family(os, "commem_frees", "counter",
+                "Objects freed by commem deleters.");
+            WriteByKind(os, "commem_frees_total", s.frees);
+            detail::write_family(os, "commem_allocated_bytes", "counter",
+                "Bytes of data in objects created by commem factories.");
+            WriteByKind(os, "commem_allocated_bytes_total", s.allocBytes);
+            detail::write_family(os, "commem_outstanding_objects", "gauge",
+                "Objects created by factories and not yet freed.");
+            WriteByKind(os, "commem_outstanding_objects", outstanding);
+            detail::write_family(os, "commem_outstanding_bytes", "gauge",
+                "Bytes of data in objects not yet freed.");
+            WriteByKind(os, "commem_outstanding_bytes", outstandingBytes, 1);
+        }
+
+        void OnAlloc(AllocationEvent const& e) noexcept override
+        {
+            auto& shard = ThreadShard();
+            auto const i = static_cast<size_t>(e.kind);
+            shard.allocs[i].fetch_add(1, std::memory_order_relaxed);
+            shard.allocBytes[i].fetch_add(e.cb, std::memory_order_relaxed);
+        }
+
+        void OnFree(AllocationEvent const& e) noexcept override
+        {
+            auto& shard = ThreadShard();
+            auto const i = static_cast<size_t>(e.kind);
+            shard.frees[i].fetch_add(1, std::memory_order_relaxed);
+            shard.freeBytes[i].fetch_add(e.cb, std::memory_order_relaxed);
+        }
+    };
+
+    // Background thread that serves metrics in the OpenMetrics text format
+    // The server either rewrites a file periodically or answers connections
+    // on a Unix domain socket (Linux and Winelib builds only); each connection
+    // receives one scrape and is closed. Sources must be added before the
+    // server is started and must outlive it. Scrapes read the sources' atomic
+    // counters, so they never block the threads that allocate.
+    // Example:
+    // AllocationStats stats;
+    // stats.Start();
+    // StatsServer server;
+    // server.AddSource(&stats);
+    // server.StartSocket("/run/app/commem.sock");
+    // ...
+    // $ socat - UNIX-CONNECT:/run/app/commem.sock
+
+    class StatsServer {
+
+        std::vector<MetricSource const*> m_sources;
+        std::thread m_thread;
+        std::mutex m_lock;
+        std::condition_variable m_wake;
+        bool m_stop = false;
+        std::string m_socketPath;
+        int m_socket = -1;
+
+        // Write the file under a temporary name, then move it into place so
+        // that readers never see a partial scrape
+        HRESULT WriteFile(std::string const& path) const noexcept
+        {
+            try
+            {
+                auto const tmp = path + ".tmp";
+                {
+                    FILE* const f = std::fopen(tmp.c_str(), "wb");
+                    if (!f) return E_FAIL;
+                    auto const text = Scrape();
+                    auto const written = std::fwrite(text.data(), 1, text.size(), f);
+                    if (std::fclose(f) != 0 || written != text.size()) return E_FAIL;
+                }
+#if defined(__linux__)
+                if (std::rename(tmp.c_str(), path.c_str()) != 0) return E_FAIL;
+#else
+                if (!MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) return E_FAIL;
+#endif
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+#if defined(__linux__)
+        void Serve() noexcept
+        {
+            for (;;)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_lock);
+                    if (m_stop) return;
+                }
+                pollfd pfd = { m_socket, POLLIN, 0 };
+                if (poll(&pfd, 1, 100) <= 0) continue;
+                int const fd = accept(m_socket, nullptr, nullptr);
+                if (fd < 0) continue;
+                try
+                {
+                    auto const text = Scrape();
+                    for (size_t sent = 0; sent < text.size();)
+                    {
+                        auto const n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                        if (n <= 0) break;
+                        sent += static_cast<size_t>(n);
+                    }
+                }
+                catch (...) { }
+                close(fd);
+            }
+        }
+#endif
+
+    public:
+        StatsServer() noexcept = default;
+        StatsServer(StatsServer const&) = delete;
+        StatsServer(StatsServer&&) = delete;
+        StatsServer& operator=(StatsServer const&) = delete;
+        StatsServer& operator=(StatsServer&&) = delete;
+
+        ~StatsServer() noexcept
+        {
+            Stop();
+        }
+
+        // Add a source. Return false if the server is running or memory for
+        // the source can't be allocated.
+        bool AddSource(MetricSource const* const source) noexcept
+        {
+            if (!source || m_thread.joinable()) return false;
+            try
+            {
+                m_sources.push_back(source);
+                return true;
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        // Return the current metrics of all sources as OpenMetrics text
+        std::string Scrape() const
+        {
+            std::ostringstream os;
+            for (auto const s : m_sources) s->WriteMetrics(os);
+            os << "# EOF\n";
+            return os.str();
+        }
+
+        // Write a file with the current metrics, then rewrite it every interval
+        HRESULT StartFile(std::string const& path, std::chrono::milliseconds const interval) noexcept
+        {
+            if (m_thread.joinable()) return E_UNEXPECTED;
+            if (path.empty() || interval.count() <= 0) return E_INVALIDARG;
+            auto const hr = WriteFile(path);
+            if (FAILED(hr)) return hr;
+            try
+            {
+                m_stop = false;
+                m_thread = std::thread([this, path, interval]()
+                    {
+                        std::unique_lock<std::mutex> lock(m_lock);
+                        while (!m_wake.wait_for(lock, interval, [this]() { return m_stop; }))
+                        {
+                            lock.unlock();
+                            (void)WriteFile(path);
+                            lock.lock();
+                        }
+                    });
+                return S_OK;
+            }
+            catch (std::bad_alloc const&)
+            {
+                return E_OUTOFMEMORY;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+        // Listen on a Unix domain socket. An existing file at the path is
+        // replaced. Return E_NOTIMPL where Unix domain sockets are not available.
+        HRESULT StartSocket(std::string const& path) noexcept
+        {
+#if defined(__linux__)
+            if (m_thread.joinable()) return E_UNEXPECTED;
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (path.empty() || path.size() >= sizeof(addr.sun_path)) return E_INVALIDARG;
+            std::copy(path.begin(), path.end(), addr.sun_path);
+
+            int const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0) return E_FAIL;
+            (void)unlink(path.c_str());
+            if (bind(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0 ||
+                listen(fd, 8) != 0)
+            {
+                close(fd);
+                return E_FAIL;
+            }
+
+            try
+            {
+                m_socketPath = path;
+                m_socket = fd;
+                m_stop = false;
+                m_thread = std::thread([this]() { Serve(); });
+                return S_OK;
+            }
+            catch (...)
+            {
+                close(fd);
+                (void)unlink(path.c_str());
+                m_socket = -1;
+                return E_FAIL;
+            }
+#else
+            (void)path;
+            return E_NOTIMPL;
+#endif
+        }
+
+        // Stop the server thread and remove the socket, if any
+        void Stop() noexcept
+        {
+            if (!m_thread.joinable()) return;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            m_thread.join();
+#if defined(__linux__)
+            if (m_socket >= 0)
+            {
+                close(m_socket);
+                (void)unlink(m_socketPath.c_str());
+                m_socket = -1;
+            }
+#endif
+        }
+    };
+}
+
+#endif  // COMMEM_STATS_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,286 @@
+// commem_topk.h: Top-k selection over SAFEARRAYs /////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_TOPK_H
+#define COMMEM_TOPK_H
+
+#include "commem_array.h"
+#include <cmath>
+#include <type_traits>
+
+namespace commem {
+
+    // Order of the elements returned by top_k
+    // Descending returns the largest elements first; Ascending returns the
+    // smallest first. NaNs come after all other values in either order.
+
+    enum class SortOrder { Descending, Ascending };
+
+    namespace detail {
+
+        // Largest k handled with per-chunk heaps; larger k uses selection
+        inline constexpr size_t top_k_heap_limit = 256;
+
+        // Elements sampled to choose the selection threshold
+        inline constexpr size_t top_k_samples = 4096;
+
+        // True if a comes before b in order (ignoring position)
+        template <typename T>
+        bool value_before(T const a, T const b, SortOrder const order) noexcept
+        {
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                if (std::isnan(a)) return false;
+                if (std::isnan(b)) return true;
+            }
+            return order == SortOrder::Descending ? key_less(b, a) : key_less(a, b);
+        }
+
+        // Order of element positions: by value, then by position, so that
+        // results don't depend on how the work was split
+        template <typename T>
+        struct PositionBefore {
+            T const* x;
+            SortOrder order;
+
+            bool operator()(ULONG const a, ULONG const b) const noexcept
+            {
+                if (value_before(x[a], x[b], order)) return true;
+                if (value_before(x[b], x[a], order)) return false;
+                return a < b;
+            }
+        };
+
+        // Select the positions of the first k elements of x, in order, into
+        // out. Small k: each chunk keeps a heap of its best k positions, and
+        // the heaps are merged. Large k: a threshold taken from a sample
+        // filters the elements in parallel, and the candidates are selected
+        // with nth_element. Either way the work after the parallel pass is
+        // proportional to k rather than n.
+        template <typename T>
+        HRESULT top_k_positions(
+            T const* const x,
+            size_t const n,
+            size_t const k,
+            SortOrder const order,
+            ULONG* const out) noexcept
+        {
+            PositionBefore<T> const before{ x, order };
+            auto const chunks = chunk_count(n);
+
+            if (k <= top_k_heap_limit)
+            {
+                std::unique_ptr<ULONG[]> heaps(new (std::nothrow) ULONG[chunks * k]);
+                std::unique_ptr<size_t[]> counts(new (std::nothrow) size_t[chunks]);
+                if (!heaps || !counts) return E_OUTOFMEMORY;
+                for_each_chunk(n, [k, &before, &heaps, &counts](size_t const c, size_t const b, size_t const e) noexcept
+                    {
+                        // A heap whose top is the last of the best k so far
+                        auto const heap = heaps.get() + c * k;
+                        size_t m = 0;
+                        for (auto i = b; i < e; ++i)
+                        {
+                            auto const p = static_cast<ULONG>(i);
+                            if (m < k)
+                            {
+                                heap[m++] = p;
+                                std::push_heap(heap, heap + m, before);
+                            }
+                            else if (before(p, heap[0]))
+                            {
+                                std::pop_heap(heap, heap + m, before);
+                                heap[m - 1] = p;
+                                std::push_heap(heap, heap + m, before);
+                            }
+                        }
+                        counts[c] = m;
+                    });
+
+                size_t m = 0;
+                for (size_t c = 0; c < chunks; ++c)
+                {
+                    std::copy_n(heaps.get() + c * k, counts[c], heaps.get() + m);
+                    m += counts[c];
+                }
+                std::partial_sort(heaps.get(), heaps.get() + k, heaps.get() + m, before);
+                std::copy_n(heaps.get(), k, out);
+                return S_OK;
+            }
+
+            // Sample evenly, and take as the threshold a sample a little past
+            // the expected rank of the kth element
+            auto const s = std::min(n, top_k_samples);
+            std::unique_ptr<ULONG[]> sample(new (std::nothrow) ULONG[s]);
+            std::unique_ptr<size_t[]> counts(new (std::nothrow) size_t[chunks + 1]);
+            if (!sample || !counts) return E_OUTOFMEMORY;
+            for (size_t i = 0; i < s; ++i) sample[i] = static_cast<ULONG>(i * n / s);
+            auto const rank = std::min(s - 1, (k * s / n) + (k * s / n) / 4 + 8);
+            std::nth_element(sample.get(), sample.get() + rank, sample.get() + s, before);
+            auto const threshold = x[sample[rank]];
+            sample.reset();
+
+            // Keep the elements that don't come after the threshold. If there
+            // are at least k of them, they include the first k.
+            for_each_chunk(n, [x, order, threshold, &counts](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    size_t m = 0;
+                    for (auto i = b; i < e; ++i) m += !value_before(threshold, x[i], order);
+                    counts[c] = m;
+                });
+            size_t m = 0;
+            for (size_t c = 0; c < chunks; ++c)
+            {
+                auto const count = counts[c];
+                counts[c] = m;
+                m += count;
+            }
+            auto const filter = m >= k;
+            if (!filter) m = n;
+
+            std::unique_ptr<ULONG[]> candidates(new (std::nothrow) ULONG[m]);
+            if (!candidates) return E_OUTOFMEMORY;
+            for_each_chunk(n, [x, order, threshold, filter, &counts, &candidates](size_t const c, size_t const b, size_t const e) noexcept
+                {
+                    if (!filter)
+                    {
+                        for (auto i = b; i < e; ++i) candidates[i] = static_cast<ULONG>(i);
+                        return;
+                    }
+                    auto p = candidates.get() + counts[c];
+                    for (auto i = b; i < e; ++i)
+                    {
+                        if (!value_before(threshold, x[i], order)) *p++ = static_cast<ULONG>(i);
+                    }
+                });
+            std::nth_element(candidates.get(), candidates.get() + (k - 1), candidates.get() + m, before);
+            std::sort(candidates.get(), candidates.get() + (k - 1), before);
+            std::copy_n(candidates.get(), k, out);
+            return S_OK;
+        }
+
+        inline HRESULT top_k(
+            LPSAFEARRAY const src,
+            size_t k,
+            unique_safearray* const values,
+            unique_safearray& indices,
+            SortOrder const order) noexcept
+        {
+            VARTYPE vt = VT_EMPTY;
+            size_t n = 0;
+            auto hr = vector_info(src, vt, n);
+            if (FAILED(hr)) return hr;
+            k = std::min(k, n);
+
+            return visit_value(vt, [=, &indices](auto const tag) noexcept
+                {
+                    typedef std::remove_pointer_t<decltype(tag)> T;
+                    LONG lb = 0;
+                    auto status = SafeArrayGetLBound(src, 1, &lb);
+                    if (FAILED(status)) return status;
+                    unique_safearray v;
+                    if (values)
+                    {
+                        status = create_vector_like(src, vt, k, v);
+                        if (FAILED(status)) return status;
+                    }
+                    unique_safearray ix;
+                    status = create_vector_like(src, VT_I4, k, ix);
+                    if (FAILED(status)) return status;
+
+                    if (k > 0)
+                    {
+                        SafeArrayData<T> in(src);
+                        if (FAILED(in.Result())) return in.Result();
+                        SafeArrayData<LONG> positions(ix.get());
+                        if (FAILED(positions.Result())) return positions.Result();
+
+                        // Select into the index array, then convert the
+                        // positions to subscripts
+                        static_assert(sizeof(LONG) == sizeof(ULONG));
+                        auto const p = reinterpret_cast<ULONG*>(positions.Data());
+                        status = top_k_positions(in.Data(), n, k, order, p);
+                        if (FAILED(status)) return status;
+
+                        if (values)
+                        {
+                            SafeArrayData<T> out(v.get());
+                            if (FAILED(out.Result())) return out.Result();
+                            for (size_t i = 0; i < k; ++i)
+                            {
+                                if constexpr (std::is_same_v<T, BSTR>)
+                                {
+                                    status = copy_bstr(in[p[i]], out[i]);
+                                    if (FAILED(status)) return status;
+                                }
+                                else out[i] = in[p[i]];
+                            }
+                        }
+                        for (size_t i = 0; i < k; ++i) positions[i] = lb + static_cast<LONG>(p[i]);
+                    }
+
+                    if (values) *values = std::move(v);
+                    indices = std::move(ix);
+                    return S_OK;
+                });
+        }
+    }
+
+    // Top-k selection
+    // Returns the first k elements of a VT_I4, VT_I8, VT_R4, VT_R8, or
+    // VT_BSTR vector in order (a partial sort), as a new vector of the same
+    // type, and their subscripts as a VT_I4 vector. BSTRs are compared
+    // ordinally, by code unit. Equal values are returned in subscript
+    // order. If k is larger than the vector, all elements are returned.
+    // Examples:
+    // unique_safearray best, where;
+    // hr = top_k(scores.get(), 100, best, where);
+    // hr = top_k(names.get(), 10, where, SortOrder::Ascending);
+
+    inline HRESULT top_k(
+        LPSAFEARRAY const src,
+        size_t const k,
+        unique_safearray& values,
+        unique_safearray& indices,
+        SortOrder const order = SortOrder::Descending) noexcept
+    {
+        return detail::top_k(src, k, &values, indices, order);
+    }
+
+    inline HRESULT top_k(
+        LPSAFEARRAY const src,
+        size_t const k,
+        unique_safearray& indices,
+        SortOrder const order = SortOrder::Descending) noexcept
+    {
+        return detail::top_k(src, k, nullptr, indices, order);
+    }
+}
+
+#endif  // COMMEM_TOPK_H
+
+///////////////////////////////////////////////////////////////////////////////
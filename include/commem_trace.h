@@ -0,0 +1,513 @@
+// commem_trace.h /////////////////////////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef COMMEM_TRACE_H
+#define COMMEM_TRACE_H
+
+#include "commem.h"
+#include <algorithm>
+#include <cstdio>
+#include <istream>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace commem {
+
+    // Operations recorded in a trace
+
+    enum class TraceOp : unsigned char { Alloc, Free };
+
+    // A single trace event (32 bytes)
+    // Events are written to trace files in host byte order
+
+    struct TraceEvent {
+        ULONGLONG time;         // Nanoseconds since the recorder was started
+        ULONGLONG id;           // Address of the object
+        ULONGLONG cb;           // Bytes of data (zero if not known)
+        DWORD thread;           // ID of the thread that reported the event
+        VARTYPE vt;             // VARTYPE of a SAFEARRAY
+        ObjectKind kind;
+        TraceOp op;
+    };
+
+    static_assert(sizeof(TraceEvent) == 32);
+
+    // Observer that records allocation events into per-thread ring buffers
+    // Each thread writes to its own ring without taking a lock. When a ring
+    // fills, the writing thread moves its contents to a shared list. Collect
+    // drains all rings and returns the events in time order.
+    // Example:
+    // TraceRecorder rec;
+    // rec.Start();
+    // ... run the workload ...
+    // rec.Stop();
+    // save_trace(file, rec.Collect());
+
+    class TraceRecorder : public AllocationObserver {
+
+        struct Ring {
+            Ring(size_t const capacity, DWORD const threadId) :
+                events(new TraceEvent[capacity]),
+                mask(capacity - 1),
+                thread(threadId) { }
+
+            std::unique_ptr<TraceEvent[]> events;
+            size_t const mask;
+            DWORD const thread;
+            std::atomic<size_t> head{ 0 };  // Written only by the owner
+            std::atomic<size_t> tail{ 0 };  // Written only under drainLock
+            std::mutex drainLock;
+        };
+
+        // Identifies this recorder in the per-thread ring cache
+        static unsigned long long NextId() noexcept
+        {
+            static std::atomic<unsigned long long> s_id{ 0 };
+            return ++s_id;
+        }
+
+        size_t const m_capacity;
+        unsigned long long const m_id = NextId();
+        ULONGLONG m_start = 0;
+        std::atomic<size_t> m_dropped{ 0 };
+        bool m_started = false;
+
+        std::mutex m_lock;                          // Guards the following
+        std::vector<std::unique_ptr<Ring>> m_rings;
+        std::vector<TraceEvent> m_spilled;
+
+        // Return the calling thread's ring, or nullptr if it can't be created
+        Ring* ThreadRing() noexcept
+        {
+            struct Cache {
+                unsigned long long id = 0;
+                Ring* ring = nullptr;
+            };
+            thread_local Cache cache;
+            if (cache.id == m_id) return cache.ring;
+
+            auto const thread = GetCurrentThreadId();
+            try
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                Ring* ring = nullptr;
+                for (auto& r : m_rings)
+                {
+                    if (r->thread == thread) ring = r.get();
+                }
+                if (!ring)
+                {
+                    m_rings.push_back(std::make_unique<Ring>(m_capacity, thread));
+                    ring = m_rings.back().get();
+                }
+                cache = { m_id, ring };
+                return ring;
+            }
+            catch (...)
+            {
+                return nullptr;
+            }
+        }
+
+        // Move the contents of a ring to the shared list
+        void Drain(Ring& ring) noexcept
+        {
+            std::lock_guard<std::mutex> drain(ring.drainLock);
+            auto const t = ring.tail.load(std::memory_order_relaxed);
+            auto const h = ring.head.load(std::memory_order_acquire);
+            try
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (auto i = t; i != h; ++i)
+                    m_spilled.push_back(ring.events[i & ring.mask]);
+            }
+            catch (...)
+            {
+                m_dropped.fetch_add(h - t, std::memory_order_relaxed);
+            }
+            ring.tail.store(h, std::memory_order_release);
+        }
+
+        void Record(TraceOp const op, AllocationEvent const& e) noexcept
+        {
+            auto const ring = ThreadRing();
+            if (!ring)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+
+            // An allocation is stamped when the allocation function returned
+            // and a free when the free function was called, so a free sorts
+            // before any allocation that reuses its address, whichever thread
+            // reports first
+            auto const time = op == TraceOp::Alloc ? e.time + e.duration : e.time;
+            TraceEvent const ev = {
+                time > m_start ? time - m_start : 0,
+                reinterpret_cast<ULONGLONG>(e.p),
+                static_cast<ULONGLONG>(e.cb),
+                ring->thread,
+                e.vt,
+                e.kind,
+                op };
+
+            auto const h = ring->head.load(std::memory_order_relaxed);
+            if (h - ring->tail.load(std::memory_order_acquire) > ring->mask) Drain(*ring);
+            ring->events[h & ring->mask] = ev;
+            ring->head.store(h + 1, std::memory_order_release);
+        }
+
+    public:
+        TraceRecorder(TraceRecorder const&) = delete;
+        TraceRecorder(TraceRecorder&&) = delete;
+        TraceRecorder& operator=(TraceRecorder const&) = delete;
+        TraceRecorder& operator=(TraceRecorder&&) = delete;
+
+        // The capacity of each ring is rounded up to a power of two
+        explicit TraceRecorder(size_t const capacity = 4096) noexcept :
+            m_capacity([capacity]() {
+                size_t n = 2;
+                while (n < capacity) n <<= 1;
+                return n;
+            }()) { }
+
+        ~TraceRecorder() noexcept
+        {
+            Stop();
+        }
+
+        // Begin recording. Return false if the recorder can't be registered.
+        bool Start() noexcept
+        {
+            if (m_started) return true;
+            m_start = detail::now();
+            m_started = add_observer(this);
+            return m_started;
+        }
+
+        // Stop recording. Events recorded so far remain available to Collect.
+        void Stop() noexcept
+        {
+            if (m_started) remove_observer(this);
+            m_started = false;
+        }
+
+        // Number of events lost because memory for them could not be allocated
+        size_t Dropped() const noexcept
+        {
+            return m_dropped.load(std::memory_order_relaxed);
+        }
+
+        // Remove and return all events recorded so far in time order
+        std::vector<TraceEvent> Collect()
+        {
+            std::vector<Ring*> rings;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (auto& r : m_rings) rings.push_back(r.get());
+            }
+            for (auto const r : rings) Drain(*r);
+
+            std::vector<TraceEvent> events;
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                events.swap(m_spilled);
+            }
+            std::stable_sort(events.begin(), events.end(),
+                [](TraceEvent const& a, TraceEvent const& b) { return a.time < b.time; });
+            return events;
+        }
+
+        void OnAlloc(AllocationEvent const& e) noexcept override
+        {
+            Record(TraceOp::Alloc, e);
+        }
+
+        void OnFree(AllocationEvent const& e) noexcept override
+        {
+            Record(TraceOp::Free, e);
+        }
+    };
+
+    // Observer that records a timeline of allocations, frees, and SAFEARRAY
+    // locks, and writes it in the Chrome trace event format (JSON), which can
+    // be loaded into chrome://tracing or the Perfetto UI. Events are appended
+    // to a preallocated buffer without taking a lock; events that arrive after
+    // the buffer is full are dropped.
+    // The timeline shows the time spent in each COM allocation and free
+    // function, each object's lifetime (as an async span keyed by address),
+    // and each SafeArrayData lock as a span on the locking thread.
+
+    class ChromeTraceWriter : public AllocationObserver {
+
+        enum class Op : unsigned char { Alloc, Free, Lock, Unlock };
+
+        struct Record {
+            AllocationEvent e;
+            DWORD thread;
+            Op op;
+            std::atomic<bool> ready;
+        };
+
+        std::unique_ptr<Record[]> m_records;
+        size_t const m_capacity;
+        std::atomic<size_t> m_next{ 0 };
+        bool m_started = false;
+
+        void Append(Op const op, AllocationEvent const& e) noexcept
+        {
+            auto const i = m_next.fetch_add(1, std::memory_order_relaxed);
+            if (i >= m_capacity) return;
+            auto& r = m_records[i];
+            r.e = e;
+            r.thread = GetCurrentThreadId();
+            r.op = op;
+            r.ready.store(true, std::memory_order_release);
+        }
+
+        static char const* KindName(ObjectKind const kind) noexcept
+        {
+            switch (kind)
+            {
+            case ObjectKind::Heap: return "heap";
+            case ObjectKind::BString: return "bstr";
+            case ObjectKind::SafeArray: return "safearray";
+            }
+            return "unknown";
+        }
+
+    public:
+        ChromeTraceWriter(ChromeTraceWriter const&) = delete;
+        ChromeTraceWriter(ChromeTraceWriter&&) = delete;
+        ChromeTraceWriter& operator=(ChromeTraceWriter const&) = delete;
+        ChromeTraceWriter& operator=(ChromeTraceWriter&&) = delete;
+
+        // Throws std::bad_alloc if the buffer can't be allocated
+        explicit ChromeTraceWriter(size_t const capacity = 1 << 18) :
+            m_records(new Record[capacity]()),
+            m_capacity(capacity) { }
+
+        ~ChromeTraceWriter() noexcept
+        {
+            Stop();
+        }
+
+        bool Start() noexcept
+        {
+            if (!m_started) m_started = add_observer(this);
+            return m_started;
+        }
+
+        void Stop() noexcept
+        {
+            if (m_started) remove_observer(this);
+            m_started = false;
+        }
+
+        // Number of events lost because the buffer was full
+        size_t Dropped() const noexcept
+        {
+            auto const n = m_next.load(std::memory_order_relaxed);
+            return n > m_capacity ? n - m_capacity : 0;
+        }
+
+        // Write the events recorded so far as a Chrome trace JSON document
+        HRESULT WriteJson(std::ostream& os) const noexcept
+        {
+            auto const n = std::min(m_next.load(std::memory_order_acquire), m_capacity);
+            ULONGLONG base = ~0ull;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (m_records[i].ready.load(std::memory_order_acquire))
+                    base = std::min(base, m_records[i].e.time);
+            }
+
+            try
+            {
+                char buf[320];
+                auto const us = [base](ULONGLONG const ns) { return (ns - base) / 1000.0; };
+                auto first = true;
+                auto const emit = [&os, &first, &buf]()
+                    {
+                        os << (first ? "\n" : ",\n") << buf;
+                        first = false;
+                    };
+
+                os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+                for (size_t i = 0; i < n; ++i)
+                {
+                    auto const& r = m_records[i];
+                    if (!r.ready.load(std::memory_order_acquire)) continue;
+                    auto const& e = r.e;
+                    auto const kind = KindName(e.kind);
+                    auto const id = reinterpret_cast<ULONGLONG>(e.p);
+                    auto const tid = static_cast<unsigned long>(r.thread);
+                    switch (r.op)
+                    {
+                    case Op::Alloc:
+                        std::snprintf(buf, sizeof(buf),
+                            "{\"name\":\"alloc %s\",\"cat\":\"commem\",\"ph\":\"X\",\"ts\":%.3f,"
+                            "\"dur\":%.3f,\"pid\":1,\"tid\":%lu,\"args\":{\"bytes\":%llu,\"vt\":%u}}",
+                            kind, us(e.time), e.duration / 1000.0, tid,
+                            static_cast<unsigned long long>(e.cb), static_cast<unsigned>(e.vt));
+                        emit();
+                        std::snprintf(buf, sizeof(buf),
+                            "{\"name\":\"%s\",\"cat\":\"lifetime\",\"ph\":\"b\",\"id\":\"0x%llx\","
+                            "\"ts\":%.3f,\"pid\":1,\"tid\":%lu,\"args\":{\"bytes\":%llu}}",
+                            kind, static_cast<unsigned long long>(id), us(e.time + e.duration), tid,
+                            static_cast<unsigned long long>(e.cb));
+                        emit();
+                        break;
+                    case Op::Free:
+                        std::snprintf(buf, sizeof(buf),
+                            "{\"name\":\"%s\",\"cat\":\"lifetime\",\"ph\":\"e\",\"id\":\"0x%llx\","
+                            "\"ts\":%.3f,\"pid\":1,\"tid\":%lu}",
+                            kind, static_cast<unsigned long long>(id), us(e.time), tid);
+                        emit();
+                        std::snprintf(buf, sizeof(buf),
+                            "{\"name\":\"free %s\",\"cat\":\"commem\",\"ph\":\"X\",\"ts\":%.3f,"
+                            "\"dur\":%.3f,\"pid\":1,\"tid\":%lu,\"args\":{\"bytes\":%llu,\"vt\":%u}}",
+                            kind, us(e.time), e.duration / 1000.0, tid,
+                            static_cast<unsigned long long>(e.cb), static_cast<unsigned>(e.vt));
+                        emit();
+                        break;
+                    case Op::Lock:
+                    case Op::Unlock:
+                        std::snprintf(buf, sizeof(buf),
+                            "{\"name\":\"lock %s\",\"cat\":\"commem\",\"ph\":\"%s\",\"ts\":%.3f,"
+                            "\"pid\":1,\"tid\":%lu,\"args\":{\"bytes\":%llu,\"vt\":%u}}",
+                            kind, r.op == Op::Lock ? "B" : "E", us(e.time), tid,
+                            static_cast<unsigned long long>(e.cb), static_cast<unsigned>(e.vt));
+                        emit();
+                        break;
+                    }
+                }
+                os << "\n]}\n";
+                return os ? S_OK : E_FAIL;
+            }
+            catch (...)
+            {
+                return E_FAIL;
+            }
+        }
+
+        void OnAlloc(AllocationEvent const& e) noexcept override
+        {
+            Append(Op::Alloc, e);
+        }
+
+        void OnFree(AllocationEvent const& e) noexcept override
+        {
+            Append(Op::Free, e);
+        }
+
+        void OnLock(AllocationEvent const& e) noexcept override
+        {
+            Append(Op::Lock, e);
+        }
+
+        void OnUnlock(AllocationEvent const& e) noexcept override
+        {
+            Append(Op::Unlock, e);
+        }
+    };
+
+    namespace detail {
+
+        // Trace file header
+        struct TraceHeader {
+            char magic[4];
+            DWORD version;
+            ULONGLONG count;
+        };
+
+        inline constexpr char trace_magic[4] = { 'C', 'M', 'T', 'R' };
+        inline constexpr DWORD trace_version = 1;
+    }
+
+    // Write a trace in binary format
+    inline HRESULT save_trace(
+        std::ostream& os,
+        std::vector<TraceEvent> const& events) noexcept
+    {
+        detail::TraceHeader header = {};
+        std::copy(detail::trace_magic, detail::trace_magic + 4, header.magic);
+        header.version = detail::trace_version;
+        header.count = events.size();
+        try
+        {
+            os.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            os.write(reinterpret_cast<char const*>(events.data()),
+                static_cast<std::streamsize>(events.size() * sizeof(TraceEvent)));
+            return os ? S_OK : E_FAIL;
+        }
+        catch (...)
+        {
+            return E_FAIL;
+        }
+    }
+
+    // Read a trace written by save_trace
+    // Return E_INVALIDARG if the header or an event's kind or operation is
+    // not valid.
+    inline HRESULT load_trace(
+        std::istream& is,
+        std::vector<TraceEvent>& events) noexcept
+    {
+        detail::TraceHeader header = {};
+        try
+        {
+            if (!is.read(reinterpret_cast<char*>(&header), sizeof(header))) return E_FAIL;
+            if (!std::equal(header.magic, header.magic + 4, detail::trace_magic) ||
+                header.version != detail::trace_version) return E_INVALIDARG;
+
+            std::vector<TraceEvent> tmp(static_cast<size_t>(header.count));
+            if (!is.read(reinterpret_cast<char*>(tmp.data()),
+                static_cast<std::streamsize>(tmp.size() * sizeof(TraceEvent)))) return E_FAIL;
+            for (auto const& e : tmp)
+            {
+                if (e.kind > ObjectKind::SafeArray || e.op > TraceOp::Free) return E_INVALIDARG;
+            }
+            events.swap(tmp);
+            return S_OK;
+        }
+        catch (std::bad_alloc const&)
+        {
+            return E_OUTOFMEMORY;
+        }
+        catch (...)
+        {
+            return E_FAIL;
+        }
+    }
+}
+
+#endif  // COMMEM_TRACE_H
+
+///////////////////////////////////////////////////////////////////////////////
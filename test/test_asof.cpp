@@ -0,0 +1,155 @@
+// test_asof.cpp: Tests for asof_join /////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_asof.h"
+#include "test_kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestAsOf: Tests for asof_join
+//
+
+class TestAsOf : public TestKernel { };
+
+TEST_F(TestAsOf, Policies)
+{
+    auto const nan = std::nan("");
+    auto grid = Vector<DATE>(VT_DATE, { 0.5, 1.0, 1.4, 2.0, 3.5, 9.0 }, 1);
+    auto times = Vector<DATE>(VT_DATE, { 1.0, 1.0, 2.0, 3.0 });
+    auto values = Vector<DOUBLE>(VT_R8, { 10.0, 11.0, 20.0, 30.0 });
+    ASSERT_TRUE(grid && times && values);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Backward, HUGE_VAL, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { nan, 11.0, 11.0, 20.0, 30.0, 30.0 }, 0.0);
+    LONG lb = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(r.get(), 1, &lb));
+    EXPECT_EQ(lb, 1);
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Forward, HUGE_VAL, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 10.0, 10.0, 20.0, 20.0, nan, nan }, 0.0);
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Nearest, HUGE_VAL, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 10.0, 11.0, 11.0, 20.0, 30.0, 30.0 }, 0.0);
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Nearest, 0.5, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 10.0, 11.0, 11.0, 20.0, 30.0, nan }, 0.0);
+}
+
+TEST_F(TestAsOf, Series)
+{
+    auto const nan = std::nan("");
+    auto grid = Vector<DATE>(VT_DATE, { 1.0, 2.0, 3.0 });
+    auto t1 = Vector<DATE>(VT_DATE, { 1.5, 2.5 }, 1);
+    auto v1 = Vector<FLOAT>(VT_R4, { 1.0f, 2.0f }, 1);
+    auto t2 = Vector<DATE>(VT_DATE, {});
+    auto v2 = Vector<DOUBLE>(VT_R8, {});
+    ASSERT_TRUE(grid && t1 && v1 && t2 && v2);
+
+    LPSAFEARRAY const times[] = { t1.get(), t2.get() };
+    LPSAFEARRAY const values[] = { v1.get(), v2.get() };
+    unique_safearray r[2];
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times, values, 2, AsOfPolicy::Backward, 1.0, r));
+    auto const a = Values<FLOAT>(r[0].get());
+    ASSERT_EQ(a.size(), 3u);
+    EXPECT_TRUE(std::isnan(a[0]));
+    EXPECT_EQ(a[1], 1.0f);
+    EXPECT_EQ(a[2], 2.0f);
+    ExpectNear(Values<DOUBLE>(r[1].get()), { nan, nan, nan }, 0.0);
+}
+
+TEST_F(TestAsOf, Large)
+{
+    // A grid of several chunks against irregular times, checked against
+    // binary search
+    size_t const n = 200000;
+    size_t const m = 70001;
+    std::vector<DATE> g(n), t(m);
+    std::vector<DOUBLE> v(m);
+    for (size_t i = 0; i < n; ++i) g[i] = static_cast<double>(i) * 0.35;
+    for (size_t j = 0; j < m; ++j)
+    {
+        t[j] = static_cast<double>(j) + static_cast<double>((j * 7919) % 100) / 200.0;
+        v[j] = static_cast<double>(j);
+    }
+    auto grid = Vector<DATE>(VT_DATE, g);
+    auto times = Vector<DATE>(VT_DATE, t);
+    auto values = Vector<DOUBLE>(VT_R8, v);
+    ASSERT_TRUE(grid && times && values);
+
+    unique_safearray back, near;
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Backward, HUGE_VAL, back));
+    ASSERT_HRESULT_SUCCEEDED(asof_join(grid.get(), times.get(), values.get(), AsOfPolicy::Nearest, 0.3, near));
+    auto const b = Values<DOUBLE>(back.get());
+    auto const c = Values<DOUBLE>(near.get());
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto const after = std::upper_bound(t.begin(), t.end(), g[i]) - t.begin();
+        if (after) ASSERT_EQ(b[i], static_cast<double>(after - 1)) << i;
+        else ASSERT_TRUE(std::isnan(b[i])) << i;
+
+        auto best = -1.0;
+        auto d = HUGE_VAL;
+        if (after && g[i] - t[after - 1] <= 0.3)
+        {
+            best = static_cast<double>(after - 1);
+            d = g[i] - t[after - 1];
+        }
+        auto const from = std::lower_bound(t.begin(), t.end(), g[i]) - t.begin();
+        if (static_cast<size_t>(from) < m && t[from] - g[i] < d && t[from] - g[i] <= 0.3) best = static_cast<double>(from);
+        if (best < 0) ASSERT_TRUE(std::isnan(c[i])) << i;
+        else ASSERT_EQ(c[i], best) << i;
+    }
+}
+
+TEST_F(TestAsOf, Errors)
+{
+    auto grid = Vector<DATE>(VT_DATE, { 1.0, 2.0 });
+    auto unsorted = Vector<DATE>(VT_DATE, { 2.0, 1.0 });
+    auto r8 = Vector<DOUBLE>(VT_R8, { 1.0, 2.0 });
+    auto i4 = Vector<LONG>(VT_I4, { 1, 2 });
+    auto shortValues = Vector<DOUBLE>(VT_R8, { 1.0 });
+    ASSERT_TRUE(grid && unsorted && r8 && i4 && shortValues);
+
+    unique_safearray r;
+    EXPECT_EQ(asof_join(grid.get(), grid.get(), r8.get(), AsOfPolicy::Backward, -1.0, r), E_INVALIDARG);
+    EXPECT_EQ(asof_join(grid.get(), unsorted.get(), r8.get(), AsOfPolicy::Backward, 1.0, r), E_INVALIDARG);
+    EXPECT_EQ(asof_join(unsorted.get(), grid.get(), r8.get(), AsOfPolicy::Backward, 1.0, r), E_INVALIDARG);
+    EXPECT_EQ(asof_join(grid.get(), r8.get(), r8.get(), AsOfPolicy::Backward, 1.0, r), DISP_E_BADVARTYPE);
+    EXPECT_EQ(asof_join(grid.get(), grid.get(), i4.get(), AsOfPolicy::Backward, 1.0, r), DISP_E_BADVARTYPE);
+    EXPECT_EQ(asof_join(grid.get(), grid.get(), shortValues.get(), AsOfPolicy::Backward, 1.0, r), E_INVALIDARG);
+    EXPECT_EQ(asof_join(grid.get(), nullptr, nullptr, 1, AsOfPolicy::Backward, 1.0, nullptr), E_POINTER);
+    LPSAFEARRAY values[] = { r8.get() };
+    EXPECT_EQ(asof_join(grid.get(), nullptr, values, 1, AsOfPolicy::Backward, 1.0, &r), E_POINTER);
+    EXPECT_FALSE(r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
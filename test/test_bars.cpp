@@ -0,0 +1,173 @@
+// test_bars.cpp: Tests for BarBuilder ////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_bars.h"
+#include "test_kernel.h"
+#include <cmath>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestBars: Tests for BarBuilder
+//
+// Each test releases the bar arrays before it ends so that the leak checks
+// in TearDown see them freed.
+//
+
+class TestBars : public TestKernel {
+protected:
+    unique_safearray m_open;
+    unique_safearray m_high;
+    unique_safearray m_low;
+    unique_safearray m_close;
+    unique_safearray m_volume;
+    unique_safearray m_count;
+
+    void TearDown() noexcept override
+    {
+        for (auto a : { &m_open, &m_high, &m_low, &m_close, &m_volume, &m_count }) a->reset();
+        TestKernel::TearDown();
+    }
+
+    // Create arrays for bars bars and attach them to builder
+    HRESULT Attach(BarBuilder& builder, DATE const origin, double const interval, ULONG const bars)
+    {
+        m_open = create_safearray_vector(VT_R8, 1, bars);
+        m_high = create_safearray_vector(VT_R8, 1, bars);
+        m_low = create_safearray_vector(VT_R8, 1, bars);
+        m_close = create_safearray_vector(VT_R8, 1, bars);
+        m_volume = create_safearray_vector(VT_R8, 1, bars);
+        m_count = create_safearray_vector(VT_I8, 1, bars);
+        return builder.Attach(origin, interval, m_open.get(), m_high.get(), m_low.get(), m_close.get(), m_volume.get(), m_count.get());
+    }
+};
+
+TEST_F(TestBars, Bars)
+{
+    auto const nan = std::nan("");
+    BarBuilder bars;
+    ASSERT_HRESULT_SUCCEEDED(Attach(bars, 10.0, 1.0, 6));
+
+    auto t = Vector<DATE>(VT_DATE, { 10.0, 10.2, 10.5, 10.9, 13.1, 13.5 });
+    auto p = Vector<DOUBLE>(VT_R8, { 5.0, 7.0, nan, 4.0, 6.0, 6.5 });
+    auto v = Vector<DOUBLE>(VT_R8, { 1.0, 2.0, 100.0, 3.0, 4.0, 5.0 });
+    ASSERT_TRUE(t && p && v);
+    ASSERT_HRESULT_SUCCEEDED(bars.Add(t.get(), p.get(), v.get()));
+    EXPECT_EQ(bars.Bars(), 4u);
+    EXPECT_EQ(Values<DOUBLE>(m_open.get())[0], 5.0);
+    EXPECT_EQ(Values<DOUBLE>(m_high.get())[0], 7.0);
+    EXPECT_EQ(Values<DOUBLE>(m_low.get())[0], 4.0);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[0], 4.0);
+    EXPECT_EQ(Values<DOUBLE>(m_volume.get())[0], 6.0);
+    EXPECT_EQ(Values<LONGLONG>(m_count.get())[0], 3);
+
+    // Empty bars carry the close forward
+    for (size_t i = 1; i < 3; ++i)
+    {
+        EXPECT_EQ(Values<DOUBLE>(m_open.get())[i], 4.0);
+        EXPECT_EQ(Values<DOUBLE>(m_high.get())[i], 4.0);
+        EXPECT_EQ(Values<DOUBLE>(m_low.get())[i], 4.0);
+        EXPECT_EQ(Values<DOUBLE>(m_close.get())[i], 4.0);
+        EXPECT_EQ(Values<DOUBLE>(m_volume.get())[i], 0.0);
+        EXPECT_EQ(Values<LONGLONG>(m_count.get())[i], 0);
+    }
+    EXPECT_EQ(Values<DOUBLE>(m_open.get())[3], 6.0);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[3], 6.5);
+    EXPECT_EQ(Values<LONGLONG>(m_count.get())[3], 2);
+}
+
+TEST_F(TestBars, Incremental)
+{
+    BarBuilder bars;
+    ASSERT_HRESULT_SUCCEEDED(Attach(bars, 0.0, 0.5, 8));
+
+    // The open bar keeps collecting ticks from later batches
+    auto t1 = Vector<DATE>(VT_DATE, { 0.1, 0.6 });
+    auto p1 = Vector<DOUBLE>(VT_R8, { 1.0, 2.0 });
+    auto t2 = Vector<DATE>(VT_DATE, { 0.7, 0.8 });
+    auto p2 = Vector<DOUBLE>(VT_R8, { 3.0, 0.5 });
+    ASSERT_TRUE(t1 && p1 && t2 && p2);
+    ASSERT_HRESULT_SUCCEEDED(bars.Add(t1.get(), p1.get()));
+    ASSERT_HRESULT_SUCCEEDED(bars.Add(t2.get(), p2.get()));
+    EXPECT_EQ(bars.Bars(), 2u);
+    EXPECT_EQ(Values<DOUBLE>(m_high.get())[1], 3.0);
+    EXPECT_EQ(Values<DOUBLE>(m_low.get())[1], 0.5);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[1], 0.5);
+    EXPECT_EQ(Values<DOUBLE>(m_volume.get())[1], 0.0);
+    EXPECT_EQ(Values<LONGLONG>(m_count.get())[1], 3);
+
+    // Quiet intervals are written by Advance
+    ASSERT_HRESULT_SUCCEEDED(bars.Advance(2.2));
+    EXPECT_EQ(bars.Bars(), 4u);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[3], 0.5);
+    EXPECT_EQ(bars.Add(t2.get(), p2.get()), E_INVALIDARG);
+
+    // Ticks after the last bar are rejected whole
+    auto t3 = Vector<DATE>(VT_DATE, { 2.3, 4.0 });
+    ASSERT_TRUE(t3);
+    EXPECT_EQ(bars.Add(t3.get(), p1.get()), DISP_E_BADINDEX);
+    EXPECT_EQ(bars.Bars(), 4u);
+
+    // New arrays continue from the last close
+    ASSERT_HRESULT_SUCCEEDED(Attach(bars, 4.0, 0.5, 4));
+    auto t4 = Vector<DATE>(VT_DATE, { 5.2 });
+    auto p4 = Vector<DOUBLE>(VT_R8, { 9.0 });
+    ASSERT_TRUE(t4 && p4);
+    ASSERT_HRESULT_SUCCEEDED(bars.Add(t4.get(), p4.get()));
+    EXPECT_EQ(bars.Bars(), 3u);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[0], 0.5);
+    EXPECT_EQ(Values<DOUBLE>(m_close.get())[2], 9.0);
+}
+
+TEST_F(TestBars, Errors)
+{
+    BarBuilder bars;
+    auto t = Vector<DATE>(VT_DATE, { 1.0, 0.5 });
+    auto p = Vector<DOUBLE>(VT_R8, { 1.0, 2.0 });
+    auto i4 = Vector<LONG>(VT_I4, { 1, 2 });
+    ASSERT_TRUE(t && p && i4);
+    EXPECT_EQ(bars.Add(t.get(), p.get()), E_UNEXPECTED);
+
+    EXPECT_EQ(Attach(bars, 0.0, 0.0, 4), E_INVALIDARG);
+    ASSERT_HRESULT_SUCCEEDED(Attach(bars, 0.0, 1.0, 4));
+    EXPECT_EQ(bars.Add(t.get(), p.get()), E_INVALIDARG);
+    EXPECT_EQ(bars.Add(p.get(), p.get()), DISP_E_BADVARTYPE);
+    EXPECT_EQ(bars.Add(t.get(), i4.get()), DISP_E_BADVARTYPE);
+    EXPECT_EQ(bars.Add(t.get(), nullptr), E_INVALIDARG);
+    EXPECT_EQ(bars.Bars(), 0u);
+
+    auto small = create_safearray_vector(VT_R8, 1, 2);
+    ASSERT_TRUE(small);
+    EXPECT_EQ(bars.Attach(0.0, 1.0, m_open.get(), m_high.get(), m_low.get(), m_close.get(), small.get(), m_count.get()), E_INVALIDARG);
+    EXPECT_EQ(bars.Attach(0.0, 1.0, m_open.get(), m_high.get(), m_low.get(), m_close.get(), m_volume.get(), m_volume.get()), DISP_E_BADVARTYPE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
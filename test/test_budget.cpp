@@ -0,0 +1,253 @@
+// test_budget.cpp: Tests for commem::AllocationBudget ////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#include "commem_budget.h"
+#include "test_commem.h"
+#include <thread>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestBudget: Tests for AllocationBudget and BudgetScope
+//
+
+class TestBudget : public TestCommem { };
+
+TEST_F(TestBudget, NoScope)
+{
+    AllocationBudget budget({ 0, 1 });
+    auto a = alloc_heap(100);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(budget.Bytes(), 0u);
+}
+
+TEST_F(TestBudget, HardBytes)
+{
+    AllocationBudget budget({ 0, 100 });
+    BudgetScope scope(budget);
+
+    auto a = alloc_heap(60);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(budget.Bytes(), 60u);
+    EXPECT_EQ(budget.Objects(), 1u);
+
+    auto b = alloc_heap(60);
+    ASSERT_FALSE(b);
+    EXPECT_EQ(budget.Rejected(), 1u);
+    EXPECT_EQ(budget.Bytes(), 60u);
+
+    a.reset();
+    EXPECT_EQ(budget.Bytes(), 0u);
+    EXPECT_EQ(budget.Objects(), 0u);
+    b = alloc_heap(60);
+    ASSERT_TRUE(b);
+    EXPECT_EQ(budget.PeakBytes(), 60u);
+}
+
+TEST_F(TestBudget, HardObjects)
+{
+    BudgetLimits limits;
+    limits.hardObjects = 2;
+    AllocationBudget budget(limits);
+    BudgetScope scope(budget);
+
+    auto a = alloc_bstr(L"A");
+    auto b = alloc_bstr(L"B");
+    auto c = alloc_bstr(L"C");
+    ASSERT_TRUE(a);
+    ASSERT_TRUE(b);
+    ASSERT_FALSE(c);
+    EXPECT_EQ(budget.Objects(), 2u);
+    EXPECT_EQ(budget.Bytes(), 2 * sizeof(OLECHAR));
+}
+
+TEST_F(TestBudget, SafeArraySize)
+{
+    AllocationBudget budget({ 0, 1000 });
+    BudgetScope scope(budget);
+
+    auto a = create_safearray_vector(VT_R8, 0, 100);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(budget.Bytes(), 800u);
+
+    SAFEARRAYBOUND bounds[2] = { { 10, 0 }, { 10, 0 } };
+    auto b = create_safearray(VT_I4, 2, bounds);
+    ASSERT_FALSE(b);
+    EXPECT_EQ(budget.Bytes(), 800u);
+}
+
+TEST_F(TestBudget, SoftLimit)
+{
+    struct Budget : AllocationBudget {
+        using AllocationBudget::AllocationBudget;
+        int calls = 0;
+        void OnSoftLimit() noexcept override { ++calls; }
+    } budget({ 100 });
+    BudgetScope scope(budget);
+
+    auto a = alloc_heap(80);
+    EXPECT_EQ(budget.calls, 0);
+    auto b = alloc_heap(80);
+    ASSERT_TRUE(b);
+    EXPECT_EQ(budget.calls, 1);
+    auto c = alloc_heap(80);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(budget.calls, 1);
+
+    b.reset();
+    c.reset();
+    c = alloc_heap(80);
+    EXPECT_EQ(budget.calls, 2);
+}
+
+TEST_F(TestBudget, Nested)
+{
+    AllocationBudget outer({ 0, 1000 });
+    AllocationBudget inner({ 0, 100 });
+    BudgetScope outerScope(outer);
+    unique_heap<void*> a;
+    {
+        BudgetScope innerScope(inner);
+        a = alloc_heap(80);
+        ASSERT_TRUE(a);
+        EXPECT_EQ(inner.Bytes(), 80u);
+        EXPECT_EQ(outer.Bytes(), 80u);
+
+        ASSERT_FALSE(alloc_heap(80));
+        EXPECT_EQ(outer.Bytes(), 80u);
+
+        BudgetScope again(inner);
+        auto b = alloc_heap(10);
+        EXPECT_EQ(inner.Bytes(), 90u);
+    }
+    auto c = alloc_heap(500);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(outer.Bytes(), 580u);
+
+    a.reset();
+    EXPECT_EQ(inner.Bytes(), 0u);
+    EXPECT_EQ(outer.Bytes(), 500u);
+}
+
+TEST_F(TestBudget, Deep)
+{
+    // Past max_depth budgets, the ones in between are skipped but the
+    // outermost (per-thread) budget is still charged
+    AllocationBudget outer({ 0, 100 });
+    AllocationBudget middle[5] = {
+        AllocationBudget({}), AllocationBudget({}), AllocationBudget({}), AllocationBudget({}), AllocationBudget({}) };
+    BudgetScope outerScope(outer);
+    BudgetScope s0(middle[0]), s1(middle[1]), s2(middle[2]), s3(middle[3]), s4(middle[4]);
+    static_assert(detail::BudgetTracker::max_depth == 4);
+
+    auto a = alloc_heap(60);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(outer.Bytes(), 60u);
+    EXPECT_EQ(middle[4].Bytes(), 60u);
+    EXPECT_EQ(middle[3].Bytes(), 60u);
+    EXPECT_EQ(middle[2].Bytes(), 60u);
+    EXPECT_EQ(middle[1].Bytes(), 0u);
+    EXPECT_EQ(middle[0].Bytes(), 0u);
+
+    EXPECT_FALSE(alloc_heap(60));
+    EXPECT_EQ(outer.Rejected(), 1u);
+    EXPECT_EQ(middle[4].Bytes(), 60u);
+
+    a.reset();
+    for (auto const& b : middle) EXPECT_EQ(b.Bytes(), 0u);
+    EXPECT_EQ(outer.Bytes(), 0u);
+}
+
+TEST_F(TestBudget, CrossThread)
+{
+    AllocationBudget budget({ 0, 1 << 20 });
+    std::vector<unique_bstr> v;
+    {
+        BudgetScope scope(budget);
+        for (int i = 0; i < 100; ++i) v.push_back(alloc_bstr(nullptr, 10));
+    }
+    shared_bstr s(alloc_bstr(nullptr, 10));
+    EXPECT_EQ(budget.Objects(), 100u);
+
+    std::thread([&v]() { v.clear(); }).join();
+    EXPECT_EQ(budget.Objects(), 0u);
+    EXPECT_EQ(budget.Bytes(), 0u);
+}
+
+TEST_F(TestBudget, Release)
+{
+    AllocationBudget outer({ 0, 1 << 20 });
+    AllocationBudget inner({ 0, 1 << 20 });
+    LPSAFEARRAY psa = nullptr;
+    BSTR b = nullptr;
+    {
+        BudgetScope s1(outer);
+        BudgetScope s2(inner);
+        auto a = create_safearray_vector(VT_R8, 0, 10);
+        auto s = alloc_bstr(nullptr, 10);
+        ASSERT_TRUE(a && s);
+        EXPECT_EQ(inner.Objects(), 2u);
+
+        // Released objects stay charged until budget_release
+        psa = a.release();
+        EXPECT_EQ(outer.Objects(), 2u);
+        budget_release(psa);
+        EXPECT_EQ(outer.Objects(), 1u);
+        EXPECT_EQ(inner.Bytes(), 10 * sizeof(OLECHAR));
+
+        budget_release(s.get());
+        b = s.release();
+        budget_release(b);
+        budget_release(nullptr);
+    }
+    EXPECT_EQ(outer.Objects(), 0u);
+    EXPECT_EQ(outer.Bytes(), 0u);
+    EXPECT_EQ(inner.Objects(), 0u);
+    EXPECT_EQ(inner.Bytes(), 0u);
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayDestroy(psa));
+    SysFreeString(b);
+}
+
+TEST_F(TestBudget, Threads)
+{
+    AllocationBudget budget({ 0, 0, 0, 1000 });
+    auto f = [&budget]()
+        {
+            BudgetScope scope(budget);
+            for (int i = 0; i < 10000; ++i) alloc_bstr(L"ABCD");
+        };
+    std::thread t1(f);
+    std::thread t2(f);
+    t1.join();
+    t2.join();
+    EXPECT_EQ(budget.Objects(), 0u);
+    EXPECT_EQ(budget.Rejected(), 0u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
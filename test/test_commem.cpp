@@ -25,7 +25,7 @@
 // IN THE SOFTWARE.
 //
 
-#include "commem.h"
+#include "commem_pool.h"
 #include "test_commem.h"
 #include <unordered_map>
 
@@ -275,12 +275,13 @@ int main(int argc, char** argv)
 
         s_dwMainThreadId = GetCurrentThreadId();
 
-        // Allocate and free a BSTR
+        // Warm up the COM allocators
         // The first BSTR allocation sets up some internal data in COM
         // (typically, 440 bytes). Do it here so that it doesn't interfere with
         // per-test memory accounting during the BSTR tests.
 
-        SysFreeString(SysAllocString(L"1234"));
+        if (FAILED(commem::warm_up(commem::WarmUpProfile())))
+            throw std::runtime_error("warm_up failed");
 
         return RUN_ALL_TESTS();
     }
@@ -0,0 +1,164 @@
+// test_distinct.cpp: Tests for distinct and value_counts /////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_distinct.h"
+#include "test_kernel.h"
+#include <cmath>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestDistinct: Tests for distinct and value_counts
+//
+
+class TestDistinct : public TestKernel { };
+
+TEST_F(TestDistinct, Small)
+{
+    auto a = Vector<LONG>(VT_I4, { 5, 3, 5, 1, 3, 5 }, 1);
+    ASSERT_TRUE(a);
+
+    unique_safearray values, counts;
+    ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts));
+    EXPECT_EQ(Values<LONG>(values.get()), (std::vector<LONG>{ 5, 3, 1 }));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 3, 2, 1 }));
+    LONG lb = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(values.get(), 1, &lb));
+    EXPECT_EQ(lb, 1);
+
+    ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts, DistinctOrder::Ascending));
+    EXPECT_EQ(Values<LONG>(values.get()), (std::vector<LONG>{ 1, 3, 5 }));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 1, 2, 3 }));
+
+    ASSERT_HRESULT_SUCCEEDED(distinct(a.get(), values));
+    EXPECT_EQ(Values<LONG>(values.get()), (std::vector<LONG>{ 5, 3, 1 }));
+}
+
+TEST_F(TestDistinct, Sorted)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0, 1.0, 2.0, 4.0, 4.0, 4.0, std::nan(""), std::nan("") });
+    ASSERT_TRUE(a);
+
+    unique_safearray values, counts;
+    ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts));
+    auto const v = Values<DOUBLE>(values.get());
+    ASSERT_EQ(v.size(), 4u);
+    EXPECT_EQ(v[2], 4.0);
+    EXPECT_TRUE(std::isnan(v[3]));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 2, 1, 3, 2 }));
+}
+
+TEST_F(TestDistinct, Large)
+{
+    // Sorted and unsorted inputs across several chunks, with few and with
+    // all distinct values
+    std::vector<LONGLONG> sorted(3 * detail::kernel_chunk + 11);
+    for (size_t i = 0; i < sorted.size(); ++i) sorted[i] = static_cast<LONGLONG>(i / 7);
+    std::vector<LONGLONG> shuffled(sorted.size());
+    for (size_t i = 0; i < shuffled.size(); ++i) shuffled[i] = static_cast<LONGLONG>((i * 7919) % 30011);
+
+    std::vector<LONGLONG> few(sorted.size());
+    for (size_t i = 0; i < few.size(); ++i) few[i] = static_cast<LONGLONG>((i * 7919) % 5);
+    std::vector<LONGLONG> unique(sorted.size());
+    for (size_t i = 0; i < unique.size(); ++i) unique[i] = static_cast<LONGLONG>((i * 7919) % unique.size());
+
+    for (auto const* x : { &sorted, &shuffled, &few, &unique })
+    {
+        std::map<LONGLONG, LONGLONG> expected;
+        std::vector<LONGLONG> firstSeen;
+        for (auto const v : *x)
+        {
+            if (!expected[v]++) firstSeen.push_back(v);
+        }
+
+        auto a = Vector<LONGLONG>(VT_I8, *x);
+        ASSERT_TRUE(a);
+        unique_safearray values, counts;
+        ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts));
+        EXPECT_EQ(Values<LONGLONG>(values.get()), firstSeen);
+
+        ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts, DistinctOrder::Ascending));
+        auto const v = Values<LONGLONG>(values.get());
+        auto const c = Values<LONGLONG>(counts.get());
+        ASSERT_EQ(v.size(), expected.size());
+        size_t j = 0;
+        for (auto const& e : expected)
+        {
+            ASSERT_EQ(v[j], e.first);
+            ASSERT_EQ(c[j], e.second);
+            ++j;
+        }
+    }
+}
+
+TEST_F(TestDistinct, BString)
+{
+    auto a = create_safearray_vector(VT_BSTR, 0, 1000);
+    ASSERT_TRUE(a);
+    {
+        SafeArrayData<BSTR> s(a.get());
+        for (size_t i = 0; i < s.Size(); ++i)
+        {
+            if (i % 10 == 9) continue;  // Null, the same as empty
+            auto const text = i % 10 == 8 ? std::wstring() : L"item" + std::to_wstring(i % 10);
+            s[i] = SysAllocString(text.c_str());
+        }
+    }
+
+    unique_safearray values, counts;
+    ASSERT_HRESULT_SUCCEEDED(value_counts(a.get(), values, counts, DistinctOrder::Ascending));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 200, 100, 100, 100, 100, 100, 100, 100, 100 }));
+    SafeArrayData<BSTR> v(values.get());
+    ASSERT_HRESULT_SUCCEEDED(v.Result());
+    EXPECT_EQ(SysStringLen(v[0]), 0u);
+    EXPECT_STREQ(v[1], L"item0");
+    EXPECT_STREQ(v[8], L"item7");
+}
+
+TEST_F(TestDistinct, Errors)
+{
+    unique_safearray values, counts;
+    EXPECT_EQ(distinct(nullptr, values), E_INVALIDARG);
+    auto v = create_safearray_vector(VT_VARIANT, 0, 3);
+    ASSERT_TRUE(v);
+    EXPECT_EQ(value_counts(v.get(), values, counts), DISP_E_BADVARTYPE);
+    EXPECT_FALSE(values);
+    EXPECT_FALSE(counts);
+
+    auto e = create_safearray_vector(VT_I4, 0, 0);
+    ASSERT_TRUE(e);
+    ASSERT_HRESULT_SUCCEEDED(value_counts(e.get(), values, counts));
+    EXPECT_TRUE(Values<LONG>(values.get()).empty());
+}
+
+///////////////////////////////////////////////////////////////////////////////
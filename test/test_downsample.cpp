@@ -0,0 +1,141 @@
+// test_downsample.cpp: Tests for downsample //////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_downsample.h"
+#include "test_kernel.h"
+#include <cmath>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestDownsample: Tests for downsample
+//
+
+class TestDownsample : public TestKernel { };
+
+TEST_F(TestDownsample, LTTB)
+{
+    auto x = Vector<DOUBLE>(VT_R8, { 0, 1, 2, 3, 4, 5, 6, 7 }, 1);
+    auto y = Vector<DOUBLE>(VT_R8, { 0, 1, 0, 9, 0, 1, -8, 0 }, 1);
+    ASSERT_TRUE(x && y);
+
+    unique_safearray xs, ys;
+    ASSERT_HRESULT_SUCCEEDED(downsample(x.get(), y.get(), 5, DownsampleMethod::LTTB, xs, ys));
+    EXPECT_EQ(Values<DOUBLE>(xs.get()), (std::vector<DOUBLE>{ 0, 2, 3, 6, 7 }));
+    EXPECT_EQ(Values<DOUBLE>(ys.get()), (std::vector<DOUBLE>{ 0, 0, 9, -8, 0 }));
+    LONG lb = -1;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(xs.get(), 1, &lb));
+    EXPECT_EQ(lb, 0);
+
+    // A short series is returned whole
+    ASSERT_HRESULT_SUCCEEDED(downsample(x.get(), y.get(), 8, DownsampleMethod::LTTB, xs, ys));
+    EXPECT_EQ(Values<DOUBLE>(ys.get()), Values<DOUBLE>(y.get()));
+}
+
+TEST_F(TestDownsample, MinMax)
+{
+    auto const nan = std::nan("");
+    auto x = Vector<DATE>(VT_DATE, { 0, 1, 2, 3, 4, 5, 6, 7, 8 });
+    auto y = Vector<DOUBLE>(VT_R8, { 5, 1, 9, 2, 2, 2, nan, nan, nan });
+    ASSERT_TRUE(x && y);
+
+    unique_safearray xs, ys;
+    ASSERT_HRESULT_SUCCEEDED(downsample(x.get(), y.get(), 6, DownsampleMethod::MinMax, xs, ys));
+    VARTYPE vt = VT_EMPTY;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetVartype(xs.get(), &vt));
+    EXPECT_EQ(vt, VT_DATE);
+    EXPECT_EQ(Values<DATE>(xs.get()), (std::vector<DATE>{ 1, 2, 3, 6 }));
+    auto const v = Values<DOUBLE>(ys.get());
+    ASSERT_EQ(v.size(), 4u);
+    EXPECT_EQ(v[0], 1.0);
+    EXPECT_EQ(v[1], 9.0);
+    EXPECT_EQ(v[2], 2.0);
+    EXPECT_TRUE(std::isnan(v[3]));
+}
+
+TEST_F(TestDownsample, Large)
+{
+    // Several series of a million points, reduced in parallel
+    size_t const n = 1000000;
+    std::vector<DOUBLE> xv(n), a(n), b(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        xv[i] = static_cast<double>(i);
+        a[i] = std::sin(static_cast<double>(i) * 1e-4);
+        b[i] = static_cast<double>((i * 7919) % 1000);
+    }
+    b[123457] = 5000.0;
+    auto x = Vector<DOUBLE>(VT_R8, xv);
+    auto ya = Vector<DOUBLE>(VT_R8, a);
+    auto yb = Vector<DOUBLE>(VT_R8, b);
+    ASSERT_TRUE(x && ya && yb);
+
+    LPSAFEARRAY const ys[] = { ya.get(), yb.get() };
+    unique_safearray xs[2], results[2];
+    ASSERT_HRESULT_SUCCEEDED(downsample(x.get(), ys, 2, 2000, DownsampleMethod::LTTB, xs, results));
+    for (size_t i = 0; i < 2; ++i)
+    {
+        auto const v = Values<DOUBLE>(xs[i].get());
+        ASSERT_EQ(v.size(), 2000u);
+        EXPECT_EQ(v.front(), 0.0);
+        EXPECT_EQ(v.back(), static_cast<double>(n - 1));
+        for (size_t j = 1; j < v.size(); ++j) ASSERT_LT(v[j - 1], v[j]);
+    }
+    auto const peak = Values<DOUBLE>(results[1].get());
+    EXPECT_NE(std::find(peak.begin(), peak.end(), 5000.0), peak.end());
+
+    ASSERT_HRESULT_SUCCEEDED(downsample(x.get(), ys, 2, 2000, DownsampleMethod::MinMax, xs, results));
+    auto const sine = Values<DOUBLE>(results[0].get());
+    EXPECT_LE(sine.size(), 2000u);
+    EXPECT_EQ(*std::max_element(sine.begin(), sine.end()), *std::max_element(a.begin(), a.end()));
+    EXPECT_EQ(*std::min_element(sine.begin(), sine.end()), *std::min_element(a.begin(), a.end()));
+}
+
+TEST_F(TestDownsample, Errors)
+{
+    auto x = Vector<DOUBLE>(VT_R8, { 0, 1, 2, 3 });
+    auto y = Vector<DOUBLE>(VT_R8, { 0, 1, 2, 3 });
+    auto i4 = Vector<LONG>(VT_I4, { 0, 1, 2, 3 });
+    auto shifted = Vector<DOUBLE>(VT_R8, { 0, 1, 2, 3 }, 1);
+    ASSERT_TRUE(x && y && i4 && shifted);
+
+    unique_safearray xs, ys;
+    EXPECT_EQ(downsample(x.get(), y.get(), 2, DownsampleMethod::LTTB, xs, ys), E_INVALIDARG);
+    EXPECT_EQ(downsample(x.get(), y.get(), 1, DownsampleMethod::MinMax, xs, ys), E_INVALIDARG);
+    EXPECT_EQ(downsample(i4.get(), y.get(), 3, DownsampleMethod::LTTB, xs, ys), DISP_E_BADVARTYPE);
+    EXPECT_EQ(downsample(x.get(), i4.get(), 3, DownsampleMethod::LTTB, xs, ys), DISP_E_BADVARTYPE);
+    EXPECT_EQ(downsample(x.get(), shifted.get(), 3, DownsampleMethod::LTTB, xs, ys), E_INVALIDARG);
+    EXPECT_EQ(downsample(x.get(), nullptr, 1, 3, DownsampleMethod::LTTB, nullptr, nullptr), E_POINTER);
+    EXPECT_FALSE(xs);
+    EXPECT_FALSE(ys);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,177 @@
+// test_executor.cpp: Tests for commem::Executor //////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#include "commem_executor.h"
+#include "test_commem.h"
+#include <numeric>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestExecutor: Tests for Executor, parallel_for, and host schedulers
+//
+
+class TestExecutor : public TestCommem { };
+
+TEST_F(TestExecutor, NotStarted)
+{
+    Executor ex;
+    EXPECT_EQ(ex.Threads(), 0u);
+    size_t calls = 0;
+    ex.ParallelFor(0, 100000, [&calls](size_t b, size_t e) noexcept { ++calls; EXPECT_EQ(e - b, 100000u); });
+    EXPECT_EQ(calls, 1u);
+}
+
+TEST_F(TestExecutor, CoversRange)
+{
+    ExecutorOptions options;
+    options.threads = 4;
+    options.grain = 100;
+    options.pin = false;
+    Executor ex;
+    ASSERT_HRESULT_SUCCEEDED(ex.Start(options));
+    EXPECT_EQ(ex.Threads(), 4u);
+    EXPECT_GE(ex.Nodes(), 1u);
+    EXPECT_EQ(ex.Start(options), E_UNEXPECTED);
+
+    std::vector<std::atomic<int>> hits(100003);
+    std::atomic<size_t> largest{ 0 };
+    ex.ParallelFor(3, hits.size(), [&hits, &largest](size_t b, size_t e) noexcept
+        {
+            for (auto i = b; i < e; ++i) hits[i].fetch_add(1);
+            auto m = largest.load();
+            while (m < e - b && !largest.compare_exchange_weak(m, e - b)) { }
+        });
+    for (size_t i = 0; i < hits.size(); ++i) ASSERT_EQ(hits[i].load(), i < 3 ? 0 : 1) << i;
+    EXPECT_LE(largest.load(), 100u);
+}
+
+TEST_F(TestExecutor, Nested)
+{
+    ExecutorOptions options;
+    options.threads = 3;
+    options.grain = 10;
+    options.pin = false;
+    Executor ex;
+    ASSERT_HRESULT_SUCCEEDED(ex.Start(options));
+
+    std::atomic<size_t> sum{ 0 };
+    ex.ParallelFor(0, 100, [&ex, &sum](size_t b, size_t e) noexcept
+        {
+            for (auto i = b; i < e; ++i)
+            {
+                EXPECT_LT(ex.CurrentNode(), ex.Nodes() + 1);
+                ex.ParallelFor(0, 100, [&sum](size_t b2, size_t e2) noexcept { sum.fetch_add(e2 - b2); }, 7);
+            }
+        });
+    EXPECT_EQ(sum.load(), 10000u);
+    EXPECT_EQ(ex.CurrentNode(), ex.Nodes());
+}
+
+TEST_F(TestExecutor, Pinned)
+{
+    ExecutorOptions options;
+    options.grain = 1000;
+    Executor ex;
+    ASSERT_HRESULT_SUCCEEDED(ex.Start(options));
+    EXPECT_GE(ex.Threads(), 1u);
+
+    std::vector<double> v(1 << 20);
+    ex.ParallelFor(0, v.size(), [&v](size_t b, size_t e) noexcept { std::iota(v.begin() + b, v.begin() + e, static_cast<double>(b)); });
+    EXPECT_EQ(v[12345], 12345.0);
+    ex.Stop();
+    EXPECT_EQ(ex.Threads(), 0u);
+}
+
+TEST_F(TestExecutor, HostScheduler)
+{
+    struct Scheduler : HostScheduler {
+        std::vector<std::thread> threads;
+        std::atomic<size_t> submitted{ 0 };
+        void Submit(void (*run)(void*) noexcept, void* context) noexcept override
+        {
+            ++submitted;
+            threads.emplace_back([run, context]() { run(context); });
+        }
+        size_t Concurrency() const noexcept override { return 4; }
+    } scheduler;
+
+    set_host_scheduler(&scheduler);
+    std::vector<std::atomic<int>> hits(10000);
+    parallel_for(0, hits.size(), [&hits](size_t b, size_t e) noexcept
+        {
+            for (auto i = b; i < e; ++i) hits[i].fetch_add(1);
+        }, 100);
+    set_host_scheduler(nullptr);
+    for (auto& t : scheduler.threads) t.join();
+
+    EXPECT_EQ(scheduler.submitted.load(), 3u);
+    for (auto const& h : hits) ASSERT_EQ(h.load(), 1);
+}
+
+TEST_F(TestExecutor, SaturatedHost)
+{
+    // The host's threads are all busy, so helpers run only after the call
+    struct Scheduler : HostScheduler {
+        std::vector<std::pair<void (*)(void*) noexcept, void*>> queued;
+        void Submit(void (*run)(void*) noexcept, void* context) noexcept override
+        {
+            queued.emplace_back(run, context);
+        }
+        size_t Concurrency() const noexcept override { return 4; }
+    } scheduler;
+
+    set_host_scheduler(&scheduler);
+    std::vector<int> hits(10000);
+    parallel_for(0, hits.size(), [&hits](size_t b, size_t e) noexcept
+        {
+            for (auto i = b; i < e; ++i) ++hits[i];
+        }, 100);
+    set_host_scheduler(nullptr);
+    for (auto const& h : hits) ASSERT_EQ(h, 1);
+
+    ASSERT_EQ(scheduler.queued.size(), 3u);
+    for (auto const& q : scheduler.queued) q.first(q.second);
+    for (auto const& h : hits) ASSERT_EQ(h, 1);
+}
+
+TEST_F(TestExecutor, Shared)
+{
+    auto const ex = shared_executor();
+    ASSERT_NE(ex, nullptr);
+    EXPECT_EQ(start_shared_executor(ExecutorOptions()), S_FALSE);
+    EXPECT_EQ(shared_executor(), ex);
+
+    std::atomic<size_t> sum{ 0 };
+    parallel_for(0, 1000000, [&sum](size_t b, size_t e) noexcept { sum.fetch_add(e - b); });
+    EXPECT_EQ(sum.load(), 1000000u);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,203 @@
+// test_gather.cpp: Tests for gather, scatter, and permute ////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_budget.h"
+#include "commem_gather.h"
+#include "test_kernel.h"
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestGather: Tests for gather, scatter, and permute
+//
+
+class TestGather : public TestKernel {
+protected:
+
+    static std::vector<std::wstring> Text(LPSAFEARRAY const psa)
+    {
+        SafeArrayData<BSTR> data(psa);
+        std::vector<std::wstring> result;
+        for (auto const b : data) result.emplace_back(b ? b : L"");
+        return result;
+    }
+};
+
+TEST_F(TestGather, Columns)
+{
+    auto names = Strings({ L"a", L"b", L"c", L"d" }, 1);
+    auto prices = Vector<DOUBLE>(VT_R8, { 1.5, 2.5, 3.5, 4.5 }, 1);
+    auto dates = Vector<DATE>(VT_DATE, { 45000.0, 45001.0, 45002.0, 45003.0 }, 1);
+    auto flags = Vector<VARIANT_BOOL>(VT_BOOL, { VARIANT_TRUE, VARIANT_FALSE, VARIANT_TRUE, VARIANT_FALSE }, 1);
+    auto index = Vector<LONG>(VT_I4, { 4, 1, 4, 2 });
+    ASSERT_TRUE(names && prices && dates && flags && index);
+
+    LPSAFEARRAY columns[] = { names.get(), prices.get(), dates.get(), flags.get() };
+    unique_safearray results[4];
+    ASSERT_HRESULT_SUCCEEDED(gather(index.get(), columns, 4, results));
+    EXPECT_EQ(Text(results[0].get()), (std::vector<std::wstring>{ L"d", L"a", L"d", L"b" }));
+    EXPECT_EQ(Values<DOUBLE>(results[1].get()), (std::vector<DOUBLE>{ 4.5, 1.5, 4.5, 2.5 }));
+    EXPECT_EQ(Values<DATE>(results[2].get()), (std::vector<DATE>{ 45003.0, 45000.0, 45003.0, 45001.0 }));
+    EXPECT_EQ(Values<VARIANT_BOOL>(results[3].get()), (std::vector<VARIANT_BOOL>{ VARIANT_FALSE, VARIANT_TRUE, VARIANT_FALSE, VARIANT_FALSE }));
+    LONG lb = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(results[0].get(), 1, &lb));
+    EXPECT_EQ(lb, 1);
+
+    // The source keeps its strings
+    EXPECT_EQ(Text(names.get()), (std::vector<std::wstring>{ L"a", L"b", L"c", L"d" }));
+}
+
+TEST_F(TestGather, Strings)
+{
+    auto names = Strings({ L"a", nullptr, L"c" });
+    auto index = Vector<LONG>(VT_I4, { 2, 1, 0, 2 });
+    ASSERT_TRUE(names && index);
+    // Keep an odd byte length
+    SafeArrayData<BSTR> data(names.get());
+    SysFreeString(data[0]);
+    data[0] = SysAllocStringByteLen("abc", 3);
+    ASSERT_TRUE(data[0]);
+
+    // The array owns the copies, so only the array is charged
+    AllocationBudget budget({ 0, 0, 0, 1 });
+    {
+        BudgetScope scope(budget);
+        for (int i = 0; i < 3; ++i)
+        {
+            unique_safearray result;
+            ASSERT_HRESULT_SUCCEEDED(gather(index.get(), names.get(), result));
+            EXPECT_EQ(budget.Objects(), 1u);
+            SafeArrayData<BSTR> out(result.get());
+            EXPECT_EQ(out[1], nullptr);
+            EXPECT_EQ(SysStringByteLen(out[2]), 3u);
+            EXPECT_EQ(std::memcmp(out[2], "abc", 3), 0);
+        }
+    }
+    EXPECT_EQ(budget.Objects(), 0u);
+    EXPECT_EQ(budget.Bytes(), 0u);
+    EXPECT_EQ(budget.Rejected(), 0u);
+}
+
+TEST_F(TestGather, Large)
+{
+    auto const n = 3 * detail::kernel_chunk + 5;
+    std::vector<LONGLONG> values(n);
+    std::vector<LONGLONG> index(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        values[i] = static_cast<LONGLONG>(i * 3);
+        index[i] = static_cast<LONGLONG>((i * 7919) % n);
+    }
+    auto a = Vector<LONGLONG>(VT_I8, values);
+    auto f = Vector<FLOAT>(VT_R4, std::vector<FLOAT>(values.begin(), values.end()));
+    auto ix = Vector<LONGLONG>(VT_I8, index);
+    ASSERT_TRUE(a && f && ix);
+
+    LPSAFEARRAY columns[] = { a.get(), f.get() };
+    unique_safearray results[2];
+    ASSERT_HRESULT_SUCCEEDED(gather(ix.get(), columns, 2, results));
+    auto const r = Values<LONGLONG>(results[0].get());
+    auto const rf = Values<FLOAT>(results[1].get());
+    for (size_t i = 0; i < n; ++i)
+    {
+        ASSERT_EQ(r[i], values[index[i]]);
+        ASSERT_EQ(rf[i], static_cast<FLOAT>(values[index[i]]));
+    }
+}
+
+TEST_F(TestGather, Scatter)
+{
+    auto values = Vector<LONG>(VT_I4, { 10, 20, 30 });
+    auto names = Strings({ L"x", L"y", L"z" });
+    auto index = Vector<LONG>(VT_I4, { 3, 0, 2 });
+    auto target = Vector<LONG>(VT_I4, { 0, 0, 0, 0 });
+    auto targetNames = Strings({ L"a", L"b", L"c", L"d" });
+    ASSERT_TRUE(values && names && index && target && targetNames);
+
+    LPSAFEARRAY columns[] = { values.get(), names.get() };
+    LPSAFEARRAY targets[] = { target.get(), targetNames.get() };
+    ASSERT_HRESULT_SUCCEEDED(scatter(index.get(), columns, 2, targets));
+    EXPECT_EQ(Values<LONG>(target.get()), (std::vector<LONG>{ 20, 0, 30, 10 }));
+    EXPECT_EQ(Text(targetNames.get()), (std::vector<std::wstring>{ L"y", L"b", L"z", L"x" }));
+    EXPECT_EQ(Text(names.get()), (std::vector<std::wstring>{ L"x", L"y", L"z" }));
+
+    auto twice = Vector<LONG>(VT_I4, { 1, 1, 2 });
+    ASSERT_TRUE(twice);
+    EXPECT_EQ(scatter(twice.get(), columns, 2, targets), E_INVALIDARG);
+    EXPECT_EQ(Values<LONG>(target.get()), (std::vector<LONG>{ 20, 0, 30, 10 }));
+}
+
+TEST_F(TestGather, Permute)
+{
+    unique_safearray table[] = {
+        Strings({ L"a", L"b", L"c" }),
+        Vector<DOUBLE>(VT_R8, { 1.0, 2.0, 3.0 }) };
+    auto order = Vector<LONG>(VT_I4, { 2, 0, 1 });
+    ASSERT_TRUE(table[0] && table[1] && order);
+    BSTR c = nullptr;
+    {
+        SafeArrayData<BSTR> s(table[0].get());
+        c = s[2];
+    }
+
+    ASSERT_HRESULT_SUCCEEDED(permute(order.get(), table, 2));
+    EXPECT_EQ(Text(table[0].get()), (std::vector<std::wstring>{ L"c", L"a", L"b" }));
+    EXPECT_EQ(Values<DOUBLE>(table[1].get()), (std::vector<DOUBLE>{ 3.0, 1.0, 2.0 }));
+    {
+        // The string was moved, not copied
+        SafeArrayData<BSTR> s(table[0].get());
+        EXPECT_EQ(s[0], c);
+    }
+
+    auto notPermutation = Vector<LONG>(VT_I4, { 0, 0, 1 });
+    ASSERT_TRUE(notPermutation);
+    EXPECT_EQ(permute(notPermutation.get(), table, 2), E_INVALIDARG);
+}
+
+TEST_F(TestGather, Errors)
+{
+    auto a = Vector<LONG>(VT_I4, { 1, 2, 3 });
+    auto b = Vector<LONG>(VT_I4, { 1, 2 });
+    auto index = Vector<LONG>(VT_I4, { 0, 3 });
+    auto strings = Strings({ L"0" });
+    auto v = create_safearray_vector(VT_VARIANT, 0, 3);
+    ASSERT_TRUE(a && b && index && strings && v);
+
+    unique_safearray results[2];
+    EXPECT_EQ(gather(index.get(), a.get(), results[0]), DISP_E_BADINDEX);
+    EXPECT_EQ(gather(strings.get(), a.get(), results[0]), DISP_E_BADVARTYPE);
+    EXPECT_EQ(gather(index.get(), v.get(), results[0]), DISP_E_BADVARTYPE);
+    LPSAFEARRAY columns[] = { a.get(), b.get() };
+    EXPECT_EQ(gather(b.get(), columns, 2, results), E_INVALIDARG);
+    EXPECT_FALSE(results[0]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
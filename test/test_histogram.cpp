@@ -0,0 +1,137 @@
+// test_histogram.cpp: Tests for histogram ////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_histogram.h"
+#include "test_kernel.h"
+#include <cmath>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestHistogram: Tests for histogram
+//
+
+class TestHistogram : public TestKernel { };
+
+TEST_F(TestHistogram, Uniform)
+{
+    auto const nan = std::nan("");
+    auto a = Vector<DOUBLE>(VT_R8, { 0.0, 0.5, 1.0, 2.5, 3.99, 4.0, -1.0, 7.0, nan }, 1);
+    ASSERT_TRUE(a);
+
+    unique_safearray counts;
+    HistogramOutliers outliers;
+    ASSERT_HRESULT_SUCCEEDED(histogram(a.get(), 0.0, 4.0, 4, counts, BinScale::Uniform, &outliers));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 2, 1, 1, 2 }));
+    EXPECT_EQ(outliers.below, 1u);
+    EXPECT_EQ(outliers.above, 1u);
+    EXPECT_EQ(outliers.nan, 1u);
+    LONG lb = -1;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(counts.get(), 1, &lb));
+    EXPECT_EQ(lb, 0);
+
+    auto i = Vector<LONG>(VT_I4, { 1, 2, 3, 4, 5 });
+    ASSERT_TRUE(i);
+    ASSERT_HRESULT_SUCCEEDED(histogram(i.get(), 1.0, 5.0, 2, counts));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 2, 3 }));
+}
+
+TEST_F(TestHistogram, Log)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 1.5, 15.0, 150.0, 250.0, 999.0, 0.0, -3.0 });
+    ASSERT_TRUE(a);
+
+    unique_safearray counts;
+    HistogramOutliers outliers;
+    ASSERT_HRESULT_SUCCEEDED(histogram(a.get(), 1.0, 1000.0, 3, counts, BinScale::Log, &outliers));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 1, 1, 3 }));
+    EXPECT_EQ(outliers.below, 2u);
+    EXPECT_EQ(histogram(a.get(), 0.0, 1000.0, 3, counts, BinScale::Log), E_INVALIDARG);
+}
+
+TEST_F(TestHistogram, Edges)
+{
+    auto a = Vector<FLOAT>(VT_R4, { 0.0f, 1.0f, 9.0f, 10.0f, 50.0f, 100.0f, 101.0f });
+    auto edges = Vector<DOUBLE>(VT_R8, { 0.0, 10.0, 100.0 });
+    ASSERT_TRUE(a && edges);
+
+    unique_safearray counts;
+    HistogramOutliers outliers;
+    ASSERT_HRESULT_SUCCEEDED(histogram(a.get(), edges.get(), counts, &outliers));
+    EXPECT_EQ(Values<LONGLONG>(counts.get()), (std::vector<LONGLONG>{ 3, 3 }));
+    EXPECT_EQ(outliers.above, 1u);
+
+    auto bad = Vector<DOUBLE>(VT_R8, { 0.0, 10.0, 10.0 });
+    ASSERT_TRUE(bad);
+    EXPECT_EQ(histogram(a.get(), bad.get(), counts), E_INVALIDARG);
+}
+
+TEST_F(TestHistogram, Large)
+{
+    // Enough elements for several private histograms, and enough bins to
+    // limit how many there are
+    auto const n = 5 * detail::kernel_chunk + 3;
+    std::vector<LONGLONG> x(n);
+    for (size_t i = 0; i < n; ++i) x[i] = static_cast<LONGLONG>(i % 1000);
+    auto a = Vector<LONGLONG>(VT_I8, x);
+    ASSERT_TRUE(a);
+
+    unique_safearray counts;
+    ASSERT_HRESULT_SUCCEEDED(histogram(a.get(), 0.0, 1000.0, 1000, counts));
+    auto const c = Values<LONGLONG>(counts.get());
+    LONGLONG total = 0;
+    for (size_t j = 0; j < c.size(); ++j)
+    {
+        ASSERT_EQ(c[j], static_cast<LONGLONG>(n / 1000 + (j < n % 1000 ? 1 : 0))) << j;
+        total += c[j];
+    }
+    EXPECT_EQ(total, static_cast<LONGLONG>(n));
+
+    ASSERT_HRESULT_SUCCEEDED(histogram(a.get(), 0.0, 1000.0, 1 << 21, counts));
+    EXPECT_EQ(Values<LONGLONG>(counts.get())[(1 << 21) / 1000], static_cast<LONGLONG>(n / 1000 + 1));
+}
+
+TEST_F(TestHistogram, Errors)
+{
+    unique_safearray counts;
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0 });
+    auto v = create_safearray_vector(VT_BSTR, 0, 3);
+    ASSERT_TRUE(a && v);
+    EXPECT_EQ(histogram(nullptr, 0.0, 1.0, 4, counts), E_INVALIDARG);
+    EXPECT_EQ(histogram(v.get(), 0.0, 1.0, 4, counts), DISP_E_BADVARTYPE);
+    EXPECT_EQ(histogram(a.get(), 1.0, 1.0, 4, counts), E_INVALIDARG);
+    EXPECT_EQ(histogram(a.get(), 0.0, 1.0, 0, counts), E_INVALIDARG);
+    EXPECT_EQ(histogram(a.get(), 0.0, 1.0, ~size_t{ 0 }, counts), E_INVALIDARG);
+    EXPECT_EQ(histogram(a.get(), v.get(), counts), DISP_E_BADVARTYPE);
+    EXPECT_FALSE(counts);
+}
+
+///////////////////////////////////////////////////////////////////////////////
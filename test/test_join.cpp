@@ -0,0 +1,157 @@
+// test_join.cpp: Tests for hash_join /////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_join.h"
+#include "test_kernel.h"
+#include <map>
+#include <utility>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestJoin: Tests for hash_join
+//
+
+class TestJoin : public TestKernel { };
+
+TEST_F(TestJoin, Inner)
+{
+    auto left = Vector<LONG>(VT_I4, { 3, 1, 4, 1, 5 }, 1);
+    auto right = Vector<LONG>(VT_I4, { 1, 2, 3, 1 });
+    ASSERT_TRUE(left && right);
+
+    unique_safearray l, r;
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Inner, l, r));
+    EXPECT_EQ(Values<LONG>(l.get()), (std::vector<LONG>{ 1, 2, 2, 4, 4 }));
+    EXPECT_EQ(Values<LONG>(r.get()), (std::vector<LONG>{ 2, 0, 3, 0, 3 }));
+    LONG lb = -1;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(l.get(), 1, &lb));
+    EXPECT_EQ(lb, 0);
+}
+
+TEST_F(TestJoin, LeftSemiAnti)
+{
+    auto left = Strings({ L"b", L"", L"a", L"ab", L"a" });
+    auto right = Strings({ L"a", L"ab", L"c", L"a", L"" }, 2);
+    ASSERT_TRUE(left && right);
+    {
+        // A null BSTR matches an empty one
+        SafeArrayData<BSTR> data(right.get());
+        SysFreeString(data[4]);
+        data[4] = nullptr;
+    }
+
+    unique_safearray l, r;
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Left, l, r, VT_I8));
+    EXPECT_EQ(Values<LONGLONG>(l.get()), (std::vector<LONGLONG>{ 0, 1, 2, 2, 3, 4, 4 }));
+    EXPECT_EQ(Values<LONGLONG>(r.get()), (std::vector<LONGLONG>{ -1, 6, 2, 5, 3, 2, 5 }));
+
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Semi, l, r));
+    EXPECT_EQ(Values<LONG>(l.get()), (std::vector<LONG>{ 1, 2, 3, 4 }));
+    EXPECT_FALSE(r);
+
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Anti, l, r));
+    EXPECT_EQ(Values<LONG>(l.get()), (std::vector<LONG>{ 0 }));
+    EXPECT_FALSE(r);
+}
+
+TEST_F(TestJoin, Large)
+{
+    // Enough rows for several partitions and probe chunks
+    size_t const n = 300000;
+    size_t const m = 50000;
+    std::vector<LONGLONG> lv(n), rv(m);
+    for (size_t i = 0; i < n; ++i) lv[i] = static_cast<LONGLONG>((i * 7919) % 60000);
+    for (size_t i = 0; i < m; ++i) rv[i] = static_cast<LONGLONG>((i * 104729) % 45000);
+    auto left = Vector<LONGLONG>(VT_I8, lv);
+    auto right = Vector<LONGLONG>(VT_I8, rv);
+    ASSERT_TRUE(left && right);
+
+    std::map<LONGLONG, std::vector<LONG>> rows;
+    for (size_t i = 0; i < m; ++i) rows[rv[i]].push_back(static_cast<LONG>(i));
+    std::vector<LONG> el, er;
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto const it = rows.find(lv[i]);
+        if (it == rows.end())
+        {
+            el.push_back(static_cast<LONG>(i));
+            er.push_back(-1);
+            continue;
+        }
+        for (auto const j : it->second)
+        {
+            el.push_back(static_cast<LONG>(i));
+            er.push_back(j);
+        }
+    }
+
+    unique_safearray l, r;
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Left, l, r));
+    EXPECT_EQ(Values<LONG>(l.get()), el);
+    EXPECT_EQ(Values<LONG>(r.get()), er);
+}
+
+TEST_F(TestJoin, Empty)
+{
+    auto left = Vector<LONG>(VT_I4, { 1, 2 });
+    auto right = Vector<LONG>(VT_I4, {});
+    ASSERT_TRUE(left && right);
+
+    unique_safearray l, r;
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Inner, l, r));
+    EXPECT_TRUE(Values<LONG>(l.get()).empty());
+    EXPECT_TRUE(Values<LONG>(r.get()).empty());
+    ASSERT_HRESULT_SUCCEEDED(hash_join(left.get(), right.get(), JoinType::Anti, l, r));
+    EXPECT_EQ(Values<LONG>(l.get()), (std::vector<LONG>{ 0, 1 }));
+}
+
+TEST_F(TestJoin, Errors)
+{
+    auto i4 = Vector<LONG>(VT_I4, { 1, 2 });
+    auto i8 = Vector<LONGLONG>(VT_I8, { 1, 2 });
+    auto r8 = Vector<DOUBLE>(VT_R8, { 1.0, 2.0 });
+    auto negative = Vector<LONG>(VT_I4, { 1, 2 }, -1);
+    ASSERT_TRUE(i4 && i8 && r8 && negative);
+
+    unique_safearray l, r;
+    EXPECT_EQ(hash_join(i4.get(), i8.get(), JoinType::Inner, l, r), DISP_E_TYPEMISMATCH);
+    EXPECT_EQ(hash_join(r8.get(), r8.get(), JoinType::Inner, l, r), DISP_E_BADVARTYPE);
+    EXPECT_EQ(hash_join(i4.get(), i4.get(), JoinType::Inner, l, r, VT_R8), DISP_E_BADVARTYPE);
+    EXPECT_EQ(hash_join(i4.get(), negative.get(), JoinType::Left, l, r), E_INVALIDARG);
+    EXPECT_EQ(hash_join(nullptr, i4.get(), JoinType::Inner, l, r), E_INVALIDARG);
+    EXPECT_FALSE(l);
+    EXPECT_FALSE(r);
+    ASSERT_HRESULT_SUCCEEDED(hash_join(i4.get(), negative.get(), JoinType::Inner, l, r));
+    EXPECT_EQ(Values<LONG>(r.get()), (std::vector<LONG>{ -1, 0 }));
+}
+
+///////////////////////////////////////////////////////////////////////////////
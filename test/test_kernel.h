@@ -0,0 +1,84 @@
+// test_kernel.h: Base class for tests of the SAFEARRAY kernels ///////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#pragma once
+#ifndef TEST_KERNEL_H
+#define TEST_KERNEL_H
+
+#include "commem_array.h"
+#include "test_commem.h"
+#include <cmath>
+#include <vector>
+
+// Fixture helpers for building input vectors and reading results
+
+class TestKernel : public TestCommem {
+protected:
+
+    // Create a vector holding values
+    template <typename T>
+    static commem::unique_safearray Vector(VARTYPE const vt, std::vector<T> const& values, LONG const lb = 0)
+    {
+        auto a = commem::create_safearray_vector(vt, lb, static_cast<ULONG>(values.size()));
+        if (!a) return a;
+        commem::SafeArrayData<T> data(a.get());
+        for (size_t i = 0; i < values.size(); ++i) data[i] = values[i];
+        return a;
+    }
+
+    // Create a VT_BSTR vector holding copies of strings (nullptr for a null BSTR)
+    static commem::unique_safearray Strings(std::vector<wchar_t const*> const& values, LONG const lb = 0)
+    {
+        auto a = commem::create_safearray_vector(VT_BSTR, lb, static_cast<ULONG>(values.size()));
+        if (!a) return a;
+        commem::SafeArrayData<BSTR> data(a.get());
+        for (size_t i = 0; i < values.size(); ++i) data[i] = SysAllocString(values[i]);
+        return a;
+    }
+
+    template <typename T>
+    static std::vector<T> Values(LPSAFEARRAY const psa)
+    {
+        commem::SafeArrayData<T> data(psa);
+        return std::vector<T>(data.begin(), data.end());
+    }
+
+    // Compare values, treating NaNs as equal
+    static void ExpectNear(std::vector<double> const& actual, std::vector<double> const& expected, double const tolerance)
+    {
+        ASSERT_EQ(actual.size(), expected.size());
+        for (size_t i = 0; i < actual.size(); ++i)
+        {
+            if (std::isnan(expected[i])) EXPECT_TRUE(std::isnan(actual[i])) << i;
+            else EXPECT_NEAR(actual[i], expected[i], tolerance) << i;
+        }
+    }
+};
+
+#endif  // TEST_KERNEL_H
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,151 @@
+// test_lifetime.cpp: Tests for commem::LifetimeHistograms ////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#include "commem_lifetime.h"
+#include "test_commem.h"
+#include <sstream>
+#include <thread>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestLifetime: Tests for LifetimeHistograms
+//
+
+class TestLifetime : public TestCommem { };
+
+TEST_F(TestLifetime, Buckets)
+{
+    for (size_t b = 0; b + 1 < LifetimeHistogram::num_buckets; ++b)
+    {
+        auto const lo = LifetimeHistogram::LowerBound(b);
+        auto const hi = LifetimeHistogram::LowerBound(b + 1);
+        ASSERT_LT(lo, hi);
+        ASSERT_EQ(LifetimeHistogram::Bucket(lo), b);
+        ASSERT_EQ(LifetimeHistogram::Bucket(hi - 1), b);
+        if (lo >= LifetimeHistogram::sub_buckets) { ASSERT_LE((hi - lo) * 8, lo); }
+    }
+    ASSERT_EQ(LifetimeHistogram::Bucket(~0ull), LifetimeHistogram::num_buckets - 1);
+}
+
+TEST_F(TestLifetime, SizeClass)
+{
+    EXPECT_EQ(LifetimeHistograms::SizeClass(0), 0u);
+    EXPECT_EQ(LifetimeHistograms::SizeClass(16), 0u);
+    EXPECT_EQ(LifetimeHistograms::SizeClass(17), 1u);
+    EXPECT_EQ(LifetimeHistograms::SizeClass(4096), 8u);
+    EXPECT_EQ(LifetimeHistograms::SizeClass(1 << 30), LifetimeHistograms::num_size_classes - 1);
+}
+
+TEST_F(TestLifetime, Record)
+{
+    LifetimeHistograms lifetimes(1);
+    ASSERT_TRUE(lifetimes.Start());
+    {
+        auto a = alloc_heap(100);
+        ASSERT_TRUE(a);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    for (int i = 0; i < 10; ++i) alloc_bstr(nullptr, 4);
+    lifetimes.Stop();
+
+    // Heap blocks don't report a size when freed; it comes from the side table
+    auto const h = lifetimes.Snapshot(ObjectKind::Heap, LifetimeHistograms::SizeClass(100));
+    ASSERT_EQ(h.count, 1u);
+    EXPECT_GE(h.sum, 2000000u);
+    EXPECT_GE(h.Quantile(0.5), 1800000u);
+
+    auto const b = lifetimes.Snapshot(ObjectKind::BString, LifetimeHistograms::SizeClass(4 * sizeof(OLECHAR)));
+    EXPECT_EQ(b.count, 10u);
+    EXPECT_EQ(lifetimes.Dropped(), 0u);
+}
+
+TEST_F(TestLifetime, Sampling)
+{
+    LifetimeHistograms lifetimes(4);
+    ASSERT_EQ(lifetimes.SampleRate(), 4u);
+    ASSERT_TRUE(lifetimes.Start());
+    std::vector<unique_bstr> v;
+    for (int i = 0; i < 1000; ++i) v.push_back(alloc_bstr(nullptr, 1));
+    v.clear();
+    lifetimes.Stop();
+
+    auto const h = lifetimes.Snapshot(ObjectKind::BString, 0);
+    EXPECT_GT(h.count, 100u);
+    EXPECT_LT(h.count, 500u);
+}
+
+TEST_F(TestLifetime, TableFull)
+{
+    LifetimeHistograms lifetimes(1, 8);
+    ASSERT_TRUE(lifetimes.Start());
+    std::vector<unique_bstr> v;
+    for (int i = 0; i < 20; ++i) v.push_back(alloc_bstr(nullptr, 1));
+    v.clear();
+    lifetimes.Stop();
+
+    EXPECT_EQ(lifetimes.Dropped(), 12u);
+    EXPECT_EQ(lifetimes.Snapshot(ObjectKind::BString, 0).count, 8u);
+}
+
+TEST_F(TestLifetime, ReusedAddress)
+{
+    // An address created again before its free is recorded takes over the
+    // old entry rather than leaving a second one behind
+    LifetimeHistograms lifetimes(1, 8);
+    int object = 0;
+    for (ULONGLONG t = 0; t < 20; ++t)
+    {
+        lifetimes.OnAlloc(AllocationEvent{ ObjectKind::Heap, VT_EMPTY, &object, 64, t * 100, 0 });
+    }
+    lifetimes.OnFree(AllocationEvent{ ObjectKind::Heap, VT_EMPTY, &object, 0, 2000, 0 });
+    lifetimes.OnFree(AllocationEvent{ ObjectKind::Heap, VT_EMPTY, &object, 0, 3000, 0 });
+    EXPECT_EQ(lifetimes.Dropped(), 0u);
+
+    auto const h = lifetimes.Snapshot(ObjectKind::Heap, LifetimeHistograms::SizeClass(64));
+    EXPECT_EQ(h.count, 1u);
+    EXPECT_EQ(h.sum, 100u);
+}
+
+TEST_F(TestLifetime, Metrics)
+{
+    LifetimeHistograms lifetimes(1);
+    ASSERT_TRUE(lifetimes.Start());
+    create_safearray_vector(VT_R8, 0, 100);
+    lifetimes.Stop();
+
+    std::ostringstream os;
+    lifetimes.WriteMetrics(os);
+    auto const text = os.str();
+    EXPECT_EQ(text.find("# TYPE commem_lifetime_seconds histogram\n"), 0u);
+    EXPECT_NE(text.find("commem_lifetime_seconds_bucket{kind=\"safearray\",size=\"1024\",le=\"+Inf\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("commem_lifetime_seconds_count{kind=\"safearray\",size=\"1024\"} 1\n"), std::string::npos);
+    EXPECT_EQ(text.find("kind=\"bstr\""), std::string::npos);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,421 @@
+// test_pool.cpp: Tests for commem pooled memory and warm_up //////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+#include "commem_budget.h"
+#include "commem_pool.h"
+#include "test_commem.h"
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestPool: Tests for pooled heap blocks and BSTRs, and warm_up
+//
+// Each test restores the built-in size classes and trims the main thread's
+// cache before it ends so that the leak checks in TearDown see every block
+// freed.
+//
+
+class TestPool : public TestCommem {
+protected:
+    void TearDown() noexcept override
+    {
+        reset_pool_classes();
+        pool_trim();
+        TestCommem::TearDown();
+    }
+};
+
+TEST_F(TestPool, HitAndMiss)
+{
+    auto const before = pool_stats();
+    void* first = nullptr;
+    {
+        auto a = pool_alloc_heap(100);
+        ASSERT_TRUE(a);
+        EXPECT_EQ(a.get_deleter().capacity, 128u);
+        first = a.get();
+    }
+    auto after = pool_stats();
+    EXPECT_EQ(after.misses - before.misses, 1u);
+    EXPECT_EQ(after.cachedBlocks - before.cachedBlocks, 1u);
+
+    auto b = pool_alloc_heap<LPOLESTR>(120);
+    ASSERT_TRUE(b);
+    EXPECT_EQ(static_cast<void*>(b.get()), first);
+    after = pool_stats();
+    EXPECT_EQ(after.hits - before.hits, 1u);
+    EXPECT_EQ(after.cachedBlocks, before.cachedBlocks);
+}
+
+TEST_F(TestPool, Large)
+{
+    auto a = pool_alloc_heap(100000);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(a.get_deleter().capacity, 0u);
+    auto const cached = pool_stats().cachedBlocks;
+    a.reset();
+    EXPECT_EQ(pool_stats().cachedBlocks, cached);
+}
+
+TEST_F(TestPool, BString)
+{
+    BSTR first = nullptr;
+    {
+        auto a = pool_alloc_bstr(L"ABCD");
+        ASSERT_TRUE(a);
+        EXPECT_EQ(SysStringLen(a.get()), 4u);
+        EXPECT_EQ(std::wstring(a.get()), L"ABCD");
+        first = a.get();
+    }
+
+    auto b = pool_alloc_bstr(L"XY");
+    ASSERT_TRUE(b);
+    EXPECT_EQ(b.get(), first);
+    EXPECT_EQ(SysStringLen(b.get()), 2u);
+    EXPECT_EQ(b.get()[2], 0);
+    EXPECT_EQ(std::wstring(b.get()), L"XY");
+
+    auto c = pool_alloc_bstr(nullptr, 5);
+    ASSERT_TRUE(c);
+    EXPECT_EQ(SysStringLen(c.get()), 5u);
+    EXPECT_FALSE(pool_alloc_bstr(nullptr));
+
+    shared_bstr d(std::move(b));
+    EXPECT_EQ(SysStringLen(d.get()), 2u);
+}
+
+TEST_F(TestPool, Depth)
+{
+    std::vector<pooled_heap<void*>> v;
+    for (int i = 0; i < 300; ++i) v.push_back(pool_alloc_heap(4096));
+    auto const cached = pool_stats().cachedBlocks;
+    v.clear();
+    EXPECT_EQ(pool_stats().cachedBlocks - cached, detail::default_pool_depth(4096));
+}
+
+TEST_F(TestPool, CrossThread)
+{
+    auto a = pool_alloc_bstr(L"ABCD");
+    ASSERT_TRUE(a);
+    auto const p = a.get();
+    auto const before = pool_stats();
+    std::thread([&a]()
+        {
+            a.reset();
+            EXPECT_EQ(detail::current_cache, nullptr);
+        }).join();
+    EXPECT_EQ(pool_stats().remoteFrees - before.remoteFrees, 1u);
+
+    // The next allocation takes the block back from the remote list
+    auto b = pool_alloc_bstr(L"WXYZ");
+    EXPECT_EQ(b.get(), p);
+    EXPECT_EQ(pool_stats().hits - before.hits, 1u);
+}
+
+TEST_F(TestPool, ProducerConsumer)
+{
+    std::vector<pooled_heap<void*>> v;
+    std::thread([&v]()
+        {
+            for (int i = 0; i < 1000; ++i) v.push_back(pool_alloc_heap(24));
+        }).join();
+
+    // The allocating thread has exited, so its cache frees remote blocks
+    v.clear();
+    EXPECT_EQ(pool_stats().cachedBlocks, 0u);
+}
+
+TEST_F(TestPool, RemoteThreads)
+{
+    std::vector<pooled_bstr> v;
+    for (int i = 0; i < 1000; ++i) v.push_back(pool_alloc_bstr(L"ABC"));
+    auto const before = pool_stats();
+    std::thread t1([&v]() { for (size_t i = 0; i < 500; ++i) v[i].reset(); });
+    std::thread t2([&v]() { for (size_t i = 500; i < 1000; ++i) v[i].reset(); });
+    t1.join();
+    t2.join();
+    EXPECT_EQ(pool_stats().remoteFrees - before.remoteFrees, 1000u);
+
+    auto const depth = detail::default_pool_depth(16);
+    for (size_t i = 0; i < depth; ++i) v[i] = pool_alloc_bstr(L"ABC");
+    EXPECT_EQ(pool_stats().hits - before.hits, depth);
+}
+
+TEST_F(TestPool, Observers)
+{
+    struct Observer : AllocationObserver {
+        size_t allocs = 0;
+        size_t frees = 0;
+        size_t bytes = 0;
+        void OnAlloc(AllocationEvent const& e) noexcept override { ++allocs; bytes += e.cb; }
+        void OnFree(AllocationEvent const&) noexcept override { ++frees; }
+    } obs;
+
+    ASSERT_TRUE(add_observer(&obs));
+    pool_alloc_bstr(L"ABCD");
+    pool_alloc_heap(10);
+    ASSERT_TRUE(remove_observer(&obs));
+    EXPECT_EQ(obs.allocs, 2u);
+    EXPECT_EQ(obs.frees, 2u);
+    EXPECT_EQ(obs.bytes, 4 * sizeof(OLECHAR) + 10);
+}
+
+TEST_F(TestPool, Budget)
+{
+    AllocationBudget budget({ 0, 100 });
+    BudgetScope scope(budget);
+    auto a = pool_alloc_heap(60);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(budget.Bytes(), 60u);
+    EXPECT_FALSE(pool_alloc_heap(60));
+    a.reset();
+    EXPECT_EQ(budget.Bytes(), 0u);
+}
+
+TEST_F(TestPool, WarmUp)
+{
+    WarmUpProfile profile;
+    profile.heap = { { 64, 10 }, { 1 << 20, 5 } };
+    profile.bstr = { { 20, 1000 } };
+    profile.safearrays = { VT_R8, VT_BSTR };
+    ASSERT_HRESULT_SUCCEEDED(warm_up(profile));
+
+    auto const cache = detail::current_cache;
+    ASSERT_NE(cache, nullptr);
+    EXPECT_EQ(cache->Count(ObjectKind::Heap, 3), 10u);
+    EXPECT_EQ(cache->Count(ObjectKind::BString, 1), detail::default_pool_depth(32));
+
+    auto const before = pool_stats();
+    std::vector<pooled_heap<void*>> v;
+    for (int i = 0; i < 10; ++i) v.push_back(pool_alloc_heap(50));
+    EXPECT_EQ(pool_stats().hits - before.hits, 10u);
+    EXPECT_EQ(pool_stats().misses, before.misses);
+}
+
+TEST_F(TestPool, ProfileFromTrace)
+{
+    auto const t = GetCurrentThreadId();
+    std::vector<TraceEvent> events = {
+        { 0, 1, 40, t, VT_EMPTY, ObjectKind::Heap, TraceOp::Alloc },
+        { 1, 2, 40, t, VT_EMPTY, ObjectKind::Heap, TraceOp::Alloc },
+        { 2, 1, 0, t, VT_EMPTY, ObjectKind::Heap, TraceOp::Free },
+        { 3, 3, 40, t, VT_EMPTY, ObjectKind::Heap, TraceOp::Alloc },
+        { 4, 4, 40, t + 1, VT_EMPTY, ObjectKind::Heap, TraceOp::Alloc },
+        { 5, 5, 10, t, VT_EMPTY, ObjectKind::BString, TraceOp::Alloc },
+        { 6, 6, 1 << 20, t, VT_EMPTY, ObjectKind::BString, TraceOp::Alloc },
+        { 7, 7, 80, t, VT_I4, ObjectKind::SafeArray, TraceOp::Alloc },
+        { 8, 8, 80, t, VT_I4, ObjectKind::SafeArray, TraceOp::Alloc },
+    };
+
+    auto const profile = profile_from_trace(events);
+    ASSERT_EQ(profile.heap.size(), 1u);
+    EXPECT_EQ(profile.heap[0].first, 48u);
+    EXPECT_EQ(profile.heap[0].second, 2u);
+    ASSERT_EQ(profile.bstr.size(), 1u);
+    EXPECT_EQ(profile.bstr[0].first, 16u);
+    EXPECT_EQ(profile.bstr[0].second, 1u);
+    ASSERT_EQ(profile.safearrays.size(), 1u);
+    EXPECT_EQ(profile.safearrays[0], VT_I4);
+}
+
+TEST_F(TestPool, SetClasses)
+{
+    PoolClasses classes;
+    classes.heap = { { 24, 4 }, { 4096, 8 } };
+    classes.bstr = { { 48, 16 } };
+
+    auto a = pool_alloc_heap(100);
+    ASSERT_TRUE(a);
+    EXPECT_EQ(a.get_deleter().capacity, 128u);
+
+    ASSERT_EQ(set_pool_classes(classes), S_OK);
+    EXPECT_EQ(set_pool_classes(classes), S_FALSE);
+    EXPECT_EQ(pool_classes().heap, classes.heap);
+
+    // No class has the capacity of a, so it is freed to the system
+    auto const cached = pool_stats().cachedBlocks;
+    a.reset();
+    EXPECT_EQ(pool_stats().cachedBlocks, cached);
+
+    auto b = pool_alloc_heap(20);
+    EXPECT_EQ(b.get_deleter().capacity, 24u);
+    b.reset();
+    EXPECT_EQ(pool_stats().cachedBlocks, cached + 1);
+    auto c = pool_alloc_bstr(nullptr, 60);
+    EXPECT_EQ(c.get_deleter().capacity, 0u);
+
+    classes.bstr = { { 64, 1 }, { 48, 1 } };
+    EXPECT_EQ(set_pool_classes(classes), E_INVALIDARG);
+    classes.bstr = { { 60, 1 } };
+    EXPECT_EQ(set_pool_classes(classes), E_INVALIDARG);
+    classes.bstr = {};
+    EXPECT_EQ(set_pool_classes(classes), E_INVALIDARG);
+}
+
+TEST_F(TestPool, SetClassesDuringRemoteFrees)
+{
+    // The same class indices have different capacities in the two tables
+    PoolClasses small = pool_classes();
+    PoolClasses large = small;
+    small.heap.clear();
+    large.heap.clear();
+    for (size_t i = 1; i <= detail::max_pool_classes; ++i)
+    {
+        small.heap.push_back({ 32 * i, 64 });
+        large.heap.push_back({ 64 * i, 64 });
+    }
+
+    std::atomic<bool> done{ false };
+    std::mutex lock;
+    std::vector<pooled_heap<char*>> handoff;
+    std::thread freer([&]()
+        {
+            while (!done.load())
+            {
+                std::vector<pooled_heap<char*>> v;
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    v.swap(handoff);
+                }
+                v.clear();
+                std::this_thread::yield();
+            }
+        });
+
+    for (int i = 0; i < 500; ++i)
+    {
+        ASSERT_HRESULT_SUCCEEDED(set_pool_classes(i % 2 ? large : small));
+        std::vector<pooled_heap<char*>> v;
+        for (size_t j = 0; j < 8 * detail::max_pool_classes; ++j)
+        {
+            size_t const cb = (i % 2 ? 64 : 32) * (j % detail::max_pool_classes + 1) - 8;
+            auto a = pool_alloc_heap<char*>(cb);
+            ASSERT_TRUE(a);
+            std::memset(a.get(), 0xCD, std::max(cb, a.get_deleter().capacity));
+            v.push_back(std::move(a));
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& a : v) handoff.push_back(std::move(a));
+    }
+    done.store(true);
+    freer.join();
+    handoff.clear();
+    pool_trim();
+    EXPECT_EQ(pool_stats().cachedBytes, 0u);
+}
+
+TEST_F(TestPool, SaveLoadClasses)
+{
+    std::stringstream ss;
+    ASSERT_HRESULT_SUCCEEDED(save_pool_classes(ss, pool_classes()));
+    PoolClasses classes;
+    ASSERT_HRESULT_SUCCEEDED(load_pool_classes(ss, classes));
+    EXPECT_EQ(classes.heap, pool_classes().heap);
+    EXPECT_EQ(classes.bstr, pool_classes().bstr);
+    EXPECT_EQ(set_pool_classes(classes), S_FALSE);
+
+    std::stringstream bad("commem-pool-classes 1\nheap 16 8\nstack 32 8\n");
+    EXPECT_EQ(load_pool_classes(bad, classes), E_INVALIDARG);
+    std::stringstream version("commem-pool-classes 2\n");
+    EXPECT_EQ(load_pool_classes(version, classes), E_INVALIDARG);
+}
+
+TEST_F(TestPool, Tuner)
+{
+    PoolTuner tuner(4, 1000);
+
+    // Too few requests: nothing changes
+    pool_alloc_heap(40);
+    EXPECT_EQ(tuner.Rebalance(), S_FALSE);
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        pool_alloc_heap(40);
+        pool_alloc_heap(200);
+        pool_alloc_heap(1000);
+        pool_alloc_heap(4000);
+    }
+    for (int i = 0; i < 100; ++i) pool_alloc_heap(10);
+
+    PoolClasses recommended;
+    ASSERT_HRESULT_SUCCEEDED(tuner.Recommend(recommended));
+    std::vector<size_t> capacities;
+    for (auto const& c : recommended.heap) capacities.push_back(c.first);
+    EXPECT_EQ(capacities, (std::vector<size_t>{ 40, 200, 1000, 4096 }));
+    EXPECT_EQ(recommended.bstr, pool_classes().bstr);
+
+    ASSERT_EQ(tuner.Rebalance(), S_OK);
+    EXPECT_EQ(pool_classes().heap, recommended.heap);
+    auto a = pool_alloc_heap(33);
+    EXPECT_EQ(a.get_deleter().capacity, 40u);
+
+    // Counting starts again after a rebalance
+    EXPECT_EQ(tuner.Rebalance(), S_FALSE);
+}
+
+TEST_F(TestPool, TunerDepth)
+{
+    // A class that keeps missing the cache gets a deeper cache
+    PoolTuner tuner(16, 100);
+    auto const depth = detail::default_pool_depth(64);
+    std::vector<pooled_heap<void*>> v;
+    for (size_t i = 0; i < 4 * depth; ++i) v.push_back(pool_alloc_heap(64));
+    v.clear();
+
+    ASSERT_HRESULT_SUCCEEDED(tuner.Rebalance());
+    auto const classes = pool_classes();
+    auto const i = std::find_if(classes.heap.begin(), classes.heap.end(),
+        [](auto const& c) { return c.first == 64; });
+    ASSERT_NE(i, classes.heap.end());
+    EXPECT_EQ(i->second, 2 * depth);
+}
+
+TEST_F(TestPool, TunerThread)
+{
+    PoolTuner tuner;
+    ASSERT_HRESULT_SUCCEEDED(tuner.Start(std::chrono::milliseconds(1)));
+    EXPECT_EQ(tuner.Start(std::chrono::milliseconds(1)), E_UNEXPECTED);
+    for (int i = 0; i < 20000; ++i) pool_alloc_bstr(nullptr, 11);
+    tuner.Stop();
+}
+
+TEST_F(TestPool, Metrics)
+{
+    pool_alloc_heap(10);
+    std::ostringstream os;
+    PoolMetrics().WriteMetrics(os);
+    EXPECT_NE(os.str().find("commem_pool_hits_total "), std::string::npos);
+    EXPECT_NE(os.str().find("# TYPE commem_pool_cached_bytes gauge"), std::string::npos);
+}
+
+///////////////////////////////////////////////////////////////////////////////
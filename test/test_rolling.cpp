@@ -0,0 +1,195 @@
+// test_rolling.cpp: Tests for rolling ////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_rolling.h"
+#include "test_kernel.h"
+#include <cmath>
+#include <limits>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestRolling: Tests for rolling
+//
+
+class TestRolling : public TestKernel { };
+
+TEST_F(TestRolling, Count)
+{
+    auto const nan = std::nan("");
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0, 3.0, 2.0, 5.0, 4.0 }, 1);
+    ASSERT_TRUE(a);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Sum, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 4.0, 6.0, 10.0, 11.0 }, 1e-12);
+    LONG lb = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(r.get(), 1, &lb));
+    EXPECT_EQ(lb, 1);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Mean, r, 3));
+    ExpectNear(Values<DOUBLE>(r.get()), { nan, nan, 2.0, 10.0 / 3, 11.0 / 3 }, 1e-12);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Min, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 1.0, 1.0, 2.0, 2.0 }, 0.0);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Max, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 3.0, 3.0, 5.0, 5.0 }, 0.0);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Variance, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { nan, 2.0, 1.0, 7.0 / 3, 7.0 / 3 }, 1e-12);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 2, RollingStat::StdDev, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { nan, std::sqrt(2.0), std::sqrt(0.5), std::sqrt(4.5), std::sqrt(0.5) }, 1e-12);
+}
+
+TEST_F(TestRolling, NaN)
+{
+    auto const nan = std::nan("");
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0, nan, 3.0, nan, nan, 6.0 });
+    ASSERT_TRUE(a);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 2, RollingStat::Max, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 1.0, 3.0, 3.0, nan, 6.0 }, 0.0);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Mean, r, 2));
+    ExpectNear(Values<DOUBLE>(r.get()), { nan, nan, 2.0, nan, nan, nan }, 1e-12);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 2, RollingStat::Sum, r, 0));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 1.0, 3.0, 3.0, 0.0, 6.0 }, 1e-12);
+}
+
+TEST_F(TestRolling, Infinity)
+{
+    // Infinities make their windows infinite (or NaN), and nothing after
+    auto const inf = std::numeric_limits<double>::infinity();
+    size_t const n = 200000;
+    std::vector<double> x(n);
+    for (size_t i = 0; i < n; ++i) x[i] = static_cast<double>(i % 10);
+    x[0] = inf;
+    x[100] = inf;
+    x[101] = -inf;
+    auto a = Vector<DOUBLE>(VT_R8, x);
+    ASSERT_TRUE(a);
+
+    unique_safearray sum, mean, sd;
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Sum, sum));
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::Mean, mean));
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), 3, RollingStat::StdDev, sd));
+    auto const s = Values<DOUBLE>(sum.get());
+    auto const m = Values<DOUBLE>(mean.get());
+    auto const d = Values<DOUBLE>(sd.get());
+    EXPECT_EQ(s[2], inf);
+    EXPECT_EQ(s[3], 6.0);
+    EXPECT_EQ(s[100], inf);
+    EXPECT_TRUE(std::isnan(s[101]));
+    EXPECT_TRUE(std::isnan(s[102]));
+    EXPECT_EQ(s[103], -inf);
+    EXPECT_EQ(m[103], -inf);
+    EXPECT_TRUE(std::isnan(d[1]));
+    EXPECT_TRUE(std::isnan(d[103]));
+    for (size_t i = 104; i < n; ++i)
+    {
+        auto const e = x[i] + x[i - 1] + x[i - 2];
+        ASSERT_EQ(s[i], e) << i;
+        ASSERT_NEAR(m[i], e / 3.0, 1e-12) << i;
+        ASSERT_FALSE(std::isnan(d[i])) << i;
+    }
+    EXPECT_EQ(s[4], 9.0);
+    EXPECT_EQ(m[4], 3.0);
+}
+
+TEST_F(TestRolling, Large)
+{
+    // Windows narrower and wider than a chunk, checked against the direct
+    // computation at sampled positions
+    size_t const n = 400000;
+    std::vector<double> x(n);
+    for (size_t i = 0; i < n; ++i) x[i] = 1e6 + std::sin(static_cast<double>(i) * 0.001) * 100.0 + static_cast<double>((i * 7919) % 101);
+    auto a = Vector<DOUBLE>(VT_R8, x);
+    ASSERT_TRUE(a);
+
+    for (size_t const w : { size_t{ 1000 }, size_t{ 150000 } })
+    {
+        unique_safearray mean, low, sd;
+        ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), w, RollingStat::Mean, mean));
+        ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), w, RollingStat::Min, low));
+        ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), w, RollingStat::StdDev, sd));
+        auto const m = Values<DOUBLE>(mean.get());
+        auto const l = Values<DOUBLE>(low.get());
+        auto const s = Values<DOUBLE>(sd.get());
+        for (size_t i = 1; i < n; i += 9973)
+        {
+            auto const first = i + 1 > w ? i + 1 - w : 0;
+            auto sum = 0.0;
+            auto min = x[first];
+            for (auto j = first; j <= i; ++j)
+            {
+                sum += x[j];
+                min = std::min(min, x[j]);
+            }
+            auto const c = static_cast<double>(i + 1 - first);
+            auto const mu = sum / c;
+            auto ss = 0.0;
+            for (auto j = first; j <= i; ++j) ss += (x[j] - mu) * (x[j] - mu);
+            EXPECT_NEAR(m[i], mu, 1e-6) << i;
+            EXPECT_EQ(l[i], min) << i;
+            EXPECT_NEAR(s[i], std::sqrt(ss / (c - 1.0)), 1e-6) << i;
+        }
+    }
+}
+
+TEST_F(TestRolling, Time)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0, 2.0, 3.0, 4.0, 5.0 });
+    auto t = Vector<DATE>(VT_DATE, { 0.0, 0.5, 0.5, 2.0, 2.9 });
+    ASSERT_TRUE(a && t);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), t.get(), 1.0, RollingStat::Sum, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 3.0, 6.0, 4.0, 9.0 }, 1e-12);
+    ASSERT_HRESULT_SUCCEEDED(rolling(a.get(), t.get(), 1.0, RollingStat::Min, r));
+    ExpectNear(Values<DOUBLE>(r.get()), { 1.0, 1.0, 1.0, 4.0, 4.0 }, 0.0);
+}
+
+TEST_F(TestRolling, Errors)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 1.0, 2.0 });
+    auto i4 = Vector<LONG>(VT_I4, { 1, 2 });
+    auto t = Vector<DATE>(VT_DATE, { 1.0, 0.0 });
+    auto shortTimes = Vector<DATE>(VT_DATE, { 1.0 });
+    ASSERT_TRUE(a && i4 && t && shortTimes);
+
+    unique_safearray r;
+    EXPECT_EQ(rolling(a.get(), 0, RollingStat::Sum, r), E_INVALIDARG);
+    EXPECT_EQ(rolling(i4.get(), 2, RollingStat::Sum, r), DISP_E_BADVARTYPE);
+    EXPECT_EQ(rolling(a.get(), a.get(), 1.0, RollingStat::Sum, r), DISP_E_BADVARTYPE);
+    EXPECT_EQ(rolling(a.get(), t.get(), 1.0, RollingStat::Sum, r), E_INVALIDARG);
+    EXPECT_EQ(rolling(a.get(), shortTimes.get(), 1.0, RollingStat::Sum, r), E_INVALIDARG);
+    EXPECT_EQ(rolling(a.get(), shortTimes.get(), 0.0, RollingStat::Sum, r), E_INVALIDARG);
+    EXPECT_FALSE(r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -639,6 +639,51 @@ TEST_F(TestSafeArrayShared, Copy)
     ASSERT_NE(SafeArrayGetVartype(a.get()), SafeArrayGetVartype(b.get()));
 }
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestSafeArrayData: Tests for SafeArrayData
+//
+
+class TestSafeArrayData : public TestSafeArray { };
+
+TEST_F(TestSafeArrayData, Access)
+{
+    unique_safearray a(SafeArrayCreateVector(VT_I4, 0, 10));
+    ASSERT_TRUE(a);
+    {
+        SafeArrayData<LONG> data(a.get());
+        ASSERT_HRESULT_SUCCEEDED(data.Result());
+        ASSERT_EQ(data.Size(), 10u);
+        ASSERT_EQ(a->cLocks, 1u);
+        LONG n = 0;
+        for (auto& x : data) x = n++;
+    }
+    ASSERT_EQ(a->cLocks, 0u);
+
+    LONG i = 9;
+    LONG x = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetElement(a.get(), &i, &x));
+    ASSERT_EQ(x, 9);
+}
+
+TEST_F(TestSafeArrayData, TypeMismatch)
+{
+    unique_safearray a(SafeArrayCreateVector(VT_I4, 0, 10));
+    ASSERT_TRUE(a);
+
+    SafeArrayData<double> data(a.get());
+    ASSERT_EQ(data.Result(), DISP_E_TYPEMISMATCH);
+    ASSERT_EQ(data.Data(), nullptr);
+    ASSERT_EQ(a->cLocks, 0u);
+}
+
+TEST_F(TestSafeArrayData, Null)
+{
+    SafeArrayData<LONG> data(nullptr);
+    ASSERT_EQ(data.Result(), E_INVALIDARG);
+    ASSERT_EQ(data.Size(), 0u);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // SafeArrayDeathTest: Verify termination by destructor if SAFEARRAY is locked
@@ -0,0 +1,192 @@
+// test_scan.cpp: Tests for the scan kernels //////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_scan.h"
+#include "test_kernel.h"
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestScan: Tests for scan, segmented_scan, and bstr_offsets
+//
+
+class TestScan : public TestKernel { };
+
+TEST_F(TestScan, Sum)
+{
+    auto a = Vector<LONG>(VT_I4, { 3, 1, 4, 1, 5 }, 1);
+    ASSERT_TRUE(a);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(scan(a.get(), r, ScanMode::Inclusive));
+    EXPECT_EQ(Values<LONG>(r.get()), (std::vector<LONG>{ 3, 4, 8, 9, 14 }));
+    LONG lb = 0;
+    ASSERT_HRESULT_SUCCEEDED(SafeArrayGetLBound(r.get(), 1, &lb));
+    EXPECT_EQ(lb, 1);
+
+    ASSERT_HRESULT_SUCCEEDED(scan(a.get(), r, ScanMode::Exclusive));
+    EXPECT_EQ(Values<LONG>(r.get()), (std::vector<LONG>{ 0, 3, 4, 8, 9 }));
+    EXPECT_EQ(Values<LONG>(a.get()), (std::vector<LONG>{ 3, 1, 4, 1, 5 }));
+}
+
+TEST_F(TestScan, Product)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 2.0, 0.5, 3.0, 4.0 });
+    ASSERT_TRUE(a);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(scan(a.get(), r, ScanMode::Inclusive, ScanOp::Product));
+    EXPECT_EQ(Values<DOUBLE>(r.get()), (std::vector<DOUBLE>{ 2.0, 1.0, 3.0, 12.0 }));
+    ASSERT_HRESULT_SUCCEEDED(scan(a.get(), r, ScanMode::Exclusive, ScanOp::Product));
+    EXPECT_EQ(Values<DOUBLE>(r.get()), (std::vector<DOUBLE>{ 1.0, 2.0, 1.0, 3.0 }));
+}
+
+TEST_F(TestScan, Large)
+{
+    // Span several chunks, with a length that isn't a multiple of the chunk
+    std::vector<LONGLONG> values(5 * detail::kernel_chunk + 123);
+    for (size_t i = 0; i < values.size(); ++i) values[i] = static_cast<LONGLONG>(i % 7) - 2;
+    auto a = Vector<LONGLONG>(VT_I8, values);
+    ASSERT_TRUE(a);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(scan(a.get(), r, ScanMode::Exclusive));
+    auto const result = Values<LONGLONG>(r.get());
+    LONGLONG sum = 0;
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        ASSERT_EQ(result[i], sum) << i;
+        sum += values[i];
+    }
+
+    // Floats are exact here because the values are small integers
+    std::vector<FLOAT> floats(values.begin(), values.end());
+    auto f = Vector<FLOAT>(VT_R4, floats);
+    ASSERT_TRUE(f);
+    ASSERT_HRESULT_SUCCEEDED(scan(f, ScanMode::Inclusive));
+    EXPECT_EQ(Values<FLOAT>(f.get()).back(), static_cast<FLOAT>(sum));
+}
+
+TEST_F(TestScan, Wraps)
+{
+    auto a = Vector<LONG>(VT_I4, { 0x7FFFFFFF, 1 });
+    ASSERT_TRUE(a);
+    ASSERT_HRESULT_SUCCEEDED(scan(a, ScanMode::Inclusive));
+    EXPECT_EQ(Values<LONG>(a.get())[1], static_cast<LONG>(0x80000000u));
+}
+
+TEST_F(TestScan, Segmented)
+{
+    auto a = Vector<LONG>(VT_I4, { 1, 2, 3, 4, 5, 6 });
+    auto k = Vector<LONG>(VT_I4, { 7, 7, 8, 8, 8, 7 });
+    ASSERT_TRUE(a && k);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(segmented_scan(a.get(), k.get(), r, ScanMode::Inclusive));
+    EXPECT_EQ(Values<LONG>(r.get()), (std::vector<LONG>{ 1, 3, 3, 7, 12, 6 }));
+    ASSERT_HRESULT_SUCCEEDED(segmented_scan(a, k.get(), ScanMode::Exclusive));
+    EXPECT_EQ(Values<LONG>(a.get()), (std::vector<LONG>{ 0, 1, 0, 3, 7, 0 }));
+}
+
+TEST_F(TestScan, SegmentedLarge)
+{
+    // Segments that cross chunk boundaries, and chunks without a head
+    auto const n = 4 * detail::kernel_chunk + 5;
+    std::vector<DOUBLE> values(n, 1.0);
+    std::vector<LONG> keys(n);
+    for (size_t i = 0; i < n; ++i) keys[i] = static_cast<LONG>(i / 100000);
+    auto a = Vector<DOUBLE>(VT_R8, values);
+    auto k = Vector<LONG>(VT_I4, keys);
+    ASSERT_TRUE(a && k);
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(segmented_scan(a.get(), k.get(), r, ScanMode::Inclusive));
+    auto const result = Values<DOUBLE>(r.get());
+    for (size_t i = 0; i < n; ++i) ASSERT_EQ(result[i], static_cast<DOUBLE>(i % 100000 + 1)) << i;
+}
+
+TEST_F(TestScan, SegmentedBString)
+{
+    auto a = Vector<LONGLONG>(VT_I8, { 10, 20, 30, 40 });
+    ASSERT_TRUE(a);
+    auto k = create_safearray_vector(VT_BSTR, 0, 4);
+    ASSERT_TRUE(k);
+    {
+        SafeArrayData<BSTR> keys(k.get());
+        keys[0] = SysAllocString(L"AB");
+        keys[1] = SysAllocString(L"AB");
+        keys[2] = nullptr;
+        keys[3] = SysAllocString(L"");
+    }
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(segmented_scan(a.get(), k.get(), r, ScanMode::Inclusive));
+    EXPECT_EQ(Values<LONGLONG>(r.get()), (std::vector<LONGLONG>{ 10, 30, 30, 70 }));
+}
+
+TEST_F(TestScan, BStringOffsets)
+{
+    auto k = create_safearray_vector(VT_BSTR, 0, 3);
+    ASSERT_TRUE(k);
+    {
+        SafeArrayData<BSTR> keys(k.get());
+        keys[0] = SysAllocString(L"ABC");
+        keys[1] = nullptr;
+        keys[2] = SysAllocString(L"D");
+    }
+
+    unique_safearray r;
+    ASSERT_HRESULT_SUCCEEDED(bstr_offsets(k.get(), r));
+    LONGLONG const c = sizeof(OLECHAR);
+    EXPECT_EQ(Values<LONGLONG>(r.get()), (std::vector<LONGLONG>{ 0, 3 * c, 3 * c, 4 * c }));
+}
+
+TEST_F(TestScan, Errors)
+{
+    unique_safearray r;
+    EXPECT_EQ(scan(nullptr, r, ScanMode::Inclusive), E_INVALIDARG);
+    EXPECT_EQ(scan(r, ScanMode::Inclusive), E_INVALIDARG);
+
+    auto v = create_safearray_vector(VT_VARIANT, 0, 3);
+    ASSERT_TRUE(v);
+    EXPECT_EQ(scan(v.get(), r, ScanMode::Inclusive), DISP_E_BADVARTYPE);
+    EXPECT_EQ(bstr_offsets(v.get(), r), DISP_E_BADVARTYPE);
+
+    auto a = Vector<LONG>(VT_I4, { 1, 2, 3 });
+    auto k = Vector<LONG>(VT_I4, { 1, 2 });
+    ASSERT_TRUE(a && k);
+    EXPECT_EQ(segmented_scan(a.get(), k.get(), r, ScanMode::Inclusive), E_INVALIDARG);
+    EXPECT_EQ(segmented_scan(a.get(), v.get(), r, ScanMode::Inclusive), DISP_E_BADVARTYPE);
+    EXPECT_EQ(segmented_scan(a.get(), nullptr, r, ScanMode::Inclusive), E_INVALIDARG);
+    EXPECT_FALSE(r);
+}
+
+///////////////////////////////////////////////////////////////////////////////
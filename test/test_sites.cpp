@@ -0,0 +1,154 @@
+// test_sites.cpp: Tests for commem::CallSiteStats ////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#include "commem_sites.h"
+#include "test_commem.h"
+#include <sstream>
+#include <thread>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestSites: Tests for tagged factories and CallSiteStats
+//
+
+class TestSites : public TestCommem { };
+
+TEST_F(TestSites, CurrentCallSite)
+{
+    // The call site lives only as long as the tagged call, so copy it
+    struct Observer : AllocationObserver {
+        bool tagged = false;
+        CallSite site{ "" };
+        void OnAlloc(AllocationEvent const&) noexcept override
+        {
+            auto const p = current_call_site();
+            tagged = p != nullptr;
+            if (p) site = *p;
+        }
+        void OnFree(AllocationEvent const&) noexcept override { }
+    } obs;
+
+    ASSERT_TRUE(add_observer(&obs));
+    {
+        auto a = alloc_bstr(CallSite("tag"), L"ABCD");
+        ASSERT_TRUE(a);
+        ASSERT_TRUE(obs.tagged);
+        EXPECT_STREQ(obs.site.file, "tag");
+        EXPECT_EQ(obs.site.line, 0u);
+
+        auto b = alloc_heap<LPOLESTR>(COMMEM_SITE, 10);
+        ASSERT_TRUE(b);
+        ASSERT_TRUE(obs.tagged);
+        EXPECT_EQ(obs.site.line, static_cast<unsigned>(__LINE__ - 3));
+
+        auto c = alloc_bstr(L"ABCD");
+        ASSERT_TRUE(c);
+        EXPECT_FALSE(obs.tagged);
+    }
+    ASSERT_TRUE(remove_observer(&obs));
+    EXPECT_EQ(current_call_site(), nullptr);
+}
+
+TEST_F(TestSites, Report)
+{
+    CallSiteStats sites;
+    ASSERT_TRUE(sites.Start());
+    std::vector<unique_bstr> keep;
+    for (int i = 0; i < 3; ++i) keep.push_back(alloc_bstr(CallSite("strings"), nullptr, 100));
+    for (int i = 0; i < 2; ++i) create_safearray_vector(CallSite("arrays"), VT_R8, 0, 10);
+    alloc_heap(16);
+    sites.Stop();
+
+    auto const v = sites.Report(CallSiteOrder::Bytes);
+    ASSERT_EQ(v.size(), 3u);
+    EXPECT_STREQ(v[0].site.file, "strings");
+    EXPECT_EQ(v[0].allocs, 3u);
+    EXPECT_EQ(v[0].bytes, 300 * sizeof(OLECHAR));
+    EXPECT_EQ(v[0].outstanding, 3);
+    EXPECT_STREQ(v[1].site.file, "arrays");
+    EXPECT_EQ(v[1].bytes, 160u);
+    EXPECT_EQ(v[1].outstanding, 0);
+    EXPECT_EQ(v[1].outstandingBytes, 0);
+    EXPECT_STREQ(v[2].site.file, "(untagged)");
+    EXPECT_EQ(v[2].allocs, 1u);
+
+    auto const r = sites.Report(CallSiteOrder::Rate);
+    EXPECT_STREQ(r[0].site.file, "strings");
+    EXPECT_GT(r[0].rate, 0);
+    EXPECT_EQ(sites.Report(CallSiteOrder::Outstanding)[0].outstandingBytes,
+        static_cast<LONGLONG>(300 * sizeof(OLECHAR)));
+}
+
+TEST_F(TestSites, CrossThreadFree)
+{
+    CallSiteStats sites;
+    ASSERT_TRUE(sites.Start());
+    auto a = alloc_heap(CallSite("heap"), 64);
+    ASSERT_TRUE(a);
+    std::thread([&a]() { a.reset(); }).join();
+    sites.Stop();
+
+    auto const v = sites.Report(CallSiteOrder::Bytes);
+    ASSERT_EQ(v.size(), 1u);
+    EXPECT_EQ(v[0].outstanding, 0);
+    EXPECT_EQ(v[0].outstandingBytes, 0);
+}
+
+TEST_F(TestSites, SiteTableFull)
+{
+    CallSiteStats sites(2);
+    ASSERT_TRUE(sites.Start());
+    alloc_bstr(CallSite("first"), L"A");
+    alloc_bstr(CallSite("second"), L"B");
+    sites.Stop();
+
+    auto const v = sites.Report(CallSiteOrder::Bytes);
+    ASSERT_EQ(v.size(), 2u);
+    EXPECT_EQ(v[0].allocs, 1u);
+    EXPECT_EQ(v[1].allocs, 1u);
+}
+
+TEST_F(TestSites, Output)
+{
+    CallSiteStats sites;
+    ASSERT_TRUE(sites.Start());
+    alloc_bstr(COMMEM_SITE, L"ABCD");
+    sites.Stop();
+
+    std::ostringstream report;
+    sites.WriteReport(report, CallSiteOrder::Bytes);
+    EXPECT_NE(report.str().find("test_sites.cpp:" + std::to_string(__LINE__ - 5)), std::string::npos);
+
+    std::ostringstream metrics;
+    sites.WriteMetrics(metrics);
+    EXPECT_NE(metrics.str().find("commem_site_allocations_total{site=\""), std::string::npos);
+    EXPECT_NE(metrics.str().find("commem_site_outstanding_objects{"), std::string::npos);
+}
+
+///////////////////////////////////////////////////////////////////////////////
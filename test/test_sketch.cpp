@@ -0,0 +1,222 @@
+// test_sketch.cpp: Tests for QuantileSketch and HyperLogLog //////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_sketch.h"
+#include "test_commem.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestSketch: Tests for QuantileSketch and HyperLogLog
+//
+
+class TestSketch : public TestCommem {
+protected:
+
+    // A permutation of 0 to n - 1 as a VT_R8 vector
+    static unique_safearray Shuffled(size_t const n)
+    {
+        auto a = create_safearray_vector(VT_R8, 0, static_cast<ULONG>(n));
+        if (!a) return a;
+        SafeArrayData<DOUBLE> data(a.get());
+        for (size_t i = 0; i < n; ++i) data[i] = static_cast<DOUBLE>((i * 7919) % n);
+        return a;
+    }
+};
+
+TEST_F(TestSketch, QuantileExact)
+{
+    // Below capacity, the sketch holds every value
+    QuantileSketch s;
+    EXPECT_TRUE(s.Empty());
+    double q = 0;
+    EXPECT_EQ(s.Quantile(0.5, q), S_FALSE);
+    EXPECT_TRUE(std::isnan(q));
+
+    for (int i = 1; i <= 100; ++i) ASSERT_HRESULT_SUCCEEDED(s.Add(static_cast<double>(i)));
+    EXPECT_EQ(s.Add(std::nan("")), S_FALSE);
+    EXPECT_EQ(s.Count(), 100u);
+    EXPECT_EQ(s.Min(), 1.0);
+    EXPECT_EQ(s.Max(), 100.0);
+
+    double const ranks[] = { 0.0, 0.5, 0.99, 1.0 };
+    double values[4] = {};
+    ASSERT_HRESULT_SUCCEEDED(s.Quantiles(ranks, 4, values));
+    EXPECT_EQ(values[0], 1.0);
+    EXPECT_EQ(values[1], 50.0);
+    EXPECT_EQ(values[2], 99.0);
+    EXPECT_EQ(values[3], 100.0);
+    EXPECT_EQ(s.Quantile(1.5, q), E_INVALIDARG);
+}
+
+TEST_F(TestSketch, QuantileColumn)
+{
+    auto const n = 1000000;
+    auto a = Shuffled(n);
+    ASSERT_TRUE(a);
+
+    QuantileSketch s;
+    ASSERT_HRESULT_SUCCEEDED(s.Add(a.get()));
+    EXPECT_EQ(s.Count(), static_cast<ULONGLONG>(n));
+    for (auto const r : { 0.01, 0.5, 0.95, 0.99 })
+    {
+        double q = 0;
+        ASSERT_HRESULT_SUCCEEDED(s.Quantile(r, q));
+        EXPECT_NEAR(q / n, r, 0.015) << r;
+    }
+
+    // The same column gives the same sketch
+    QuantileSketch t;
+    ASSERT_HRESULT_SUCCEEDED(t.Add(a.get()));
+    std::ostringstream os1, os2;
+    ASSERT_HRESULT_SUCCEEDED(s.Save(os1));
+    ASSERT_HRESULT_SUCCEEDED(t.Save(os2));
+    EXPECT_EQ(os1.str(), os2.str());
+    EXPECT_LT(os1.str().size(), 16384u);
+
+    // Each batch advances the generator the chunks' seeds are drawn from,
+    // so a batch too small to compact still changes it
+    auto small = Shuffled(10);
+    ASSERT_TRUE(small);
+    QuantileSketch u, v;
+    ASSERT_HRESULT_SUCCEEDED(u.Add(small.get()));
+    for (int i = 0; i < 10; ++i) ASSERT_HRESULT_SUCCEEDED(v.Add(static_cast<double>((i * 7919) % 10)));
+    std::ostringstream os3, os4;
+    ASSERT_HRESULT_SUCCEEDED(u.Save(os3));
+    ASSERT_HRESULT_SUCCEEDED(v.Save(os4));
+    EXPECT_NE(os3.str(), os4.str());
+}
+
+TEST_F(TestSketch, QuantileMerge)
+{
+    QuantileSketch a, b;
+    for (int i = 0; i < 50000; ++i) ASSERT_HRESULT_SUCCEEDED(a.Add(static_cast<double>(i)));
+    for (int i = 50000; i < 100000; ++i) ASSERT_HRESULT_SUCCEEDED(b.Add(static_cast<double>(i)));
+    ASSERT_HRESULT_SUCCEEDED(a.Merge(b));
+    EXPECT_EQ(a.Count(), 100000u);
+    EXPECT_EQ(a.Max(), 99999.0);
+    double q = 0;
+    ASSERT_HRESULT_SUCCEEDED(a.Quantile(0.75, q));
+    EXPECT_NEAR(q / 100000, 0.75, 0.015);
+
+    QuantileSketch c(100);
+    EXPECT_EQ(a.Merge(c), E_INVALIDARG);
+}
+
+TEST_F(TestSketch, QuantileSaveLoad)
+{
+    QuantileSketch s;
+    for (int i = 0; i < 10000; ++i) ASSERT_HRESULT_SUCCEEDED(s.Add(static_cast<double>(i % 977)));
+    std::stringstream ss;
+    ASSERT_HRESULT_SUCCEEDED(s.Save(ss));
+
+    QuantileSketch t;
+    ASSERT_HRESULT_SUCCEEDED(t.Load(ss));
+    EXPECT_EQ(t.Count(), s.Count());
+    double a = 0, b = 0;
+    ASSERT_HRESULT_SUCCEEDED(s.Quantile(0.9, a));
+    ASSERT_HRESULT_SUCCEEDED(t.Quantile(0.9, b));
+    EXPECT_EQ(a, b);
+
+    std::istringstream bad("XXXX....");
+    EXPECT_EQ(t.Load(bad), E_INVALIDARG);
+    EXPECT_EQ(t.Count(), s.Count());
+}
+
+TEST_F(TestSketch, Distinct)
+{
+    HyperLogLog h;
+    EXPECT_EQ(h.Estimate(), 0.0);
+
+    auto a = Shuffled(200000);
+    ASSERT_TRUE(a);
+    ASSERT_HRESULT_SUCCEEDED(h.Add(a.get()));
+    ASSERT_HRESULT_SUCCEEDED(h.Add(a.get()));
+    EXPECT_NEAR(h.Estimate() / 200000, 1.0, 0.05);
+
+    // Small counts use linear counting
+    HyperLogLog s;
+    for (ULONGLONG i = 0; i < 100; ++i) s.AddHash(detail::hash_value(static_cast<LONGLONG>(i)));
+    EXPECT_NEAR(s.Estimate(), 100.0, 5.0);
+}
+
+TEST_F(TestSketch, DistinctBString)
+{
+    auto a = create_safearray_vector(VT_BSTR, 0, 30000);
+    ASSERT_TRUE(a);
+    {
+        SafeArrayData<BSTR> data(a.get());
+        for (size_t i = 0; i < data.Size(); ++i)
+        {
+            auto const s = std::to_wstring(i % 10000) + L"-customer";
+            data[i] = SysAllocString(s.c_str());
+        }
+    }
+
+    HyperLogLog h(14);
+    ASSERT_HRESULT_SUCCEEDED(h.Add(a.get()));
+    EXPECT_NEAR(h.Estimate() / 10000, 1.0, 0.05);
+
+    HyperLogLog other(14);
+    for (int i = 0; i < 10000; ++i) other.AddHash(detail::hash_value(static_cast<LONGLONG>(i)));
+    ASSERT_HRESULT_SUCCEEDED(h.Merge(other));
+    EXPECT_NEAR(h.Estimate() / 20000, 1.0, 0.05);
+    EXPECT_EQ(h.Merge(HyperLogLog(10)), E_INVALIDARG);
+
+    std::stringstream ss;
+    ASSERT_HRESULT_SUCCEEDED(h.Save(ss));
+    EXPECT_EQ(ss.str().size(), 12u + (1u << 14));
+    HyperLogLog t;
+    ASSERT_HRESULT_SUCCEEDED(t.Load(ss));
+    EXPECT_EQ(t.Precision(), 14u);
+    EXPECT_EQ(t.Estimate(), h.Estimate());
+}
+
+TEST_F(TestSketch, Errors)
+{
+    QuantileSketch s;
+    HyperLogLog h;
+    EXPECT_EQ(s.Add(nullptr), E_INVALIDARG);
+    EXPECT_EQ(h.Add(nullptr), E_INVALIDARG);
+    auto v = create_safearray_vector(VT_VARIANT, 0, 3);
+    ASSERT_TRUE(v);
+    EXPECT_EQ(s.Add(v.get()), DISP_E_BADVARTYPE);
+    EXPECT_EQ(h.Add(v.get()), DISP_E_BADVARTYPE);
+    auto b = create_safearray_vector(VT_BSTR, 0, 3);
+    ASSERT_TRUE(b);
+    EXPECT_EQ(s.Add(b.get()), DISP_E_BADVARTYPE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
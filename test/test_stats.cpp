@@ -0,0 +1,129 @@
+// test_stats.cpp: Tests for commem::AllocationStats and StatsServer //////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#include "commem_stats.h"
+#include "test_commem.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestStats: Tests for AllocationStats and StatsServer
+//
+
+class TestStats : public TestCommem { };
+
+TEST_F(TestStats, Counts)
+{
+    AllocationStats stats;
+    ASSERT_TRUE(stats.Start());
+    auto a = alloc_bstr(L"ABCD");
+    ASSERT_TRUE(a);
+    {
+        auto b = create_safearray_vector(VT_R8, 0, 4);
+        ASSERT_TRUE(b);
+        auto c = alloc_heap(16);
+        ASSERT_TRUE(c);
+    }
+    stats.Stop();
+
+    auto const s = stats.Snapshot();
+    EXPECT_EQ(s.allocs[static_cast<size_t>(ObjectKind::BString)], 1u);
+    EXPECT_EQ(s.Outstanding(ObjectKind::BString), 1);
+    EXPECT_EQ(s.OutstandingBytes(ObjectKind::BString), static_cast<LONGLONG>(4 * sizeof(OLECHAR)));
+    EXPECT_EQ(s.frees[static_cast<size_t>(ObjectKind::SafeArray)], 1u);
+    EXPECT_EQ(s.Outstanding(ObjectKind::SafeArray), 0);
+    EXPECT_EQ(s.allocBytes[static_cast<size_t>(ObjectKind::SafeArray)], 32u);
+    EXPECT_EQ(s.allocBytes[static_cast<size_t>(ObjectKind::Heap)], 16u);
+    EXPECT_EQ(s.Outstanding(ObjectKind::Heap), 0);
+}
+
+TEST_F(TestStats, Scrape)
+{
+    AllocationStats stats;
+    ASSERT_TRUE(stats.Start());
+    alloc_bstr(L"ABCD");
+    stats.Stop();
+
+    StatsServer server;
+    ASSERT_TRUE(server.AddSource(&stats));
+    auto const text = server.Scrape();
+    EXPECT_NE(text.find("# TYPE commem_allocations counter\n"), std::string::npos);
+    EXPECT_NE(text.find("commem_allocations_total{kind=\"bstr\"} 1\n"), std::string::npos);
+    EXPECT_NE(text.find("commem_outstanding_objects{kind=\"bstr\"} 0\n"), std::string::npos);
+    EXPECT_EQ(text.find("commem_outstanding_bytes{kind=\"heap\"}"), std::string::npos);
+    EXPECT_EQ(text.substr(text.size() - 6), "# EOF\n");
+}
+
+TEST_F(TestStats, File)
+{
+    AllocationStats stats;
+    StatsServer server;
+    ASSERT_TRUE(server.AddSource(&stats));
+    ASSERT_HRESULT_SUCCEEDED(server.StartFile("test_stats.txt", std::chrono::milliseconds(10)));
+    ASSERT_FALSE(server.AddSource(&stats));
+    ASSERT_EQ(server.StartFile("test_stats.txt", std::chrono::milliseconds(10)), E_UNEXPECTED);
+    server.Stop();
+
+    std::ifstream is("test_stats.txt");
+    std::stringstream ss;
+    ss << is.rdbuf();
+    EXPECT_EQ(ss.str(), server.Scrape());
+    is.close();
+    std::remove("test_stats.txt");
+}
+
+#if defined(__linux__)
+TEST_F(TestStats, Socket)
+{
+    AllocationStats stats;
+    StatsServer server;
+    ASSERT_TRUE(server.AddSource(&stats));
+    ASSERT_HRESULT_SUCCEEDED(server.StartSocket("test_stats.sock"));
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, "test_stats.sock");
+    int const fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)), 0);
+
+    std::string text;
+    char buf[256];
+    for (ssize_t n; (n = read(fd, buf, sizeof(buf))) > 0;) text.append(buf, static_cast<size_t>(n));
+    close(fd);
+    server.Stop();
+
+    EXPECT_EQ(text, server.Scrape());
+    EXPECT_NE(access("test_stats.sock", F_OK), 0);
+}
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
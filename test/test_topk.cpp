@@ -0,0 +1,159 @@
+// test_topk.cpp: Tests for top_k /////////////////////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+
+
+#include "commem_topk.h"
+#include "test_kernel.h"
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestTopK: Tests for top_k
+//
+
+class TestTopK : public TestKernel {
+protected:
+
+    // Check top_k against a stable sort for k at and around the heap limit
+    template <typename T>
+    static void Check(VARTYPE const vt, std::vector<T> const& x, size_t const k, SortOrder const order)
+    {
+        std::vector<LONG> expected(x.size());
+        std::iota(expected.begin(), expected.end(), 0);
+        std::stable_sort(expected.begin(), expected.end(), [&x, order](LONG a, LONG b)
+            {
+                return order == SortOrder::Descending ? x[b] < x[a] : x[a] < x[b];
+            });
+        expected.resize(std::min(k, x.size()));
+
+        auto a = Vector<T>(vt, x);
+        ASSERT_TRUE(a);
+        unique_safearray values, indices;
+        ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), k, values, indices, order));
+        ASSERT_EQ(Values<LONG>(indices.get()), expected) << k;
+        auto const v = Values<T>(values.get());
+        for (size_t i = 0; i < expected.size(); ++i) ASSERT_EQ(v[i], x[expected[i]]);
+    }
+};
+
+TEST_F(TestTopK, Small)
+{
+    auto a = Vector<DOUBLE>(VT_R8, { 3.0, 9.0, 1.0, 9.0, 7.0 }, 10);
+    ASSERT_TRUE(a);
+
+    unique_safearray values, indices;
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 3, values, indices));
+    EXPECT_EQ(Values<DOUBLE>(values.get()), (std::vector<DOUBLE>{ 9.0, 9.0, 7.0 }));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 11, 13, 14 }));
+
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 2, indices, SortOrder::Ascending));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 12, 10 }));
+
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 100, values, indices));
+    EXPECT_EQ(Values<DOUBLE>(values.get()).size(), 5u);
+
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 0, values, indices));
+    EXPECT_TRUE(Values<DOUBLE>(values.get()).empty());
+}
+
+TEST_F(TestTopK, NaN)
+{
+    auto const nan = std::nan("");
+    auto a = Vector<DOUBLE>(VT_R8, { nan, 2.0, nan, 1.0 });
+    ASSERT_TRUE(a);
+
+    unique_safearray indices;
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 3, indices));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 1, 3, 0 }));
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 3, indices, SortOrder::Ascending));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 3, 1, 0 }));
+}
+
+TEST_F(TestTopK, Large)
+{
+    // Many chunks, with many ties, through both the heap and the selection
+    std::vector<LONG> x(3 * detail::kernel_chunk + 77);
+    unsigned state = 12345;
+    for (auto& v : x)
+    {
+        state = state * 1103515245u + 12345u;
+        v = static_cast<LONG>((state >> 8) % 50000);
+    }
+    for (size_t k : { size_t{ 1 }, size_t{ 100 }, detail::top_k_heap_limit, detail::top_k_heap_limit + 1, size_t{ 5000 }, x.size() / 2 })
+    {
+        Check<LONG>(VT_I4, x, k, SortOrder::Descending);
+        Check<LONG>(VT_I4, x, k, SortOrder::Ascending);
+    }
+
+    std::vector<FLOAT> f(x.begin(), x.end());
+    Check<FLOAT>(VT_R4, f, 1000, SortOrder::Descending);
+}
+
+TEST_F(TestTopK, BString)
+{
+    auto a = create_safearray_vector(VT_BSTR, 0, 5);
+    ASSERT_TRUE(a);
+    {
+        SafeArrayData<BSTR> s(a.get());
+        s[0] = SysAllocString(L"pear");
+        s[1] = SysAllocString(L"apple");
+        s[2] = nullptr;
+        s[3] = SysAllocString(L"Zebra");
+        s[4] = SysAllocString(L"applesauce");
+    }
+
+    unique_safearray values, indices;
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 4, values, indices, SortOrder::Ascending));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 2, 3, 1, 4 }));
+    SafeArrayData<BSTR> v(values.get());
+    ASSERT_HRESULT_SUCCEEDED(v.Result());
+    EXPECT_EQ(v[0], nullptr);
+    EXPECT_STREQ(v[1], L"Zebra");
+    EXPECT_STREQ(v[3], L"applesauce");
+
+    ASSERT_HRESULT_SUCCEEDED(top_k(a.get(), 1, indices));
+    EXPECT_EQ(Values<LONG>(indices.get()), (std::vector<LONG>{ 0 }));
+}
+
+TEST_F(TestTopK, Errors)
+{
+    unique_safearray values, indices;
+    EXPECT_EQ(top_k(nullptr, 1, values, indices), E_INVALIDARG);
+    auto v = create_safearray_vector(VT_VARIANT, 0, 3);
+    ASSERT_TRUE(v);
+    EXPECT_EQ(top_k(v.get(), 1, values, indices), DISP_E_BADVARTYPE);
+    EXPECT_FALSE(values);
+    EXPECT_FALSE(indices);
+}
+
+///////////////////////////////////////////////////////////////////////////////
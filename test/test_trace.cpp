@@ -0,0 +1,291 @@
+// test_trace.cpp: Tests for commem::TraceRecorder ////////////////////////////
+//
+// commem: COM Memory Management
+//
+// commem is released under the MIT license.
+//
+// Copyright 2024 Jeffrey M. Engelmann
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+//
+
+#include "commem_trace.h"
+#include "test_commem.h"
+#include <sstream>
+#include <thread>
+
+using namespace commem;
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// TestTrace: Tests for factories, observers, and TraceRecorder
+//
+
+class TestTrace : public TestCommem { };
+
+TEST_F(TestTrace, NotRecording)
+{
+    TraceRecorder rec;
+    {
+        auto a = alloc_bstr(L"ABCD");
+        ASSERT_TRUE(a);
+    }
+    ASSERT_TRUE(rec.Collect().empty());
+}
+
+TEST_F(TestTrace, Factories)
+{
+    TraceRecorder rec;
+    ASSERT_TRUE(rec.Start());
+    {
+        auto a = alloc_heap<LPOLESTR>(10);
+        ASSERT_TRUE(a);
+
+        auto b = alloc_bstr(L"ABCD");
+        ASSERT_TRUE(b);
+        ASSERT_STREQ(b.get(), L"ABCD");
+
+        auto c = create_safearray_vector(VT_I4, 0, 10);
+        ASSERT_TRUE(c);
+    }
+    rec.Stop();
+
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 6u);
+
+    EXPECT_EQ(events[0].kind, ObjectKind::Heap);
+    EXPECT_EQ(events[0].op, TraceOp::Alloc);
+    EXPECT_EQ(events[0].cb, 10u);
+
+    EXPECT_EQ(events[1].kind, ObjectKind::BString);
+    EXPECT_EQ(events[1].op, TraceOp::Alloc);
+    EXPECT_EQ(events[1].cb, 4 * sizeof(OLECHAR));
+
+    EXPECT_EQ(events[2].kind, ObjectKind::SafeArray);
+    EXPECT_EQ(events[2].op, TraceOp::Alloc);
+    EXPECT_EQ(events[2].vt, VT_I4);
+    EXPECT_EQ(events[2].cb, 40u);
+
+    // Destroyed in reverse order of construction
+    EXPECT_EQ(events[3].kind, ObjectKind::SafeArray);
+    EXPECT_EQ(events[3].op, TraceOp::Free);
+    EXPECT_EQ(events[3].id, events[2].id);
+    EXPECT_EQ(events[4].kind, ObjectKind::BString);
+    EXPECT_EQ(events[4].id, events[1].id);
+    EXPECT_EQ(events[5].kind, ObjectKind::Heap);
+    EXPECT_EQ(events[5].id, events[0].id);
+
+    for (size_t i = 1; i < events.size(); ++i)
+        EXPECT_LE(events[i - 1].time, events[i].time);
+}
+
+TEST_F(TestTrace, DeleterOnly)
+{
+    TraceRecorder rec;
+    ASSERT_TRUE(rec.Start());
+    {
+        // Not allocated by a factory, so only the free is recorded
+        unique_bstr a(SysAllocString(L"ABCD"));
+        ASSERT_TRUE(a);
+    }
+    rec.Stop();
+
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 1u);
+    EXPECT_EQ(events[0].op, TraceOp::Free);
+    EXPECT_EQ(events[0].cb, 4 * sizeof(OLECHAR));
+}
+
+TEST_F(TestTrace, RingSpill)
+{
+    TraceRecorder rec(4);
+    ASSERT_TRUE(rec.Start());
+    for (int i = 0; i < 100; ++i)
+    {
+        auto a = alloc_heap(16);
+        ASSERT_TRUE(a);
+    }
+    rec.Stop();
+
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 200u);
+    EXPECT_EQ(rec.Dropped(), 0u);
+    for (size_t i = 0; i < events.size(); ++i)
+        EXPECT_EQ(events[i].op, i % 2 ? TraceOp::Free : TraceOp::Alloc);
+}
+
+TEST_F(TestTrace, Threads)
+{
+    TraceRecorder rec(16);
+    ASSERT_TRUE(rec.Start());
+
+    auto f = []()
+        {
+            for (int i = 0; i < 1000; ++i) alloc_bstr(nullptr, 8);
+        };
+    std::thread t1(f);
+    std::thread t2(f);
+    t1.join();
+    t2.join();
+    rec.Stop();
+
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 4000u);
+
+    size_t n1 = 0;
+    for (auto const& e : events) if (e.thread == events[0].thread) ++n1;
+    EXPECT_EQ(n1, 2000u);
+}
+
+TEST_F(TestTrace, ReusedAddress)
+{
+    // Thread A frees an object and thread B reuses its address, but B
+    // reports its allocation before A reports the free. The events are
+    // ordered by when the free began and the allocation returned.
+    TraceRecorder rec;
+    ASSERT_TRUE(rec.Start());
+    auto const t = detail::now();
+    int object = 0;
+    rec.OnAlloc({ ObjectKind::Heap, VT_EMPTY, &object, 16, t + 1000, 500 });
+    rec.OnAlloc({ ObjectKind::Heap, VT_EMPTY, &object, 16, t + 3000, 1000 });
+    rec.OnFree({ ObjectKind::Heap, VT_EMPTY, &object, 0, t + 2000, 1500 });
+    rec.Stop();
+
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 3u);
+    EXPECT_EQ(events[0].op, TraceOp::Alloc);
+    EXPECT_EQ(events[1].op, TraceOp::Free);
+    EXPECT_EQ(events[2].op, TraceOp::Alloc);
+    EXPECT_EQ(events[1].time - events[0].time, 500u);
+    EXPECT_EQ(events[2].time - events[1].time, 2000u);
+}
+
+TEST_F(TestTrace, SaveLoad)
+{
+    TraceRecorder rec;
+    ASSERT_TRUE(rec.Start());
+    create_safearray_vector(VT_R8, 0, 4);
+    rec.Stop();
+    auto const events = rec.Collect();
+    ASSERT_EQ(events.size(), 2u);
+
+    std::stringstream ss;
+    ASSERT_HRESULT_SUCCEEDED(save_trace(ss, events));
+
+    std::vector<TraceEvent> loaded;
+    ASSERT_HRESULT_SUCCEEDED(load_trace(ss, loaded));
+    ASSERT_EQ(loaded.size(), 2u);
+    EXPECT_EQ(loaded[0].vt, VT_R8);
+    EXPECT_EQ(loaded[0].cb, 32u);
+    EXPECT_EQ(loaded[1].id, events[1].id);
+}
+
+TEST_F(TestTrace, LoadBadEvent)
+{
+    TraceEvent e = {};
+    e.kind = static_cast<ObjectKind>(3);
+    std::stringstream kind;
+    ASSERT_HRESULT_SUCCEEDED(save_trace(kind, { e }));
+    std::vector<TraceEvent> loaded;
+    EXPECT_EQ(load_trace(kind, loaded), E_INVALIDARG);
+
+    e.kind = ObjectKind::Heap;
+    e.op = static_cast<TraceOp>(2);
+    std::stringstream op;
+    ASSERT_HRESULT_SUCCEEDED(save_trace(op, { e }));
+    EXPECT_EQ(load_trace(op, loaded), E_INVALIDARG);
+    EXPECT_TRUE(loaded.empty());
+}
+
+TEST_F(TestTrace, LoadBadMagic)
+{
+    std::stringstream ss("XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX");
+    std::vector<TraceEvent> loaded;
+    ASSERT_EQ(load_trace(ss, loaded), E_INVALIDARG);
+    ASSERT_TRUE(loaded.empty());
+}
+
+TEST_F(TestTrace, Timing)
+{
+    struct Observer : AllocationObserver {
+        AllocationEvent alloc = {};
+        AllocationEvent free = {};
+        void OnAlloc(AllocationEvent const& e) noexcept override { alloc = e; }
+        void OnFree(AllocationEvent const& e) noexcept override { free = e; }
+    } obs;
+
+    ASSERT_TRUE(add_observer(&obs));
+    {
+        auto a = create_safearray_vector(VT_I4, 0, 1000);
+        ASSERT_TRUE(a);
+    }
+    ASSERT_TRUE(remove_observer(&obs));
+
+    EXPECT_EQ(obs.alloc.kind, ObjectKind::SafeArray);
+    EXPECT_EQ(obs.free.p, obs.alloc.p);
+    EXPECT_GT(obs.alloc.time, 0u);
+    EXPECT_GE(obs.free.time, obs.alloc.time + obs.alloc.duration);
+}
+
+TEST_F(TestTrace, ChromeTrace)
+{
+    ChromeTraceWriter w(16);
+    ASSERT_TRUE(w.Start());
+    {
+        auto a = create_safearray_vector(VT_R8, 0, 8);
+        ASSERT_TRUE(a);
+        SafeArrayData<double> data(a.get());
+        ASSERT_HRESULT_SUCCEEDED(data.Result());
+    }
+    w.Stop();
+    ASSERT_EQ(w.Dropped(), 0u);
+
+    std::stringstream ss;
+    ASSERT_HRESULT_SUCCEEDED(w.WriteJson(ss));
+    auto const json = ss.str();
+    EXPECT_EQ(json.find("{\"displayTimeUnit\""), 0u);
+    EXPECT_NE(json.find("\"name\":\"alloc safearray\""), std::string::npos);
+    EXPECT_NE(json.find("\"name\":\"free safearray\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"b\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"e\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"B\""), std::string::npos);
+    EXPECT_NE(json.find("\"ph\":\"E\""), std::string::npos);
+    EXPECT_NE(json.find("\"bytes\":64"), std::string::npos);
+    EXPECT_EQ(json.substr(json.size() - 4), "\n]}\n");
+}
+
+TEST_F(TestTrace, ChromeTraceFull)
+{
+    ChromeTraceWriter w(2);
+    ASSERT_TRUE(w.Start());
+    for (int i = 0; i < 3; ++i) alloc_bstr(L"ABCD");
+    w.Stop();
+    EXPECT_EQ(w.Dropped(), 4u);
+}
+
+TEST_F(TestTrace, ObserverSlots)
+{
+    TraceRecorder rec;
+    ASSERT_TRUE(rec.Start());
+    ASSERT_TRUE(rec.Start());       // Already started
+    rec.Stop();
+    ASSERT_FALSE(remove_observer(&rec));
+}
+
+///////////////////////////////////////////////////////////////////////////////